@@ -0,0 +1,186 @@
+#include "../uvx.h"
+#include <string.h>
+
+// Asserts allocations-per-message budgets of uvx hot paths: accept, read, send and log.
+// uvx must be built with UVX_ALLOC_COUNTING defined (see test/build/CMakeLists.txt).
+// The peers are raw libuv handles writing from stack buffers, so only uvx allocations are counted.
+// Usage:
+//   ./alloc-test     exits with 0 if all budgets are met, or 1 if not
+
+#define PORT_PLAIN  9201 // xserver with config.accumulate_recv == 0
+#define PORT_ACCUM  9202 // xserver with config.accumulate_recv == 1
+#define PORT_LOG    9203
+#define CONNS       20
+#define MSGS        2000
+#define MSG_SIZE    100
+
+static uv_loop_t* loop;
+static uvx_server_t plain_server, accum_server;
+static uv_tcp_t peers[2][CONNS];
+static uv_connect_t connects[2][CONNS];
+static uint64_t peer_recv_bytes;
+static uvx_server_conn_t* first_conn;
+static int failures;
+static uv_timer_t ticker; // wakes up UV_RUN_ONCE periodically, to check timeouts
+
+static void on_accum_recv(uvx_server_t* xserver, uvx_server_conn_t* conn, void* data, ssize_t datalen) {
+    uvx_server_conn_consume(conn, (unsigned int) datalen);
+}
+
+static void on_conn_ok(uvx_server_t* xserver, uvx_server_conn_t* conn) {
+    if(first_conn == NULL)
+        first_conn = conn;
+}
+
+static void on_peer_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    static char buffer[65536];
+    buf->base = buffer;
+    buf->len = sizeof(buffer);
+}
+
+static void on_peer_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+    if(nread > 0)
+        peer_recv_bytes += nread;
+}
+
+static void on_tick(uv_timer_t* handle) {
+}
+
+static void on_peer_connect(uv_connect_t* req, int status) {
+    if(status == 0)
+        uv_read_start(req->handle, on_peer_alloc, on_peer_read);
+}
+
+// runs the loop until *value >= expected, or timeout (5 seconds)
+static void run_until(uint64_t* value, uint64_t expected) {
+    uint64_t deadline = uv_now(loop) + 5000;
+    while(*value < expected && uv_now(loop) < deadline)
+        uv_run(loop, UV_RUN_ONCE);
+}
+
+static uint64_t allocs(void) {
+    uvx_alloc_stats_t stats;
+    uvx_alloc_stats(&stats);
+    return stats.allocs + stats.reallocs;
+}
+
+static void check(const char* path, uint64_t allocs, uint64_t msgs, double budget) {
+    double per_msg = (msgs ? (double) allocs / msgs : 0.0);
+    int ok = (msgs > 0 && per_msg <= budget);
+    printf("%-16s %6llu allocs / %6llu msgs = %.3f per msg (budget %.3f) %s\n", path,
+           (unsigned long long) allocs, (unsigned long long) msgs, per_msg, budget, ok ? "ok" : "FAILED");
+    if(!ok)
+        failures++;
+}
+
+// a budget near zero passes trivially if allocations are not counted, so the warm-up must count them.
+// xconn->inbuf is grown by automem, which allocates through uvx_malloc() (see uvx_set_allocator()).
+static void check_counted(const char* path, uint64_t allocs, uint64_t min) {
+    int ok = (allocs >= min);
+    printf("%-16s %6llu allocs (at least %llu) %s\n", path, (unsigned long long) allocs, (unsigned long long) min,
+           ok ? "ok" : "FAILED");
+    if(!ok)
+        failures++;
+}
+
+static void start_server(uvx_server_t* xserver, int port, int accumulate) {
+    uvx_server_config_t config = uvx_server_default_config(xserver);
+    config.conn_count = CONNS;
+    config.accumulate_recv = accumulate;
+    config.on_recv = (accumulate ? on_accum_recv : NULL);
+    config.on_conn_ok = on_conn_ok;
+    config.log_out = NULL;
+    uvx_server_start(xserver, loop, "127.0.0.1", port, config);
+}
+
+// writes MSGS messages from peers to the xserver, returns the reads of xserver
+static uint64_t write_messages(uvx_server_t* xserver, int index) {
+    char data[MSG_SIZE];
+    memset(data, 'x', sizeof(data));
+    uv_buf_t buf = uv_buf_init(data, sizeof(data));
+    uvx_stats_t stats;
+    uvx_server_stats(xserver, &stats);
+    uint64_t reads = stats.msgs_in, bytes = stats.bytes_in;
+    for(int i = 0; i < MSGS; i++) {
+        uv_try_write((uv_stream_t*) &peers[index][i % CONNS], &buf, 1);
+        if(i % CONNS == CONNS - 1)
+            uv_run(loop, UV_RUN_NOWAIT);
+    }
+    uint64_t deadline = uv_now(loop) + 5000;
+    do {
+        uv_run(loop, UV_RUN_ONCE);
+        uvx_server_stats(xserver, &stats);
+    } while(stats.bytes_in - bytes < (uint64_t) MSGS * MSG_SIZE && uv_now(loop) < deadline);
+    return stats.msgs_in - reads;
+}
+
+int main(int argc, char** argv) {
+    uvx_alloc_stats_t stats;
+    if(!uvx_alloc_stats(&stats)) {
+        printf("uvx is not built with UVX_ALLOC_COUNTING\n");
+        return 1;
+    }
+    loop = uv_default_loop();
+    uv_timer_init(loop, &ticker);
+    uv_timer_start(&ticker, on_tick, 10, 10);
+    start_server(&plain_server, PORT_PLAIN, 0);
+    start_server(&accum_server, PORT_ACCUM, 1);
+
+    // accept: one allocation per connection
+    uint64_t a = allocs();
+    for(int s = 0; s < 2; s++) {
+        struct sockaddr_in addr;
+        uv_ip4_addr("127.0.0.1", (s == 0 ? PORT_PLAIN : PORT_ACCUM), &addr);
+        for(int i = 0; i < CONNS; i++) {
+            uv_tcp_init(loop, &peers[s][i]);
+            uv_tcp_connect(&connects[s][i], &peers[s][i], (const struct sockaddr*) &addr, on_peer_connect);
+        }
+    }
+    uvx_stats_t plain_stats, accum_stats;
+    uint64_t deadline = uv_now(loop) + 5000;
+    do {
+        uv_run(loop, UV_RUN_ONCE);
+        uvx_server_stats(&plain_server, &plain_stats);
+        uvx_server_stats(&accum_server, &accum_stats);
+    } while(plain_stats.accepts + accum_stats.accepts < 2 * CONNS && uv_now(loop) < deadline);
+    check("accept", allocs() - a, plain_stats.accepts + accum_stats.accepts, 1.0);
+
+    // read: one buffer per read, or amortized zero if config.accumulate_recv == 1
+    a = allocs();
+    uint64_t reads = write_messages(&plain_server, 0);
+    check("read", allocs() - a, reads, 1.0);
+    a = allocs();
+    write_messages(&accum_server, 1); // warm up the buffers, allocates xconn->inbuf of every connection
+    check_counted("read warm-up", allocs() - a, CONNS);
+    a = allocs();
+    reads = write_messages(&accum_server, 1);
+    check("read accumulate", allocs() - a, reads, 0.05);
+
+    // send: one write request per send, `data` is allocated by caller (before counting)
+    static void* datas[MSGS];
+    for(int i = 0; i < MSGS; i++) {
+        datas[i] = uvx_malloc(MSG_SIZE);
+        memset(datas[i], 's', MSG_SIZE);
+    }
+    a = allocs();
+    uint64_t expected = peer_recv_bytes + (uint64_t) MSGS * MSG_SIZE;
+    for(int i = 0; i < MSGS; i++)
+        uvx_server_conn_send(first_conn, datas[i], MSG_SIZE);
+    run_until(&peer_recv_bytes, expected);
+    check("send", allocs() - a, MSGS, 1.0);
+
+    // log: one send request (with copied data) per log
+    uvx_log_t xlog;
+    uvx_log_init(&xlog, loop, "127.0.0.1", PORT_LOG, "alloc-test");
+    uv_run(loop, UV_RUN_NOWAIT);
+    a = allocs();
+    for(int i = 0; i < MSGS; i++) {
+        uvx_log_send(&xlog, UVX_LOG_INFO, "test", "allocations of log", __FILE__, __LINE__);
+        if(i % 100 == 99)
+            uv_run(loop, UV_RUN_NOWAIT);
+    }
+    check("log", allocs() - a, MSGS, 1.0);
+
+    printf(failures ? "FAILED\n" : "PASSED\n");
+    return (failures ? 1 : 0);
+}
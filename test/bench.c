@@ -0,0 +1,540 @@
+#include "../uvx.h"
+#include "../utils/atomic.h"
+#include <string.h>
+#include <unistd.h>
+
+// Benchmarks of uvx over loopback, the server runs in its own thread and loop.
+// Usage:
+//   ./bench echo [options]   xclients send messages to an echo xserver
+//   ./bench rr   [options]   xclients send length-prefixed requests, xserver replies responses
+//   ./bench req  [options]   as rr, but by uvx_client_request() with request ids
+//   ./bench udp  [options]   an xudp sends datagrams to an echo xudp
+//   ./bench loge [options]   serialize logs by uvx_log_serialize()
+//   ./bench pubsub [options] xclients subscribe to a topic, xserver publishes messages by uvx_server_publish()
+// Options:
+//   -c clients    number of xclients (default 8)
+//   -m inflight   messages in flight per client (default 16)
+//   -s size       message (request) size in bytes (default 128)
+//   -r size       response size in bytes of rr (default 128)
+//   -n count      total messages (default 1000000, or 200000 of udp), deliveries of pubsub
+//   -p port       server port (default 9100)
+//   -u path       echo, rr and req over unix domain socket "unix:path", instead of loopback tcp
+//   -S size       echo, rr and req over shared-memory rings of this size in bytes (see config.shm_ring_size)
+//   -U            xserver of echo, rr and req uses io_uring (see config.io_uring), compare with the default libuv
+// Reports msgs/s, MB/s, latency percentiles and allocations per message.
+// Allocations are counted if linked with -Wl,--wrap=malloc,... (see test/build/CMakeLists.txt).
+
+#define BENCH_ECHO 1
+#define BENCH_RR   2
+#define BENCH_UDP  3
+#define BENCH_LOGE 4
+#define BENCH_REQ  5
+#define BENCH_PUBSUB 6
+
+static int mode;
+static int clients = 8;
+static int inflight = 16;
+static unsigned int size = 128;
+static unsigned int response_size = 128;
+static uint64_t total = 0;
+static int port = 9100;
+static char endpoint[128] = "127.0.0.1"; // of xserver and xclients, "unix:path" by -u
+static unsigned int shm_ring_size = 0;   // by -S
+static int io_uring = 0;                 // by -U
+
+static uv_loop_t* loop;
+static uint64_t sent, completed, lost;
+static uint64_t bytes;
+static uint64_t start_time;
+static uvx_histogram_t latency;
+
+//-----------------------------------------------
+// allocations counting
+
+static uint64_t allocs;
+
+#ifdef UVX_BENCH_WRAP_MALLOC
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    uvx_atomic_add_u64(&allocs, 1);
+    return __real_malloc(size);
+}
+void* __wrap_calloc(size_t n, size_t size) {
+    uvx_atomic_add_u64(&allocs, 1);
+    return __real_calloc(n, size);
+}
+void* __wrap_realloc(void* p, size_t size) {
+    uvx_atomic_add_u64(&allocs, 1);
+    return __real_realloc(p, size);
+}
+#endif
+
+//-----------------------------------------------
+// server thread
+
+static uv_loop_t server_loop;
+static uv_async_t server_stop;
+static uv_thread_t server_thread;
+static uvx_server_t xserver;
+static uvx_udp_t server_udp;
+
+static void on_server_echo(uvx_server_t* xserver, uvx_server_conn_t* conn, void* data, ssize_t datalen) {
+    void* p = uvx_malloc(datalen);
+    memcpy(p, data, datalen);
+    uvx_server_conn_send(conn, p, (unsigned int) datalen);
+}
+
+// requests and responses are prefixed with 4 bytes big-endian length,
+// followed by 4 bytes request id in req mode
+static unsigned int read_length(const unsigned char* p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+static void write_length(unsigned char* p, unsigned int len) {
+    p[0] = (unsigned char)(len >> 24); p[1] = (unsigned char)(len >> 16);
+    p[2] = (unsigned char)(len >> 8);  p[3] = (unsigned char)len;
+}
+
+static void on_server_request(uvx_server_t* xserver, uvx_server_conn_t* conn, void* data, ssize_t datalen) {
+    unsigned char* p = (unsigned char*) data;
+    unsigned int consumed = 0;
+    while(datalen - consumed >= 4) {
+        unsigned int len = read_length(p + consumed);
+        if(datalen - consumed < 4 + len)
+            break;
+        unsigned char* response = (unsigned char*) uvx_malloc(4 + response_size);
+        write_length(response, response_size);
+        memset(response + 4, 'r', response_size);
+        if(mode == BENCH_REQ)
+            memcpy(response + 4, p + consumed + 4, 4); // the request id
+        consumed += 4 + len;
+        uvx_server_conn_send(conn, response, 4 + response_size);
+        uvx_server_conn_mark_reply(conn);
+    }
+    uvx_server_conn_consume(conn, consumed);
+}
+
+static void on_server_udp(uvx_udp_t* xudp, void* data, ssize_t datalen, const struct sockaddr* addr, unsigned int flags) {
+    uvx_udp_send_to_addr(xudp, addr, data, (unsigned int) datalen);
+}
+
+// pubsub: clients subscribe to "bench.ticks" or "bench.*", messages begin with 8 bytes publish time
+static uv_idle_t server_publisher;
+static int subscribers;
+static uint64_t published;
+
+static void on_server_publish(uv_idle_t* handle) {
+    uint64_t count = total / clients;
+    // keeps at most 4MB in write queues, or else publishes faster than sent
+    for(int i = 0; i < 64 && published < count; i++) {
+        if(uvx_atomic_load_u64(&xserver.stats.write_queue_bytes) >= 4 * 1024 * 1024)
+            return;
+        char* p = (char*) uvx_malloc(size);
+        uint64_t now = uv_hrtime();
+        memcpy(p, &now, 8);
+        memset(p + 8, 'p', size - 8);
+        uvx_server_publish(&xserver, "bench.ticks", p, size);
+        published++;
+    }
+    if(published >= count)
+        uv_idle_stop(handle);
+}
+
+static void on_server_subscribe(uvx_server_t* xserver, uvx_server_conn_t* conn, void* data, ssize_t datalen) {
+    char topic[64];
+    if(datalen <= 0 || datalen >= (ssize_t) sizeof(topic))
+        return;
+    memcpy(topic, data, datalen);
+    topic[datalen] = '\0';
+    uvx_server_conn_subscribe(conn, topic);
+    if(++subscribers == clients)
+        uv_idle_start(&server_publisher, on_server_publish);
+}
+
+static void on_server_stop(uv_async_t* handle) {
+    uv_stop(&server_loop);
+}
+
+static void run_server(void* arg) {
+    uv_run(&server_loop, UV_RUN_DEFAULT);
+}
+
+static void start_server(void) {
+    uv_loop_init(&server_loop);
+    uv_async_init(&server_loop, &server_stop, on_server_stop);
+    if(mode == BENCH_UDP) {
+        uvx_udp_config_t config = uvx_udp_default_config(&server_udp);
+        config.on_recv = on_server_udp;
+        config.log_out = NULL;
+        uvx_udp_start(&server_udp, &server_loop, "127.0.0.1", port, config);
+    } else {
+        uvx_server_config_t config = uvx_server_default_config(&xserver);
+        config.conn_count = clients;
+        config.on_recv = (mode == BENCH_ECHO ? on_server_echo : on_server_request);
+        if(mode == BENCH_PUBSUB) {
+            config.on_recv = on_server_subscribe;
+            uv_idle_init(&server_loop, &server_publisher);
+        }
+        config.accumulate_recv = (mode == BENCH_RR || mode == BENCH_REQ);
+        config.latency_histograms = 1;
+        config.shm_enable = (shm_ring_size > 0);
+        config.io_uring = io_uring;
+        config.log_out = NULL;
+        uvx_server_start(&xserver, &server_loop, endpoint, port, config);
+    }
+    uv_thread_create(&server_thread, run_server, NULL);
+}
+
+static void stop_server(void) {
+    uv_async_send(&server_stop);
+    uv_thread_join(&server_thread);
+}
+
+//-----------------------------------------------
+// tcp clients
+
+typedef struct bench_client_s {
+    uvx_client_t xclient;
+    uint64_t* send_times;    // ring of send times of messages in flight
+    unsigned int head, count;
+    uint64_t pending_bytes;  // echo: received bytes of incomplete message
+} bench_client_t;
+
+static bench_client_t* bench_clients;
+
+static void finish(void) {
+    uv_stop(loop);
+}
+
+static void on_client_request_response(uvx_client_t* xclient, int status, void* frame, unsigned int size, void* ctx);
+
+static void send_message(bench_client_t* c) {
+    if(sent >= total)
+        return;
+    sent++;
+    unsigned char* p;
+    unsigned int len;
+    if(mode == BENCH_RR || mode == BENCH_REQ) {
+        len = 4 + size;
+        p = (unsigned char*) uvx_malloc(len);
+        write_length(p, size);
+        memset(p + 4, 'q', size);
+    } else {
+        len = size;
+        p = (unsigned char*) uvx_malloc(len);
+        memset(p, 'e', size);
+    }
+    c->send_times[(c->head + c->count++) % inflight] = uv_hrtime();
+    if(mode == BENCH_REQ)
+        uvx_client_request(&c->xclient, p, len, 10000, on_client_request_response, c);
+    else
+        uvx_client_send(&c->xclient, p, len);
+}
+
+static void complete_message(bench_client_t* c, unsigned int len) {
+    uint64_t send_time = c->send_times[c->head];
+    c->head = (c->head + 1) % inflight;
+    c->count--;
+    uvx_histogram_record(&latency, (uv_hrtime() - send_time) / 1000);
+    bytes += len;
+    if(++completed >= total)
+        finish();
+    else
+        send_message(c);
+}
+
+static void on_client_ok(uvx_client_t* xclient) {
+    bench_client_t* c = (bench_client_t*) xclient->data;
+    if(mode == BENCH_PUBSUB) {
+        // both match "bench.ticks"
+        const char* topic = ((c - bench_clients) % 2 ? "bench.*" : "bench.ticks");
+        char* p = (char*) uvx_malloc(strlen(topic));
+        memcpy(p, topic, strlen(topic));
+        uvx_client_send(xclient, p, (unsigned int) strlen(topic));
+        return;
+    }
+    for(int i = 0; i < inflight; i++)
+        send_message(c);
+}
+
+static void on_client_echo(uvx_client_t* xclient, void* data, ssize_t datalen) {
+    bench_client_t* c = (bench_client_t*) xclient->data;
+    c->pending_bytes += datalen;
+    while(c->pending_bytes >= size) {
+        c->pending_bytes -= size;
+        complete_message(c, size);
+    }
+}
+
+static void on_client_response(uvx_client_t* xclient, void* data, ssize_t datalen) {
+    bench_client_t* c = (bench_client_t*) xclient->data;
+    unsigned char* p = (unsigned char*) data;
+    unsigned int consumed = 0;
+    while(datalen - consumed >= 4) {
+        unsigned int len = read_length(p + consumed);
+        if(datalen - consumed < 4 + len)
+            break;
+        consumed += 4 + len;
+        complete_message(c, size + len);
+    }
+    uvx_client_consume(xclient, consumed);
+}
+
+static void on_client_publish(uvx_client_t* xclient, void* data, ssize_t datalen) {
+    const unsigned char* p = (const unsigned char*) data;
+    unsigned int consumed = 0;
+    uint64_t now = uv_hrtime();
+    while(datalen - consumed >= size) {
+        uint64_t publish_time;
+        memcpy(&publish_time, p + consumed, 8);
+        uvx_histogram_record(&latency, (now - publish_time) / 1000);
+        consumed += size;
+        bytes += size;
+        if(++completed >= total)
+            finish();
+    }
+    uvx_client_consume(xclient, consumed);
+}
+
+static int request_frame_length(uvx_client_t* xclient, const void* data, unsigned int size) {
+    if(size < 4)
+        return 0;
+    unsigned int len = 4 + read_length((const unsigned char*) data);
+    return (size >= len ? (int) len : 0);
+}
+
+static unsigned int get_request_id(uvx_client_t* xclient, const void* frame, unsigned int size) {
+    return read_length((const unsigned char*) frame + 4);
+}
+
+static void set_request_id(uvx_client_t* xclient, void* frame, unsigned int size, unsigned int id) {
+    write_length((unsigned char*) frame + 4, id);
+}
+
+// responses come in order, so the send times are still a ring
+static void on_client_request_response(uvx_client_t* xclient, int status, void* frame, unsigned int len, void* ctx) {
+    bench_client_t* c = (bench_client_t*) ctx;
+    if(status != 0) {
+        // timeout or canceled
+        c->head = (c->head + 1) % inflight;
+        c->count--;
+        if(++lost + completed >= total)
+            finish();
+        return;
+    }
+    complete_message(c, size + len - 4);
+}
+
+static void start_clients(void) {
+    bench_clients = (bench_client_t*) calloc(clients, sizeof(bench_client_t));
+    for(int i = 0; i < clients; i++) {
+        bench_client_t* c = &bench_clients[i];
+        c->send_times = (uint64_t*) calloc(inflight, sizeof(uint64_t));
+        uvx_client_config_t config = uvx_client_default_config(&c->xclient);
+        config.on_conn_ok = on_client_ok;
+        config.on_recv = (mode == BENCH_ECHO ? on_client_echo : on_client_response);
+        config.accumulate_recv = (mode == BENCH_RR);
+        if(mode == BENCH_PUBSUB) {
+            config.on_recv = on_client_publish;
+            config.accumulate_recv = 1;
+        }
+        if(mode == BENCH_REQ) {
+            config.on_recv = NULL;
+            config.frame_length = request_frame_length;
+            config.get_request_id = get_request_id;
+            config.set_request_id = set_request_id;
+            config.max_inflight_requests = inflight;
+        }
+        config.shm_ring_size = shm_ring_size;
+        config.log_out = NULL;
+        c->xclient.data = c;
+        uvx_client_connect(&c->xclient, loop, endpoint, port, config);
+    }
+}
+
+//-----------------------------------------------
+// udp client
+
+static uvx_udp_t client_udp;
+static uint64_t outstanding;
+static uint64_t last_completed;
+static uv_timer_t udp_timer;
+
+// the first 8 bytes of datagram is its send time
+static void send_datagram(void) {
+    if(sent >= total)
+        return;
+    sent++;
+    outstanding++;
+    char buf[65536];
+    uint64_t now = uv_hrtime();
+    memset(buf, 'u', size);
+    memcpy(buf, &now, sizeof(now));
+    uvx_udp_send_to_ip(&client_udp, "127.0.0.1", port, buf, size);
+}
+
+static void on_client_udp(uvx_udp_t* xudp, void* data, ssize_t datalen, const struct sockaddr* addr, unsigned int flags) {
+    uint64_t send_time;
+    memcpy(&send_time, data, sizeof(send_time));
+    uvx_histogram_record(&latency, (uv_hrtime() - send_time) / 1000);
+    bytes += datalen;
+    if(outstanding > 0)
+        outstanding--;
+    if(++completed + lost >= total)
+        finish();
+    else
+        send_datagram();
+}
+
+// datagrams may be lost, refill the window if no progress
+static void on_udp_timer(uv_timer_t* handle) {
+    if(completed == last_completed) {
+        lost += outstanding;
+        outstanding = 0;
+        if(completed + lost >= total) {
+            finish();
+            return;
+        }
+        for(int i = 0; i < clients * inflight; i++)
+            send_datagram();
+    }
+    last_completed = completed;
+}
+
+static void start_udp_client(void) {
+    uvx_udp_config_t config = uvx_udp_default_config(&client_udp);
+    config.on_recv = on_client_udp;
+    config.log_out = NULL;
+    uvx_udp_start(&client_udp, loop, NULL, 0, config);
+    uv_timer_init(loop, &udp_timer);
+    uv_timer_start(&udp_timer, on_udp_timer, 100, 100);
+    uv_unref((uv_handle_t*) &udp_timer);
+    for(int i = 0; i < clients * inflight; i++)
+        send_datagram();
+}
+
+//-----------------------------------------------
+// loge serialization
+
+static void bench_loge(void) {
+    uvx_log_t xlog;
+    uvx_log_init(&xlog, loop, "127.0.0.1", port, "bench");
+    char msg[1024];
+    memset(msg, 'l', sizeof(msg));
+    msg[size < sizeof(msg) ? size : sizeof(msg) - 1] = '\0';
+    char buf[1024];
+    for(uint64_t i = 0; i < total; i++) {
+        uint64_t t = uv_hrtime();
+        unsigned int len = uvx_log_serialize(&xlog, buf, sizeof(buf), UVX_LOG_INFO, "bench,loge", msg, __FILE__, __LINE__);
+        uvx_histogram_record(&latency, (uv_hrtime() - t) / 1000);
+        bytes += len;
+        completed++;
+    }
+}
+
+//-----------------------------------------------
+
+static void report(const char* name, uint64_t elapsed_ns, uint64_t allocs_delta) {
+    double seconds = elapsed_ns / 1e9;
+    printf("%s: %llu msgs in %.3f s", name, (unsigned long long) completed, seconds);
+    if(lost)
+        printf(", %llu lost", (unsigned long long) lost);
+    printf("\n  %.0f msgs/s, %.2f MB/s\n", completed / seconds, bytes / seconds / 1048576);
+    if(mode == BENCH_LOGE)
+        printf("  %.1f ns/msg\n", completed ? (double) elapsed_ns / completed : 0.0);
+    printf("  latency(us): p50=%llu p99=%llu p999=%llu max=%llu\n",
+           (unsigned long long) uvx_histogram_percentile(&latency, 50.0),
+           (unsigned long long) uvx_histogram_percentile(&latency, 99.0),
+           (unsigned long long) uvx_histogram_percentile(&latency, 99.9),
+           (unsigned long long) latency.max);
+#ifdef UVX_BENCH_WRAP_MALLOC
+    printf("  allocations: %.2f per msg\n", completed ? (double) allocs_delta / completed : 0.0);
+#else
+    printf("  allocations: not counted\n");
+#endif
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        printf("usage: %s echo|rr|req|udp|loge|pubsub [-c clients] [-m inflight] [-s size] [-r size] [-n count] [-p port] [-u path] [-S size] [-U]\n", argv[0]);
+        return 1;
+    }
+    const char* name = argv[1];
+    if(strcmp(name, "echo") == 0)      mode = BENCH_ECHO;
+    else if(strcmp(name, "rr") == 0)   mode = BENCH_RR;
+    else if(strcmp(name, "req") == 0)  mode = BENCH_REQ;
+    else if(strcmp(name, "udp") == 0)  mode = BENCH_UDP;
+    else if(strcmp(name, "loge") == 0) mode = BENCH_LOGE;
+    else if(strcmp(name, "pubsub") == 0) mode = BENCH_PUBSUB;
+    else {
+        printf("unknown benchmark: %s\n", name);
+        return 1;
+    }
+    int opt;
+    optind = 2;
+    while((opt = getopt(argc, argv, "c:m:s:r:n:p:u:S:U")) != -1) {
+        switch(opt) {
+        case 'c': clients = atoi(optarg); break;
+        case 'm': inflight = atoi(optarg); break;
+        case 's': size = (unsigned int) atoi(optarg); break;
+        case 'r': response_size = (unsigned int) atoi(optarg); break;
+        case 'n': total = (uint64_t) atoll(optarg); break;
+        case 'p': port = atoi(optarg); break;
+        case 'u': snprintf(endpoint, sizeof(endpoint), "unix:%s", optarg); break;
+        case 'S': shm_ring_size = (unsigned int) atoi(optarg); break;
+        case 'U': io_uring = 1; break;
+        default: return 1;
+        }
+    }
+    if(total == 0)
+        total = (mode == BENCH_UDP ? 200000 : 1000000);
+    if(mode == BENCH_UDP && size < 8)
+        size = 8;
+    if(mode == BENCH_UDP && size > 65507)
+        size = 65507;
+    if(mode == BENCH_PUBSUB && size < 8)
+        size = 8; // the publish time
+    if(mode == BENCH_PUBSUB && clients > 0)
+        total = (total + clients - 1) / clients * clients; // messages are delivered to every client
+    if(mode == BENCH_REQ && size < 4)
+        size = 4; // the request id
+    if(mode == BENCH_REQ && response_size < 4)
+        response_size = 4;
+    if(size == 0 || clients <= 0 || inflight <= 0) {
+        printf("invalid options\n");
+        return 1;
+    }
+    printf("%s: clients=%d inflight=%d size=%u response=%u count=%llu endpoint=%s%s\n", name, clients, inflight,
+           size, response_size, (unsigned long long) total, endpoint, (io_uring ? " io_uring" : ""));
+
+    loop = uv_default_loop();
+    uvx_histogram_reset(&latency);
+    if(mode == BENCH_LOGE) {
+        uint64_t a = allocs;
+        start_time = uv_hrtime();
+        bench_loge();
+        report(name, uv_hrtime() - start_time, allocs - a);
+        return 0;
+    }
+
+    start_server();
+    usleep(100000); // wait for the server listening
+    uint64_t a = uvx_atomic_load_u64(&allocs);
+    start_time = uv_hrtime();
+    if(mode == BENCH_UDP)
+        start_udp_client();
+    else
+        start_clients();
+    uv_run(loop, UV_RUN_DEFAULT);
+    uint64_t elapsed = uv_hrtime() - start_time;
+    report(name, elapsed, uvx_atomic_load_u64(&allocs) - a);
+    if(mode == BENCH_RR || mode == BENCH_REQ) {
+        char buf[160];
+        printf("  server reply latency(us): %s\n", uvx_histogram_summary(&xserver.reply_latency, buf, sizeof(buf)));
+    }
+    stop_server();
+    return 0;
+}
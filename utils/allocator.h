@@ -0,0 +1,35 @@
+#ifndef __UVX_ALLOCATOR_H
+#define __UVX_ALLOCATOR_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the memory allocator of uvx, automem and linkhash, defaults to malloc/calloc/realloc/free.
+// it can be replaced by uvx_set_allocator(), e.g. with jemalloc, mimalloc or a counting allocator.
+typedef struct uvx_allocator_s {
+    void* (*malloc)  (size_t size);
+    void* (*calloc)  (size_t count, size_t size);
+    void* (*realloc) (void* p, size_t size);
+    void  (*free)    (void* p);
+} uvx_allocator_t;
+
+// set the memory allocator, all four functions are required. pass NULL to restore the default.
+// please call it before any other uvx/automem/linkhash function, and never call it again while
+// any memory allocated by the previous allocator is still alive.
+void uvx_set_allocator(const uvx_allocator_t* allocator);
+
+// allocate and free memory by current allocator.
+// memory passed to uvx and freed by uvx (e.g. `data` of `uvx_server_conn_send`) must be allocated by these.
+void* uvx_malloc(size_t size);
+void* uvx_calloc(size_t count, size_t size);
+void* uvx_realloc(void* p, size_t size);
+void  uvx_free(void* p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__UVX_ALLOCATOR_H
@@ -14,19 +14,20 @@
 
 //#include "bits.h"
 #include "arraylist.h"
+#include "allocator.h"
 
 struct array_list*
 array_list_new(array_list_free_fn *free_fn)
 {
   struct array_list *arr;
 
-  arr = (struct array_list*)calloc(1, sizeof(struct array_list));
+  arr = (struct array_list*)uvx_calloc(1, sizeof(struct array_list));
   if(!arr) return NULL;
   arr->size = ARRAY_LIST_DEFAULT_SIZE;
   arr->length = 0;
   arr->free_fn = free_fn;
-  if(!(arr->array = (void**)calloc(sizeof(void*), arr->size))) {
-    free(arr);
+  if(!(arr->array = (void**)uvx_calloc(sizeof(void*), arr->size))) {
+    uvx_free(arr);
     return NULL;
   }
   return arr;
@@ -38,8 +39,8 @@ array_list_free(struct array_list *arr)
   int i;
   for(i = 0; i < arr->length; i++)
     if(arr->array[i] && NULL != arr->free_fn) arr->free_fn(arr->array[i]);
-  free(arr->array);
-  free(arr);
+  uvx_free(arr->array);
+  uvx_free(arr);
 }
 
 void*
@@ -58,7 +59,7 @@ static int array_list_expand_internal(struct array_list *arr, int mx)
 
   if(mx < arr->size) return 0;
   new_size = max(arr->size << 1, mx);
-  if(!(t = realloc(arr->array, new_size*sizeof(void*)))) return -1;
+  if(!(t = uvx_realloc(arr->array, new_size*sizeof(void*)))) return -1;
   arr->array = (void**)t;
   (void)memset(arr->array + arr->size, 0, (new_size-arr->size)*sizeof(void*));
   arr->size = new_size;
@@ -96,7 +97,7 @@ static void check_and_free_array_memary(struct array_list * arr){
 	new_size = arr->size >> 1;
 	if(arr->length >= new_size) return;
 	
-	if(!(t = realloc(arr->array, new_size*sizeof(void*)))) return;
+	if(!(t = uvx_realloc(arr->array, new_size*sizeof(void*)))) return;
 	arr->array = (void**)t;
 	(void)memset(arr->array + arr->length, 0, (new_size-arr->length)*sizeof(void*));
 	arr->size = new_size;
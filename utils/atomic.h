@@ -0,0 +1,38 @@
+#ifndef __UVX_ATOMIC_H
+#define __UVX_ATOMIC_H
+
+// minimal atomic operations used by uvx, on GCC/Clang and MSVC.
+
+#include <stdint.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+	#include <windows.h>
+	// MSVC: Interlocked* are full barriers, plain volatile loads/stores are acquire/release on x86/x64
+	#define uvx_atomic_load_u32(p)        (*(volatile uint32_t*)(p))
+	#define uvx_atomic_store_u32(p,v)     (*(volatile uint32_t*)(p) = (v))
+	#define uvx_atomic_load_u64(p)        ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0))
+	#define uvx_atomic_store_u64(p,v)     InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+	#define uvx_atomic_add_u32(p,v)       ((uint32_t)InterlockedExchangeAdd((volatile LONG*)(p), (LONG)(v)))
+	#define uvx_atomic_add_u64(p,v)       ((uint64_t)InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v)))
+	#define uvx_atomic_cas_u32(p,expected,desired) \
+		(InterlockedCompareExchange((volatile LONG*)(p), (LONG)(desired), (LONG)(expected)) == (LONG)(expected))
+	#define uvx_atomic_cas_u64(p,expected,desired) \
+		(InterlockedCompareExchange64((volatile LONG64*)(p), (LONG64)(desired), (LONG64)(expected)) == (LONG64)(expected))
+#else
+	#define uvx_atomic_load_u32(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+	#define uvx_atomic_store_u32(p,v)     __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+	#define uvx_atomic_load_u64(p)        __atomic_load_n((p), __ATOMIC_RELAXED)
+	#define uvx_atomic_store_u64(p,v)     __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+	#define uvx_atomic_add_u32(p,v)       __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+	#define uvx_atomic_add_u64(p,v)       __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+	#define uvx_atomic_cas_u32(p,expected,desired) \
+		__atomic_compare_exchange_n((p), &(expected), (desired), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+	#define uvx_atomic_cas_u64(p,expected,desired) \
+		__atomic_compare_exchange_n((p), &(expected), (desired), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#endif
+
+// add `v` to a counter which is only written by one thread, without lock prefix.
+// readers of any thread see untorn values (by uvx_atomic_load_u64).
+#define uvx_atomic_add1w_u64(p,v)     uvx_atomic_store_u64((p), uvx_atomic_load_u64(p) + (v))
+
+#endif //__UVX_ATOMIC_H
@@ -1,15 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
-
-#if defined(_WIN32) || defined(_WIN64)
-	#include <windows.h>
-#else
-	#include <stdio.h>
-	#include <stdlib.h>
-	#include <string.h>
-#endif
+#include <string.h>
 
 #include "automem.h"
+#include "allocator.h"
 
 // author: bywayboy
 
@@ -17,11 +11,7 @@ void automem_init(automem_t* pmem, unsigned int initBufferSize)
 {
 	pmem->size = 0;
 	pmem->buffersize = (initBufferSize == 0 ? 128 : initBufferSize);
-#if defined(_WIN32) || defined(_WIN64)
-	pmem->pdata = (unsigned char*) HeapAlloc(GetProcessHeap(),0,pmem->buffersize);
-#else
-	pmem->pdata = (unsigned char*) malloc(pmem->buffersize);
-#endif
+	pmem->pdata = (unsigned char*) uvx_malloc(pmem->buffersize);
 	
 }
 
@@ -30,11 +20,7 @@ void automem_uninit(automem_t* pmem)
 	if(NULL != pmem->pdata)
 	{
 		pmem->size = pmem->buffersize = 0;
-#if defined(_WIN32) || defined(_WIN64)
-		HeapFree(GetProcessHeap(),0,pmem->pdata);
-#else
-		free(pmem->pdata);
-#endif
+		uvx_free(pmem->pdata);
 		pmem->pdata = NULL;
 	}
 }
@@ -59,11 +45,7 @@ void automem_ensure_newspace(automem_t* pmem, unsigned int len)
 	}
 	if(newbuffersize > pmem->buffersize)
 	{
-#if defined(_WIN32) || defined(_WIN64)
-		pmem->pdata = (unsigned char*)HeapReAlloc(GetProcessHeap(),0,pmem->pdata,newbuffersize);
-#else
-		pmem->pdata = (unsigned char*) realloc(pmem->pdata, newbuffersize);
-#endif
+		pmem->pdata = (unsigned char*) uvx_realloc(pmem->pdata, newbuffersize);
 		pmem->buffersize = newbuffersize;
 	}
 }
@@ -78,7 +60,7 @@ void automem_attach(automem_t* pmem, void* pdata, unsigned int len)
 }
 
 //after automem_detach(), pmem is not available utill next automem_init()
-//returned value must be free(), if not NULL
+//returned value must be uvx_free(), if not NULL
 
 /* ȡָͳ */
 
@@ -119,15 +101,9 @@ int automem_erase_ex(automem_t* pmem, unsigned int size,unsigned int limit)
 
 		if(pmem->buffersize > (newsize + limit))
 		{
-#if defined(_WIN32) || defined(_WIN64)
-			char * buffer = (char*) HeapAlloc(GetProcessHeap(), 0, newsize + limit);
-			memcpy(buffer, pmem->pdata + size, newsize);
-			HeapFree(GetProcessHeap(),0,pmem->pdata);
-#else
-			char * buffer = (unsigned char*) malloc(newsize + limit);
+			char * buffer = (char*) uvx_malloc(newsize + limit);
 			memcpy(buffer, pmem->pdata + size, newsize);
-			free(pmem->pdata);
-#endif
+			uvx_free(pmem->pdata);
 			pmem->pdata = (unsigned char*)buffer;
 			pmem->size = newsize;
 			pmem->buffersize = newsize + limit;
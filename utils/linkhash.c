@@ -17,6 +17,7 @@
 #include <limits.h>
 
 #include "linkhash.h"
+#include "allocator.h"
 
 static void lh_abort(const char *msg, ...)
 {
@@ -61,12 +62,12 @@ struct lh_table* lh_table_new(int size, const char *name,
 	int i;
 	struct lh_table *t;
 
-	t = (struct lh_table*)calloc(1, sizeof(struct lh_table));
+	t = (struct lh_table*)uvx_calloc(1, sizeof(struct lh_table));
 	if(!t) lh_abort("lh_table_new: calloc failed\n");
 	t->count = 0;
 	t->size = size;
 	t->name = name;
-	t->table = (struct lh_entry*)calloc(size, sizeof(struct lh_entry));
+	t->table = (struct lh_entry*)uvx_calloc(size, sizeof(struct lh_entry));
 	if(!t->table) lh_abort("lh_table_new: calloc failed\n");
 	t->free_fn = free_fn;
 	t->hash_fn = hash_fn;
@@ -98,13 +99,13 @@ void lh_table_resize(struct lh_table *t, int new_size)
 		lh_table_insert(new_t, ent->k, ent->v);
 		ent = ent->next;
 	}
-	free(t->table);
+	uvx_free(t->table);
 	t->table = new_t->table;
 	t->size = new_size;
 	t->head = new_t->head;
 	t->tail = new_t->tail;
 	t->resizes++;
-	free(new_t);
+	uvx_free(new_t);
 }
 
 void lh_table_free(struct lh_table *t)
@@ -115,8 +116,8 @@ void lh_table_free(struct lh_table *t)
 			t->free_fn(c);
 		}
 	}
-	free(t->table);
-	free(t);
+	uvx_free(t->table);
+	uvx_free(t);
 }
 
 
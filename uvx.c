@@ -2,14 +2,21 @@
 #include <stdio.h>
 #include <string.h>
 #include <memory.h>
+#include <stddef.h>
 #include <assert.h>
 
 #include <uv.h>
 
+#include "uvx.h"
 #include "utils/automem.h"
+#include "utils/atomic.h"
 
 // Author: Liigo <liigo@qq.com>
 
+// defines in uvx_event.c
+void uvx__event(int level, const char* tag, const char* fmt, ...);
+void uvx__event_log(FILE* out, FILE* err, int level, const char* tag, const char* fmt, ...);
+
 const char* uvx_get_ip_port(const struct sockaddr* addr, char* ipbuf, int buflen, int* port) {
     switch (addr->sa_family) {
     case AF_INET: {
@@ -60,34 +67,177 @@ const char* uvx_get_tcp_ip_port(uv_tcp_t* uvclient, char* ipbuf, int buflen, int
 	if(r == 0) {
 		return uvx_get_ip_port(&addr, ipbuf, buflen, port);
 	} else {
-        printf("\n!!! [uvx] get client ip failed: %s\n", uv_strerror(r));
+        uvx__event_log(stdout, stdout, UVX_LOG_WARN, "uvx", "get client ip failed: %s", uv_strerror(r));
 		return NULL;
 	}
 }
 
+// returns the path of an "unix:/path" endpoint, or NULL if it's an ip.
+const char* uvx__pipe_name(const char* endpoint) {
+    return (strncmp(endpoint, "unix:", 5) == 0 ? endpoint + 5 : NULL);
+}
+
+// the write request of uvx_send_to_stream()
+typedef struct uvx_write_req_s {
+    uv_write_t w;
+    unsigned int size;
+    uvx_stats_t* stats; // can be NULL
+    uvx_histogram_t* latency; // can be NULL
+    uint64_t start_time; // uv_hrtime() when queued, only set if latency != NULL
+} uvx_write_req_t;
+
 static void uvx_after_send_to_stream(uv_write_t* w, int status) {
+    uvx_write_req_t* req = (uvx_write_req_t*) w;
     if(status) {
-        printf("\n!!! [uvx] uvx_send_to_stream() failed or canceled: %d\n", status);
+        uvx__event_log(stdout, stdout, UVX_LOG_WARN, "uvx", "uvx_send_to_stream() failed or canceled: %s", uv_strerror(status));
+    } else if(req->latency) {
+        uvx_histogram_record(req->latency, (uv_hrtime() - req->start_time) / 1000);
+    }
+    if(req->stats) {
+        uvx_stats_t* stats = req->stats;
+        uvx_atomic_add1w_u64(&stats->write_queue_count, (uint64_t)-1);
+        uvx_atomic_add1w_u64(&stats->write_queue_bytes, (uint64_t)0 - req->size);
+        if(status == 0) {
+            uvx_atomic_add1w_u64(&stats->msgs_out, 1);
+            uvx_atomic_add1w_u64(&stats->bytes_out, req->size);
+        } else {
+            uvx_atomic_add1w_u64(&stats->send_failures, 1);
+        }
     }
     //see uvx_send_to_stream()
-    free(w->data);
-    free(w);
+    uvx_free(w->data);
+    uvx_free(w);
 }
 
-// Note: after this call, do not use `data` anymore, its memory will be `free`ed later.
-int uvx_send_to_stream(uv_stream_t* stream, void* data, unsigned int size) {
-    // puts("uvx_send_to_stream()\n");
+// the internal version of uvx_send_to_stream(), updating `stats` and `latency` if they're not NULL.
+int uvx__send_to_stream(uv_stream_t* stream, void* data, unsigned int size, uvx_stats_t* stats, uvx_histogram_t* latency) {
     assert(stream && data);
     uv_buf_t buf = { .base = (char*)data, .len = (size_t)size };
-    uv_write_t* w = (uv_write_t*) malloc(sizeof(uv_write_t));
-    memset(w, 0, sizeof(uv_write_t));
-    w->data = data; // free it in uvx_after_send_to_stream()
-    return (uv_write(w, stream, &buf, 1, uvx_after_send_to_stream) == 0 ? 1 : 0);
+    uvx_write_req_t* req = (uvx_write_req_t*) uvx_malloc(sizeof(uvx_write_req_t));
+    memset(req, 0, sizeof(uvx_write_req_t));
+    req->w.data = data; // free it in uvx_after_send_to_stream()
+    req->size = size;
+    req->stats = stats;
+    req->latency = latency;
+    if(latency)
+        req->start_time = uv_hrtime();
+    int r = uv_write(&req->w, stream, &buf, 1, uvx_after_send_to_stream);
+    if(r != 0) {
+        if(stats)
+            uvx_atomic_add1w_u64(&stats->send_failures, 1);
+        uvx__event_log(stdout, stdout, UVX_LOG_WARN, "uvx", "uvx_send_to_stream() failed: %s", uv_strerror(r));
+        uvx_free(data);
+        uvx_free(req);
+        return 0;
+    }
+    if(stats) {
+        uvx_atomic_add1w_u64(&stats->write_queue_count, 1);
+        uvx_atomic_add1w_u64(&stats->write_queue_bytes, size);
+    }
+    return 1;
+}
+
+// the write request of uvx__send_bufs_to_stream(), followed by `count` bufs
+typedef struct uvx_write_bufs_req_s {
+    uv_write_t w;
+    unsigned int count, size;
+    uvx_stats_t* stats; // can be NULL
+    uv_buf_t bufs[1];
+} uvx_write_bufs_req_t;
+
+static void uvx_after_send_bufs_to_stream(uv_write_t* w, int status) {
+    uvx_write_bufs_req_t* req = (uvx_write_bufs_req_t*) w;
+    if(status)
+        uvx__event_log(stdout, stdout, UVX_LOG_WARN, "uvx", "uvx__send_bufs_to_stream() failed or canceled: %s", uv_strerror(status));
+    if(req->stats) {
+        uvx_stats_t* stats = req->stats;
+        uvx_atomic_add1w_u64(&stats->write_queue_count, (uint64_t)-1);
+        uvx_atomic_add1w_u64(&stats->write_queue_bytes, (uint64_t)0 - req->size);
+        if(status == 0) {
+            uvx_atomic_add1w_u64(&stats->msgs_out, req->count);
+            uvx_atomic_add1w_u64(&stats->bytes_out, req->size);
+        } else {
+            uvx_atomic_add1w_u64(&stats->send_failures, req->count);
+        }
+    }
+    for(unsigned int i = 0; i < req->count; i++)
+        uvx_free(req->bufs[i].base);
+    uvx_free(req);
+}
+
+// sends `count` bufs in one vectored write, every bufs[i].base will be `free`ed later (even if fails).
+// counts as `count` sends in `stats` but one write in the write queue.
+int uvx__send_bufs_to_stream(uv_stream_t* stream, const uv_buf_t* bufs, unsigned int count, uvx_stats_t* stats) {
+    assert(stream && bufs && count > 0);
+    uvx_write_bufs_req_t* req = (uvx_write_bufs_req_t*) uvx_malloc(sizeof(uvx_write_bufs_req_t) + (count - 1) * sizeof(uv_buf_t));
+    req->count = count;
+    req->size = 0;
+    req->stats = stats;
+    for(unsigned int i = 0; i < count; i++) {
+        req->bufs[i] = bufs[i];
+        req->size += (unsigned int) bufs[i].len;
+    }
+    int r = uv_write(&req->w, stream, req->bufs, count, uvx_after_send_bufs_to_stream);
+    if(r != 0) {
+        if(stats)
+            uvx_atomic_add1w_u64(&stats->send_failures, count);
+        uvx__event_log(stdout, stdout, UVX_LOG_WARN, "uvx", "uvx__send_bufs_to_stream() failed: %s", uv_strerror(r));
+        for(unsigned int i = 0; i < count; i++)
+            uvx_free(req->bufs[i].base);
+        uvx_free(req);
+        return 0;
+    }
+    if(stats) {
+        uvx_atomic_add1w_u64(&stats->write_queue_count, 1);
+        uvx_atomic_add1w_u64(&stats->write_queue_bytes, req->size);
+    }
+    return 1;
+}
+
+// Note: after this call, do not use `data` anymore, its memory will be `free`ed later.
+int uvx_send_to_stream(uv_stream_t* stream, void* data, unsigned int size) {
+    return uvx__send_to_stream(stream, data, size, NULL, NULL);
+}
+
+// take a snapshot of `src`, it may be updated by another thread at the same time.
+void uvx__stats_snapshot(uvx_stats_t* src, uvx_stats_t* dst) {
+    uint64_t* s = (uint64_t*) src;
+    uint64_t* d = (uint64_t*) dst;
+    for(unsigned int i = 0; i < offsetof(uvx_stats_t, bytes_in_rate) / sizeof(uint64_t); i++)
+        d[i] = uvx_atomic_load_u64(&s[i]);
+    dst->bytes_in_rate  = src->bytes_in_rate;
+    dst->bytes_out_rate = src->bytes_out_rate;
+    dst->msgs_in_rate   = src->msgs_in_rate;
+    dst->msgs_out_rate  = src->msgs_out_rate;
+    memcpy(&dst->last_tick, &src->last_tick, sizeof(src->last_tick));
+}
+
+// compute rates per second since last tick, called at heartbeat.
+void uvx__stats_tick(uvx_stats_t* stats, uint64_t now_ms) {
+    if(stats->last_tick.time_ms && now_ms > stats->last_tick.time_ms) {
+        double seconds = (now_ms - stats->last_tick.time_ms) / 1000.0;
+        stats->bytes_in_rate  = (stats->bytes_in  - stats->last_tick.bytes_in)  / seconds;
+        stats->bytes_out_rate = (stats->bytes_out - stats->last_tick.bytes_out) / seconds;
+        stats->msgs_in_rate   = (stats->msgs_in   - stats->last_tick.msgs_in)   / seconds;
+        stats->msgs_out_rate  = (stats->msgs_out  - stats->last_tick.msgs_out)  / seconds;
+    }
+    stats->last_tick.time_ms   = now_ms;
+    stats->last_tick.bytes_in  = stats->bytes_in;
+    stats->last_tick.bytes_out = stats->bytes_out;
+    stats->last_tick.msgs_in   = stats->msgs_in;
+    stats->last_tick.msgs_out  = stats->msgs_out;
+}
+
+// record the delay of a timer, i.e. the loop lag.
+void uvx__stats_lag(uvx_stats_t* stats, uint64_t lag_ms) {
+    uvx_atomic_store_u64(&stats->loop_lag_ms, lag_ms);
+    if(lag_ms > stats->loop_lag_max_ms)
+        uvx_atomic_store_u64(&stats->loop_lag_max_ms, lag_ms);
 }
 
 static void uvx_after_send_mem(uv_write_t* w, int status) {
     if(status) {
-        printf("\n!!! [uvx] uvx_send_mem() failed or canceled: %d\n", status);
+        uvx__event_log(stdout, stdout, UVX_LOG_WARN, "uvx", "uvx_send_mem() failed or canceled: %s", uv_strerror(status));
     }
 
     //see uxv_send_mem()
@@ -95,7 +245,7 @@ static void uvx_after_send_mem(uv_write_t* w, int status) {
     mem.pdata = (unsigned char*)w->data;
     automem_uninit(&mem);
 
-    free(w);
+    uvx_free(w);
 }
 
 // Deprecated, use uvx_send_to_stream() instead.
@@ -105,7 +255,7 @@ int uvx_send_mem(automem_t* mem, uv_stream_t* stream) {
     assert(mem && mem->pdata);
     assert(stream);
     uv_buf_t buf = { .base = (char*)mem->pdata, .len = (size_t)mem->size };
-    uv_write_t* w = (uv_write_t*) malloc(sizeof(uv_write_t));
+    uv_write_t* w = (uv_write_t*) uvx_malloc(sizeof(uv_write_t));
     memset(w, 0, sizeof(uv_write_t));
     w->data = mem->pdata; // free it in after_send_mem()
     return uv_write(w, stream, &buf, 1, uvx_after_send_mem);
@@ -115,10 +265,82 @@ int uvx_send_mem(automem_t* mem, uv_stream_t* stream) {
 // internal functions
 
 void uvx__on_alloc_buf(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
-	buf->base = (char*) malloc(suggested_size);
+	buf->base = (char*) uvx_malloc(suggested_size);
 	buf->len  = buf->base ? suggested_size : 0;
 }
 
+// hands libuv the free tail (at least `size` bytes) of `mem`, so that reads land in place.
+// after a successful read, the caller should increase `mem->size` by `nread`.
+void uvx__alloc_mem_tail(automem_t* mem, size_t size, uv_buf_t* buf) {
+	if(mem->pdata == NULL)
+		automem_init(mem, (unsigned int)size);
+	automem_ensure_newspace(mem, (unsigned int)size);
+	buf->base = mem->pdata ? (char*)mem->pdata + mem->size : NULL;
+	buf->len  = mem->pdata ? (size_t)(mem->buffersize - mem->size) : 0;
+}
+
+// the initial receive buffer size, it will be adjusted by uvx__recv_sizer_update()
+#define UVX_RECV_SIZER_INITIAL  2048
+
+void uvx__recv_sizer_init(uvx_recv_sizer_t* sizer, unsigned int min, unsigned int max) {
+	memset(sizer, 0, sizeof(uvx_recv_sizer_t));
+	if(max == 0 && min == 0)
+		return; // disabled, use libuv's suggested size
+	if(min == 0) min = 1;
+	if(max < min) max = min;
+	sizer->min = min;
+	sizer->max = max;
+	sizer->size = UVX_RECV_SIZER_INITIAL;
+	if(sizer->size < min) sizer->size = min;
+	if(sizer->size > max) sizer->size = max;
+}
+
+// returns the receive buffer size for next read
+size_t uvx__recv_sizer_size(uvx_recv_sizer_t* sizer, size_t suggested_size) {
+	return sizer->size ? (size_t)sizer->size : suggested_size;
+}
+
+// grows the buffer if the last read filled it up, shrinks it after two consecutive small reads.
+void uvx__recv_sizer_update(uvx_recv_sizer_t* sizer, ssize_t nread) {
+	if(nread <= 0)
+		return;
+	sizer->last_read = (unsigned int) nread;
+	if(sizer->size == 0)
+		return;
+	if(sizer->last_read >= sizer->size) {
+		sizer->small_reads = 0;
+		if(sizer->size < sizer->max) {
+			sizer->size = (sizer->size > sizer->max / 2) ? sizer->max : sizer->size * 2;
+			sizer->grow_count++;
+		}
+	} else if(sizer->last_read <= sizer->size / 2 && sizer->size > sizer->min) {
+		if(++sizer->small_reads >= 2) {
+			sizer->small_reads = 0;
+			sizer->size = (sizer->size / 2 < sizer->min) ? sizer->min : sizer->size / 2;
+			sizer->shrink_count++;
+		}
+	} else {
+		sizer->small_reads = 0;
+	}
+}
+
+// consume the leading `size` bytes of `mem`, and release its memory if it's empty and oversized.
+unsigned int uvx__consume_mem(automem_t* mem, unsigned int size, uvx_recv_sizer_t* sizer) {
+	if(mem->pdata == NULL)
+		return 0;
+	automem_erase(mem, size);
+	if(mem->size == 0 && mem->buffersize > 2 * uvx__recv_sizer_size(sizer, 65536))
+		automem_uninit(mem); // lazy init again, see uvx__alloc_mem_tail()
+	return mem->size;
+}
+
+// dump the summary of a latency histogram to uvx event log, if it's not empty.
+void uvx__histogram_dump(const char* tag, const char* name, const char* what, uvx_histogram_t* h) {
+    char buf[160];
+    if(uvx_atomic_load_u64(&h->count) > 0)
+        uvx__event(UVX_LOG_INFO, tag, "%s %s latency(us): %s", name, what, uvx_histogram_summary(h, buf, sizeof(buf)));
+}
+
 /**
 // vc2017 has builtin snprintf
 #if defined(_WIN32) && !defined(__GNUC__)
@@ -142,4 +364,4 @@ int snprintf(char* buf, size_t len, const char* fmt, ...) {
 	return n;
 }
 #endif
-**/
\ No newline at end of file
+**/
@@ -12,6 +12,7 @@ extern "C"	{
 #include <uv.h>
 #include "loge/loge.h"
 #include "utils/automem.h"
+#include "utils/allocator.h"
 
 //-----------------------------------------------
 // uvx: a lightweight wrapper of libuv, defines `uvx_server_t`(TCP server),
@@ -25,6 +26,9 @@ extern "C"	{
 //   a `uvx_udp_config_t` with some params and callbacks, then call `uvx_udp_start`.
 // - To define a logging service (which I call it xlog), just call `uvx_log_init`.
 //
+// xserver and xclient also support unix domain sockets (or named pipes on Windows), by passing
+// "unix:/path" as the ip (and the port is ignored), with the same callbacks and semantics.
+//
 // There are a few predefined callbacks, such as on_conn_ok, on_conn_close, on_heartbeat, etc.
 // All callbacks are optional. Maybe `on_recv` is the most useful one you care about.
 //
@@ -32,6 +36,83 @@ extern "C"	{
 // http://github.com/liigo/uvx
 
 
+//-----------------------------------------------
+// adaptive receive buffer sizing: `uvx_recv_sizer_t`
+
+// each xserver connection and xclient tracks its recent read sizes, grows the receive buffer
+// (up to `max`) when a read fills it up, and shrinks it (down to `min`) after consecutive small reads.
+// all fields are read-only stats for users.
+typedef struct uvx_recv_sizer_s {
+    unsigned int size;         // current receive buffer size in bytes, 0 means use libuv's suggested size
+    unsigned int min, max;     // see config.recv_buffer_min and config.recv_buffer_max
+    unsigned int last_read;    // size in bytes of the last read
+    unsigned int small_reads;  // count of consecutive reads which fit in half of the buffer
+    unsigned int grow_count;   // how many times the buffer has grown
+    unsigned int shrink_count; // how many times the buffer has shrunk
+} uvx_recv_sizer_t;
+
+
+//-----------------------------------------------
+// uvx stats: `uvx_stats_t`
+
+// the stats of an xserver, xclient or xudp (and xlog), updated on hot paths by its loop thread.
+// please read it through `uvx_server_stats`/`uvx_client_stats`/`uvx_udp_stats`/`uvx_log_stats`,
+// which take a consistent-enough snapshot without locking, from any thread.
+typedef struct uvx_stats_s {
+    uint64_t bytes_in, bytes_out;   // bytes received and sent (sent means write completed)
+    uint64_t msgs_in, msgs_out;     // reads (or datagrams) received, and writes (or datagrams) sent
+    uint64_t send_failures;         // sends failed or canceled
+    uint64_t write_queue_count;     // sends queued but not completed yet
+    uint64_t write_queue_bytes;     // bytes queued but not completed yet
+    uint64_t accepts;               // xserver: connections accepted; xclient: connections established
+    uint64_t closes;                // connections closed
+    uint64_t timeouts;              // xserver: connections closed for long time silence
+    uint64_t loop_lag_ms;           // delay of last heartbeat timer, i.e. how long the loop was blocked
+    uint64_t loop_lag_max_ms;       // max delay of heartbeat timer
+    // rates per second, computed at every heartbeat for the last interval
+    double bytes_in_rate, bytes_out_rate, msgs_in_rate, msgs_out_rate;
+    struct {
+        uint64_t time_ms, bytes_in, bytes_out, msgs_in, msgs_out;
+    } last_tick; // internal use, see rates
+} uvx_stats_t;
+
+
+//-----------------------------------------------
+// uvx latency histogram: `uvx_histogram_t`
+
+// a log-linear (HDR-style) histogram of latencies in microseconds, with fixed memory.
+// values below 16 have exact buckets, larger values are split into 16 linear sub-buckets
+// per power of 2 (relative error <= 6.25%), values above UVX_HISTOGRAM_MAX are clamped.
+// recording is lock-free and can be done from any thread, so are the queries.
+#define UVX_HISTOGRAM_SUB_BITS  4
+#define UVX_HISTOGRAM_MAX_BITS  36 // max value is (2^36 - 1) microseconds, about 19 hours
+#define UVX_HISTOGRAM_MAX       ((((uint64_t)1) << UVX_HISTOGRAM_MAX_BITS) - 1)
+#define UVX_HISTOGRAM_BUCKETS   ((UVX_HISTOGRAM_MAX_BITS - UVX_HISTOGRAM_SUB_BITS + 1) << UVX_HISTOGRAM_SUB_BITS)
+
+typedef struct uvx_histogram_s {
+    uint64_t count, sum, max;
+    uint64_t min; // (min + 1), or 0 if nothing recorded, please read it by uvx_histogram_min()
+    uint64_t buckets[UVX_HISTOGRAM_BUCKETS];
+} uvx_histogram_t;
+
+// clear all recorded values.
+void uvx_histogram_reset(uvx_histogram_t* h);
+
+// record a value (in microseconds).
+void uvx_histogram_record(uvx_histogram_t* h, uint64_t value);
+
+// returns the value at `percentile` (0.0 ~ 100.0, e.g. 99.9), or 0 if nothing recorded.
+// the result is the highest value of its bucket, but never greater than the max recorded value.
+uint64_t uvx_histogram_percentile(uvx_histogram_t* h, double percentile);
+
+// returns the min recorded value, or 0 if nothing recorded.
+uint64_t uvx_histogram_min(uvx_histogram_t* h);
+
+// format a one-line summary (count, min, mean, p50, p90, p99, p99.9, max) into `buf`.
+// returns `buf`.
+const char* uvx_histogram_summary(uvx_histogram_t* h, char* buf, int buflen);
+
+
 //-----------------------------------------------
 // uvx tcp server: `uvx_server_t`
 
@@ -45,6 +126,16 @@ typedef void (*UVX_S_ON_CONN_CLOSE)     (uvx_server_t* xserver, uvx_server_conn_
 typedef void (*UVX_S_ON_ITER_CONN)      (uvx_server_t* xserver, uvx_server_conn_t* conn, void* userdata);
 typedef void (*UVX_S_ON_RECV)           (uvx_server_t* xserver, uvx_server_conn_t* conn, void* data, ssize_t datalen);
 typedef void (*UVX_S_ON_HEARTBEAT)      (uvx_server_t* xserver, unsigned int index);
+typedef void (*UVX_S_ON_HANDOFF)        (uvx_server_t* xserver, int listener, unsigned int conns);
+typedef void (*UVX_S_ON_SHUTDOWN)       (uvx_server_t* xserver);
+
+// priority classes of sends, see uvx_server_conn_send_prio()
+#define UVX_SEND_HIGH    0 // control messages, e.g. heartbeats and acks
+#define UVX_SEND_NORMAL  1 // the class of uvx_server_conn_send()
+#define UVX_SEND_BULK    2 // large data, e.g. file contents
+#define UVX_SEND_CLASSES 3
+
+#define UVX_CONN_KEY_MAX 32 // max size of string keys including the ending '\0', see uvx_server_conn_bind()
 
 typedef struct uvx_server_config_s {
     char name[32];    // the xserver's name (with-ending-'\0')
@@ -53,6 +144,46 @@ typedef struct uvx_server_config_s {
     int conn_extra_size; // the bytes of extra data, see `uvx_server_conn_t.extra`
     float conn_timeout_seconds; // if > 0, timeout-ed connections will be closed
     float heartbeat_interval_seconds; // used by heartbeat timer
+    int accumulate_recv; // 1: on, 0: off. if on, reads land in `conn->inbuf` directly, see `uvx_server_conn_consume`
+    unsigned int recv_buffer_min; // adaptive receive buffer size in bytes, see `uvx_recv_sizer_t`.
+    unsigned int recv_buffer_max; // if both are 0 (default), use libuv's suggested size (64KB) for every read.
+    // read budgets per loop iteration, 0 means unlimited. a connection exceeds its budget is paused
+    // (uv_read_stop) and resumed at the end of current loop iteration, to keep fairness.
+    unsigned int read_budget_count;      // max reads from one connection per loop iteration
+    unsigned int read_budget_bytes;      // max bytes read from one connection per loop iteration
+    unsigned int loop_read_budget_bytes; // max bytes read from all connections per loop iteration
+    // accept limits, 0 means unlimited, to protect the xserver from reconnect storms.
+    unsigned int accept_batch_max;  // max connections accepted per loop iteration, the rest are deferred to next iteration
+    float accept_rate_per_second;   // max rate of accepting connections, the rest are deferred until allowed
+    unsigned int conn_max;          // max live connections, excess ones are closed immediately after accepted
+    // ingress rate limits (token buckets, bursting up to one second of rate), 0 means unlimited. a connection exceeds
+    // them is paused (uv_read_stop) until the tokens are refilled. messages are reads, as counted in stats.msgs_in.
+    // they don't apply to io_uring connections and messages through shared memory.
+    unsigned int conn_recv_bytes_per_second; // max bytes per second read from one connection
+    unsigned int conn_recv_msgs_per_second;  // max messages per second read from one connection
+    unsigned int recv_bytes_per_second;      // max bytes per second read from all connections
+    unsigned int recv_msgs_per_second;       // max messages per second read from all connections
+    // overload protection, 0 means off. while the loop lag exceeds it, new connections are closed immediately
+    // after accepted (see accept_stats.shed), to keep serving the existing ones.
+    unsigned int overload_lag_ms;
+    // latency histograms, see `uvx_server_t.*_latency`
+    int latency_histograms;     // 1: on, 0: off
+    float latency_dump_seconds; // if > 0, dump percentiles to uvx event log at heartbeat, in this interval
+    // shared-memory transport, 1: on, 0: off. if on, xclients on the same host (loopback or unix socket)
+    // with config.shm_ring_size > 0 transfer messages through shared memory, see `uvx_client_config_t`.
+    // don't send to a connection before receiving from it, because the client expects the reply of its hello first.
+    int shm_enable;
+    unsigned int shm_spin_us; // max time of busy-polling the ring after the last message, before sleeping
+    // io_uring engine (Linux 6.0+), 1: on, 0: off. if on, connections read by multishot recv into provided buffers
+    // (of recv_buffer_max bytes, at most 64KB, or 64KB if 0), and write by batched sendmsg. falls back to libuv if not supported.
+    // read budgets don't apply to it. accepting is still done by libuv.
+    int io_uring;
+    // if > 0, sends of at least this size use MSG_ZEROCOPY (Linux tcp), 0: off. the data is freed after the kernel
+    // completes it (acked by the peer), so it's only worth for large (>= 64KB) buffers.
+    unsigned int zerocopy_min;
+    // fairness of prioritized sends, see uvx_server_conn_send_prio(). after writing this many bytes of higher
+    // classes while a lower class is waiting, a message of the lower class is written ahead. 0: strict priority.
+    unsigned int send_starve_bytes;
     // callbacks
     UVX_S_ON_CONN_OK        on_conn_ok;
     UVX_S_ON_CONN_FAIL      on_conn_fail;
@@ -65,50 +196,196 @@ typedef struct uvx_server_config_s {
     FILE* log_err;
 } uvx_server_config_t;
 
+// the stats of read budgets, see config.read_budget_*
+typedef struct uvx_read_budget_stats_s {
+    uint64_t paused_count;        // how many times connections were paused by read budgets
+    uint64_t resumed_count;       // how many times paused connections were resumed
+    uint64_t pause_time_total_us; // total delay of paused connections in microseconds
+    uint64_t pause_time_max_us;   // max delay of a paused connection in microseconds, i.e. the tail latency
+    uint64_t loop_bytes_max;      // max bytes read from all connections in one loop iteration
+    unsigned int loop_paused_max; // max count of connections paused in one loop iteration
+    uint64_t limited_count;       // how many times connections were paused by rate limits, see config.*_per_second
+} uvx_read_budget_stats_t;
+
+// the stats of accepting connections, see config.accept_* and config.conn_max
+typedef struct uvx_accept_stats_s {
+    uint64_t accepted; // connections accepted and kept
+    uint64_t rejected; // connections closed immediately because of config.conn_max
+    uint64_t deferred; // times of deferring accepts because of config.accept_batch_max or accept_rate_per_second
+    uint64_t failed;   // failures of listening or accepting
+    uint64_t shed;     // connections closed immediately because of config.overload_lag_ms
+} uvx_accept_stats_t;
+
+// the stats of a priority class of sends, see uvx_server_conn_send_prio()
+typedef struct uvx_send_class_stats_s {
+    uint64_t queued_count;     // messages queued and not written yet
+    uint64_t queued_bytes;
+    uint64_t sent_count;       // messages written
+    uint64_t sent_bytes;
+    uint64_t wait_time_max_us; // max time a message waited in the queue, in microseconds
+    uint64_t promoted_count;   // messages written ahead of higher classes, see config.send_starve_bytes
+} uvx_send_class_stats_t;
+
 struct uvx_server_s {
     uv_loop_t* uvloop;
-    uv_tcp_t   uvserver;
+    union {
+        uv_tcp_t  uvserver;
+        uv_pipe_t uvserver_pipe; // if listening on "unix:/path"
+    };
     uvx_server_config_t config;
-    unsigned char privates[136]; // to store uvx_server_private_t
+    uvx_stats_t stats; // read it by uvx_server_stats()
+    // latency histograms in microseconds, only recorded if config.latency_histograms == 1
+    uvx_histogram_t send_latency;  // from uvx_server_conn_send() to write completed
+    uvx_histogram_t reply_latency; // from the first read of a request to uvx_server_conn_mark_reply()
+    uvx_histogram_t loop_latency;  // busy time of each loop iteration, excluding the time waiting for I/O
+    unsigned char privates[5 * sizeof(uv_timer_t) + sizeof(uv_check_t) + 336 + UVX_SEND_CLASSES * sizeof(uvx_send_class_stats_t)]; // to store uvx_server_private_t
     void* data; // for public use
 };
 typedef struct uvx_server_s uvx_server_t;
 
 typedef struct uvx_server_conn_s {
     uvx_server_t* xserver;
-    uv_tcp_t uvclient;
+    union {
+        uv_tcp_t  uvclient;
+        uv_pipe_t uvclient_pipe; // if the xserver listening on "unix:/path"
+    };
     uint64_t last_comm_time; // time of last communication (uv_now(loop))
     int refcount;
     uv_mutex_t refmutex;
+    automem_t inbuf; // received but not consumed data, only used if config.accumulate_recv == 1
+    uvx_recv_sizer_t recv_sizer; // adaptive receive buffer size and its stats
     void* extra; // pointer to extra data, if config.conn_extra_size > 0, or else is NULL
-    // extra data resides here
+    // private data and extra data reside here
 } uvx_server_conn_t;
 
 // returns the default config for xserver, used by uvx_server_start().
 uvx_server_config_t uvx_server_default_config(uvx_server_t* xserver);
 
-// start an xserver listening on ip:port, support IPv4 and IPv6.
+// start an xserver listening on ip:port, support IPv4 and IPv6, or "unix:/path" (the port is ignored).
 // please pass in uninitialized xserver and initialized config.
 // returns 1 on success, or 0 if fails.
 int uvx_server_start(uvx_server_t* xserver, uv_loop_t* loop, const char* ip, int port, uvx_server_config_t config);
 
-// shutdown the xserver normally.
+// shutdown the xserver normally: stops accepting and closes all connections, dropping their queued writes.
+// same as uvx_server_drain(xserver, 0, NULL).
 // returns 1 on success, or 0 if fails.
 int uvx_server_shutdown(uvx_server_t* xserver);
 
+// drain and shutdown the xserver: stops accepting, half-closes every connection after its queued writes are sent,
+// and closes it on EOF of the peer, or after `timeout_ms` milliseconds (0: closes it now).
+// on_conn_close is called for every connection, then `on_shutdown` (can be NULL) after all handles are closed,
+// xserver can be freed since then.
+// returns 1 on success, or 0 if fails (e.g. it's draining already).
+int uvx_server_drain(uvx_server_t* xserver, unsigned int timeout_ms, UVX_S_ON_SHUTDOWN on_shutdown);
+
+// hot upgrade, the old process: waits for a new process (see uvx_server_takeover()) on unix domain socket `path`,
+// which only processes of the same user can connect. when one connects, the listening socket is handed off and
+// the xserver stops accepting (or resumes if the handoff aborts). then every connection stops
+// reading, and is handed off with its `extra` data and unconsumed `inbuf` after its queued writes are sent,
+// or is closed if they are not sent in `drain_ms` milliseconds. shm and io_uring connections are closed.
+// on_conn_close is called for connections handed off too. `on_done` (can be NULL) is called at the end,
+// with the listener handed off or not and the number of connections, the process can exit then.
+// returns 1 on success, or 0 if fails.
+int uvx_server_handoff_listen(uvx_server_t* xserver, const char* path, unsigned int drain_ms, UVX_S_ON_HANDOFF on_done);
+
+// hot upgrade, the new process: starts an xserver as uvx_server_start(), but takes over the listening socket and
+// connections from the old process waiting on `path`, or listens on ip:port if there is no old process.
+// adopted connections get on_conn_ok with `extra` copied (fix up pointers in it), then on_recv with their
+// unconsumed inbuf if config.accumulate_recv. `on_done` (can be NULL) is called after all connections adopted.
+// returns 1 on success, or 0 if fails.
+int uvx_server_takeover(uvx_server_t* xserver, uv_loop_t* loop, const char* path, const char* ip, int port,
+                        uvx_server_config_t config, UVX_S_ON_HANDOFF on_done);
+
 // iterate all connections if on_iter_conn != NULL.
 // returns the number of connections.
 int uvx_server_iter_conns(uvx_server_t* xserver, UVX_S_ON_ITER_CONN on_iter_conn, void* userdata);
 
+// secondary index of connections by application keys, e.g. user ids. a key is the integer `ikey` if `skey` is NULL,
+// or the string `skey` (shorter than UVX_CONN_KEY_MAX bytes). a key can be bound to many connections (sessions),
+// and a connection to many keys. bindings are removed after the connection is closed.
+// bind and unbind return 1 on success, or 0 if fails (e.g. the key is too long, or it's not bound).
+int uvx_server_conn_bind(uvx_server_conn_t* conn, int64_t ikey, const char* skey);
+int uvx_server_conn_unbind(uvx_server_conn_t* conn, int64_t ikey, const char* skey);
+
+// iterate connections bound to the key if on_iter_conn != NULL, the most recently bound first.
+// on_iter_conn can unbind the connection passed to it, but not others.
+// returns the number of connections.
+int uvx_server_iter_key(uvx_server_t* xserver, int64_t ikey, const char* skey,
+                        UVX_S_ON_ITER_CONN on_iter_conn, void* userdata);
+
+// returns the connection bound to the key most recently, or NULL.
+uvx_server_conn_t* uvx_server_find_key(uvx_server_t* xserver, int64_t ikey, const char* skey);
+
+// topic pub/sub: subscribes the connection to `topic`, or to all topics starting with it if it ends with '*'
+// (e.g. "news.*", or "*" for all). subscriptions are removed after the connection is closed.
+// unsubscribe takes the topic as subscribed, or NULL to unsubscribe all.
+// returns 1 on success, or 0 if fails (e.g. the topic is empty, or it's not subscribed).
+int uvx_server_conn_subscribe(uvx_server_conn_t* conn, const char* topic);
+int uvx_server_conn_unsubscribe(uvx_server_conn_t* conn, const char* topic);
+
+// sends data to every connection subscribed to `topic`, once even if it matches many subscriptions.
+// data is shared by all deliveries (not copied), and they're written by one vectored write per connection
+// in the next loop iteration, in order with uvx_server_conn_send().
+// don't use `data` any more, it will be `free`ed later, as uvx_server_conn_send().
+// returns the number of connections delivered to.
+int uvx_server_publish(uvx_server_t* xserver, const char* topic, void* data, unsigned int size);
+
 // manager conn refcount manually, +1 or -1, free conn when refcount == 0. threadsafe.
 void uvx_server_conn_ref(uvx_server_conn_t* conn, int ref);
 
 // send data to tcp client (not only xclient) of the connection.
 // don't use `data` any more, it will be `free`ed later.
-// please make sure that `data` was `malloc`ed before, so that it can be `free`ed correctly.
+// please make sure that `data` was allocated by `uvx_malloc`, it's freed by `uvx_free` (see `uvx_set_allocator`).
 // returns 1 on success, or 0 if fails.
 int uvx_server_conn_send(uvx_server_conn_t* conn, void* data, unsigned int size);
 
+// send data with priority class `prio` (UVX_SEND_*), as uvx_server_conn_send() does.
+// messages queued but not written yet are written by classes, higher ones first (see config.send_starve_bytes),
+// in order within a class. after called, all sends of the connection are queued (without zerocopy), as UVX_SEND_NORMAL
+// if by uvx_server_conn_send(). connections of shm or io_uring, or with a file sending, send it in order as usual.
+// returns 1 on success, or 0 if fails.
+int uvx_server_conn_send_prio(uvx_server_conn_t* conn, void* data, unsigned int size, int prio);
+
+// get the stats of each priority class of the connection, writing to `stats[UVX_SEND_CLASSES]`.
+// returns 0 if uvx_server_conn_send_prio() was never called for it.
+int uvx_server_conn_send_stats(uvx_server_conn_t* conn, uvx_send_class_stats_t* stats);
+
+// get the stats of each priority class of all connections, writing to `stats[UVX_SEND_CLASSES]`.
+void uvx_server_send_stats(uvx_server_t* xserver, uvx_send_class_stats_t* stats);
+
+// send `length` bytes of file `fd` from `offset` to the connection, in order with other sends.
+// on Linux it's sent by sendfile(2) without copying into user space, otherwise it's read asynchronously
+// in 64KB chunks, the next one after the previous one is written, so at most two chunks are in memory.
+// the fd is owned by uvx after called, and closed after sent or failed.
+// returns 1 on success, or 0 if fails.
+int uvx_server_conn_sendfile(uvx_server_conn_t* conn, uv_file fd, int64_t offset, uint64_t length);
+
+// take a snapshot of the xserver's stats, writing to `stats`. can be called from any thread.
+void uvx_server_stats(uvx_server_t* xserver, uvx_stats_t* stats);
+
+// get the stats of read budgets, writing to `stats`. see config.read_budget_*.
+void uvx_server_read_budget_stats(uvx_server_t* xserver, uvx_read_budget_stats_t* stats);
+
+// get the stats of accepting connections, writing to `stats`. see config.accept_* and config.conn_max.
+void uvx_server_accept_stats(uvx_server_t* xserver, uvx_accept_stats_t* stats);
+
+// shutdown (half-close) the connection after all queued data were sent.
+// the connection is closed later, when the peer closes it too, or it's timeout-ed.
+// returns 1 on success, or 0 if fails.
+int uvx_server_conn_shutdown(uvx_server_conn_t* conn);
+
+// consume (remove) the leading `size` bytes of `conn->inbuf`, only used if config.accumulate_recv == 1.
+// in that mode libuv reads directly into the free tail of `conn->inbuf`, without copying,
+// and on_recv receives the whole unconsumed region (`conn->inbuf.pdata`, `conn->inbuf.size`),
+// so please consume every complete message inside on_recv, or else it will be received again.
+// returns the remaining unconsumed size in bytes.
+unsigned int uvx_server_conn_consume(uvx_server_conn_t* conn, unsigned int size);
+
+// mark the reply of current request is sent (or queued), records `xserver->reply_latency`
+// since the first read of the request. the next read starts a new request.
+// only takes effect if config.latency_histograms == 1.
+void uvx_server_conn_mark_reply(uvx_server_conn_t* conn);
+
 //-----------------------------------------------
 // uvx tcp client: `uvx_client_t`
 
@@ -122,10 +399,56 @@ typedef void (*UVX_C_ON_CONN_CLOSE)     (uvx_client_t* xclient);
 typedef void (*UVX_C_ON_RECV)           (uvx_client_t* xclient, void* data, ssize_t datalen);
 typedef void (*UVX_C_ON_HEARTBEAT)      (uvx_client_t* xclient, unsigned int index);
 
+// the frame codec of request/response, see `uvx_client_request`.
+// returns the length of the first complete frame in `data`, 0 if more data is needed, or -1 if data is invalid.
+typedef int  (*UVX_C_FRAME_LENGTH)      (uvx_client_t* xclient, const void* data, unsigned int size);
+// returns the request id of a frame, the server replies a request with the same id.
+typedef unsigned int (*UVX_C_GET_REQUEST_ID) (uvx_client_t* xclient, const void* frame, unsigned int size);
+// writes the request id into a frame before it's sent.
+typedef void (*UVX_C_SET_REQUEST_ID)    (uvx_client_t* xclient, void* frame, unsigned int size, unsigned int id);
+// status is 0 on success, UV_ETIMEDOUT if timeout, or UV_ECANCELED if the connection is closed.
+// `frame` is NULL if status != 0, don't use it after returns.
+typedef void (*UVX_C_ON_RESPONSE)       (uvx_client_t* xclient, int status, void* frame, unsigned int size, void* ctx);
+
+// stats of requests, all are in total except `inflight`
+typedef struct uvx_request_stats_s {
+    uint64_t inflight;  // requests waiting for response now
+    uint64_t sent, responses, timeouts, canceled;
+} uvx_request_stats_t;
+
+// drop policies of the pending queue, see `uvx_client_config_t.pending_max_count`
+#define UVX_PENDING_DROP_NEWEST 0 // rejects the new send if the queue is full
+#define UVX_PENDING_DROP_OLDEST 1 // drops the oldest sends to make room for the new one
+
+// stats of the pending queue, all bytes are in total except `count` and `bytes`
+typedef struct uvx_pending_stats_s {
+    uint64_t count, bytes;  // sends in the queue now
+    uint64_t queued_bytes;  // bytes queued while disconnected
+    uint64_t flushed_bytes; // bytes flushed after connected
+    uint64_t dropped_bytes; // bytes dropped by config.pending_drop_policy, or at shutdown
+} uvx_pending_stats_t;
+
 typedef struct uvx_client_config_s {
     char name[32];    // the xclient's name (with-ending-'\0')
-    int auto_connect; // 1: on, 0: off
+    int auto_connect; // 1: on, 0: off. if on, reconnect after the connection is closed or failed
     float heartbeat_interval_seconds;
+    // the n-th consecutive reconnect waits min(reconnect_max_seconds, reconnect_delay_seconds * reconnect_backoff ^ (n-1)),
+    // reduced randomly by up to `reconnect_jitter` (0.0 ~ 1.0) of it, so that clients don't reconnect in lockstep.
+    float reconnect_delay_seconds; // delay of the first reconnect, 0 means reconnect immediately
+    float reconnect_max_seconds;   // the cap of delays
+    float reconnect_backoff;       // the multiplier of delay after each failed reconnect
+    float reconnect_jitter;
+    // if pending_max_count > 0, sends are queued while disconnected (up to pending_max_count sends and
+    // pending_max_bytes bytes if it's > 0), and flushed in one write after connected (and on_conn_ok).
+    unsigned int pending_max_count;
+    unsigned int pending_max_bytes;
+    int pending_drop_policy; // UVX_PENDING_DROP_*
+    int accumulate_recv; // 1: on, 0: off. if on, reads land in `xclient->inbuf` directly, see `uvx_client_consume`
+    unsigned int recv_buffer_min; // adaptive receive buffer size in bytes, see `uvx_recv_sizer_t`.
+    unsigned int recv_buffer_max; // if both are 0 (default), use libuv's suggested size (64KB) for every read.
+    // latency histograms, see `uvx_client_t.*_latency`
+    int latency_histograms;     // 1: on, 0: off
+    float latency_dump_seconds; // if > 0, dump percentiles to uvx event log at heartbeat, in this interval
     // callbacks
     UVX_C_ON_CONN_OK       on_conn_ok;
     UVX_C_ON_CONN_FAIL     on_conn_fail;
@@ -133,6 +456,19 @@ typedef struct uvx_client_config_s {
     UVX_C_ON_CONN_CLOSE    on_conn_close;
     UVX_C_ON_RECV          on_recv;
     UVX_C_ON_HEARTBEAT     on_heartbeat;
+    // request/response, see `uvx_client_request`. if frame_length is set, accumulate_recv is turned on,
+    // and each frame which is not a response of requests is passed to on_recv (and consumed) one by one.
+    UVX_C_FRAME_LENGTH     frame_length;
+    UVX_C_GET_REQUEST_ID   get_request_id;
+    UVX_C_SET_REQUEST_ID   set_request_id;
+    unsigned int max_inflight_requests; // 0 means unlimited
+    // shared-memory transport (POSIX only), to an xserver on the same host with config.shm_enable == 1.
+    // if shm_ring_size > 0, a segment of two rings (shm_ring_size bytes for each direction) is created on each
+    // connection and negotiated through it, then messages go through the rings, and the connection only carries
+    // wake-ups. messages keep their boundaries, each one is received by a call of on_recv. a send larger than
+    // shm_ring_size / 2 fails. if the xserver refuses the segment, the connection is used as usual.
+    unsigned int shm_ring_size;
+    unsigned int shm_spin_us; // max time of busy-polling the ring after the last message, before sleeping
     // logs
     FILE* log_out;
     FILE* log_err;
@@ -140,10 +476,25 @@ typedef struct uvx_client_config_s {
 
 struct uvx_client_s {
     uv_loop_t* uvloop;
-    uv_tcp_t   uvclient;
-    uv_tcp_t*  uvserver; // &uvclient or NULL
+    union {
+        uv_tcp_t  uvclient;
+        uv_pipe_t uvclient_pipe; // if connecting to "unix:/path"
+    };
+    uv_tcp_t*  uvserver; // &uvclient (even if it's a pipe) or NULL
     uvx_client_config_t config;
-    unsigned char privates[224]; // stores value of uvx_client_private_t
+    uint64_t last_recv_time; // time of connected or last received data (uv_now(loop))
+    uint64_t reconnect_attempts;     // reconnects started, in total
+    unsigned int reconnect_failures; // consecutive failed connects since last connected
+    uvx_pending_stats_t pending_stats; // see config.pending_max_count
+    uvx_request_stats_t request_stats; // see uvx_client_request()
+    uvx_stats_t stats; // read it by uvx_client_stats()
+    // latency histograms in microseconds, only recorded if config.latency_histograms == 1
+    uvx_histogram_t send_latency;    // from uvx_client_send() to write completed
+    uvx_histogram_t connect_latency; // from starting connect (or reconnect) to connected
+    uvx_histogram_t request_latency; // from uvx_client_request() to response received
+    automem_t inbuf; // received but not consumed data, only used if config.accumulate_recv == 1
+    uvx_recv_sizer_t recv_sizer; // adaptive receive buffer size and its stats
+    unsigned char privates[sizeof(uv_connect_t) + 3 * sizeof(uv_timer_t) + 288]; // stores value of uvx_client_private_t
     void* data;
 };
 typedef struct uvx_client_s uvx_client_t;
@@ -151,19 +502,40 @@ typedef struct uvx_client_s uvx_client_t;
 // returns the default config for xclient, used by uvx_client_connect().
 uvx_client_config_t uvx_client_default_config(uvx_client_t* xclient);
 
-// connect to an tcp server (not only xserver) that listening ip:port. support IPv4 and IPv6.
+// connect to an tcp server (not only xserver) that listening ip:port. support IPv4 and IPv6, or "unix:/path".
 // please pass in uninitialized xclient and initialized config.
 // returns 1 on success, or 0 if fails.
 int uvx_client_connect(uvx_client_t* xclient, uv_loop_t* loop, const char* ip, int port, uvx_client_config_t config);
 
 // send data to the connected tcp server (not only xserver).
 // don't use `data` any more, it will be `free`ed later.
-// please make sure that `data` was `malloc`ed before, so that it can be `free`ed correctly.
-// if no server is connected, free data immediately, to avoid memory leak.
-// returns 1 on success, or 0 if fails.
+// please make sure that `data` was allocated by `uvx_malloc`, it's freed by `uvx_free` (see `uvx_set_allocator`).
+// if no server is connected, queue it if config.pending_max_count > 0, or free data immediately, to avoid memory leak.
+// returns 1 on success (or queued), or 0 if fails.
 int uvx_client_send(uvx_client_t* xclient, void* data, unsigned int size);
 
-// disconnect the current connection (and it will re-connect at next heartbeat timer).
+// take a snapshot of the xclient's stats, writing to `stats`. can be called from any thread.
+void uvx_client_stats(uvx_client_t* xclient, uvx_stats_t* stats);
+
+// consume (remove) the leading `size` bytes of `xclient->inbuf`, only used if config.accumulate_recv == 1.
+// see `uvx_server_conn_consume` for more details.
+// returns the remaining unconsumed size in bytes.
+unsigned int uvx_client_consume(uvx_client_t* xclient, unsigned int size);
+
+// send a request frame, and `on_response` will be called with `ctx` once: on its response, timeout, or
+// UV_ECANCELED if the connection is closed or the frame is dropped from the pending queue (UVX_PENDING_DROP_OLDEST).
+// config.frame_length, get_request_id and set_request_id are required.
+// many requests can be outstanding on the connection (pipelining), up to config.max_inflight_requests.
+// `timeout_ms` is the max time waiting for response, 0 means no timeout (but canceled if disconnected).
+// `data` is treated as `uvx_client_send`, its request id is written by config.set_request_id.
+// returns 1 on success, or 0 if fails (`on_response` will not be called).
+int uvx_client_request(uvx_client_t* xclient, void* data, unsigned int size, unsigned int timeout_ms,
+                       UVX_C_ON_RESPONSE on_response, void* ctx);
+
+// returns 1 if the current connection transfers messages through shared memory, see config.shm_ring_size.
+int uvx_client_shm_active(uvx_client_t* xclient);
+
+// disconnect the current connection (and it will re-connect later if config.auto_connect == 1).
 // returns 1 on success, or 0 if fails.
 int uvx_client_disconnect(uvx_client_t* xclient);
 
@@ -171,6 +543,98 @@ int uvx_client_disconnect(uvx_client_t* xclient);
 // returns 1 on success, or 0 if fails.
 int uvx_client_shutdown(uvx_client_t* xclient);
 
+//-----------------------------------------------
+// uvx tcp client pool: `uvx_client_pool_t`
+
+// a pool maintains `conns_per_backend` xclients to each backend of an address list, and routes sends
+// to healthy connections by round-robin, least-outstanding or consistent hashing. a connection is
+// healthy if it's connected and has received data in `unhealthy_seconds`. unhealthy ones are
+// disconnected at heartbeat, and re-connected with backoff like any xclient.
+// in callbacks of `config.client`, the xclient can be cast to `uvx_pool_conn_t*`.
+
+typedef struct uvx_client_pool_s uvx_client_pool_t;
+
+#define UVX_POOL_ROUND_ROBIN       0 // rotates over all healthy connections
+#define UVX_POOL_LEAST_OUTSTANDING 1 // the healthy connection with fewest writes not completed and requests in flight
+#define UVX_POOL_CONSISTENT_HASH   2 // the backend is chosen by key, see `uvx_client_pool_send_key`
+
+typedef struct uvx_client_pool_config_s {
+    char name[32];            // the pool's name (with-ending-'\0')
+    int conns_per_backend;    // connections to each backend
+    int policy;               // UVX_POOL_*
+    int hash_replicas;        // virtual nodes per backend on the consistent hash ring
+    float unhealthy_seconds;  // if > 0, connections received nothing in this time are unhealthy.
+                              // please make sure the backends reply to heartbeats sent by `client.on_heartbeat`.
+    uvx_client_config_t client; // config of every xclient, its name is overwritten
+} uvx_client_pool_config_t;
+
+typedef struct uvx_pool_conn_s {
+    uvx_client_t xclient; // must be the first member
+    uvx_client_pool_t* pool;
+    int backend;          // index of its backend
+} uvx_pool_conn_t;
+
+typedef struct uvx_pool_backend_s {
+    char ip[40];
+    int port;
+    uint64_t routed;      // sends routed to this backend by the pool
+} uvx_pool_backend_t;
+
+// throughput and health of a backend, see `uvx_client_pool_backend_stats`
+typedef struct uvx_pool_backend_stats_s {
+    int conns;            // connections to the backend
+    int healthy;          // healthy connections
+    uint64_t routed;      // sends routed to the backend by the pool
+    uvx_stats_t stats;    // sum of its connections' stats, including rates
+} uvx_pool_backend_stats_t;
+
+struct uvx_client_pool_s {
+    uv_loop_t* uvloop;
+    uvx_client_pool_config_t config;
+    int backend_count;
+    uvx_pool_backend_t* backends;
+    uvx_pool_conn_t* conns; // conn_count connections, grouped by backend
+    int conn_count;         // backend_count * config.conns_per_backend
+    unsigned int rr_index;
+    void* ring;             // the consistent hash ring, sorted
+    int ring_size;
+    uv_timer_t release_timer;
+    void* data; // for public use
+};
+
+// returns the default config for a pool, used by uvx_client_pool_start().
+uvx_client_pool_config_t uvx_client_pool_default_config(uvx_client_pool_t* pool);
+
+// start a pool connecting to backends, `addrs` are "ip:port" (or "[ipv6]:port") strings.
+// please pass in uninitialized pool and initialized config.
+// returns 1 on success, or 0 if fails.
+int uvx_client_pool_start(uvx_client_pool_t* pool, uv_loop_t* loop, const char** addrs, int count,
+                          uvx_client_pool_config_t config);
+
+// pick a healthy connection by config.policy. `key` is used by UVX_POOL_CONSISTENT_HASH,
+// if it's NULL, or the policy is not consistent hashing, `key` is ignored.
+// returns NULL if no healthy connection.
+uvx_pool_conn_t* uvx_client_pool_pick(uvx_client_pool_t* pool, const void* key, unsigned int keylen);
+
+// send data through a healthy connection picked by config.policy, see `uvx_client_send` for `data`.
+// returns 1 on success, or 0 if fails (`data` is freed too).
+int uvx_client_pool_send(uvx_client_pool_t* pool, void* data, unsigned int size);
+
+// send data to the backend chosen by consistent hashing of `key`, see `uvx_client_pool_send`.
+int uvx_client_pool_send_key(uvx_client_pool_t* pool, const void* key, unsigned int keylen,
+                             void* data, unsigned int size);
+
+// returns 1 if the connection is healthy, or 0 if not.
+int uvx_client_pool_conn_healthy(uvx_pool_conn_t* conn);
+
+// get throughput and health of the backend at `index`, writing to `stats`.
+void uvx_client_pool_backend_stats(uvx_client_pool_t* pool, int index, uvx_pool_backend_stats_t* stats);
+
+// shutdown the pool, its memory is released after all connections are closed.
+// returns 1 on success, or 0 if fails.
+int uvx_client_pool_shutdown(uvx_client_pool_t* pool);
+
+
 //-----------------------------------------------
 // uvx udp: `uvx_udp_t`
 
@@ -191,6 +655,7 @@ struct uvx_udp_s {
     uv_loop_t* uvloop;
     uv_udp_t   uvudp;
     uvx_udp_config_t config;
+    uvx_stats_t stats; // read it by uvx_udp_stats()
     void* data;
 };
 
@@ -209,6 +674,10 @@ int uvx_udp_start(uvx_udp_t* xudp, uv_loop_t* loop, const char* ip, int port, uv
 int uvx_udp_send_to_ip(uvx_udp_t* xudp, const char* ip, int port, const void* data, unsigned int datalen);
 int uvx_udp_send_to_addr(uvx_udp_t* xudp, const struct sockaddr* addr, const void* data, unsigned int datalen);
 
+// take a snapshot of the xudp's stats, writing to `stats`. can be called from any thread.
+// rates are not computed by xudp itself (no heartbeat), see `uvx_metrics_t`.
+void uvx_udp_stats(uvx_udp_t* xudp, uvx_stats_t* stats);
+
 // set broadcast on (1) or off (0)
 // returns 1 on success, or 0 if fails.
 int uvx_udp_set_broadcast(uvx_udp_t* xudp, int on);
@@ -292,6 +761,9 @@ int uvx_log_send_serialized(uvx_log_t* xlog, const void* data, unsigned int data
 // to enable (if enabled==1) or disable (if enabled==0) the log
 void uvx_log_enable(uvx_log_t* xlog, int enabled);
 
+// take a snapshot of the xlog's stats (of its xudp), writing to `stats`. can be called from any thread.
+void uvx_log_stats(uvx_log_t* xlog, uvx_stats_t* stats);
+
 
 // a printf-like UVX_LOG utility macro, to format and send a log.
 // parameters:
@@ -322,6 +794,139 @@ void uvx_log_enable(uvx_log_t* xlog, int enabled);
     }
 
 
+//-----------------------------------------------
+// uvx metrics: `uvx_metrics_t`
+
+// serves the stats of registered xservers/xclients/xudps/xlogs in Prometheus text format,
+// through an embedded xserver (HTTP/1.0, any path), e.g. `curl http://127.0.0.1:9100/metrics`.
+// it also computes rates of registered xudps/xlogs at its heartbeat, which have no heartbeat themselves.
+
+#define UVX_METRICS_MAX 64
+
+typedef struct uvx_metrics_s {
+    uvx_server_t xserver;
+    int count;
+    struct {
+        int kind; // internal use
+        void* instance;
+    } items[UVX_METRICS_MAX];
+} uvx_metrics_t;
+
+// start serving metrics on ip:port, rates of xudps/xlogs are computed every `interval_seconds`.
+// please pass in uninitialized metrics.
+// returns 1 on success, or 0 if fails.
+int uvx_metrics_start(uvx_metrics_t* metrics, uv_loop_t* loop, const char* ip, int port, float interval_seconds);
+
+// register an instance to metrics, they should be in the same loop as metrics.
+// returns 1 on success, or 0 if fails (too many instances).
+int uvx_metrics_add_server(uvx_metrics_t* metrics, uvx_server_t* xserver);
+int uvx_metrics_add_client(uvx_metrics_t* metrics, uvx_client_t* xclient);
+int uvx_metrics_add_udp(uvx_metrics_t* metrics, uvx_udp_t* xudp);
+int uvx_metrics_add_log(uvx_metrics_t* metrics, uvx_log_t* xlog);
+
+// format the stats of all registered instances in Prometheus text format, appending to `out`.
+// returns the size in bytes of the appended text.
+unsigned int uvx_metrics_format(uvx_metrics_t* metrics, automem_t* out);
+
+// shutdown the metrics normally.
+// returns 1 on success, or 0 if fails.
+int uvx_metrics_shutdown(uvx_metrics_t* metrics);
+
+
+//-----------------------------------------------
+// uvx internal event log
+
+// uvx records its own diagnostics of running (e.g. connections, heartbeats, timeouts, errors)
+// into a lock-free event ring, and drains them asynchronously in a background thread,
+// so library logging never does blocking I/O on loop threads.
+// if no drain target is set (by default), events of xserver/xclient are written to `log_out` of its config,
+// or `log_err` if the level is UVX_LOG_WARN or above. a drain target set below receives all events instead.
+
+// set the level of uvx internal event log (UVX_LOG_*), events below it are discarded.
+// default level is UVX_LOG_INFO.
+void uvx_event_log_level(int level);
+
+// drain events to a file (e.g. stdout, stderr) asynchronously, in a background thread.
+// returns 1 on success, or 0 if fails (e.g. already draining to a target).
+int uvx_event_log_to_file(FILE* fp);
+
+// drain events to an xlog (with event's tag and msg) periodically, in xlog's loop thread.
+// returns 1 on success, or 0 if fails (e.g. already draining to a target, or the timer of the last xlog
+// target is not closed yet: run its loop once after uvx_event_log_stop()).
+int uvx_event_log_to_xlog(uvx_log_t* xlog, float interval_seconds);
+
+// stop draining events to the target, then events are written to `log_out`/`log_err` of configs again.
+// the remaining events are drained before it returns.
+void uvx_event_log_stop(void);
+
+
+//-----------------------------------------------
+// uvx watchdog: `uvx_watchdog_t`
+
+// a watchdog of an uv loop, measures the busy time of every loop iteration (by an uv_prepare_t and
+// uv_check_t pair), and attributes slow iterations (stalls) to the longest uvx callback ran in it,
+// e.g. on_recv of an xserver. the worst stalls are kept as offenders, see `uvx_watchdog_offenders`.
+// a monitor thread warns (via uvx internal event log) while a callback is still blocking the loop.
+// time spent outside uvx callbacks (e.g. in user's timers) is attributed to "unknown".
+
+#define UVX_WATCHDOG_OFFENDERS 16
+
+// a stall: a slow loop iteration
+typedef struct uvx_stall_s {
+    uint64_t time;        // uv_now() when the iteration ended
+    uint64_t busy_us;     // busy time of the iteration in microseconds, excluding the time waiting for I/O
+    uint64_t callback_us; // time of the longest uvx callback in the iteration in microseconds
+    const char* callback; // type of the longest uvx callback, e.g. "on_recv", or "unknown"
+    char name[32];        // the name of xserver/xclient/xudp which the callback belongs to
+} uvx_stall_t;
+
+typedef struct uvx_watchdog_s {
+    uv_loop_t* uvloop;
+    float stall_ms;      // iterations busier than this are stalls
+    uvx_log_t* xlog;     // if not NULL, stalls are sent through it too
+    uint64_t iterations; // loop iterations measured, read-only
+    uint64_t stalls;     // count of stalls, read-only
+    uint64_t max_us;     // max busy time of an iteration in microseconds, read-only
+    unsigned char privates[sizeof(uv_prepare_t) + sizeof(uv_check_t) + sizeof(uv_thread_t) + sizeof(uv_mutex_t)
+                           + sizeof(uv_cond_t) + 160 + UVX_WATCHDOG_OFFENDERS * sizeof(uvx_stall_t)]; // uvx_watchdog_private_t
+    void* data; // for public use
+} uvx_watchdog_t;
+
+// start a watchdog of the loop, must be called in the loop's thread, and only one watchdog per thread.
+// stall_ms: iterations busier than this (in milliseconds) are stalls.
+// xlog: can be NULL, or else stalls are also sent through it (as UVX_LOG_WARN).
+// returns 1 on success, or 0 if fails.
+int uvx_watchdog_start(uvx_watchdog_t* watchdog, uv_loop_t* loop, float stall_ms, uvx_log_t* xlog);
+
+// get the worst stalls (at most UVX_WATCHDOG_OFFENDERS), sorted by busy time desc. threadsafe.
+// returns the number of stalls written to `stalls`.
+int uvx_watchdog_offenders(uvx_watchdog_t* watchdog, uvx_stall_t* stalls, int max);
+
+// stop the watchdog, must be called in the loop's thread.
+// returns 1 on success, or 0 if fails.
+int uvx_watchdog_stop(uvx_watchdog_t* watchdog);
+
+
+//-----------------------------------------------
+// uvx allocations
+
+// uvx allocates memory by `uvx_malloc`/`uvx_free`, which can be replaced by `uvx_set_allocator`,
+// see utils/allocator.h.
+
+// counts of memory allocations made by uvx, to catch regressions on hot paths (e.g. a new malloc per read).
+// only counted if uvx is built with UVX_ALLOC_COUNTING defined. see `uvx_alloc_stats`.
+typedef struct uvx_alloc_stats_s {
+    uint64_t allocs;   // malloc and calloc
+    uint64_t reallocs; // realloc
+    uint64_t frees;    // free, not including free(NULL)
+    uint64_t bytes;    // bytes requested by all allocs and reallocs
+} uvx_alloc_stats_t;
+
+// get the counts of memory allocations made by uvx, writing to `stats`. threadsafe.
+// returns 1 on success, or 0 if uvx is not built with UVX_ALLOC_COUNTING (`stats` is zeroed).
+int uvx_alloc_stats(uvx_alloc_stats_t* stats);
+
+
 //-----------------------------------------------
 // other
 
@@ -338,7 +943,7 @@ int uvx_get_raw_ip_port(const struct sockaddr* addr, unsigned char* ipbuf, int*
 const char* uvx_get_tcp_ip_port(uv_tcp_t* uvclient, char* ipbuf, int buflen, int* port);
 
 // send data to a libuv stream. don't use `data` any more, it will be `free`ed later.
-// please make sure that `data` was `malloc`ed before, so that it can be `free`ed correctly.
+// please make sure that `data` was allocated by `uvx_malloc`, it's freed by `uvx_free` (see `uvx_set_allocator`).
 // returns 1 on success, or 0 if fails.
 int uvx_send_to_stream(uv_stream_t* stream, void* data, unsigned int size);
 
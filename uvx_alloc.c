@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "uvx.h"
+#include "utils/atomic.h"
+#include "utils/allocator.h"
+
+// memory allocator of uvx, automem and linkhash, see `uvx_set_allocator` and `uvx_alloc_stats`.
+
+#ifdef UVX_ALLOC_COUNTING
+static uvx_alloc_stats_t _uvx_alloc_stats;
+	#define UVX_ALLOC_COUNT(field,n)  uvx_atomic_add_u64(&_uvx_alloc_stats.field, (n))
+#else
+	#define UVX_ALLOC_COUNT(field,n)  do { } while(0)
+#endif
+
+static uvx_allocator_t _uvx_allocator = { malloc, calloc, realloc, free };
+
+void uvx_set_allocator(const uvx_allocator_t* allocator) {
+    if(allocator) {
+        assert(allocator->malloc && allocator->calloc && allocator->realloc && allocator->free);
+        _uvx_allocator = *allocator;
+    } else {
+        _uvx_allocator.malloc  = malloc;
+        _uvx_allocator.calloc  = calloc;
+        _uvx_allocator.realloc = realloc;
+        _uvx_allocator.free    = free;
+    }
+}
+
+void* uvx_malloc(size_t size) {
+    UVX_ALLOC_COUNT(allocs, 1);
+    UVX_ALLOC_COUNT(bytes, size);
+    return _uvx_allocator.malloc(size);
+}
+
+void* uvx_calloc(size_t count, size_t size) {
+    UVX_ALLOC_COUNT(allocs, 1);
+    UVX_ALLOC_COUNT(bytes, count * size);
+    return _uvx_allocator.calloc(count, size);
+}
+
+void* uvx_realloc(void* p, size_t size) {
+    UVX_ALLOC_COUNT(reallocs, 1);
+    UVX_ALLOC_COUNT(bytes, size);
+    return _uvx_allocator.realloc(p, size);
+}
+
+void uvx_free(void* p) {
+    if(p) {
+        UVX_ALLOC_COUNT(frees, 1);
+    }
+    _uvx_allocator.free(p);
+}
+
+int uvx_alloc_stats(uvx_alloc_stats_t* stats) {
+#ifdef UVX_ALLOC_COUNTING
+    stats->allocs   = uvx_atomic_load_u64(&_uvx_alloc_stats.allocs);
+    stats->reallocs = uvx_atomic_load_u64(&_uvx_alloc_stats.reallocs);
+    stats->frees    = uvx_atomic_load_u64(&_uvx_alloc_stats.frees);
+    stats->bytes    = uvx_atomic_load_u64(&_uvx_alloc_stats.bytes);
+    return 1;
+#else
+    memset(stats, 0, sizeof(uvx_alloc_stats_t));
+    return 0;
+#endif
+}
@@ -0,0 +1,431 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#ifdef __linux__
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #include <sys/sendfile.h>
+    #include <linux/errqueue.h>
+#endif
+
+#include "uvx.h"
+#include "utils/atomic.h"
+
+// uvx bulk sends of large payloads (Linux only): files by sendfile(2), and memory by MSG_ZEROCOPY.
+//
+// a bulk writes to the socket directly, after libuv's write queue is empty. while it has jobs, all sends of
+// the connection are queued as jobs, to keep the order. if the socket is full (EAGAIN), the next chunk is
+// written by uv_write(), whose completion means it's writable again. a zerocopy buffer is freed only after
+// the kernel notified its completion through the error queue; if the connection is closed before that,
+// the socket is kept open by a dup-ed fd until notified (or UVX_BULK_LINGER_MS).
+
+// defines in uvx_event.c
+void uvx__event(int level, const char* tag, const char* fmt, ...);
+
+#ifdef __linux__
+
+#define UVX_BULK_CHUNK      65536  // size of a file chunk written by uv_write()
+#define UVX_BULK_MEM_CHUNK  (1u << 20) // max size of a memory chunk written by uv_write()
+#define UVX_BULK_LINGER_MS  30000  // max time to wait for zerocopy completions after closed, then reset
+
+typedef struct uvx_bulk_job_s {
+    struct uvx_bulk_job_s* next;
+    char* data;         // memory, owned, or NULL for a file
+    uv_file fd;         // the file, owned
+    int64_t offset;
+    uint64_t size, done;
+    int zerocopy;       // 1: send data by MSG_ZEROCOPY
+    int nosendfile;     // 1: sendfile() is not supported by the file, write chunks by uv_write()
+    uint32_t zc_last;   // id of the last zerocopy send of this job
+    int zc_used;        // 1 if any part was sent by MSG_ZEROCOPY
+} uvx_bulk_job_t;
+
+typedef struct uvx_bulk_s {
+    struct uvx_bulk_s* next; // in the pollers list, while waiting for zerocopy completions
+    struct uvx_bulk_s** pollers;
+    int polling;        // 1 if it's in *pollers
+    uv_stream_t* stream; // NULL after closed
+    uvx_stats_t* stats;
+    int fd;             // the socket, a dup-ed fd after closed
+    uvx_bulk_job_t *head, *tail; // jobs to send
+    uvx_bulk_job_t *zc_head, *zc_tail; // jobs sent, waiting for zerocopy completions
+    uint32_t zc_next;   // id of next zerocopy send, the kernel counts them from 0
+    uint32_t zc_done;   // all zerocopy sends before this id are completed
+    int zc_state;       // 0: not tried, 1: on, -1: not supported by the socket
+    int writing;        // 1 if a chunk of head is being written by uv_write()
+    int shutdown;       // 1: shutdown writing after all jobs sent
+    int failed;
+    uint64_t close_time; // uv_now() when closed
+} uvx_bulk_t;
+
+typedef struct uvx_bulk_write_s {
+    uv_write_t w;
+    uvx_bulk_t* bulk;
+    char* chunk;        // a file chunk, owned, or NULL if it's in job's data
+    size_t size;
+} uvx_bulk_write_t;
+
+static void _uvx_bulk_pump(uvx_bulk_t* bulk);
+
+// the stream must be a connected tcp or pipe. zerocopy sends are polled by uvx__bulk_poll_all(pollers).
+uvx_bulk_t* uvx__bulk_new(uv_stream_t* stream, uvx_stats_t* stats, uvx_bulk_t** pollers) {
+    uv_os_fd_t fd;
+    if(uv_fileno((uv_handle_t*) stream, &fd) != 0)
+        return NULL;
+    uvx_bulk_t* bulk = (uvx_bulk_t*) uvx_calloc(1, sizeof(uvx_bulk_t));
+    bulk->pollers = pollers;
+    bulk->stream = stream;
+    bulk->stats = stats;
+    bulk->fd = fd;
+    return bulk;
+}
+
+// returns 1 if it has jobs, then all sends should go through it to keep the order
+int uvx__bulk_active(uvx_bulk_t* bulk) {
+    return (bulk && bulk->head != NULL);
+}
+
+static void _uvx_bulk_free_job(uvx_bulk_job_t* job) {
+    if(job->data)
+        uvx_free(job->data);
+    else
+        close(job->fd);
+    uvx_free(job);
+}
+
+// a job is done (sent or failed), its data is freed after zerocopy completed
+static void _uvx_bulk_done(uvx_bulk_t* bulk, uvx_bulk_job_t* job, int ok) {
+    uvx_atomic_add1w_u64(&bulk->stats->write_queue_count, (uint64_t)-1);
+    uvx_atomic_add1w_u64(&bulk->stats->write_queue_bytes, (uint64_t)0 - job->size);
+    if(ok) {
+        uvx_atomic_add1w_u64(&bulk->stats->msgs_out, 1);
+        uvx_atomic_add1w_u64(&bulk->stats->bytes_out, job->size);
+    } else {
+        uvx_atomic_add1w_u64(&bulk->stats->send_failures, 1);
+    }
+    if(job->zc_used && (int32_t)(bulk->zc_done - job->zc_last) <= 0) {
+        job->next = NULL;
+        if(bulk->zc_tail)
+            bulk->zc_tail->next = job;
+        else
+            bulk->zc_head = job;
+        bulk->zc_tail = job;
+        return;
+    }
+    _uvx_bulk_free_job(job);
+}
+
+// drops all jobs, except the head which is being written by uv_write()
+static void _uvx_bulk_drop(uvx_bulk_t* bulk) {
+    uvx_bulk_job_t* job = (bulk->writing ? bulk->head->next : bulk->head);
+    while(job) {
+        uvx_bulk_job_t* next = job->next;
+        _uvx_bulk_done(bulk, job, 0);
+        job = next;
+    }
+    if(bulk->writing) {
+        bulk->head->next = NULL;
+        bulk->tail = bulk->head;
+    } else {
+        bulk->head = bulk->tail = NULL;
+    }
+}
+
+static void _uvx_bulk_add(uvx_bulk_t* bulk, uvx_bulk_job_t* job) {
+    uvx_atomic_add1w_u64(&bulk->stats->write_queue_count, 1);
+    uvx_atomic_add1w_u64(&bulk->stats->write_queue_bytes, job->size);
+    if(bulk->tail)
+        bulk->tail->next = job;
+    else
+        bulk->head = job;
+    bulk->tail = job;
+    _uvx_bulk_pump(bulk);
+}
+
+// queues a send, which takes the ownership of data. returns 0 on failure, and data is freed.
+int uvx__bulk_send(uvx_bulk_t* bulk, void* data, unsigned int size, int zerocopy) {
+    if(bulk->stream == NULL || bulk->failed || bulk->shutdown) {
+        uvx_atomic_add1w_u64(&bulk->stats->send_failures, 1);
+        uvx_free(data);
+        return 0;
+    }
+    uvx_bulk_job_t* job = (uvx_bulk_job_t*) uvx_calloc(1, sizeof(uvx_bulk_job_t));
+    job->data = (char*) data;
+    job->size = size;
+    job->zerocopy = zerocopy;
+    _uvx_bulk_add(bulk, job);
+    return 1;
+}
+
+// queues a send of `length` bytes of file `fd` from `offset`, which takes the ownership of fd.
+// returns 0 on failure, and fd is closed.
+int uvx__bulk_sendfile(uvx_bulk_t* bulk, uv_file fd, int64_t offset, uint64_t length) {
+    if(bulk->stream == NULL || bulk->failed || bulk->shutdown) {
+        uvx_atomic_add1w_u64(&bulk->stats->send_failures, 1);
+        close(fd);
+        return 0;
+    }
+    uvx_bulk_job_t* job = (uvx_bulk_job_t*) uvx_calloc(1, sizeof(uvx_bulk_job_t));
+    job->fd = fd;
+    job->offset = offset;
+    job->size = length;
+    _uvx_bulk_add(bulk, job);
+    return 1;
+}
+
+static void _uvx_bulk_fail(uvx_bulk_t* bulk, const char* what, int err) {
+    uvx__event(UVX_LOG_WARN, "uvx-bulk", "%s failed: %s", what, strerror(err));
+    bulk->failed = 1; // the connection is broken, reading will see the error and close it
+    _uvx_bulk_drop(bulk);
+}
+
+static void _uv_bulk_after_shutdown(uv_shutdown_t* req, int status) {
+    uvx_free(req);
+}
+
+static void _uvx_bulk_maybe_free(uvx_bulk_t* bulk) {
+    if(bulk->stream == NULL && !bulk->writing && !bulk->polling && bulk->zc_head == NULL)
+        uvx_free(bulk);
+}
+
+static void _uvx_bulk_pop(uvx_bulk_t* bulk) {
+    uvx_bulk_job_t* job = bulk->head;
+    bulk->head = job->next;
+    if(bulk->head == NULL)
+        bulk->tail = NULL;
+    _uvx_bulk_done(bulk, job, 1);
+}
+
+static void _uv_bulk_after_write(uv_write_t* w, int status) {
+    uvx_bulk_write_t* req = (uvx_bulk_write_t*) w;
+    uvx_bulk_t* bulk = req->bulk;
+    uvx_bulk_job_t* job = bulk->head;
+    bulk->writing = 0;
+    uvx_free(req->chunk);
+    if(status == 0 && bulk->stream) {
+        job->done += req->size;
+        if(job->done == job->size)
+            _uvx_bulk_pop(bulk);
+    } else {
+        bulk->head = job->next; // closed or failed
+        if(bulk->head == NULL)
+            bulk->tail = NULL;
+        _uvx_bulk_done(bulk, job, 0);
+        if(bulk->stream)
+            _uvx_bulk_fail(bulk, "uv_write()", -status);
+    }
+    uvx_free(req);
+    if(bulk->stream)
+        _uvx_bulk_pump(bulk);
+    else
+        _uvx_bulk_maybe_free(bulk);
+}
+
+// writes next chunk of head by uv_write(), which waits for libuv's write queue and the socket to be writable
+static void _uvx_bulk_write_chunk(uvx_bulk_t* bulk) {
+    uvx_bulk_job_t* job = bulk->head;
+    uvx_bulk_write_t* req = (uvx_bulk_write_t*) uvx_malloc(sizeof(uvx_bulk_write_t));
+    req->bulk = bulk;
+    req->chunk = NULL;
+    uint64_t remain = job->size - job->done;
+    uv_buf_t buf;
+    if(job->data) {
+        req->size = (size_t)(remain < UVX_BULK_MEM_CHUNK ? remain : UVX_BULK_MEM_CHUNK);
+        buf = uv_buf_init(job->data + job->done, (unsigned int) req->size);
+    } else {
+        size_t size = (size_t)(remain < UVX_BULK_CHUNK ? remain : UVX_BULK_CHUNK);
+        req->chunk = (char*) uvx_malloc(size);
+        ssize_t n = pread(job->fd, req->chunk, size, (off_t)(job->offset + job->done));
+        if(n <= 0) {
+            uvx_free(req->chunk);
+            uvx_free(req);
+            _uvx_bulk_fail(bulk, "pread()", (n == 0 ? EIO : errno)); // EIO: the file is shorter than expected
+            return;
+        }
+        req->size = (size_t) n;
+        buf = uv_buf_init(req->chunk, (unsigned int) n);
+    }
+    int r = uv_write(&req->w, bulk->stream, &buf, 1, _uv_bulk_after_write);
+    if(r != 0) {
+        uvx_free(req->chunk);
+        uvx_free(req);
+        _uvx_bulk_fail(bulk, "uv_write()", -r);
+        return;
+    }
+    bulk->writing = 1;
+}
+
+static void _uvx_bulk_zerocopy_on(uvx_bulk_t* bulk) {
+    int one = 1;
+    bulk->zc_state = (setsockopt(bulk->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 ? 1 : -1);
+    if(bulk->zc_state < 0)
+        uvx__event(UVX_LOG_INFO, "uvx-bulk", "MSG_ZEROCOPY is not supported by the socket: %s", strerror(errno));
+}
+
+static void _uvx_bulk_pump(uvx_bulk_t* bulk) {
+    while(bulk->head && !bulk->writing && !bulk->failed) {
+        uvx_bulk_job_t* job = bulk->head;
+        uint64_t remain = job->size - job->done;
+        if(remain == 0) {
+            _uvx_bulk_pop(bulk);
+            continue;
+        }
+        if(uv_stream_get_write_queue_size(bulk->stream) > 0 || job->nosendfile) {
+            _uvx_bulk_write_chunk(bulk); // after the data queued by libuv
+            return;
+        }
+        ssize_t n;
+        size_t size = (size_t)(remain < 0x40000000 ? remain : 0x40000000);
+        int zerocopy = 0;
+        if(job->data) {
+            if(job->zerocopy && bulk->zc_state == 0)
+                _uvx_bulk_zerocopy_on(bulk);
+            zerocopy = (job->zerocopy && bulk->zc_state > 0);
+            n = send(bulk->fd, job->data + job->done, size, MSG_NOSIGNAL | MSG_DONTWAIT | (zerocopy ? MSG_ZEROCOPY : 0));
+            if(n < 0 && zerocopy && errno == ENOBUFS) { // out of optmem for notifications, copy this one
+                zerocopy = 0;
+                n = send(bulk->fd, job->data + job->done, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+            }
+        } else {
+            off_t offset = (off_t)(job->offset + job->done);
+            n = sendfile(bulk->fd, job->fd, &offset, size);
+            if(n == 0) {
+                _uvx_bulk_fail(bulk, "sendfile()", EIO); // the file is shorter than expected
+                return;
+            }
+        }
+        if(n > 0) {
+            job->done += (uint64_t) n;
+            if(zerocopy) {
+                job->zc_used = 1;
+                job->zc_last = bulk->zc_next++;
+                if(!bulk->polling) {
+                    bulk->next = *bulk->pollers;
+                    *bulk->pollers = bulk;
+                    bulk->polling = 1;
+                }
+            }
+            if(job->done == job->size)
+                _uvx_bulk_pop(bulk);
+        } else if(errno == EINTR) {
+            continue;
+        } else if(errno == EAGAIN) {
+            _uvx_bulk_write_chunk(bulk); // when it's writable
+            return;
+        } else if(!job->data && (errno == EINVAL || errno == ENOSYS)) {
+            job->nosendfile = 1; // e.g. the file does not support mmap-like operations
+        } else {
+            _uvx_bulk_fail(bulk, (job->data ? "send()" : "sendfile()"), errno);
+            return;
+        }
+    }
+    if(bulk->head == NULL && bulk->shutdown == 1 && !bulk->failed) {
+        bulk->shutdown = 2;
+        uv_shutdown_t* req = (uv_shutdown_t*) uvx_malloc(sizeof(uv_shutdown_t));
+        if(uv_shutdown(req, bulk->stream, _uv_bulk_after_shutdown) != 0)
+            uvx_free(req);
+    }
+}
+
+// shuts down writing after all jobs sent. returns 0 on failure.
+int uvx__bulk_shutdown(uvx_bulk_t* bulk) {
+    if(bulk->stream == NULL || bulk->shutdown)
+        return 0;
+    bulk->shutdown = 1;
+    _uvx_bulk_pump(bulk);
+    return 1;
+}
+
+// reads zerocopy completions from the error queue, and frees the data of completed jobs.
+static void _uvx_bulk_poll(uvx_bulk_t* bulk) {
+    char control[128];
+    for(;;) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(bulk->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break; // EAGAIN: no more
+        for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err* ee = (struct sock_extended_err*) CMSG_DATA(cm);
+            if(ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // [ee_info, ee_data] are completed, tcp completes them in order
+            if((int32_t)(ee->ee_data + 1 - bulk->zc_done) > 0)
+                bulk->zc_done = ee->ee_data + 1;
+        }
+    }
+    while(bulk->zc_head && (int32_t)(bulk->zc_done - bulk->zc_head->zc_last) > 0) {
+        uvx_bulk_job_t* job = bulk->zc_head;
+        bulk->zc_head = job->next;
+        if(bulk->zc_head == NULL)
+            bulk->zc_tail = NULL;
+        _uvx_bulk_free_job(job);
+    }
+}
+
+// polls bulks waiting for zerocopy completions, should be called in each loop iteration (or periodically).
+// a closed bulk is freed after all completed, or reset after UVX_BULK_LINGER_MS.
+void uvx__bulk_poll_all(uvx_bulk_t** pollers, uint64_t now) {
+    uvx_bulk_t** p = pollers;
+    while(*p) {
+        uvx_bulk_t* bulk = *p;
+        _uvx_bulk_poll(bulk);
+        int waiting = ((int32_t)(bulk->zc_next - bulk->zc_done) > 0);
+        if(bulk->stream == NULL && waiting && now - bulk->close_time >= UVX_BULK_LINGER_MS) {
+            // the peer does not read, reset the connection to discard the pinned data, then free it
+            struct linger lg = { 1, 0 };
+            setsockopt(bulk->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+            waiting = 0;
+            bulk->zc_done = bulk->zc_next;
+            close(bulk->fd);
+            bulk->fd = -1;
+            _uvx_bulk_poll(bulk);
+            uvx__event(UVX_LOG_WARN, "uvx-bulk", "reset a closed connection, zerocopy sends are not completed");
+        }
+        if(waiting) {
+            p = &bulk->next;
+            continue;
+        }
+        *p = bulk->next;
+        bulk->polling = 0;
+        if(bulk->stream == NULL) {
+            if(bulk->fd >= 0)
+                close(bulk->fd);
+            _uvx_bulk_maybe_free(bulk);
+        }
+    }
+}
+
+// drops jobs not sent, before the stream is closed. the bulk is freed later.
+void uvx__bulk_close(uvx_bulk_t* bulk, uint64_t now) {
+    _uvx_bulk_drop(bulk);
+    bulk->stream = NULL;
+    bulk->close_time = now;
+    if(bulk->polling) {
+        _uvx_bulk_poll(bulk);
+        if((int32_t)(bulk->zc_next - bulk->zc_done) > 0)
+            bulk->fd = dup(bulk->fd); // keeps the socket open until zerocopy completed, -1 on failure
+        else
+            bulk->fd = -1;
+        return; // freed by uvx__bulk_poll_all()
+    }
+    _uvx_bulk_maybe_free(bulk);
+}
+
+#else // not Linux: not supported, xservers send as usual
+
+struct uvx_bulk_s;
+
+struct uvx_bulk_s* uvx__bulk_new(uv_stream_t* stream, uvx_stats_t* stats, struct uvx_bulk_s** pollers) { return NULL; }
+int uvx__bulk_active(struct uvx_bulk_s* bulk) { return 0; }
+int uvx__bulk_send(struct uvx_bulk_s* bulk, void* data, unsigned int size, int zerocopy) { uvx_free(data); return 0; }
+int uvx__bulk_sendfile(struct uvx_bulk_s* bulk, uv_file fd, int64_t offset, uint64_t length) { return 0; }
+int uvx__bulk_shutdown(struct uvx_bulk_s* bulk) { return 0; }
+void uvx__bulk_poll_all(struct uvx_bulk_s** pollers, uint64_t now) { }
+void uvx__bulk_close(struct uvx_bulk_s* bulk, uint64_t now) { }
+
+#endif // __linux__
@@ -7,30 +7,113 @@
 #include "uvx.h"
 #include "utils/automem.h"
 #include "utils/linkhash.h"
+#include "utils/atomic.h"
 
 // Author: Liigo <liigo@qq.com>
 
+// defines in uvx_event.c
+void uvx__event(int level, const char* tag, const char* fmt, ...);
+void uvx__event_log(FILE* out, FILE* err, int level, const char* tag, const char* fmt, ...);
+
+// defines in uvx_watchdog.c
+void uvx__watch_enter(const char* callback, const char* name);
+void uvx__watch_exit(void);
+
+// defines in uvx.c
+void uvx__on_alloc_buf(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+void uvx__alloc_mem_tail(automem_t* mem, size_t size, uv_buf_t* buf);
+void uvx__recv_sizer_init(uvx_recv_sizer_t* sizer, unsigned int min, unsigned int max);
+size_t uvx__recv_sizer_size(uvx_recv_sizer_t* sizer, size_t suggested_size);
+void uvx__recv_sizer_update(uvx_recv_sizer_t* sizer, ssize_t nread);
+unsigned int uvx__consume_mem(automem_t* mem, unsigned int size, uvx_recv_sizer_t* sizer);
+int uvx__send_to_stream(uv_stream_t* stream, void* data, unsigned int size, uvx_stats_t* stats, uvx_histogram_t* latency);
+int uvx__send_bufs_to_stream(uv_stream_t* stream, const uv_buf_t* bufs, unsigned int count, uvx_stats_t* stats);
+void uvx__stats_snapshot(uvx_stats_t* src, uvx_stats_t* dst);
+void uvx__stats_tick(uvx_stats_t* stats, uint64_t now_ms);
+void uvx__stats_lag(uvx_stats_t* stats, uint64_t lag_ms);
+void uvx__histogram_dump(const char* tag, const char* name, const char* what, uvx_histogram_t* h);
+const char* uvx__pipe_name(const char* endpoint);
+
+// defines in uvx_shm.c
+typedef int (*UVX_SHM_ON_MSG)(void* owner, void* data, unsigned int size);
+typedef void (*UVX_SHM_ON_FAIL)(void* owner, int fatal);
+struct uvx_shm_s* uvx__shm_new(uv_loop_t* loop, uv_stream_t* stream, unsigned int spin_us, uvx_stats_t* stats,
+                               UVX_SHM_ON_MSG on_msg, UVX_SHM_ON_FAIL on_fail, void* owner);
+int uvx__shm_connect(struct uvx_shm_s* shm, unsigned int ring_size);
+int uvx__shm_on_read(struct uvx_shm_s* shm, const void* data, unsigned int size, unsigned int* used);
+int uvx__shm_send(struct uvx_shm_s* shm, void* data, unsigned int size);
+void uvx__shm_drain(struct uvx_shm_s* shm);
+void uvx__shm_close(struct uvx_shm_s* shm);
+int uvx__shm_active(struct uvx_shm_s* shm);
+
 typedef union uvx_sockaddr_4_6_s{
     struct sockaddr_in  in4;
     struct sockaddr_in6 in6;
 } uvx_sockaddr_4_6_t;
 
+#define UVX_PIPE_NAME_MAX 128
+
 //! 修改此结构体时注意同步修改uvx_client_t.privates!
 typedef struct uvx_client_private_s {
-    uv_connect_t conn;              // sizeof(uv_connect_t) == 64
+    uv_connect_t conn;
     uvx_sockaddr_4_6_t server_addr; // sizeof(uvx_sockaddr_4_6_t) == 28
-    uv_timer_t heartbeat_timer;     // sizeof(uv_timer_t) == 120
+    char pipe_name[UVX_PIPE_NAME_MAX]; // the path of "unix:/path", or empty if connecting to ip:port
+    uv_timer_t heartbeat_timer;
     unsigned int heartbeat_index;
+    uint64_t heartbeat_due; // uv_now() when the heartbeat timer is expected to fire, to measure loop lag
     int connection_closed;
+    uv_timer_t reconnect_timer;
+    uint32_t jitter_seed;       // xorshift32 state, to randomize reconnect delays
+    int shutdown;               // uvx_client_shutdown() was called
+    int timers_closed;          // timers closed by uvx_client_shutdown(): heartbeat_timer, reconnect_timer and wheel_timer
+    uv_buf_t* pending;          // the ring of sends queued while disconnected, config.pending_max_count bufs
+    unsigned int pending_head;  // index of the oldest one, the count is xclient->pending_stats.count
+    // requests waiting for response, see uvx_client_request()
+    struct lh_table* requests;  // request id -> uvx_request_t*, lazy init
+    struct uvx_request_s** wheel; // the timer wheel of request timeouts, UVX_WHEEL_SLOTS lists, lazy init
+    uv_timer_t wheel_timer;     // ticks every UVX_WHEEL_TICK_MS if there are requests in the wheel
+    unsigned int wheel_cursor;  // the slot of current tick
+    unsigned int wheel_count;   // requests in the wheel
+    unsigned int next_request_id;
+    uint64_t connect_time;      // uv_hrtime() of starting connect, to measure connect_latency
+    uint64_t latency_dump_time; // uv_now() of last dumping latency histograms
+    struct uvx_shm_s* shm;      // the shared-memory transport of current connection, see config.shm_ring_size
 } uvx_client_private_t;
 
 #define UVX__C_PRIVATE(x)  ((uvx_client_private_t*)(&(x)->privates))
 
+// an event written to config.log_out/log_err of the xclient if no drain target is set, see uvx_event.c
+#define UVX__C_EVENT(x, level, ...)  uvx__event_log((x)->config.log_out, (x)->config.log_err, (level), "uvx-client", __VA_ARGS__)
+
+// a request waiting for response
+typedef struct uvx_request_s {
+    unsigned int id;
+    unsigned int rounds;  // remaining rounds of the timer wheel before timeout
+    unsigned int slot;    // slot in the timer wheel, or UVX_WHEEL_SLOTS if no timeout
+    struct uvx_request_s *prev, *next; // in the slot's list
+    UVX_C_ON_RESPONSE on_response;
+    void* ctx;
+    uint64_t start_time;  // uv_hrtime() when sent, only set if config.latency_histograms
+} uvx_request_t;
+
+#define UVX_WHEEL_SLOTS   512
+#define UVX_WHEEL_TICK_MS 10  // a round of the timer wheel is 5.12 seconds
+
+// compile-time check: uvx_client_t.privates must be large enough to store uvx_client_private_t
+typedef char uvx__check_client_privates[sizeof(uvx_client_private_t) <= sizeof(((uvx_client_t*)0)->privates) ? 1 : -1];
+
 uvx_client_config_t uvx_client_default_config(uvx_client_t* xclient) {
     uvx_client_config_t config = { 0 };
     snprintf(config.name, sizeof(config.name), "xclient-%p", xclient);
     config.auto_connect = 1;
     config.heartbeat_interval_seconds = 60.0;
+    config.reconnect_delay_seconds = 0.1;
+    config.reconnect_max_seconds = 30.0;
+    config.reconnect_backoff = 2.0;
+    config.reconnect_jitter = 0.5;
+    config.recv_buffer_min = 0;
+    config.recv_buffer_max = 0;
+    config.shm_spin_us = 50;
     config.log_out = stdout;
     config.log_err = stderr;
     return config;
@@ -41,34 +124,106 @@ static int uvx__client_reconnect(uvx_client_t* xclient);
 static void uvx__on_heartbeat_timer(uv_timer_t* handle) {
     uvx_client_t* xclient = (uvx_client_t*) handle->data;
     assert(xclient);
+    uint64_t now = uv_now(xclient->uvloop);
+    uvx__stats_lag(&xclient->stats, now > UVX__C_PRIVATE(xclient)->heartbeat_due ? now - UVX__C_PRIVATE(xclient)->heartbeat_due : 0);
+    UVX__C_PRIVATE(xclient)->heartbeat_due = now + uv_timer_get_repeat(handle);
+    uvx__stats_tick(&xclient->stats, now);
+    if(xclient->config.latency_histograms && xclient->config.latency_dump_seconds > 0
+       && now - UVX__C_PRIVATE(xclient)->latency_dump_time >= (uint64_t)(xclient->config.latency_dump_seconds * 1000)) {
+        UVX__C_PRIVATE(xclient)->latency_dump_time = now;
+        uvx__histogram_dump("uvx-client", xclient->config.name, "send", &xclient->send_latency);
+        uvx__histogram_dump("uvx-client", xclient->config.name, "connect", &xclient->connect_latency);
+    }
 
     if(xclient->uvserver) {
         unsigned int index = UVX__C_PRIVATE(xclient)->heartbeat_index++;
-        if(xclient->config.log_out)
-            fprintf(xclient->config.log_out, "[uvx-client] %s on heartbeat (index %u)\n", xclient->config.name, index);
-        if(xclient->config.on_heartbeat)
+        UVX__C_EVENT(xclient, UVX_LOG_DEBUG, "%s on heartbeat (index %u)", xclient->config.name, index);
+        if(xclient->config.on_heartbeat) {
+            uvx__watch_enter("on_heartbeat", xclient->config.name);
             xclient->config.on_heartbeat(xclient, index);
-    } else {
-        if(UVX__C_PRIVATE(xclient)->connection_closed)
-            uvx__client_reconnect(xclient); // auto reconnect
+            uvx__watch_exit();
+        }
     }
 }
 
+static void uvx__on_reconnect_timer(uv_timer_t* handle) {
+    uvx_client_t* xclient = (uvx_client_t*) handle->data;
+    assert(xclient);
+    if(UVX__C_PRIVATE(xclient)->connection_closed && !UVX__C_PRIVATE(xclient)->shutdown) {
+        uvx_atomic_add1w_u64(&xclient->reconnect_attempts, 1);
+        uvx__client_reconnect(xclient);
+    }
+}
+
+// schedules a reconnect with exponential backoff and jitter, after the connection was closed
+static void uvx__client_schedule_reconnect(uvx_client_t* xclient) {
+    uvx_client_config_t* config = &xclient->config;
+    if(!config->auto_connect || UVX__C_PRIVATE(xclient)->shutdown)
+        return;
+    double delay = config->reconnect_delay_seconds;
+    for(unsigned int i = 1; i < xclient->reconnect_failures && delay < config->reconnect_max_seconds; i++)
+        delay *= config->reconnect_backoff;
+    if(delay > config->reconnect_max_seconds)
+        delay = config->reconnect_max_seconds;
+    if(config->reconnect_jitter > 0) {
+        uint32_t x = UVX__C_PRIVATE(xclient)->jitter_seed;
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        UVX__C_PRIVATE(xclient)->jitter_seed = x;
+        delay -= delay * config->reconnect_jitter * ((double) x / 4294967296.0);
+    }
+    uint64_t timeout = (uint64_t)(delay * 1000); // in milliseconds
+    UVX__C_EVENT(xclient, UVX_LOG_DEBUG, "%s reconnect in %llu ms (failures %u)",
+                 config->name, (unsigned long long) timeout, xclient->reconnect_failures);
+    uv_timer_start(&UVX__C_PRIVATE(xclient)->reconnect_timer, uvx__on_reconnect_timer, timeout, 0);
+}
+
 int uvx_client_connect(uvx_client_t* xclient, uv_loop_t* loop, const char* ip, int port, uvx_client_config_t config) {
 	assert(xclient && loop && ip);
 	xclient->uvloop = loop;
     xclient->uvserver = NULL;
     UVX__C_PRIVATE(xclient)->connection_closed = 0;
+    UVX__C_PRIVATE(xclient)->shutdown = 0;
+    UVX__C_PRIVATE(xclient)->timers_closed = 0;
+    UVX__C_PRIVATE(xclient)->jitter_seed = (uint32_t)(uv_hrtime() ^ (uintptr_t) xclient) | 1; // never 0
+    xclient->reconnect_attempts = 0;
+    xclient->reconnect_failures = 0;
+    memset(&xclient->pending_stats, 0, sizeof(uvx_pending_stats_t));
+    UVX__C_PRIVATE(xclient)->pending = NULL; // lazy init, see uvx__client_pending_push()
+    UVX__C_PRIVATE(xclient)->pending_head = 0;
+    UVX__C_PRIVATE(xclient)->shm = NULL;
+    memset(&xclient->request_stats, 0, sizeof(uvx_request_stats_t));
+    uvx_histogram_reset(&xclient->request_latency);
+    UVX__C_PRIVATE(xclient)->requests = NULL; // lazy init, see uvx_client_request()
+    UVX__C_PRIVATE(xclient)->wheel = NULL;
+    UVX__C_PRIVATE(xclient)->wheel_cursor = 0;
+    UVX__C_PRIVATE(xclient)->wheel_count = 0;
+    UVX__C_PRIVATE(xclient)->next_request_id = 1;
+    UVX__C_PRIVATE(xclient)->wheel_timer.data = xclient;
+    uv_timer_init(loop, &UVX__C_PRIVATE(xclient)->wheel_timer);
+    if(config.frame_length)
+        config.accumulate_recv = 1; // frames are parsed in xclient->inbuf
     memcpy(&xclient->config, &config, sizeof(uvx_client_config_t));
-    if(strchr(ip, ':'))
-        uv_ip6_addr(ip, port, (struct sockaddr_in6*) &UVX__C_PRIVATE(xclient)->server_addr);
-    else
-        uv_ip4_addr(ip, port, (struct sockaddr_in*) &UVX__C_PRIVATE(xclient)->server_addr);
+    memset(&xclient->inbuf, 0, sizeof(xclient->inbuf)); // lazy init, see uvx__alloc_mem_tail()
+    memset(&xclient->stats, 0, sizeof(uvx_stats_t));
+    uvx_histogram_reset(&xclient->send_latency);
+    uvx_histogram_reset(&xclient->connect_latency);
+    UVX__C_PRIVATE(xclient)->latency_dump_time = uv_now(loop);
+    const char* pipe_name = uvx__pipe_name(ip);
+    snprintf(UVX__C_PRIVATE(xclient)->pipe_name, UVX_PIPE_NAME_MAX, "%s", (pipe_name ? pipe_name : ""));
+    if(pipe_name == NULL) {
+        if(strchr(ip, ':'))
+            uv_ip6_addr(ip, port, (struct sockaddr_in6*) &UVX__C_PRIVATE(xclient)->server_addr);
+        else
+            uv_ip4_addr(ip, port, (struct sockaddr_in*) &UVX__C_PRIVATE(xclient)->server_addr);
+    }
 
+    UVX__C_PRIVATE(xclient)->reconnect_timer.data = xclient;
+    uv_timer_init(loop, &UVX__C_PRIVATE(xclient)->reconnect_timer);
 	int ret = uvx__client_reconnect(xclient);
 
     int timeout = (int)(config.heartbeat_interval_seconds * 1000); // in milliseconds
     UVX__C_PRIVATE(xclient)->heartbeat_index = 0;
+    UVX__C_PRIVATE(xclient)->heartbeat_due = uv_now(loop) + timeout;
     UVX__C_PRIVATE(xclient)->heartbeat_timer.data = xclient;
 	uv_timer_init(loop, &UVX__C_PRIVATE(xclient)->heartbeat_timer);
 	uv_timer_start(&UVX__C_PRIVATE(xclient)->heartbeat_timer, uvx__on_heartbeat_timer, timeout, timeout);
@@ -76,91 +231,480 @@ int uvx_client_connect(uvx_client_t* xclient, uv_loop_t* loop, const char* ip, i
 	return ret;
 }
 
+static void uvx__client_remove_request(uvx_client_t* xclient, uvx_request_t* req);
+
+// drops the oldest send. returns the request it belongs to, which was removed, or NULL.
+static uvx_request_t* uvx__client_pending_drop_oldest(uvx_client_t* xclient) {
+    uvx_client_private_t* priv = UVX__C_PRIVATE(xclient);
+    uv_buf_t* buf = &priv->pending[priv->pending_head];
+    uvx_request_t* req = NULL;
+    priv->pending_head = (priv->pending_head + 1) % xclient->config.pending_max_count;
+    uvx_atomic_add1w_u64(&xclient->pending_stats.count, (uint64_t)-1);
+    uvx_atomic_add1w_u64(&xclient->pending_stats.bytes, (uint64_t)0 - buf->len);
+    uvx_atomic_add1w_u64(&xclient->pending_stats.dropped_bytes, buf->len);
+    if(priv->requests && xclient->config.get_request_id) {
+        unsigned int id = xclient->config.get_request_id(xclient, buf->base, (unsigned int) buf->len);
+        struct lh_entry* e = lh_table_lookup_entry(priv->requests, (const void*)(uintptr_t) id);
+        if(e) {
+            req = (uvx_request_t*) e->v;
+            uvx__client_remove_request(xclient, req);
+        }
+    }
+    uvx_free(buf->base);
+    return req;
+}
+
+// returns 1 if there is no room for `size` bytes in the pending queue
+static int uvx__client_pending_full(uvx_client_t* xclient, unsigned int size) {
+    uvx_pending_stats_t* stats = &xclient->pending_stats;
+    unsigned int max_bytes = xclient->config.pending_max_bytes;
+    return (stats->count >= xclient->config.pending_max_count || (max_bytes > 0 && stats->bytes + size > max_bytes));
+}
+
+static void uvx__client_complete_request(uvx_client_t* xclient, uvx_request_t* req, int status, void* frame, unsigned int size);
+
+// queues data while disconnected, returns 0 if it's dropped.
+// if data is a request frame it's dropped here, uvx_client_request() removes the request.
+static int uvx__client_pending_push(uvx_client_t* xclient, void* data, unsigned int size) {
+    uvx_client_private_t* priv = UVX__C_PRIVATE(xclient);
+    uvx_pending_stats_t* stats = &xclient->pending_stats;
+    unsigned int max_count = xclient->config.pending_max_count;
+    unsigned int max_bytes = xclient->config.pending_max_bytes;
+    uvx_request_t* canceled = NULL; // requests of the sends dropped, linked by next
+    if(xclient->config.pending_drop_policy == UVX_PENDING_DROP_OLDEST && (max_bytes == 0 || size <= max_bytes)) {
+        while(stats->count > 0 && uvx__client_pending_full(xclient, size)) {
+            uvx_request_t* req = uvx__client_pending_drop_oldest(xclient);
+            if(req) {
+                req->next = canceled;
+                canceled = req;
+            }
+        }
+    }
+    int queued = 0;
+    if(uvx__client_pending_full(xclient, size)) {
+        uvx_atomic_add1w_u64(&stats->dropped_bytes, size);
+        uvx_free(data);
+    } else {
+        if(priv->pending == NULL)
+            priv->pending = (uv_buf_t*) uvx_malloc(max_count * sizeof(uv_buf_t));
+        priv->pending[(priv->pending_head + stats->count) % max_count] = uv_buf_init((char*)data, size);
+        uvx_atomic_add1w_u64(&stats->count, 1);
+        uvx_atomic_add1w_u64(&stats->bytes, size);
+        uvx_atomic_add1w_u64(&stats->queued_bytes, size);
+        queued = 1;
+    }
+    // after the queue is updated, on_response may send again
+    while(canceled) {
+        uvx_request_t* next = canceled->next;
+        uvx__client_complete_request(xclient, canceled, UV_ECANCELED, NULL, 0);
+        canceled = next;
+    }
+    return queued;
+}
+
+// sends all queued data in one write, after connected
+static void uvx__client_pending_flush(uvx_client_t* xclient) {
+    uvx_client_private_t* priv = UVX__C_PRIVATE(xclient);
+    uvx_pending_stats_t* stats = &xclient->pending_stats;
+    unsigned int count = (unsigned int) stats->count, max_count = xclient->config.pending_max_count;
+    uint64_t bytes = stats->bytes;
+    if(count == 0)
+        return;
+    uv_buf_t* bufs = priv->pending + priv->pending_head;
+    if(priv->pending_head + count > max_count) {
+        // wrapped around, makes them contiguous
+        bufs = (uv_buf_t*) uvx_malloc(count * sizeof(uv_buf_t));
+        for(unsigned int i = 0; i < count; i++)
+            bufs[i] = priv->pending[(priv->pending_head + i) % max_count];
+    }
+    int ok = 1;
+    if(priv->shm) {
+        for(unsigned int i = 0; i < count; i++)
+            ok &= uvx__shm_send(priv->shm, bufs[i].base, (unsigned int) bufs[i].len);
+    } else {
+        ok = uvx__send_bufs_to_stream((uv_stream_t*)xclient->uvserver, bufs, count, &xclient->stats);
+    }
+    if(bufs != priv->pending + priv->pending_head)
+        uvx_free(bufs);
+    uvx_atomic_add1w_u64((ok ? &stats->flushed_bytes : &stats->dropped_bytes), bytes);
+    uvx_atomic_add1w_u64(&stats->count, (uint64_t)0 - count);
+    uvx_atomic_add1w_u64(&stats->bytes, (uint64_t)0 - bytes);
+    priv->pending_head = 0;
+    UVX__C_EVENT(xclient, UVX_LOG_INFO, "%s flushed %u pending sends (%llu bytes)",
+                 xclient->config.name, count, (unsigned long long) bytes);
+}
+
 int uvx_client_send(uvx_client_t* xclient, void* data, unsigned int size) {
-	if (xclient->uvserver) {
-		return uvx_send_to_stream((uv_stream_t*)xclient->uvserver, data, size);
+	if (xclient->uvserver && UVX__C_PRIVATE(xclient)->shm) {
+		return uvx__shm_send(UVX__C_PRIVATE(xclient)->shm, data, size);
+	} else if (xclient->uvserver) {
+		return uvx__send_to_stream((uv_stream_t*)xclient->uvserver, data, size, &xclient->stats,
+		                           (xclient->config.latency_histograms ? &xclient->send_latency : NULL));
+	} else if(xclient->config.pending_max_count > 0 && !UVX__C_PRIVATE(xclient)->shutdown) {
+		return uvx__client_pending_push(xclient, data, size);
 	} else {
-		free(data);
+		uvx_free(data);
 		return 0;
 	}
 }
 
+void uvx_client_stats(uvx_client_t* xclient, uvx_stats_t* stats) {
+    uvx__stats_snapshot(&xclient->stats, stats);
+}
+
+unsigned int uvx_client_consume(uvx_client_t* xclient, unsigned int size) {
+    return uvx__consume_mem(&xclient->inbuf, size, &xclient->recv_sizer);
+}
+
+static void _uvx_client_close(uvx_client_t* xclient);
+
+// removes the request from the timer wheel and the table
+static void uvx__client_remove_request(uvx_client_t* xclient, uvx_request_t* req) {
+    uvx_client_private_t* priv = UVX__C_PRIVATE(xclient);
+    if(req->slot < UVX_WHEEL_SLOTS) {
+        if(req->prev)
+            req->prev->next = req->next;
+        else
+            priv->wheel[req->slot] = req->next;
+        if(req->next)
+            req->next->prev = req->prev;
+        if(--priv->wheel_count == 0)
+            uv_timer_stop(&priv->wheel_timer);
+    }
+    lh_table_delete(priv->requests, (const void*)(uintptr_t) req->id);
+    uvx_atomic_add1w_u64(&xclient->request_stats.inflight, (uint64_t)-1);
+}
+
+// calls on_response and frees the request, which was removed
+static void uvx__client_complete_request(uvx_client_t* xclient, uvx_request_t* req, int status, void* frame, unsigned int size) {
+    if(status == 0) {
+        uvx_atomic_add1w_u64(&xclient->request_stats.responses, 1);
+        if(xclient->config.latency_histograms)
+            uvx_histogram_record(&xclient->request_latency, (uv_hrtime() - req->start_time) / 1000);
+    } else {
+        uvx_atomic_add1w_u64((status == UV_ETIMEDOUT ? &xclient->request_stats.timeouts : &xclient->request_stats.canceled), 1);
+    }
+    uvx__watch_enter("on_response", xclient->config.name);
+    req->on_response(xclient, status, frame, size, req->ctx);
+    uvx__watch_exit();
+    uvx_free(req);
+}
+
+// fails all requests with `status`, after the connection is closed
+static void uvx__client_cancel_requests(uvx_client_t* xclient, int status) {
+    uvx_client_private_t* priv = UVX__C_PRIVATE(xclient);
+    if(priv->requests == NULL)
+        return;
+    while(priv->requests->head) {
+        uvx_request_t* req = (uvx_request_t*) priv->requests->head->v;
+        uvx__client_remove_request(xclient, req);
+        uvx__client_complete_request(xclient, req, status, NULL, 0);
+    }
+}
+
+static void uvx__on_wheel_timer(uv_timer_t* handle) {
+    uvx_client_t* xclient = (uvx_client_t*) handle->data;
+    uvx_client_private_t* priv = UVX__C_PRIVATE(xclient);
+    priv->wheel_cursor = (priv->wheel_cursor + 1) % UVX_WHEEL_SLOTS;
+    uvx_request_t* req = priv->wheel[priv->wheel_cursor];
+    while(req) {
+        uvx_request_t* next = req->next;
+        if(req->rounds > 0) {
+            req->rounds--;
+        } else {
+            uvx__client_remove_request(xclient, req);
+            uvx__client_complete_request(xclient, req, UV_ETIMEDOUT, NULL, 0);
+            if(priv->shutdown)
+                return; // requests were canceled in on_response
+        }
+        req = next;
+    }
+}
+
+int uvx_client_request(uvx_client_t* xclient, void* data, unsigned int size, unsigned int timeout_ms,
+                       UVX_C_ON_RESPONSE on_response, void* ctx) {
+    uvx_client_private_t* priv = UVX__C_PRIVATE(xclient);
+    uvx_client_config_t* config = &xclient->config;
+    assert(config->frame_length && config->get_request_id && config->set_request_id && on_response);
+    if(priv->shutdown || (config->max_inflight_requests > 0 && xclient->request_stats.inflight >= config->max_inflight_requests)) {
+        uvx_free(data);
+        return 0;
+    }
+    if(priv->requests == NULL)
+        priv->requests = lh_kptr_table_new((config->max_inflight_requests ? config->max_inflight_requests * 3 / 2 + 1 : 64),
+                                           "xclient requests table", NULL);
+
+    uvx_request_t* req = (uvx_request_t*) uvx_malloc(sizeof(uvx_request_t));
+    do {
+        req->id = priv->next_request_id++;
+    } while(req->id == 0 || req->id >= 0xFFFFFFFEu || lh_table_lookup_entry(priv->requests, (const void*)(uintptr_t) req->id));
+    req->on_response = on_response;
+    req->ctx = ctx;
+    req->prev = req->next = NULL;
+    req->slot = UVX_WHEEL_SLOTS;
+    if(config->latency_histograms)
+        req->start_time = uv_hrtime();
+    if(timeout_ms > 0) {
+        if(priv->wheel == NULL)
+            priv->wheel = (uvx_request_t**) uvx_calloc(UVX_WHEEL_SLOTS, sizeof(uvx_request_t*));
+        unsigned int ticks = (timeout_ms + UVX_WHEEL_TICK_MS - 1) / UVX_WHEEL_TICK_MS;
+        req->slot = (priv->wheel_cursor + ticks) % UVX_WHEEL_SLOTS;
+        req->rounds = (ticks - 1) / UVX_WHEEL_SLOTS;
+        req->next = priv->wheel[req->slot];
+        if(req->next)
+            req->next->prev = req;
+        priv->wheel[req->slot] = req;
+        if(priv->wheel_count++ == 0)
+            uv_timer_start(&priv->wheel_timer, uvx__on_wheel_timer, UVX_WHEEL_TICK_MS, UVX_WHEEL_TICK_MS);
+    }
+    lh_table_insert(priv->requests, (void*)(uintptr_t) req->id, req);
+    uvx_atomic_add1w_u64(&xclient->request_stats.inflight, 1);
+
+    config->set_request_id(xclient, data, size, req->id);
+    if(!uvx_client_send(xclient, data, size)) {
+        uvx__client_remove_request(xclient, req);
+        uvx_free(req);
+        return 0;
+    }
+    uvx_atomic_add1w_u64(&xclient->request_stats.sent, 1);
+    return 1;
+}
+
+// parses frames in xclient->inbuf, dispatches responses to requests and others to on_recv
+static void uvx__client_on_frames(uvx_client_t* xclient) {
+    uvx_client_private_t* priv = UVX__C_PRIVATE(xclient);
+    unsigned int offset = 0;
+    while(offset < xclient->inbuf.size && !priv->shutdown && !uv_is_closing((uv_handle_t*) &xclient->uvclient)) {
+        void* frame = (char*)xclient->inbuf.pdata + offset;
+        int len = xclient->config.frame_length(xclient, frame, xclient->inbuf.size - offset);
+        if(len == 0)
+            break;
+        if(len < 0 || (unsigned int) len > xclient->inbuf.size - offset) {
+            UVX__C_EVENT(xclient, UVX_LOG_WARN, "%s received invalid frame", xclient->config.name);
+            _uvx_client_close(xclient);
+            return;
+        }
+        offset += len;
+        struct lh_entry* e = NULL;
+        if(priv->requests && xclient->config.get_request_id) {
+            unsigned int id = xclient->config.get_request_id(xclient, frame, len);
+            e = lh_table_lookup_entry(priv->requests, (const void*)(uintptr_t) id);
+        }
+        if(e) {
+            uvx_request_t* req = (uvx_request_t*) e->v;
+            uvx__client_remove_request(xclient, req);
+            uvx__client_complete_request(xclient, req, 0, frame, len);
+        } else if(xclient->config.on_recv) {
+            uvx__watch_enter("on_recv", xclient->config.name);
+            xclient->config.on_recv(xclient, frame, len);
+            uvx__watch_exit();
+        }
+    }
+    uvx_client_consume(xclient, offset);
+}
+
 static void _uv_on_connect(uv_connect_t* conn, int status);
 
 static int uvx__client_reconnect(uvx_client_t* xclient) {
     xclient->uvserver = NULL;
 	UVX__C_PRIVATE(xclient)->connection_closed = 0;
     UVX__C_PRIVATE(xclient)->conn.data = xclient;
-	uv_tcp_init(xclient->uvloop, &xclient->uvclient);
-    int ret = uv_tcp_connect(&UVX__C_PRIVATE(xclient)->conn, &xclient->uvclient,
+    UVX__C_PRIVATE(xclient)->connect_time = uv_hrtime();
+    int ret = 0;
+    if(UVX__C_PRIVATE(xclient)->pipe_name[0]) {
+        uv_pipe_init(xclient->uvloop, &xclient->uvclient_pipe, 0);
+        uv_pipe_connect(&UVX__C_PRIVATE(xclient)->conn, &xclient->uvclient_pipe, UVX__C_PRIVATE(xclient)->pipe_name, _uv_on_connect);
+    } else {
+        uv_tcp_init(xclient->uvloop, &xclient->uvclient);
+        ret = uv_tcp_connect(&UVX__C_PRIVATE(xclient)->conn, &xclient->uvclient,
                              (const struct sockaddr*) &UVX__C_PRIVATE(xclient)->server_addr, _uv_on_connect);
-    if(ret >= 0 && xclient->config.log_out)
-        fprintf(xclient->config.log_out, "[uvx-client] %s connect to server ...\n", xclient->config.name);
-    if(ret < 0 && xclient->config.log_err)
-        fprintf(xclient->config.log_err, "\n!!! [uvx-client] %s connect failed: %s\n", xclient->config.name, uv_strerror(ret));
+    }
+    if(ret >= 0) {
+        UVX__C_EVENT(xclient, UVX_LOG_INFO, "%s connect to server ...", xclient->config.name);
+    } else {
+        UVX__C_EVENT(xclient, UVX_LOG_ERROR, "%s connect failed: %s", xclient->config.name, uv_strerror(ret));
+        _uv_on_connect(&UVX__C_PRIVATE(xclient)->conn, ret); // closes the handle and reconnects later, as async failures
+    }
     return (ret >= 0 ? 1 : 0);
 }
 
 static void uvx__after_close_client(uv_handle_t* handle) {
     uvx_client_t* xclient = (uvx_client_t*) handle->data;
     assert(handle->data);
-    if(xclient->config.on_conn_close)
+    if(xclient->config.on_conn_close) {
+        uvx__watch_enter("on_conn_close", xclient->config.name);
         xclient->config.on_conn_close(xclient);
+        uvx__watch_exit();
+    }
+    if(xclient->uvserver) {
+        uvx_atomic_add1w_u64(&xclient->stats.closes, 1);
+        uvx__client_cancel_requests(xclient, UV_ECANCELED); // no response on a new connection
+    }
+    automem_uninit(&xclient->inbuf); // unconsumed data of the closed connection is useless
     xclient->uvserver = NULL;
     UVX__C_PRIVATE(xclient)->connection_closed = 1;
+    uvx__client_schedule_reconnect(xclient);
 }
 
 static void _uvx_client_close(uvx_client_t* xclient) {
-    if(xclient->config.log_out)
-        fprintf(xclient->config.log_out, "[uvx-client] %s on close\n", xclient->config.name);
-    if(xclient->config.on_conn_closing)
+    UVX__C_EVENT(xclient, UVX_LOG_INFO, "%s on close", xclient->config.name);
+    if(xclient->config.on_conn_closing) {
+        uvx__watch_enter("on_conn_closing", xclient->config.name);
         xclient->config.on_conn_closing(xclient);
-    uv_close((uv_handle_t*) &xclient->uvclient, uvx__after_close_client);
+        uvx__watch_exit();
+    }
+    if(UVX__C_PRIVATE(xclient)->shm) {
+        uvx__shm_close(UVX__C_PRIVATE(xclient)->shm);
+        UVX__C_PRIVATE(xclient)->shm = NULL;
+    }
+    uv_close((uv_handle_t*) &xclient->uvclient, uvx__after_close_client); // will reconnect, see uvx__client_schedule_reconnect()
+}
 
-	// heartbeat_timer is reused to re-connect on next uvx__on_heartbeat_timer(), do not stop it.
-	// uv_timer_stop(&_context.heartbeat_timer);
-	// uv_close((uv_handle_t*)&_context.heartbeat_timer, NULL);
+// delivers a message received through shared memory, as it's read from the connection.
+// returns 0 if the connection is closed in callbacks.
+static int uvx__client_on_shm_msg(void* owner, void* data, unsigned int size) {
+    uvx_client_t* xclient = (uvx_client_t*) owner;
+    xclient->last_recv_time = uv_now(xclient->uvloop);
+    if(xclient->config.accumulate_recv) {
+        uv_buf_t tail;
+        uvx__alloc_mem_tail(&xclient->inbuf, size, &tail);
+        memcpy(tail.base, data, size);
+        xclient->inbuf.size += size;
+        if(xclient->config.frame_length) {
+            uvx__client_on_frames(xclient);
+        } else if(xclient->config.on_recv) {
+            uvx__watch_enter("on_recv", xclient->config.name);
+            xclient->config.on_recv(xclient, xclient->inbuf.pdata, xclient->inbuf.size);
+            uvx__watch_exit();
+        }
+    } else if(xclient->config.on_recv) {
+        uvx__watch_enter("on_recv", xclient->config.name);
+        xclient->config.on_recv(xclient, data, size);
+        uvx__watch_exit();
+    }
+    return !uv_is_closing((uv_handle_t*) &xclient->uvclient);
+}
+
+// the server doesn't reply the hello in time, or corrupted the rings of shared-memory transport
+static void uvx__client_on_shm_fail(void* owner, int fatal) {
+    uvx_client_t* xclient = (uvx_client_t*) owner;
+    uvx__shm_close(UVX__C_PRIVATE(xclient)->shm);
+    UVX__C_PRIVATE(xclient)->shm = NULL; // or else falls back to the connection
+    if(fatal && !uv_is_closing((uv_handle_t*) &xclient->uvclient))
+        _uvx_client_close(xclient); // will try reconnect
+}
+
+// handles the reply of hello and doorbells of shared-memory transport, see config.shm_ring_size.
+// returns the size of the remaining normal data, which is moved to the start of `base`.
+static ssize_t uvx__client_shm_read(uvx_client_t* xclient, char* base, ssize_t nread) {
+    uvx_client_private_t* priv = UVX__C_PRIVATE(xclient);
+    unsigned int used = 0;
+    xclient->last_recv_time = uv_now(xclient->uvloop);
+    if(!uvx__shm_on_read(priv->shm, base, (unsigned int) nread, &used)) {
+        uvx__shm_close(priv->shm); // refused, falls back to the connection
+        priv->shm = NULL;
+    }
+    memmove(base, base + used, nread - used);
+    return nread - used;
 }
 
 static void uvx__on_client_read(uv_stream_t* uvserver, ssize_t nread, const uv_buf_t* buf) {
     uvx_client_t* xclient = (uvx_client_t*) uvserver->data;
     assert(xclient);
 
+	if(nread > 0 && UVX__C_PRIVATE(xclient)->shm)
+		nread = uvx__client_shm_read(xclient, buf->base, nread);
 	if(nread > 0) {
         assert(xclient->uvserver == (uv_tcp_t*)uvserver);
-        if(xclient->config.on_recv)
+        uvx__recv_sizer_update(&xclient->recv_sizer, nread);
+        uvx_atomic_add1w_u64(&xclient->stats.msgs_in, 1);
+        uvx_atomic_add1w_u64(&xclient->stats.bytes_in, nread);
+        xclient->last_recv_time = uv_now(xclient->uvloop);
+        if(xclient->config.accumulate_recv) {
+            // data was read into xclient->inbuf directly, see uvx__on_client_alloc_buf()
+            assert(buf->base == (char*)xclient->inbuf.pdata + xclient->inbuf.size);
+            xclient->inbuf.size += (unsigned int) nread;
+            if(xclient->config.frame_length) {
+                uvx__client_on_frames(xclient);
+                return;
+            }
+            if(xclient->config.on_recv) {
+                uvx__watch_enter("on_recv", xclient->config.name);
+                xclient->config.on_recv(xclient, xclient->inbuf.pdata, xclient->inbuf.size);
+                uvx__watch_exit();
+            }
+            return;
+        }
+        if(xclient->config.on_recv) {
+            uvx__watch_enter("on_recv", xclient->config.name);
             xclient->config.on_recv(xclient, buf->base, nread);
+            uvx__watch_exit();
+        }
 	} else if(nread < 0) {
 		uv_read_stop(uvserver);
-		if(xclient->config.log_err)
-            fprintf(xclient->config.log_err, "\n!!! [uvx-client] %s on recv error: %s\n", xclient->config.name, uv_strerror(nread));
-		_uvx_client_close(xclient); // will try reconnect on next uvx__on_heartbeat_timer()
+        UVX__C_EVENT(xclient, (nread == UV_EOF ? UVX_LOG_INFO : UVX_LOG_WARN),
+                     "%s on recv error: %s", xclient->config.name, uv_strerror(nread));
+        if(uvx__shm_active(UVX__C_PRIVATE(xclient)->shm))
+            uvx__shm_drain(UVX__C_PRIVATE(xclient)->shm); // messages sent before the server closed
+        if(!uv_is_closing((uv_handle_t*) uvserver))
+            _uvx_client_close(xclient); // will try reconnect
 	}
-    free(buf->base);
+    if(!xclient->config.accumulate_recv)
+        uvx_free(buf->base);
 }
 
-// defines in uvx.c
-void uvx__on_alloc_buf(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+static void uvx__on_client_alloc_buf(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    uvx_client_t* xclient = (uvx_client_t*) handle->data;
+    assert(xclient);
+    if(xclient->config.accumulate_recv)
+        uvx__alloc_mem_tail(&xclient->inbuf, uvx__recv_sizer_size(&xclient->recv_sizer, suggested_size), buf);
+    else
+        uvx__on_alloc_buf(handle, uvx__recv_sizer_size(&xclient->recv_sizer, suggested_size), buf);
+}
 
 static void _uv_on_connect(uv_connect_t* conn, int status) {
     uvx_client_t* xclient = (uvx_client_t*) conn->data;
     xclient->uvclient.data = xclient;
+	if(status == UV_ECANCELED)
+		return; // closed by uvx_client_shutdown() while connecting
 
 	if(status == 0) {
-		if(xclient->config.log_out)
-            fprintf(xclient->config.log_out, "[uvx-client] %s connect to server ok\n", xclient->config.name);
+        UVX__C_EVENT(xclient, UVX_LOG_INFO, "%s connect to server ok", xclient->config.name);
 		assert(conn->handle == (uv_stream_t*) &xclient->uvclient);
 		xclient->uvserver = (uv_tcp_t*) conn->handle;
-        if(xclient->config.on_conn_ok)
+		xclient->last_recv_time = uv_now(xclient->uvloop);
+		xclient->reconnect_failures = 0;
+		uvx__recv_sizer_init(&xclient->recv_sizer, xclient->config.recv_buffer_min, xclient->config.recv_buffer_max);
+		uvx_atomic_add1w_u64(&xclient->stats.accepts, 1);
+		if(xclient->config.shm_ring_size > 0) {
+		    // sends go to the ring since now, even before the server replies the hello
+		    UVX__C_PRIVATE(xclient)->shm = uvx__shm_new(xclient->uvloop, conn->handle, xclient->config.shm_spin_us,
+		                                                &xclient->stats, uvx__client_on_shm_msg, uvx__client_on_shm_fail,
+		                                                xclient);
+		    if(!uvx__shm_connect(UVX__C_PRIVATE(xclient)->shm, xclient->config.shm_ring_size)) {
+		        uvx__shm_close(UVX__C_PRIVATE(xclient)->shm);
+		        UVX__C_PRIVATE(xclient)->shm = NULL;
+		    }
+		}
+		if(xclient->config.latency_histograms)
+		    uvx_histogram_record(&xclient->connect_latency, (uv_hrtime() - UVX__C_PRIVATE(xclient)->connect_time) / 1000);
+        if(xclient->config.on_conn_ok) {
+            uvx__watch_enter("on_conn_ok", xclient->config.name);
             xclient->config.on_conn_ok(xclient);
-		uv_read_start(conn->handle, uvx__on_alloc_buf, uvx__on_client_read);
+            uvx__watch_exit();
+        }
+		uvx__client_pending_flush(xclient); // after on_conn_ok, which may send a handshake
+		uv_read_start(conn->handle, uvx__on_client_alloc_buf, uvx__on_client_read);
 	} else {
 		xclient->uvserver = NULL;
-		if(xclient->config.log_err)
-            fprintf(xclient->config.log_err, "\n!!! [uvx-client] %s connect to server failed: %s\n", xclient->config.name, uv_strerror(status));
-        if(xclient->config.on_conn_fail)
+		xclient->reconnect_failures++;
+        UVX__C_EVENT(xclient, UVX_LOG_WARN, "%s connect to server failed: %s", xclient->config.name, uv_strerror(status));
+        if(xclient->config.on_conn_fail) {
+            uvx__watch_enter("on_conn_fail", xclient->config.name);
             xclient->config.on_conn_fail(xclient);
-		_uvx_client_close(xclient); // will try reconnect on next on_heartbeat
+            uvx__watch_exit();
+        }
+		_uvx_client_close(xclient); // will try reconnect
 	}
 }
 
@@ -170,10 +714,46 @@ int uvx_client_disconnect(uvx_client_t* xclient) {
 	return 1;
 }
 
+static void uvx__after_close_timer(uv_handle_t* handle) {
+    uvx_client_t* xclient = (uvx_client_t*) handle->data;
+    UVX__C_PRIVATE(xclient)->timers_closed++;
+}
+
 int uvx_client_shutdown(uvx_client_t* xclient) {
 	uv_timer_t* heartbeat_timer = &UVX__C_PRIVATE(xclient)->heartbeat_timer;
+	uv_timer_t* reconnect_timer = &UVX__C_PRIVATE(xclient)->reconnect_timer;
+	if(UVX__C_PRIVATE(xclient)->shutdown)
+		return 1; // already shutdown, e.g. called again by on_response of canceled requests
+	UVX__C_PRIVATE(xclient)->shutdown = 1;
 	uv_timer_stop(heartbeat_timer);
-	uv_close((uv_handle_t*)heartbeat_timer, NULL);
-	uvx_client_disconnect(xclient);
+	uv_close((uv_handle_t*)heartbeat_timer, uvx__after_close_timer);
+	uv_timer_stop(reconnect_timer);
+	uv_close((uv_handle_t*)reconnect_timer, uvx__after_close_timer);
+	// cancels requests, including the ones in pending queue
+	uvx__client_cancel_requests(xclient, UV_ECANCELED);
+	uv_timer_stop(&UVX__C_PRIVATE(xclient)->wheel_timer);
+	uv_close((uv_handle_t*)&UVX__C_PRIVATE(xclient)->wheel_timer, uvx__after_close_timer);
+	if(UVX__C_PRIVATE(xclient)->requests)
+		lh_table_free(UVX__C_PRIVATE(xclient)->requests);
+	uvx_free(UVX__C_PRIVATE(xclient)->wheel);
+	UVX__C_PRIVATE(xclient)->requests = NULL;
+	UVX__C_PRIVATE(xclient)->wheel = NULL;
+	// drops pending sends
+	while(xclient->pending_stats.count > 0)
+		uvx__client_pending_drop_oldest(xclient);
+	uvx_free(UVX__C_PRIVATE(xclient)->pending);
+	UVX__C_PRIVATE(xclient)->pending = NULL;
+	// closes the connection if it's connected or still connecting
+	if(!UVX__C_PRIVATE(xclient)->connection_closed && !uv_is_closing((uv_handle_t*) &xclient->uvclient))
+		_uvx_client_close(xclient);
 	return 1;
 }
+
+int uvx_client_shm_active(uvx_client_t* xclient) {
+    return uvx__shm_active(UVX__C_PRIVATE(xclient)->shm);
+}
+
+// returns 1 if all handles of xclient were closed after uvx_client_shutdown(), used by uvx_client_pool.c
+int uvx__client_closed(uvx_client_t* xclient) {
+    return (UVX__C_PRIVATE(xclient)->connection_closed && UVX__C_PRIVATE(xclient)->timers_closed == 3);
+}
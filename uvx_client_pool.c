@@ -0,0 +1,298 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "uvx.h"
+
+// uvx tcp client pool, see `uvx_client_pool_t`.
+
+// defines in uvx_event.c
+void uvx__event(int level, const char* tag, const char* fmt, ...);
+void uvx__event_log(FILE* out, FILE* err, int level, const char* tag, const char* fmt, ...);
+
+// defines in uvx_client.c
+int uvx__client_closed(uvx_client_t* xclient);
+
+// defines in uvx.c
+void uvx__stats_snapshot(uvx_stats_t* src, uvx_stats_t* dst);
+
+// a virtual node on the consistent hash ring
+typedef struct uvx_pool_node_s {
+    uint32_t hash;
+    int backend;
+} uvx_pool_node_t;
+
+// FNV-1a, with murmur3's finalizer to spread similar keys (such as "ip:port#1", "ip:port#2") over the ring
+static uint32_t _uvx_pool_hash(const void* key, unsigned int keylen) {
+    const unsigned char* p = (const unsigned char*) key;
+    uint32_t h = 2166136261u;
+    for(unsigned int i = 0; i < keylen; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// writes not completed and requests waiting for response
+static uint64_t _uvx_pool_outstanding(uvx_pool_conn_t* conn) {
+    return conn->xclient.stats.write_queue_count + conn->xclient.request_stats.inflight;
+}
+
+static int _uvx_pool_node_cmp(const void* a, const void* b) {
+    uint32_t x = ((const uvx_pool_node_t*)a)->hash, y = ((const uvx_pool_node_t*)b)->hash;
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+uvx_client_pool_config_t uvx_client_pool_default_config(uvx_client_pool_t* pool) {
+    uvx_client_pool_config_t config;
+    memset(&config, 0, sizeof(config));
+    snprintf(config.name, sizeof(config.name), "xpool-%p", pool);
+    config.conns_per_backend = 2;
+    config.policy = UVX_POOL_ROUND_ROBIN;
+    config.hash_replicas = 100;
+    config.unhealthy_seconds = 0;
+    config.client = uvx_client_default_config(NULL);
+    return config;
+}
+
+int uvx_client_pool_conn_healthy(uvx_pool_conn_t* conn) {
+    uvx_client_t* xclient = &conn->xclient;
+    if(xclient->uvserver == NULL)
+        return 0;
+    float unhealthy_seconds = conn->pool->config.unhealthy_seconds;
+    if(unhealthy_seconds > 0 && uv_now(xclient->uvloop) - xclient->last_recv_time > (uint64_t)(unhealthy_seconds * 1000))
+        return 0;
+    return 1;
+}
+
+// disconnects an unhealthy connection, it will be re-connected by the xclient
+static void _uvx_pool_on_heartbeat(uvx_client_t* xclient, unsigned int index) {
+    uvx_pool_conn_t* conn = (uvx_pool_conn_t*) xclient;
+    uvx_client_pool_t* pool = conn->pool;
+    if(!uvx_client_pool_conn_healthy(conn)) {
+        uvx__event_log(xclient->config.log_out, xclient->config.log_err, UVX_LOG_WARN, "uvx-pool",
+                       "%s disconnect unhealthy %s", pool->config.name, xclient->config.name);
+        uvx_client_disconnect(xclient);
+        return;
+    }
+    if(pool->config.client.on_heartbeat)
+        pool->config.client.on_heartbeat(xclient, index);
+}
+
+// parses "ip:port" or "[ipv6]:port"
+static int _uvx_pool_parse_addr(const char* addr, char* ip, int iplen, int* port) {
+    const char* colon = strrchr(addr, ':');
+    if(colon == NULL)
+        return 0;
+    const char* begin = addr;
+    const char* end = colon;
+    if(*begin == '[') {
+        begin++;
+        if(end[-1] != ']')
+            return 0;
+        end--;
+    }
+    if(end - begin <= 0 || end - begin >= iplen)
+        return 0;
+    memcpy(ip, begin, end - begin);
+    ip[end - begin] = '\0';
+    *port = atoi(colon + 1);
+    return (*port > 0 && *port < 65536);
+}
+
+int uvx_client_pool_start(uvx_client_pool_t* pool, uv_loop_t* loop, const char** addrs, int count,
+                          uvx_client_pool_config_t config) {
+    assert(pool && loop && addrs && count > 0);
+    memset(pool, 0, sizeof(uvx_client_pool_t));
+    pool->uvloop = loop;
+    if(config.conns_per_backend <= 0)
+        config.conns_per_backend = 1;
+    if(config.hash_replicas <= 0)
+        config.hash_replicas = 1;
+    memcpy(&pool->config, &config, sizeof(uvx_client_pool_config_t));
+
+    pool->backends = (uvx_pool_backend_t*) uvx_calloc(count, sizeof(uvx_pool_backend_t));
+    for(int i = 0; i < count; i++) {
+        uvx_pool_backend_t* backend = &pool->backends[i];
+        if(!_uvx_pool_parse_addr(addrs[i], backend->ip, sizeof(backend->ip), &backend->port)) {
+            uvx__event(UVX_LOG_ERROR, "uvx-pool", "%s invalid address: %s", config.name, addrs[i]);
+            uvx_free(pool->backends);
+            pool->backends = NULL;
+            return 0;
+        }
+    }
+    pool->backend_count = count;
+
+    // consistent hash ring: hash_replicas virtual nodes per backend
+    pool->ring_size = count * config.hash_replicas;
+    uvx_pool_node_t* ring = (uvx_pool_node_t*) uvx_calloc(pool->ring_size, sizeof(uvx_pool_node_t));
+    for(int i = 0; i < count; i++) {
+        for(int r = 0; r < config.hash_replicas; r++) {
+            char node[64];
+            int n = snprintf(node, sizeof(node), "%s:%d#%d", pool->backends[i].ip, pool->backends[i].port, r);
+            ring[i * config.hash_replicas + r].hash = _uvx_pool_hash(node, n);
+            ring[i * config.hash_replicas + r].backend = i;
+        }
+    }
+    qsort(ring, pool->ring_size, sizeof(uvx_pool_node_t), _uvx_pool_node_cmp);
+    pool->ring = ring;
+
+    pool->conn_count = count * config.conns_per_backend;
+    pool->conns = (uvx_pool_conn_t*) uvx_calloc(pool->conn_count, sizeof(uvx_pool_conn_t));
+    int ok = 1;
+    for(int i = 0; i < pool->conn_count; i++) {
+        uvx_pool_conn_t* conn = &pool->conns[i];
+        uvx_pool_backend_t* backend = &pool->backends[i / config.conns_per_backend];
+        uvx_client_config_t client_config = config.client;
+        snprintf(client_config.name, sizeof(client_config.name), "%.16s-%s:%d", config.name, backend->ip, backend->port);
+        client_config.on_heartbeat = _uvx_pool_on_heartbeat;
+        conn->pool = pool;
+        conn->backend = i / config.conns_per_backend;
+        if(!uvx_client_connect(&conn->xclient, loop, backend->ip, backend->port, client_config))
+            ok = 0; // will retry by the xclient
+    }
+    return ok;
+}
+
+// the healthy connection of backend with fewest outstanding writes and requests, starting at `start`
+static uvx_pool_conn_t* _uvx_pool_pick_in_backend(uvx_client_pool_t* pool, int backend, unsigned int start) {
+    int n = pool->config.conns_per_backend;
+    uvx_pool_conn_t* conns = pool->conns + backend * n;
+    uvx_pool_conn_t* best = NULL;
+    for(int i = 0; i < n; i++) {
+        uvx_pool_conn_t* conn = &conns[(start + i) % n];
+        if(!uvx_client_pool_conn_healthy(conn))
+            continue;
+        if(best == NULL || _uvx_pool_outstanding(conn) < _uvx_pool_outstanding(best))
+            best = conn;
+        if(pool->config.policy != UVX_POOL_LEAST_OUTSTANDING)
+            break; // the first healthy one
+    }
+    return best;
+}
+
+static uvx_pool_conn_t* _uvx_pool_pick_hash(uvx_client_pool_t* pool, const void* key, unsigned int keylen) {
+    uvx_pool_node_t* ring = (uvx_pool_node_t*) pool->ring;
+    uint32_t hash = _uvx_pool_hash(key, keylen);
+    // the first node whose hash >= key's hash, wraps around
+    int lo = 0, hi = pool->ring_size;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    // skips backends without healthy connection, keeps other keys stable
+    for(int i = 0; i < pool->ring_size; i++) {
+        int backend = ring[(lo + i) % pool->ring_size].backend;
+        uvx_pool_conn_t* conn = _uvx_pool_pick_in_backend(pool, backend, hash);
+        if(conn)
+            return conn;
+    }
+    return NULL;
+}
+
+uvx_pool_conn_t* uvx_client_pool_pick(uvx_client_pool_t* pool, const void* key, unsigned int keylen) {
+    if(pool->config.policy == UVX_POOL_CONSISTENT_HASH && key)
+        return _uvx_pool_pick_hash(pool, key, keylen);
+    int total = pool->backend_count * pool->config.conns_per_backend; // 0 after shutdown
+    uvx_pool_conn_t* best = NULL;
+    unsigned int start = pool->rr_index++;
+    for(int i = 0; i < total; i++) {
+        uvx_pool_conn_t* conn = &pool->conns[(start + i) % total];
+        if(!uvx_client_pool_conn_healthy(conn))
+            continue;
+        if(pool->config.policy != UVX_POOL_LEAST_OUTSTANDING)
+            return conn;
+        if(best == NULL || _uvx_pool_outstanding(conn) < _uvx_pool_outstanding(best))
+            best = conn;
+    }
+    return best;
+}
+
+static int _uvx_pool_send(uvx_client_pool_t* pool, uvx_pool_conn_t* conn, void* data, unsigned int size) {
+    if(conn == NULL) {
+        uvx_free(data);
+        return 0;
+    }
+    pool->backends[conn->backend].routed++;
+    return uvx_client_send(&conn->xclient, data, size);
+}
+
+int uvx_client_pool_send(uvx_client_pool_t* pool, void* data, unsigned int size) {
+    return _uvx_pool_send(pool, uvx_client_pool_pick(pool, NULL, 0), data, size);
+}
+
+int uvx_client_pool_send_key(uvx_client_pool_t* pool, const void* key, unsigned int keylen,
+                             void* data, unsigned int size) {
+    return _uvx_pool_send(pool, uvx_client_pool_pick(pool, key, keylen), data, size);
+}
+
+void uvx_client_pool_backend_stats(uvx_client_pool_t* pool, int index, uvx_pool_backend_stats_t* stats) {
+    assert(index >= 0 && index < pool->backend_count);
+    memset(stats, 0, sizeof(uvx_pool_backend_stats_t));
+    int n = pool->config.conns_per_backend;
+    stats->conns = n;
+    stats->routed = pool->backends[index].routed;
+    for(int i = 0; i < n; i++) {
+        uvx_pool_conn_t* conn = &pool->conns[index * n + i];
+        uvx_stats_t s;
+        uvx__stats_snapshot(&conn->xclient.stats, &s);
+        stats->healthy += uvx_client_pool_conn_healthy(conn);
+        stats->stats.bytes_in += s.bytes_in;
+        stats->stats.bytes_out += s.bytes_out;
+        stats->stats.msgs_in += s.msgs_in;
+        stats->stats.msgs_out += s.msgs_out;
+        stats->stats.send_failures += s.send_failures;
+        stats->stats.write_queue_count += s.write_queue_count;
+        stats->stats.write_queue_bytes += s.write_queue_bytes;
+        stats->stats.accepts += s.accepts;
+        stats->stats.closes += s.closes;
+        stats->stats.timeouts += s.timeouts;
+        stats->stats.bytes_in_rate += s.bytes_in_rate;
+        stats->stats.bytes_out_rate += s.bytes_out_rate;
+        stats->stats.msgs_in_rate += s.msgs_in_rate;
+        stats->stats.msgs_out_rate += s.msgs_out_rate;
+        if(s.loop_lag_max_ms > stats->stats.loop_lag_max_ms)
+            stats->stats.loop_lag_max_ms = s.loop_lag_max_ms;
+    }
+}
+
+static void _uvx_pool_after_close_timer(uv_handle_t* handle) {
+    uvx_client_pool_t* pool = (uvx_client_pool_t*) handle->data;
+    uvx_free(pool->conns);
+    uvx_free(pool->backends);
+    uvx_free(pool->ring);
+    pool->conns = NULL;
+    pool->backends = NULL;
+    pool->ring = NULL;
+}
+
+// checks every millisecond after shutdown, until all xclients have been closed
+static void _uvx_pool_on_release_timer(uv_timer_t* handle) {
+    uvx_client_pool_t* pool = (uvx_client_pool_t*) handle->data;
+    for(int i = 0; i < pool->conn_count; i++) {
+        if(!uvx__client_closed(&pool->conns[i].xclient))
+            return;
+    }
+    uv_timer_stop(handle);
+    uv_close((uv_handle_t*) handle, _uvx_pool_after_close_timer);
+}
+
+int uvx_client_pool_shutdown(uvx_client_pool_t* pool) {
+    for(int i = 0; i < pool->conn_count; i++)
+        uvx_client_shutdown(&pool->conns[i].xclient);
+    pool->backend_count = 0; // nothing can be picked
+    pool->ring_size = 0;
+    uv_timer_init(pool->uvloop, &pool->release_timer);
+    pool->release_timer.data = pool;
+    uv_timer_start(&pool->release_timer, _uvx_pool_on_release_timer, 1, 1);
+    return 1;
+}
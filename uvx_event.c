@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "uvx.h"
+#include "utils/atomic.h"
+
+// uvx internal event log: a lock-free ring of uvx's own diagnostics,
+// drained asynchronously to a file, to an xlog, or to log_out/log_err of configs by default,
+// never doing blocking I/O on loop threads.
+
+#define UVX_EVENT_RING_SIZE  1024 // must be power of 2
+#define UVX_EVENT_MSG_SIZE   200
+
+typedef struct uvx_event_s {
+    uint32_t seq;   // sequence number of the ring slot, see Dmitry Vyukov's bounded MPMC queue
+    int level;
+    time_t time;
+    const char* tag; // static string, e.g. "uvx-server"
+    FILE* fp;        // log_out or log_err of the config, used if no drain target is set
+    char msg[UVX_EVENT_MSG_SIZE];
+} uvx_event_t;
+
+static struct {
+    uvx_event_t ring[UVX_EVENT_RING_SIZE];
+    uint32_t write_pos; // producers: any thread
+    uint32_t read_pos;  // consumer: the drain thread or the drain timer
+    uint32_t dropped;   // events dropped because the ring is full
+    int level;
+    int draining;       // 1 if any drain target is set
+    // the drain thread, drains to file, or to event's fp if no drain target is set. started on first use.
+    int thread_ok;
+    uv_thread_t thread;
+    uv_mutex_t mutex;   // held by the consumer
+    uv_cond_t cond;
+    FILE* fp;
+    // drain to xlog, in its loop thread
+    uvx_log_t* xlog;
+    uv_timer_t timer;
+    int timer_closing;  // uvx_event_log_to_xlog() fails until the timer is closed
+} _uvx_events;
+
+static uv_once_t _uvx_events_once = UV_ONCE_INIT;
+
+static void _uvx_event_thread(void* arg);
+
+static void _uvx_event_init_once(void) {
+    for(uint32_t i = 0; i < UVX_EVENT_RING_SIZE; i++)
+        _uvx_events.ring[i].seq = i;
+    _uvx_events.write_pos = _uvx_events.read_pos = 0;
+    _uvx_events.level = UVX_LOG_INFO;
+    uv_mutex_init(&_uvx_events.mutex);
+    uv_cond_init(&_uvx_events.cond);
+    _uvx_events.thread_ok = (uv_thread_create(&_uvx_events.thread, _uvx_event_thread, NULL) == 0);
+}
+
+static void _uvx_event_init() {
+    uv_once(&_uvx_events_once, _uvx_event_init_once);
+}
+
+void uvx_event_log_level(int level) {
+    _uvx_event_init();
+    _uvx_events.level = level;
+}
+
+// record an event into the ring, it's lock-free and threadsafe.
+// events are discarded if there is no drain target and no fp, or below the level, or the ring is full.
+static void _uvx_event_record(FILE* fp, int level, const char* tag, const char* fmt, va_list ap) {
+    if(!_uvx_events.draining && fp == NULL)
+        return;
+    _uvx_event_init();
+    if(level < _uvx_events.level || (!_uvx_events.draining && !_uvx_events.thread_ok))
+        return;
+    uint32_t pos = uvx_atomic_load_u32(&_uvx_events.write_pos);
+    uvx_event_t* e;
+    for(;;) {
+        e = &_uvx_events.ring[pos & (UVX_EVENT_RING_SIZE - 1)];
+        int32_t diff = (int32_t)(uvx_atomic_load_u32(&e->seq) - pos);
+        if(diff == 0) {
+            if(uvx_atomic_cas_u32(&_uvx_events.write_pos, pos, pos + 1))
+                break;
+        } else if(diff < 0) {
+            uvx_atomic_add_u32(&_uvx_events.dropped, 1); // full
+            return;
+        }
+        pos = uvx_atomic_load_u32(&_uvx_events.write_pos);
+    }
+    e->level = level;
+    e->time = time(NULL);
+    e->tag = tag;
+    e->fp = fp;
+    vsnprintf(e->msg, sizeof(e->msg), fmt, ap);
+    uvx_atomic_store_u32(&e->seq, pos + 1); // publish it
+}
+
+// an event of xserver/xclient, written to `out` (or `err` if level >= UVX_LOG_WARN) if no drain target is set
+void uvx__event_log(FILE* out, FILE* err, int level, const char* tag, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    _uvx_event_record((level >= UVX_LOG_WARN ? err : out), level, tag, fmt, ap);
+    va_end(ap);
+}
+
+// an event only written to the drain target
+void uvx__event(int level, const char* tag, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    _uvx_event_record(NULL, level, tag, fmt, ap);
+    va_end(ap);
+}
+
+typedef void (*UVX_ON_EVENT) (uvx_event_t* e);
+
+// drain all recorded events, only one consumer at the same time (holding _uvx_events.mutex).
+static int _uvx_event_drain(UVX_ON_EVENT on_event) {
+    int n = 0;
+    for(;;) {
+        uint32_t pos = _uvx_events.read_pos;
+        uvx_event_t* e = &_uvx_events.ring[pos & (UVX_EVENT_RING_SIZE - 1)];
+        if(uvx_atomic_load_u32(&e->seq) != pos + 1)
+            break; // empty
+        on_event(e);
+        uvx_atomic_store_u32(&e->seq, pos + UVX_EVENT_RING_SIZE); // release the slot
+        _uvx_events.read_pos = pos + 1;
+        n++;
+    }
+    uint32_t dropped = uvx_atomic_load_u32(&_uvx_events.dropped);
+    if(dropped) {
+        uvx_atomic_add_u32(&_uvx_events.dropped, (uint32_t)(0 - dropped));
+        uvx_event_t e = { .seq = 0, .level = UVX_LOG_WARN, .time = time(NULL), .tag = "uvx", .fp = stderr };
+        snprintf(e.msg, sizeof(e.msg), "%u events dropped, the event ring is full", dropped);
+        on_event(&e);
+    }
+    return n;
+}
+
+// writes to the drain file, or to the event's fp if no drain target is set
+static void _uvx_event_to_file(uvx_event_t* e) {
+    FILE* fp = (_uvx_events.fp ? _uvx_events.fp : e->fp);
+    if(fp == NULL)
+        return;
+    char timestr[32];
+    strftime(timestr, sizeof(timestr), "[%Y-%m-%d %X]", localtime(&e->time));
+    fprintf(fp, "%s[%s] %s %s\n", (e->level >= UVX_LOG_WARN ? "!!! " : ""), e->tag, timestr, e->msg);
+    if(fp != _uvx_events.fp)
+        fflush(fp);
+}
+
+// runs until the process exits, it's idle while draining to xlog
+static void _uvx_event_thread(void* arg) {
+    uv_mutex_lock(&_uvx_events.mutex);
+    for(;;) {
+        if(_uvx_events.xlog == NULL && _uvx_event_drain(_uvx_event_to_file) > 0 && _uvx_events.fp)
+            fflush(_uvx_events.fp);
+        uv_cond_timedwait(&_uvx_events.cond, &_uvx_events.mutex, 20 * 1000000); // 20ms
+    }
+}
+
+int uvx_event_log_to_file(FILE* fp) {
+    assert(fp);
+    _uvx_event_init();
+    if(!_uvx_events.thread_ok)
+        return 0;
+    uv_mutex_lock(&_uvx_events.mutex);
+    int ok = !_uvx_events.draining; // or else call uvx_event_log_stop() first
+    if(ok) {
+        _uvx_event_drain(_uvx_event_to_file); // recorded before, to log_out/log_err
+        _uvx_events.fp = fp;
+        _uvx_events.draining = 1;
+    }
+    uv_mutex_unlock(&_uvx_events.mutex);
+    return ok;
+}
+
+static void _uvx_event_to_xlog(uvx_event_t* e) {
+    uvx_log_send(_uvx_events.xlog, e->level, e->tag, e->msg, NULL, 0);
+}
+
+static void _uv_on_event_timer(uv_timer_t* handle) {
+    uv_mutex_lock(&_uvx_events.mutex);
+    _uvx_event_drain(_uvx_event_to_xlog);
+    uv_mutex_unlock(&_uvx_events.mutex);
+}
+
+static void _uv_after_close_event_timer(uv_handle_t* handle) {
+    uv_mutex_lock(&_uvx_events.mutex);
+    _uvx_events.timer_closing = 0;
+    uv_mutex_unlock(&_uvx_events.mutex);
+}
+
+int uvx_event_log_to_xlog(uvx_log_t* xlog, float interval_seconds) {
+    assert(xlog);
+    _uvx_event_init();
+    uv_mutex_lock(&_uvx_events.mutex);
+    int ok = (!_uvx_events.draining && !_uvx_events.timer_closing); // or else call uvx_event_log_stop() first
+    if(ok) {
+        int timeout = (int)(interval_seconds * 1000); // in milliseconds
+        if(timeout <= 0) timeout = 100;
+        _uvx_events.xlog = xlog;
+        uv_timer_init(xlog->uvloop, &_uvx_events.timer);
+        uv_timer_start(&_uvx_events.timer, _uv_on_event_timer, timeout, timeout);
+        uv_unref((uv_handle_t*) &_uvx_events.timer); // do not keep the loop alive
+        _uvx_events.draining = 1;
+    }
+    uv_mutex_unlock(&_uvx_events.mutex);
+    return ok;
+}
+
+void uvx_event_log_stop(void) {
+    if(!_uvx_events.draining)
+        return;
+    uv_mutex_lock(&_uvx_events.mutex);
+    if(_uvx_events.fp) {
+        _uvx_event_drain(_uvx_event_to_file); // the remaining
+        fflush(_uvx_events.fp);
+        _uvx_events.fp = NULL;
+    }
+    if(_uvx_events.xlog) {
+        _uvx_event_drain(_uvx_event_to_xlog); // the remaining
+        uv_timer_stop(&_uvx_events.timer);
+        _uvx_events.timer_closing = 1;
+        uv_close((uv_handle_t*) &_uvx_events.timer, _uv_after_close_event_timer);
+        _uvx_events.xlog = NULL;
+    }
+    _uvx_events.draining = 0;
+    uv_mutex_unlock(&_uvx_events.mutex);
+}
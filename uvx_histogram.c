@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "uvx.h"
+#include "utils/atomic.h"
+
+#if defined(_MSC_VER) && !defined(__clang__)
+	#include <intrin.h>
+#endif
+
+// uvx latency histogram, see `uvx_histogram_t`.
+
+#define UVX_HISTOGRAM_SUB_COUNT  (1 << UVX_HISTOGRAM_SUB_BITS)
+
+// index of the highest set bit, `value` must not be 0
+static unsigned int _uvx_highest_bit(uint64_t value) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (unsigned int) index;
+#else
+    return 63 - (unsigned int) __builtin_clzll(value);
+#endif
+}
+
+static unsigned int _uvx_histogram_index(uint64_t value) {
+    if(value < UVX_HISTOGRAM_SUB_COUNT)
+        return (unsigned int) value;
+    if(value > UVX_HISTOGRAM_MAX)
+        value = UVX_HISTOGRAM_MAX;
+    unsigned int bit = _uvx_highest_bit(value); // >= UVX_HISTOGRAM_SUB_BITS
+    unsigned int sub = (unsigned int)(value >> (bit - UVX_HISTOGRAM_SUB_BITS)) - UVX_HISTOGRAM_SUB_COUNT;
+    return ((bit - UVX_HISTOGRAM_SUB_BITS + 1) << UVX_HISTOGRAM_SUB_BITS) + sub;
+}
+
+// the highest value of bucket `index`
+static uint64_t _uvx_histogram_value(unsigned int index) {
+    if(index < UVX_HISTOGRAM_SUB_COUNT)
+        return index;
+    unsigned int bit = (index >> UVX_HISTOGRAM_SUB_BITS) + UVX_HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = (index & (UVX_HISTOGRAM_SUB_COUNT - 1)) + UVX_HISTOGRAM_SUB_COUNT;
+    unsigned int shift = bit - UVX_HISTOGRAM_SUB_BITS;
+    return (sub << shift) + (((uint64_t)1) << shift) - 1;
+}
+
+void uvx_histogram_reset(uvx_histogram_t* h) {
+    for(int i = 0; i < UVX_HISTOGRAM_BUCKETS; i++)
+        uvx_atomic_store_u64(&h->buckets[i], 0);
+    uvx_atomic_store_u64(&h->sum, 0);
+    uvx_atomic_store_u64(&h->min, 0);
+    uvx_atomic_store_u64(&h->max, 0);
+    uvx_atomic_store_u64(&h->count, 0);
+}
+
+void uvx_histogram_record(uvx_histogram_t* h, uint64_t value) {
+    uvx_atomic_add_u64(&h->buckets[_uvx_histogram_index(value)], 1);
+    uvx_atomic_add_u64(&h->sum, value);
+    uint64_t old = uvx_atomic_load_u64(&h->max);
+    while(value > old && !uvx_atomic_cas_u64(&h->max, old, value))
+        old = uvx_atomic_load_u64(&h->max);
+    // h->min stores (min + 1), 0 means nothing recorded
+    uint64_t min1 = (value < UVX_HISTOGRAM_MAX ? value : UVX_HISTOGRAM_MAX) + 1;
+    old = uvx_atomic_load_u64(&h->min);
+    while((old == 0 || min1 < old) && !uvx_atomic_cas_u64(&h->min, old, min1))
+        old = uvx_atomic_load_u64(&h->min);
+    uvx_atomic_add_u64(&h->count, 1);
+}
+
+uint64_t uvx_histogram_percentile(uvx_histogram_t* h, double percentile) {
+    uint64_t total = 0;
+    for(int i = 0; i < UVX_HISTOGRAM_BUCKETS; i++)
+        total += uvx_atomic_load_u64(&h->buckets[i]);
+    if(total == 0)
+        return 0;
+    if(percentile < 0.0) percentile = 0.0;
+    if(percentile > 100.0) percentile = 100.0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+    if(rank == 0) rank = 1;
+    uint64_t max = uvx_atomic_load_u64(&h->max);
+    uint64_t n = 0;
+    for(int i = 0; i < UVX_HISTOGRAM_BUCKETS; i++) {
+        n += uvx_atomic_load_u64(&h->buckets[i]);
+        if(n >= rank) {
+            uint64_t value = _uvx_histogram_value(i);
+            return (value < max ? value : max);
+        }
+    }
+    return max;
+}
+
+uint64_t uvx_histogram_min(uvx_histogram_t* h) {
+    uint64_t min1 = uvx_atomic_load_u64(&h->min);
+    return (min1 ? min1 - 1 : 0);
+}
+
+const char* uvx_histogram_summary(uvx_histogram_t* h, char* buf, int buflen) {
+    uint64_t count = uvx_atomic_load_u64(&h->count);
+    uint64_t sum = uvx_atomic_load_u64(&h->sum);
+    snprintf(buf, buflen, "count=%llu min=%llu mean=%.1f p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu",
+             (unsigned long long) count, (unsigned long long) uvx_histogram_min(h),
+             count ? (double)sum / count : 0.0,
+             (unsigned long long) uvx_histogram_percentile(h, 50.0),
+             (unsigned long long) uvx_histogram_percentile(h, 90.0),
+             (unsigned long long) uvx_histogram_percentile(h, 99.0),
+             (unsigned long long) uvx_histogram_percentile(h, 99.9),
+             (unsigned long long) uvx_atomic_load_u64(&h->max));
+    return buf;
+}
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "uvx.h"
+#include "utils/linkhash.h"
+
+// uvx secondary index of connections by application keys, see uvx_server_conn_bind().
+//
+// a key (an integer or a short string) maps to a list of bindings in a hash table, and each connection links its
+// bindings in another list, so lookups are O(1), and all bindings of a connection are removed when it's closed.
+
+// a key of the index, an integer if skey is empty (and is_str == 0)
+typedef struct uvx_index_key_s {
+    int64_t ikey;
+    int is_str;
+    char skey[UVX_CONN_KEY_MAX];
+} uvx_index_key_t;
+
+typedef struct uvx_index_entry_s {
+    uvx_index_key_t key; // the key of the hash table entry
+    struct uvx_index_node_s* head; // bindings of the key, the most recent first
+} uvx_index_entry_t;
+
+// a binding of a key and a connection
+typedef struct uvx_index_node_s {
+    uvx_index_entry_t* entry;
+    void* conn;
+    struct uvx_index_node_s *prev, *next; // in entry's list
+    struct uvx_index_node_s* conn_next;   // in connection's list
+} uvx_index_node_t;
+
+typedef struct uvx_index_s {
+    struct lh_table* table; // uvx_index_key_t* -> uvx_index_entry_t*
+} uvx_index_t;
+
+static unsigned long _uvx_index_hash(const void* k) {
+    const uvx_index_key_t* key = (const uvx_index_key_t*) k;
+    if(key->is_str)
+        return lh_char_hash(key->skey);
+    uint64_t h = (uint64_t) key->ikey * 0x9e3779b97f4a7c15ULL; // fibonacci hashing
+    return (unsigned long)(h ^ (h >> 32));
+}
+
+static int _uvx_index_equal(const void* k1, const void* k2) {
+    const uvx_index_key_t* a = (const uvx_index_key_t*) k1;
+    const uvx_index_key_t* b = (const uvx_index_key_t*) k2;
+    if(a->is_str != b->is_str)
+        return 0;
+    return (a->is_str ? strcmp(a->skey, b->skey) == 0 : a->ikey == b->ikey);
+}
+
+// returns 0 if skey is too long
+static int _uvx_index_make_key(uvx_index_key_t* key, int64_t ikey, const char* skey) {
+    key->ikey = 0;
+    key->is_str = (skey != NULL);
+    key->skey[0] = '\0';
+    if(skey == NULL) {
+        key->ikey = ikey;
+        return 1;
+    }
+    size_t len = strlen(skey);
+    if(len >= UVX_CONN_KEY_MAX)
+        return 0;
+    memcpy(key->skey, skey, len + 1);
+    return 1;
+}
+
+uvx_index_t* uvx__index_new(int size) {
+    uvx_index_t* index = (uvx_index_t*) uvx_malloc(sizeof(uvx_index_t));
+    index->table = lh_table_new(size, "connections index", NULL, _uvx_index_hash, _uvx_index_equal);
+    return index;
+}
+
+// all bindings should be removed before
+void uvx__index_free(uvx_index_t* index) {
+    if(index == NULL)
+        return;
+    assert(index->table->count == 0);
+    lh_table_free(index->table);
+    uvx_free(index);
+}
+
+static uvx_index_entry_t* _uvx_index_lookup(uvx_index_t* index, int64_t ikey, const char* skey) {
+    uvx_index_key_t key;
+    if(index == NULL || !_uvx_index_make_key(&key, ikey, skey))
+        return NULL;
+    return (uvx_index_entry_t*) lh_table_lookup(index->table, &key);
+}
+
+// binds conn to the key, `bindings` is the list of conn. returns 0 if the key is invalid.
+int uvx__index_bind(uvx_index_t* index, uvx_index_node_t** bindings, void* conn, int64_t ikey, const char* skey) {
+    uvx_index_key_t key;
+    if(!_uvx_index_make_key(&key, ikey, skey))
+        return 0;
+    uvx_index_entry_t* entry = (uvx_index_entry_t*) lh_table_lookup(index->table, &key);
+    if(entry == NULL) {
+        entry = (uvx_index_entry_t*) uvx_malloc(sizeof(uvx_index_entry_t));
+        memcpy(&entry->key, &key, sizeof(key));
+        entry->head = NULL;
+        lh_table_insert(index->table, &entry->key, entry);
+    } else {
+        for(uvx_index_node_t* node = *bindings; node; node = node->conn_next) {
+            if(node->entry == entry)
+                return 1; // bound already
+        }
+    }
+    uvx_index_node_t* node = (uvx_index_node_t*) uvx_malloc(sizeof(uvx_index_node_t));
+    node->entry = entry;
+    node->conn = conn;
+    node->prev = NULL;
+    node->next = entry->head;
+    if(entry->head)
+        entry->head->prev = node;
+    entry->head = node;
+    node->conn_next = *bindings;
+    *bindings = node;
+    return 1;
+}
+
+static void _uvx_index_remove(uvx_index_t* index, uvx_index_node_t* node) {
+    uvx_index_entry_t* entry = node->entry;
+    if(node->prev)
+        node->prev->next = node->next;
+    else
+        entry->head = node->next;
+    if(node->next)
+        node->next->prev = node->prev;
+    if(entry->head == NULL) {
+        lh_table_delete(index->table, &entry->key);
+        uvx_free(entry);
+    }
+    uvx_free(node);
+}
+
+// unbinds conn from the key. returns 0 if it was not bound.
+int uvx__index_unbind(uvx_index_t* index, uvx_index_node_t** bindings, int64_t ikey, const char* skey) {
+    uvx_index_entry_t* entry = _uvx_index_lookup(index, ikey, skey);
+    if(entry == NULL)
+        return 0;
+    for(uvx_index_node_t** p = bindings; *p; p = &(*p)->conn_next) {
+        if((*p)->entry == entry) {
+            uvx_index_node_t* node = *p;
+            *p = node->conn_next;
+            _uvx_index_remove(index, node);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// unbinds conn from all keys
+void uvx__index_unbind_all(uvx_index_t* index, uvx_index_node_t** bindings) {
+    while(*bindings) {
+        uvx_index_node_t* node = *bindings;
+        *bindings = node->conn_next;
+        _uvx_index_remove(index, node);
+    }
+}
+
+// returns the first binding of the key (the most recent), or NULL, see uvx__index_next()
+uvx_index_node_t* uvx__index_find(uvx_index_t* index, int64_t ikey, const char* skey) {
+    uvx_index_entry_t* entry = _uvx_index_lookup(index, ikey, skey);
+    return (entry ? entry->head : NULL);
+}
+
+// returns the connection of `*node`, and moves it to the next binding of the key, or NULL.
+// the connection can be unbound from the key before the next call.
+void* uvx__index_next(uvx_index_node_t** node) {
+    void* conn = (*node)->conn;
+    *node = (*node)->next;
+    return conn;
+}
@@ -57,6 +57,10 @@ int uvx_log_send_bin(uvx_log_t* xlog, int level, const char* tags,
 	return uvx_udp_send_to_addr(&xlog->xudp, &xlog->target_addr.addr, buf, size);
 }
 
+void uvx_log_stats(uvx_log_t* xlog, uvx_stats_t* stats) {
+    uvx_udp_stats(&xlog->xudp, stats);
+}
+
 UVXLOG_INLINE
 int uvx_log_send_serialized(uvx_log_t* xlog, const void* data, unsigned int datalen) {
     return uvx_udp_send_to_addr(&xlog->xudp, &xlog->target_addr.addr, data, datalen);
@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+
+#include "uvx.h"
+#include "utils/automem.h"
+#include "utils/atomic.h"
+
+// uvx metrics: serves stats of uvx instances in Prometheus text format.
+
+// defines in uvx.c
+void uvx__stats_tick(uvx_stats_t* stats, uint64_t now_ms);
+
+enum { UVX_METRICS_SERVER = 1, UVX_METRICS_CLIENT, UVX_METRICS_UDP, UVX_METRICS_LOG };
+
+static const char* _uvx_metrics_kinds[] = { "", "xserver", "xclient", "xudp", "xlog" };
+
+typedef struct uvx_metric_def_s {
+    const char* name;
+    const char* type; // "counter" or "gauge"
+    const char* help;
+    size_t offset;    // offset inside uvx_stats_t (or uvx_client_t for _uvx_client_metric_defs)
+    int is_double;
+} uvx_metric_def_t;
+
+#define UVX_METRIC_U64(name,type,field,help) { name, type, help, offsetof(uvx_stats_t, field), 0 }
+#define UVX_METRIC_DBL(name,field,help)      { name, "gauge", help, offsetof(uvx_stats_t, field), 1 }
+
+static const uvx_metric_def_t _uvx_metric_defs[] = {
+    UVX_METRIC_U64("uvx_bytes_in_total",      "counter", bytes_in,          "Bytes received."),
+    UVX_METRIC_U64("uvx_bytes_out_total",     "counter", bytes_out,         "Bytes sent."),
+    UVX_METRIC_U64("uvx_msgs_in_total",       "counter", msgs_in,           "Reads or datagrams received."),
+    UVX_METRIC_U64("uvx_msgs_out_total",      "counter", msgs_out,          "Writes or datagrams sent."),
+    UVX_METRIC_U64("uvx_send_failures_total", "counter", send_failures,     "Sends failed or canceled."),
+    UVX_METRIC_U64("uvx_write_queue_count",   "gauge",   write_queue_count, "Sends queued but not completed."),
+    UVX_METRIC_U64("uvx_write_queue_bytes",   "gauge",   write_queue_bytes, "Bytes queued but not completed."),
+    UVX_METRIC_U64("uvx_accepts_total",       "counter", accepts,           "Connections accepted or established."),
+    UVX_METRIC_U64("uvx_closes_total",        "counter", closes,            "Connections closed."),
+    UVX_METRIC_U64("uvx_timeouts_total",      "counter", timeouts,          "Connections closed for long time silence."),
+    UVX_METRIC_U64("uvx_loop_lag_ms",         "gauge",   loop_lag_ms,       "Delay of the last heartbeat timer."),
+    UVX_METRIC_U64("uvx_loop_lag_max_ms",     "gauge",   loop_lag_max_ms,   "Max delay of the heartbeat timer."),
+    UVX_METRIC_DBL("uvx_bytes_in_rate",       bytes_in_rate,  "Bytes received per second in the last interval."),
+    UVX_METRIC_DBL("uvx_bytes_out_rate",      bytes_out_rate, "Bytes sent per second in the last interval."),
+    UVX_METRIC_DBL("uvx_msgs_in_rate",        msgs_in_rate,   "Reads or datagrams received per second in the last interval."),
+    UVX_METRIC_DBL("uvx_msgs_out_rate",       msgs_out_rate,  "Writes or datagrams sent per second in the last interval."),
+};
+
+// counters of xclients only
+#define UVX_CLIENT_METRIC(name,field,help)   { name, "counter", help, offsetof(uvx_client_t, field), 0 }
+
+static const uvx_metric_def_t _uvx_client_metric_defs[] = {
+    UVX_CLIENT_METRIC("uvx_reconnect_attempts_total",     reconnect_attempts,          "Reconnects started."),
+    UVX_CLIENT_METRIC("uvx_pending_queued_bytes_total",   pending_stats.queued_bytes,  "Bytes queued while disconnected."),
+    UVX_CLIENT_METRIC("uvx_pending_flushed_bytes_total",  pending_stats.flushed_bytes, "Queued bytes flushed after connected."),
+    UVX_CLIENT_METRIC("uvx_pending_dropped_bytes_total",  pending_stats.dropped_bytes, "Queued bytes dropped."),
+};
+
+static void _uvx_metrics_snapshot(uvx_metrics_t* metrics, int i, uvx_stats_t* stats, const char** name) {
+    void* instance = metrics->items[i].instance;
+    switch(metrics->items[i].kind) {
+    case UVX_METRICS_SERVER:
+        uvx_server_stats((uvx_server_t*)instance, stats);
+        *name = ((uvx_server_t*)instance)->config.name;
+        break;
+    case UVX_METRICS_CLIENT:
+        uvx_client_stats((uvx_client_t*)instance, stats);
+        *name = ((uvx_client_t*)instance)->config.name;
+        break;
+    case UVX_METRICS_UDP:
+        uvx_udp_stats((uvx_udp_t*)instance, stats);
+        *name = ((uvx_udp_t*)instance)->config.name;
+        break;
+    case UVX_METRICS_LOG:
+        uvx_log_stats((uvx_log_t*)instance, stats);
+        *name = ((uvx_log_t*)instance)->loge.name;
+        break;
+    default:
+        assert(0);
+    }
+}
+
+// appends `name` as a Prometheus label value, escaping '\\', '"' and '\n'
+static void _uvx_metrics_append_label(automem_t* out, const char* name) {
+    for(; *name; name++) {
+        if(*name == '\\' || *name == '"')
+            automem_append_char(out, '\\');
+        if(*name == '\n')
+            automem_append_voidp(out, "\\n", 2);
+        else
+            automem_append_char(out, *name);
+    }
+}
+
+unsigned int uvx_metrics_format(uvx_metrics_t* metrics, automem_t* out) {
+    unsigned int old_size = out->size;
+    uvx_stats_t stats[UVX_METRICS_MAX];
+    const char* names[UVX_METRICS_MAX];
+    for(int i = 0; i < metrics->count; i++)
+        _uvx_metrics_snapshot(metrics, i, &stats[i], &names[i]);
+
+    char line[256];
+    for(size_t m = 0; m < sizeof(_uvx_metric_defs) / sizeof(_uvx_metric_defs[0]); m++) {
+        const uvx_metric_def_t* def = &_uvx_metric_defs[m];
+        int n = snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", def->name, def->help, def->name, def->type);
+        automem_append_voidp(out, line, n);
+        for(int i = 0; i < metrics->count; i++) {
+            const char* value = (const char*)&stats[i] + def->offset;
+            n = snprintf(line, sizeof(line), "%s{kind=\"%s\",name=\"", def->name, _uvx_metrics_kinds[metrics->items[i].kind]);
+            automem_append_voidp(out, line, n);
+            _uvx_metrics_append_label(out, names[i]);
+            if(def->is_double)
+                n = snprintf(line, sizeof(line), "\"} %.3f\n", *(const double*)value);
+            else
+                n = snprintf(line, sizeof(line), "\"} %llu\n", (unsigned long long) *(const uint64_t*)value);
+            automem_append_voidp(out, line, n);
+        }
+    }
+    // connections of xservers
+    automem_append_voidp(out, "# HELP uvx_connections Live connections.\n# TYPE uvx_connections gauge\n", 70);
+    for(int i = 0; i < metrics->count; i++) {
+        if(metrics->items[i].kind != UVX_METRICS_SERVER)
+            continue;
+        automem_append_voidp(out, "uvx_connections{kind=\"xserver\",name=\"", 37);
+        _uvx_metrics_append_label(out, names[i]);
+        int n = snprintf(line, sizeof(line), "\"} %d\n", uvx_server_iter_conns((uvx_server_t*)metrics->items[i].instance, NULL, NULL));
+        automem_append_voidp(out, line, n);
+    }
+    // reconnects and pending sends of xclients
+    for(size_t m = 0; m < sizeof(_uvx_client_metric_defs) / sizeof(_uvx_client_metric_defs[0]); m++) {
+        const uvx_metric_def_t* def = &_uvx_client_metric_defs[m];
+        int n = snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", def->name, def->help, def->name, def->type);
+        automem_append_voidp(out, line, n);
+        for(int i = 0; i < metrics->count; i++) {
+            if(metrics->items[i].kind != UVX_METRICS_CLIENT)
+                continue;
+            uint64_t* value = (uint64_t*)((char*)metrics->items[i].instance + def->offset);
+            n = snprintf(line, sizeof(line), "%s{kind=\"xclient\",name=\"", def->name);
+            automem_append_voidp(out, line, n);
+            _uvx_metrics_append_label(out, names[i]);
+            n = snprintf(line, sizeof(line), "\"} %llu\n", (unsigned long long) uvx_atomic_load_u64(value));
+            automem_append_voidp(out, line, n);
+        }
+    }
+    return out->size - old_size;
+}
+
+static void _uvx_metrics_on_recv(uvx_server_t* xserver, uvx_server_conn_t* conn, void* data, ssize_t datalen) {
+    uvx_metrics_t* metrics = (uvx_metrics_t*) xserver->data;
+    // wait for the end of HTTP request header
+    const char* end = NULL;
+    for(ssize_t i = 3; i < datalen; i++) {
+        if(memcmp((const char*)data + i - 3, "\r\n\r\n", 4) == 0) {
+            end = (const char*)data + i + 1;
+            break;
+        }
+    }
+    if(end == NULL) {
+        if(datalen > 8192)
+            uvx_server_conn_shutdown(conn); // too large
+        return;
+    }
+    uvx_server_conn_consume(conn, (unsigned int)datalen);
+
+    automem_t body, mem;
+    automem_init(&body, 4096);
+    uvx_metrics_format(metrics, &body);
+    automem_init(&mem, body.size + 128);
+    char header[128];
+    int n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                             "Content-Length: %u\r\nConnection: close\r\n\r\n", body.size);
+    automem_append_voidp(&mem, header, n);
+    automem_append_voidp(&mem, body.pdata, body.size);
+    automem_uninit(&body);
+    uvx_server_conn_send(conn, mem.pdata, mem.size); // mem.pdata will be free-ed later
+    uvx_server_conn_shutdown(conn);
+}
+
+// computes rates of xudps/xlogs, which have no heartbeat
+static void _uvx_metrics_on_heartbeat(uvx_server_t* xserver, unsigned int index) {
+    uvx_metrics_t* metrics = (uvx_metrics_t*) xserver->data;
+    uint64_t now = uv_now(xserver->uvloop);
+    for(int i = 0; i < metrics->count; i++) {
+        if(metrics->items[i].kind == UVX_METRICS_UDP)
+            uvx__stats_tick(&((uvx_udp_t*)metrics->items[i].instance)->stats, now);
+        else if(metrics->items[i].kind == UVX_METRICS_LOG)
+            uvx__stats_tick(&((uvx_log_t*)metrics->items[i].instance)->xudp.stats, now);
+    }
+}
+
+int uvx_metrics_start(uvx_metrics_t* metrics, uv_loop_t* loop, const char* ip, int port, float interval_seconds) {
+    assert(metrics && loop && ip);
+    metrics->count = 0;
+    uvx_server_config_t config = uvx_server_default_config(&metrics->xserver);
+    snprintf(config.name, sizeof(config.name), "xmetrics-%p", metrics);
+    config.conn_count = 16;
+    config.conn_timeout_seconds = 30.0;
+    config.heartbeat_interval_seconds = interval_seconds;
+    config.accumulate_recv = 1;
+    config.on_recv = _uvx_metrics_on_recv;
+    config.on_heartbeat = _uvx_metrics_on_heartbeat;
+    metrics->xserver.data = metrics;
+    return uvx_server_start(&metrics->xserver, loop, ip, port, config);
+}
+
+static int _uvx_metrics_add(uvx_metrics_t* metrics, int kind, void* instance) {
+    if(metrics->count >= UVX_METRICS_MAX)
+        return 0;
+    metrics->items[metrics->count].kind = kind;
+    metrics->items[metrics->count].instance = instance;
+    metrics->count++;
+    return 1;
+}
+
+int uvx_metrics_add_server(uvx_metrics_t* metrics, uvx_server_t* xserver) {
+    return _uvx_metrics_add(metrics, UVX_METRICS_SERVER, xserver);
+}
+
+int uvx_metrics_add_client(uvx_metrics_t* metrics, uvx_client_t* xclient) {
+    return _uvx_metrics_add(metrics, UVX_METRICS_CLIENT, xclient);
+}
+
+int uvx_metrics_add_udp(uvx_metrics_t* metrics, uvx_udp_t* xudp) {
+    return _uvx_metrics_add(metrics, UVX_METRICS_UDP, xudp);
+}
+
+int uvx_metrics_add_log(uvx_metrics_t* metrics, uvx_log_t* xlog) {
+    return _uvx_metrics_add(metrics, UVX_METRICS_LOG, xlog);
+}
+
+int uvx_metrics_shutdown(uvx_metrics_t* metrics) {
+    metrics->count = 0;
+    return uvx_server_shutdown(&metrics->xserver);
+}
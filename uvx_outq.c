@@ -0,0 +1,263 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "uvx.h"
+#include "utils/atomic.h"
+
+// uvx prioritized outbound queue of a connection, see uvx_server_conn_send_prio().
+//
+// messages wait in per-class queues, and only one batch of them is written by uv_write() at a time, so a message
+// of higher class jumps ahead of all queued lower ones, waiting for the batch in flight at most. messages are never
+// split, to keep them intact in the byte stream. if `starve_bytes` of higher classes were written while a lower
+// class was waiting, its next message is promoted ahead of them, so it won't be starved.
+
+// defines in uvx_event.c
+void uvx__event(int level, const char* tag, const char* fmt, ...);
+
+#define UVX_OUTQ_BATCH_BUFS  16    // max messages of a batch
+#define UVX_OUTQ_BATCH_BYTES 65536 // a batch stops growing after this size, unless it's one message
+
+typedef struct uvx_outq_msg_s {
+    struct uvx_outq_msg_s* next;
+    char* data;         // owned
+    unsigned int size;
+    uint64_t time;      // uv_hrtime() when queued
+} uvx_outq_msg_t;
+
+typedef struct uvx_outq_class_s {
+    uvx_outq_msg_t *head, *tail;
+    uint64_t skipped;   // bytes of higher classes written since its head was waiting
+} uvx_outq_class_t;
+
+typedef struct uvx_outq_s {
+    uv_stream_t* stream; // NULL after closed
+    uvx_stats_t* stats;
+    uvx_histogram_t* latency; // can be NULL
+    uvx_send_class_stats_t* totals; // of all connections, can be NULL
+    uvx_send_class_stats_t classes[UVX_SEND_CLASSES];
+    uvx_outq_class_t queues[UVX_SEND_CLASSES];
+    unsigned int starve_bytes; // 0: strict priority
+    int writing;        // 1 if a batch is being written
+    int shutdown;       // 1: shutdown writing after all sent
+} uvx_outq_t;
+
+typedef struct uvx_outq_write_s {
+    uv_write_t w;
+    uvx_outq_t* q;
+    unsigned int count, size;
+    uv_buf_t bufs[UVX_OUTQ_BATCH_BUFS];
+    uint64_t times[UVX_OUTQ_BATCH_BUFS];
+} uvx_outq_write_t;
+
+static void _uvx_outq_pump(uvx_outq_t* q);
+
+// the stream must be a connected tcp or pipe
+uvx_outq_t* uvx__outq_new(uv_stream_t* stream, uvx_stats_t* stats, uvx_histogram_t* latency,
+                          uvx_send_class_stats_t* totals, unsigned int starve_bytes) {
+    uvx_outq_t* q = (uvx_outq_t*) uvx_calloc(1, sizeof(uvx_outq_t));
+    q->stream = stream;
+    q->stats = stats;
+    q->latency = latency;
+    q->totals = totals;
+    q->starve_bytes = starve_bytes;
+    return q;
+}
+
+// returns 1 if it has messages queued or being written
+int uvx__outq_active(uvx_outq_t* q) {
+    if(q == NULL || q->stream == NULL)
+        return 0;
+    if(q->writing)
+        return 1;
+    for(int i = 0; i < UVX_SEND_CLASSES; i++) {
+        if(q->queues[i].head)
+            return 1;
+    }
+    return 0;
+}
+
+static void _uvx_outq_count(uvx_outq_t* q, int prio, int64_t count, int64_t bytes) {
+    q->classes[prio].queued_count += count;
+    q->classes[prio].queued_bytes += bytes;
+    if(q->totals) {
+        q->totals[prio].queued_count += count;
+        q->totals[prio].queued_bytes += bytes;
+    }
+}
+
+// queues data of class `prio`, and frees it after written. returns 0 on failure.
+int uvx__outq_send(uvx_outq_t* q, void* data, unsigned int size, int prio) {
+    if(prio < 0)
+        prio = 0;
+    if(prio >= UVX_SEND_CLASSES)
+        prio = UVX_SEND_CLASSES - 1;
+    if(q->stream == NULL || q->shutdown) {
+        uvx_atomic_add1w_u64(&q->stats->send_failures, 1);
+        uvx_free(data);
+        return 0;
+    }
+    uvx_outq_msg_t* msg = (uvx_outq_msg_t*) uvx_malloc(sizeof(uvx_outq_msg_t));
+    msg->next = NULL;
+    msg->data = (char*) data;
+    msg->size = size;
+    msg->time = uv_hrtime();
+    uvx_outq_class_t* c = &q->queues[prio];
+    if(c->tail)
+        c->tail->next = msg;
+    else
+        c->head = msg;
+    c->tail = msg;
+    _uvx_outq_count(q, prio, 1, size);
+    uvx_atomic_add1w_u64(&q->stats->write_queue_count, 1);
+    uvx_atomic_add1w_u64(&q->stats->write_queue_bytes, size);
+    _uvx_outq_pump(q);
+    return 1;
+}
+
+// returns the class to write next: the highest one, unless a lower one waited for starve_bytes
+static int _uvx_outq_pick(uvx_outq_t* q) {
+    int prio = -1;
+    for(int i = 0; i < UVX_SEND_CLASSES; i++) {
+        if(q->queues[i].head == NULL)
+            continue;
+        if(prio < 0) {
+            prio = i;
+        } else if(q->starve_bytes && q->queues[i].skipped >= q->starve_bytes) {
+            q->classes[i].promoted_count++;
+            if(q->totals)
+                q->totals[i].promoted_count++;
+            return i;
+        }
+    }
+    return prio;
+}
+
+static void _uv_after_outq_write(uv_write_t* w, int status) {
+    uvx_outq_write_t* req = (uvx_outq_write_t*) w;
+    uvx_outq_t* q = req->q;
+    uvx_stats_t* stats = q->stats;
+    uint64_t now = uv_hrtime();
+    if(status)
+        uvx__event(UVX_LOG_WARN, "uvx-outq", "write failed or canceled: %s", uv_strerror(status));
+    uvx_atomic_add1w_u64(&stats->write_queue_count, (uint64_t)0 - req->count);
+    uvx_atomic_add1w_u64(&stats->write_queue_bytes, (uint64_t)0 - req->size);
+    if(status == 0) {
+        uvx_atomic_add1w_u64(&stats->msgs_out, req->count);
+        uvx_atomic_add1w_u64(&stats->bytes_out, req->size);
+    } else {
+        uvx_atomic_add1w_u64(&stats->send_failures, req->count);
+    }
+    for(unsigned int i = 0; i < req->count; i++) {
+        if(status == 0 && q->latency)
+            uvx_histogram_record(q->latency, (now - req->times[i]) / 1000);
+        uvx_free(req->bufs[i].base);
+    }
+    uvx_free(req);
+    q->writing = 0;
+    if(q->stream == NULL)
+        uvx_free(q); // closed while writing
+    else
+        _uvx_outq_pump(q);
+}
+
+static void _uv_after_outq_shutdown(uv_shutdown_t* req, int status) {
+    uvx_free(req); // the connection will be closed on EOF or timeout
+}
+
+// writes the next batch, if not writing
+static void _uvx_outq_pump(uvx_outq_t* q) {
+    if(q->writing || q->stream == NULL)
+        return;
+    uvx_outq_write_t* req = NULL;
+    uint64_t now = uv_hrtime();
+    int prio;
+    while((req == NULL || (req->count < UVX_OUTQ_BATCH_BUFS && req->size < UVX_OUTQ_BATCH_BYTES))
+          && (prio = _uvx_outq_pick(q)) >= 0) {
+        if(req == NULL) {
+            req = (uvx_outq_write_t*) uvx_malloc(sizeof(uvx_outq_write_t));
+            req->q = q;
+            req->count = req->size = 0;
+        }
+        uvx_outq_class_t* c = &q->queues[prio];
+        uvx_outq_msg_t* msg = c->head;
+        c->head = msg->next;
+        if(c->head == NULL)
+            c->tail = NULL;
+        c->skipped = 0;
+        for(int i = prio + 1; i < UVX_SEND_CLASSES; i++) {
+            if(q->queues[i].head)
+                q->queues[i].skipped += msg->size;
+        }
+        _uvx_outq_count(q, prio, -1, -(int64_t) msg->size);
+        uvx_send_class_stats_t* cs = &q->classes[prio];
+        uint64_t wait = (now - msg->time) / 1000;
+        cs->sent_count++;
+        cs->sent_bytes += msg->size;
+        if(wait > cs->wait_time_max_us)
+            cs->wait_time_max_us = wait;
+        if(q->totals) {
+            q->totals[prio].sent_count++;
+            q->totals[prio].sent_bytes += msg->size;
+            if(wait > q->totals[prio].wait_time_max_us)
+                q->totals[prio].wait_time_max_us = wait;
+        }
+        req->bufs[req->count] = uv_buf_init(msg->data, msg->size);
+        req->times[req->count] = msg->time;
+        req->count++;
+        req->size += msg->size;
+        uvx_free(msg);
+    }
+    if(req == NULL) {
+        if(q->shutdown) {
+            q->shutdown = 0;
+            uv_shutdown_t* sreq = (uv_shutdown_t*) uvx_malloc(sizeof(uv_shutdown_t));
+            if(uv_shutdown(sreq, q->stream, _uv_after_outq_shutdown) != 0)
+                uvx_free(sreq);
+        }
+        return;
+    }
+    int r = uv_write(&req->w, q->stream, req->bufs, req->count, _uv_after_outq_write);
+    if(r != 0) {
+        uvx__event(UVX_LOG_WARN, "uvx-outq", "write failed: %s", uv_strerror(r));
+        q->writing = 1;
+        _uv_after_outq_write(&req->w, r); // pumps the next batch, which may fail again
+        return;
+    }
+    q->writing = 1;
+}
+
+// shuts down writing after all messages sent. returns 0 on failure.
+int uvx__outq_shutdown(uvx_outq_t* q) {
+    if(q->stream == NULL || q->shutdown)
+        return 0;
+    q->shutdown = 1;
+    _uvx_outq_pump(q);
+    return 1;
+}
+
+// copies the stats of each class
+void uvx__outq_stats(uvx_outq_t* q, uvx_send_class_stats_t* stats) {
+    memcpy(stats, q->classes, sizeof(q->classes));
+}
+
+// drops messages not written, before the stream is closed. q is freed now, or after the batch in flight.
+void uvx__outq_close(uvx_outq_t* q) {
+    for(int i = 0; i < UVX_SEND_CLASSES; i++) {
+        while(q->queues[i].head) {
+            uvx_outq_msg_t* msg = q->queues[i].head;
+            q->queues[i].head = msg->next;
+            _uvx_outq_count(q, i, -1, -(int64_t) msg->size);
+            uvx_atomic_add1w_u64(&q->stats->write_queue_count, (uint64_t)-1);
+            uvx_atomic_add1w_u64(&q->stats->write_queue_bytes, (uint64_t)0 - msg->size);
+            uvx_atomic_add1w_u64(&q->stats->send_failures, 1);
+            uvx_free(msg->data);
+            uvx_free(msg);
+        }
+        q->queues[i].tail = NULL;
+    }
+    q->stream = NULL;
+    if(!q->writing)
+        uvx_free(q);
+}
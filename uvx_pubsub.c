@@ -0,0 +1,414 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "uvx.h"
+#include "utils/atomic.h"
+
+// uvx topic router of connections, see uvx_server_publish().
+//
+// topics are indexed in a trie of characters (first-child/next-sibling nodes, so a node is a few pointers), a
+// subscription is linked at the node of its topic, as an exact one, or a prefix one if the topic ends with '*'.
+// a publish walks the trie along its topic once, collecting prefix subscriptions on the way, and exact ones at the
+// end. its data is shared (refcounted) by all deliveries, which are queued per connection and written by one
+// vectored write per connection in the next loop iteration, before polling for I/O.
+
+// defines in uvx_event.c
+void uvx__event(int level, const char* tag, const char* fmt, ...);
+
+// returns 1 if conn can be written directly, 0 if it must send copies by `send`, or -1 to skip it
+typedef int (*UVX_PUBSUB_ROUTE)(void* conn);
+typedef int (*UVX_PUBSUB_SEND)(void* conn, void* data, unsigned int size);
+
+// the data of a publish, shared by its deliveries
+typedef struct uvx_pub_s {
+    unsigned int refs;
+    unsigned int size;
+    char* data;     // owned
+    uint64_t time;  // uv_hrtime() when published, only set if latency != NULL
+} uvx_pub_t;
+
+typedef struct uvx_topic_node_s {
+    struct uvx_topic_node_s *parent, *child, *sibling;
+    struct uvx_sub_s* exact;  // subscriptions of the topic
+    struct uvx_sub_s* prefix; // subscriptions of topics starting with it
+    char c;
+} uvx_topic_node_t;
+
+typedef struct uvx_sub_s {
+    uvx_topic_node_t* node;
+    struct uvx_pubsub_conn_s* pc;
+    int prefix;
+    struct uvx_sub_s *prev, *next; // in node's list
+    struct uvx_sub_s* conn_next;   // in connection's list
+} uvx_sub_t;
+
+typedef struct uvx_pubsub_conn_s {
+    struct uvx_pubsub_s* ps;
+    void* conn;
+    uv_stream_t* stream;
+    uvx_sub_t* subs;
+    uint64_t seq;        // of the last publish delivered to, so a publish matching many subscriptions is delivered once
+    uvx_pub_t** pending; // deliveries not written yet
+    unsigned int count, cap;
+    int queued;          // 1 if in ps->flushes
+    struct uvx_pubsub_conn_s* flush_next;
+} uvx_pubsub_conn_t;
+
+typedef struct uvx_pubsub_s {
+    uvx_topic_node_t root;
+    uv_prepare_t prepare; // flushes deliveries before polling for I/O
+    uvx_pubsub_conn_t* flushes; // connections with pending deliveries
+    uint64_t seq;
+    uvx_stats_t* stats;
+    uvx_histogram_t* latency; // can be NULL
+    UVX_PUBSUB_ROUTE route;
+    UVX_PUBSUB_SEND send;
+    uv_buf_t* bufs;       // scratch of flushes
+    unsigned int bufs_cap;
+    uv_close_cb on_close;
+    void* close_data;
+} uvx_pubsub_t;
+
+// the write request of deliveries, followed by `count` pubs
+typedef struct uvx_pub_write_s {
+    uv_write_t w;
+    uvx_pubsub_t* ps;
+    unsigned int count, size;
+    uvx_pub_t* pubs[1];
+} uvx_pub_write_t;
+
+static void _uv_on_pubsub_prepare(uv_prepare_t* handle);
+
+uvx_pubsub_t* uvx__pubsub_new(uv_loop_t* loop, uvx_stats_t* stats, uvx_histogram_t* latency,
+                              UVX_PUBSUB_ROUTE route, UVX_PUBSUB_SEND send) {
+    uvx_pubsub_t* ps = (uvx_pubsub_t*) uvx_calloc(1, sizeof(uvx_pubsub_t));
+    ps->stats = stats;
+    ps->latency = latency;
+    ps->route = route;
+    ps->send = send;
+    uv_prepare_init(loop, &ps->prepare);
+    ps->prepare.data = ps;
+    uv_prepare_start(&ps->prepare, _uv_on_pubsub_prepare);
+    uv_unref((uv_handle_t*) &ps->prepare);
+    return ps;
+}
+
+static void _uvx_pub_release(uvx_pub_t* pub) {
+    if(--pub->refs == 0) {
+        uvx_free(pub->data);
+        uvx_free(pub);
+    }
+}
+
+static void _uv_after_pubsub_close(uv_handle_t* handle) {
+    uvx_pubsub_t* ps = (uvx_pubsub_t*) handle->data;
+    handle->data = ps->close_data;
+    if(ps->on_close)
+        ps->on_close(handle);
+    uvx_free(ps->bufs);
+    uvx_free(ps);
+}
+
+// all connections should be freed before. calls on_close(handle) with handle->data == data, then frees ps.
+void uvx__pubsub_close(uvx_pubsub_t* ps, void* data, uv_close_cb on_close) {
+    assert(ps->root.child == NULL && ps->root.exact == NULL && ps->root.prefix == NULL);
+    ps->on_close = on_close;
+    ps->close_data = data;
+    uv_prepare_stop(&ps->prepare);
+    uv_close((uv_handle_t*) &ps->prepare, _uv_after_pubsub_close);
+}
+
+// returns the node of topic `len` bytes, creates it (and its parents) if `create`, or NULL
+static uvx_topic_node_t* _uvx_topic_node(uvx_pubsub_t* ps, const char* topic, size_t len, int create) {
+    uvx_topic_node_t* node = &ps->root;
+    for(size_t i = 0; i < len; i++) {
+        uvx_topic_node_t* child = node->child;
+        while(child && child->c != topic[i])
+            child = child->sibling;
+        if(child == NULL) {
+            if(!create)
+                return NULL;
+            child = (uvx_topic_node_t*) uvx_calloc(1, sizeof(uvx_topic_node_t));
+            child->c = topic[i];
+            child->parent = node;
+            child->sibling = node->child;
+            node->child = child;
+        }
+        node = child;
+    }
+    return node;
+}
+
+// frees the node and its parents which have no subscriptions and children
+static void _uvx_topic_prune(uvx_topic_node_t* node) {
+    while(node->parent && node->child == NULL && node->exact == NULL && node->prefix == NULL) {
+        uvx_topic_node_t* parent = node->parent;
+        uvx_topic_node_t** p = &parent->child;
+        while(*p != node)
+            p = &(*p)->sibling;
+        *p = node->sibling;
+        uvx_free(node);
+        node = parent;
+    }
+}
+
+// returns the node of pattern, and whether it's a prefix (ends with '*')
+static uvx_topic_node_t* _uvx_pattern_node(uvx_pubsub_t* ps, const char* pattern, int* prefix, int create) {
+    size_t len = strlen(pattern);
+    *prefix = (len > 0 && pattern[len - 1] == '*');
+    if(*prefix)
+        len--;
+    return _uvx_topic_node(ps, pattern, len, create);
+}
+
+// returns the pubsub state of conn `*pc`, creates it if NULL
+static uvx_pubsub_conn_t* _uvx_pubsub_conn(uvx_pubsub_t* ps, uvx_pubsub_conn_t** pc, void* conn, uv_stream_t* stream) {
+    if(*pc == NULL) {
+        *pc = (uvx_pubsub_conn_t*) uvx_calloc(1, sizeof(uvx_pubsub_conn_t));
+        (*pc)->ps = ps;
+        (*pc)->conn = conn;
+        (*pc)->stream = stream;
+    }
+    return *pc;
+}
+
+// subscribes conn to the topic, or topics starting with it if it ends with '*'. `*pc` is the state of conn.
+// returns 0 if the topic is empty.
+int uvx__pubsub_subscribe(uvx_pubsub_t* ps, uvx_pubsub_conn_t** pc, void* conn, uv_stream_t* stream, const char* topic) {
+    int prefix;
+    if(topic == NULL || topic[0] == '\0')
+        return 0;
+    uvx_topic_node_t* node = _uvx_pattern_node(ps, topic, &prefix, 1);
+    uvx_pubsub_conn_t* c = _uvx_pubsub_conn(ps, pc, conn, stream);
+    for(uvx_sub_t* sub = c->subs; sub; sub = sub->conn_next) {
+        if(sub->node == node && sub->prefix == prefix)
+            return 1; // subscribed already
+    }
+    uvx_sub_t* sub = (uvx_sub_t*) uvx_malloc(sizeof(uvx_sub_t));
+    uvx_sub_t** head = (prefix ? &node->prefix : &node->exact);
+    sub->node = node;
+    sub->pc = c;
+    sub->prefix = prefix;
+    sub->prev = NULL;
+    sub->next = *head;
+    if(*head)
+        (*head)->prev = sub;
+    *head = sub;
+    sub->conn_next = c->subs;
+    c->subs = sub;
+    return 1;
+}
+
+static void _uvx_pubsub_remove(uvx_sub_t* sub) {
+    uvx_topic_node_t* node = sub->node;
+    if(sub->prev)
+        sub->prev->next = sub->next;
+    else if(sub->prefix)
+        node->prefix = sub->next;
+    else
+        node->exact = sub->next;
+    if(sub->next)
+        sub->next->prev = sub->prev;
+    uvx_free(sub);
+    _uvx_topic_prune(node);
+}
+
+// unsubscribes conn from the topic (as subscribed), or all topics if topic is NULL.
+// returns 0 if it was not subscribed.
+int uvx__pubsub_unsubscribe(uvx_pubsub_t* ps, uvx_pubsub_conn_t* pc, const char* topic) {
+    if(pc == NULL)
+        return 0;
+    if(topic == NULL) {
+        int n = (pc->subs != NULL);
+        while(pc->subs) {
+            uvx_sub_t* sub = pc->subs;
+            pc->subs = sub->conn_next;
+            _uvx_pubsub_remove(sub);
+        }
+        return n;
+    }
+    int prefix;
+    uvx_topic_node_t* node = _uvx_pattern_node(ps, topic, &prefix, 0);
+    if(node == NULL)
+        return 0;
+    for(uvx_sub_t** p = &pc->subs; *p; p = &(*p)->conn_next) {
+        if((*p)->node == node && (*p)->prefix == prefix) {
+            uvx_sub_t* sub = *p;
+            *p = sub->conn_next;
+            _uvx_pubsub_remove(sub);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// drops deliveries not written, e.g. the connection is closing
+void uvx__pubsub_drop(uvx_pubsub_conn_t* pc) {
+    if(pc == NULL || pc->count == 0)
+        return;
+    uvx_atomic_add1w_u64(&pc->ps->stats->send_failures, pc->count);
+    for(unsigned int i = 0; i < pc->count; i++)
+        _uvx_pub_release(pc->pending[i]);
+    pc->count = 0;
+}
+
+// unsubscribes all topics, drops deliveries not written, and frees the state of conn
+void uvx__pubsub_conn_free(uvx_pubsub_t* ps, uvx_pubsub_conn_t** pc) {
+    if(*pc == NULL)
+        return;
+    uvx__pubsub_unsubscribe(ps, *pc, NULL);
+    uvx__pubsub_drop(*pc);
+    if((*pc)->queued) {
+        uvx_pubsub_conn_t** p = &ps->flushes;
+        while(*p != *pc)
+            p = &(*p)->flush_next;
+        *p = (*pc)->flush_next;
+    }
+    uvx_free((*pc)->pending);
+    uvx_free(*pc);
+    *pc = NULL;
+}
+
+static void _uv_after_pub_write(uv_write_t* w, int status) {
+    uvx_pub_write_t* req = (uvx_pub_write_t*) w;
+    uvx_stats_t* stats = req->ps->stats;
+    if(status)
+        uvx__event(UVX_LOG_WARN, "uvx-pubsub", "write failed or canceled: %s", uv_strerror(status));
+    uvx_atomic_add1w_u64(&stats->write_queue_count, (uint64_t)-1);
+    uvx_atomic_add1w_u64(&stats->write_queue_bytes, (uint64_t)0 - req->size);
+    if(status == 0) {
+        uvx_atomic_add1w_u64(&stats->msgs_out, req->count);
+        uvx_atomic_add1w_u64(&stats->bytes_out, req->size);
+    } else {
+        uvx_atomic_add1w_u64(&stats->send_failures, req->count);
+    }
+    uint64_t now = (status == 0 && req->ps->latency ? uv_hrtime() : 0);
+    for(unsigned int i = 0; i < req->count; i++) {
+        if(now)
+            uvx_histogram_record(req->ps->latency, (now - req->pubs[i]->time) / 1000);
+        _uvx_pub_release(req->pubs[i]);
+    }
+    uvx_free(req);
+}
+
+// writes the deliveries of conn, by one vectored write, or sends copies if conn can't be written directly.
+// called before sending others to conn, to keep the order.
+void uvx__pubsub_flush(uvx_pubsub_conn_t* pc) {
+    if(pc == NULL || pc->count == 0)
+        return;
+    uvx_pubsub_t* ps = pc->ps;
+    unsigned int count = pc->count;
+    pc->count = 0;
+    int route = ps->route(pc->conn);
+    if(route <= 0) {
+        for(unsigned int i = 0; i < count; i++) {
+            uvx_pub_t* pub = pc->pending[i];
+            if(route == 0) {
+                char* copy = (char*) uvx_malloc(pub->size);
+                memcpy(copy, pub->data, pub->size);
+                ps->send(pc->conn, copy, pub->size);
+            } else {
+                uvx_atomic_add1w_u64(&ps->stats->send_failures, 1);
+            }
+            _uvx_pub_release(pub);
+        }
+        return;
+    }
+    if(ps->bufs_cap < count) {
+        uvx_free(ps->bufs);
+        ps->bufs_cap = (count > 64 ? count : 64);
+        ps->bufs = (uv_buf_t*) uvx_malloc(ps->bufs_cap * sizeof(uv_buf_t));
+    }
+    uvx_pub_write_t* req = (uvx_pub_write_t*) uvx_malloc(sizeof(uvx_pub_write_t) + (count - 1) * sizeof(uvx_pub_t*));
+    req->ps = ps;
+    req->count = count;
+    req->size = 0;
+    for(unsigned int i = 0; i < count; i++) {
+        uvx_pub_t* pub = pc->pending[i];
+        req->pubs[i] = pub;
+        req->size += pub->size;
+        ps->bufs[i] = uv_buf_init(pub->data, pub->size); // uv_write() copies bufs
+    }
+    int r = uv_write(&req->w, pc->stream, ps->bufs, count, _uv_after_pub_write);
+    if(r != 0) {
+        uvx__event(UVX_LOG_WARN, "uvx-pubsub", "write failed: %s", uv_strerror(r));
+        uvx_atomic_add1w_u64(&ps->stats->send_failures, count);
+        for(unsigned int i = 0; i < count; i++)
+            _uvx_pub_release(req->pubs[i]);
+        uvx_free(req);
+        return;
+    }
+    uvx_atomic_add1w_u64(&ps->stats->write_queue_count, 1);
+    uvx_atomic_add1w_u64(&ps->stats->write_queue_bytes, req->size);
+}
+
+static void _uv_on_pubsub_prepare(uv_prepare_t* handle) {
+    uvx_pubsub_t* ps = (uvx_pubsub_t*) handle->data;
+    while(ps->flushes) {
+        uvx_pubsub_conn_t* pc = ps->flushes;
+        ps->flushes = pc->flush_next;
+        pc->flush_next = NULL;
+        pc->queued = 0;
+        uvx__pubsub_flush(pc);
+    }
+}
+
+static void _uvx_pubsub_deliver(uvx_pubsub_t* ps, uvx_sub_t* sub, uvx_pub_t* pub, unsigned int* n) {
+    for(; sub; sub = sub->next) {
+        uvx_pubsub_conn_t* pc = sub->pc;
+        if(pc->seq == ps->seq)
+            continue; // delivered by another subscription
+        pc->seq = ps->seq;
+        int route = ps->route(pc->conn);
+        if(route < 0)
+            continue;
+        if(route == 0) {
+            uvx__pubsub_flush(pc); // after the queued
+            char* copy = (char*) uvx_malloc(pub->size);
+            memcpy(copy, pub->data, pub->size);
+            *n += ps->send(pc->conn, copy, pub->size);
+            continue;
+        }
+        (*n)++;
+        if(pc->count == pc->cap) {
+            pc->cap = (pc->cap ? pc->cap * 2 : 16);
+            pc->pending = (uvx_pub_t**) uvx_realloc(pc->pending, pc->cap * sizeof(uvx_pub_t*));
+        }
+        pc->pending[pc->count++] = pub;
+        pub->refs++;
+        if(!pc->queued) {
+            pc->queued = 1;
+            pc->flush_next = ps->flushes;
+            ps->flushes = pc;
+        }
+    }
+}
+
+// delivers data to connections subscribed to the topic, frees data after all written.
+// returns the number of connections delivered to.
+unsigned int uvx__pubsub_publish(uvx_pubsub_t* ps, const char* topic, void* data, unsigned int size) {
+    uvx_pub_t* pub = (uvx_pub_t*) uvx_malloc(sizeof(uvx_pub_t));
+    pub->refs = 1; // released at the end
+    pub->size = size;
+    pub->data = (char*) data;
+    pub->time = (ps && ps->latency ? uv_hrtime() : 0);
+    unsigned int n = 0;
+    if(ps && topic) {
+        ps->seq++;
+        uvx_topic_node_t* node = &ps->root;
+        for(const char* p = topic; node; p++) {
+            _uvx_pubsub_deliver(ps, node->prefix, pub, &n);
+            if(*p == '\0') {
+                _uvx_pubsub_deliver(ps, node->exact, pub, &n);
+                break;
+            }
+            node = node->child;
+            while(node && node->c != *p)
+                node = node->sibling;
+        }
+    }
+    _uvx_pub_release(pub);
+    return n;
+}
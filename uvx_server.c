@@ -1,3 +1,7 @@
+#ifdef __linux__
+    #define _GNU_SOURCE // struct ucred
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -5,24 +9,206 @@
 #include <time.h>
 #include <assert.h>
 
+#ifndef _WIN32
+    #include <errno.h>
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+#endif
+
 #include "uvx.h"
 #include "utils/automem.h"
 #include "utils/linkhash.h"
+#include "utils/atomic.h"
 
 // Author: Liigo <liigo@qq.com>
 
+// defines in uvx_event.c
+void uvx__event(int level, const char* tag, const char* fmt, ...);
+void uvx__event_log(FILE* out, FILE* err, int level, const char* tag, const char* fmt, ...);
+
+// defines in uvx_watchdog.c
+void uvx__watch_enter(const char* callback, const char* name);
+void uvx__watch_exit(void);
+
+// defines in uvx.c
+void uvx__on_alloc_buf(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+void uvx__alloc_mem_tail(automem_t* mem, size_t size, uv_buf_t* buf);
+void uvx__recv_sizer_init(uvx_recv_sizer_t* sizer, unsigned int min, unsigned int max);
+size_t uvx__recv_sizer_size(uvx_recv_sizer_t* sizer, size_t suggested_size);
+void uvx__recv_sizer_update(uvx_recv_sizer_t* sizer, ssize_t nread);
+unsigned int uvx__consume_mem(automem_t* mem, unsigned int size, uvx_recv_sizer_t* sizer);
+int uvx__send_to_stream(uv_stream_t* stream, void* data, unsigned int size, uvx_stats_t* stats, uvx_histogram_t* latency);
+void uvx__stats_snapshot(uvx_stats_t* src, uvx_stats_t* dst);
+void uvx__stats_tick(uvx_stats_t* stats, uint64_t now_ms);
+void uvx__stats_lag(uvx_stats_t* stats, uint64_t lag_ms);
+void uvx__histogram_dump(const char* tag, const char* name, const char* what, uvx_histogram_t* h);
+const char* uvx__pipe_name(const char* endpoint);
+
+// defines in uvx_shm.c
+typedef int (*UVX_SHM_ON_MSG)(void* owner, void* data, unsigned int size);
+typedef void (*UVX_SHM_ON_FAIL)(void* owner, int fatal);
+struct uvx_shm_s* uvx__shm_new(uv_loop_t* loop, uv_stream_t* stream, unsigned int spin_us, uvx_stats_t* stats,
+                               UVX_SHM_ON_MSG on_msg, UVX_SHM_ON_FAIL on_fail, void* owner);
+int uvx__shm_is_local(uv_stream_t* stream);
+int uvx__shm_is_hello(const void* data, unsigned int size);
+int uvx__shm_on_read(struct uvx_shm_s* shm, const void* data, unsigned int size, unsigned int* used);
+int uvx__shm_send(struct uvx_shm_s* shm, void* data, unsigned int size);
+void uvx__shm_drain(struct uvx_shm_s* shm);
+void uvx__shm_close(struct uvx_shm_s* shm);
+unsigned int uvx__shm_queued(struct uvx_shm_s* shm);
+int uvx__shm_active(struct uvx_shm_s* shm);
+
+// defines in uvx_uring.c
+typedef void (*UVX_URING_ON_RECV)(void* owner, char* data, ssize_t nread);
+struct uvx_uring_s* uvx__uring_new(uv_loop_t* loop, unsigned int buf_size, UVX_URING_ON_RECV on_recv);
+void uvx__uring_close(struct uvx_uring_s* ring);
+struct uvx_uring_conn_s* uvx__uring_conn_new(struct uvx_uring_s* ring, uv_stream_t* stream, uvx_stats_t* stats, void* owner);
+int uvx__uring_send(struct uvx_uring_conn_s* uc, void* data, unsigned int size);
+int uvx__uring_shutdown(struct uvx_uring_conn_s* uc);
+void uvx__uring_conn_close(struct uvx_uring_conn_s* uc);
+unsigned int uvx__uring_queued(struct uvx_uring_conn_s* uc);
+
+// defines in uvx_bulk.c
+struct uvx_bulk_s* uvx__bulk_new(uv_stream_t* stream, uvx_stats_t* stats, struct uvx_bulk_s** pollers);
+int uvx__bulk_active(struct uvx_bulk_s* bulk);
+int uvx__bulk_send(struct uvx_bulk_s* bulk, void* data, unsigned int size, int zerocopy);
+int uvx__bulk_sendfile(struct uvx_bulk_s* bulk, uv_file fd, int64_t offset, uint64_t length);
+int uvx__bulk_shutdown(struct uvx_bulk_s* bulk);
+void uvx__bulk_poll_all(struct uvx_bulk_s** pollers, uint64_t now);
+void uvx__bulk_close(struct uvx_bulk_s* bulk, uint64_t now);
+
+// defines in uvx_outq.c
+struct uvx_outq_s* uvx__outq_new(uv_stream_t* stream, uvx_stats_t* stats, uvx_histogram_t* latency,
+                                 uvx_send_class_stats_t* totals, unsigned int starve_bytes);
+int uvx__outq_active(struct uvx_outq_s* q);
+int uvx__outq_send(struct uvx_outq_s* q, void* data, unsigned int size, int prio);
+int uvx__outq_shutdown(struct uvx_outq_s* q);
+void uvx__outq_stats(struct uvx_outq_s* q, uvx_send_class_stats_t* stats);
+void uvx__outq_close(struct uvx_outq_s* q);
+
+// defines in uvx_index.c
+struct uvx_index_node_s;
+struct uvx_index_s* uvx__index_new(int size);
+void uvx__index_free(struct uvx_index_s* index);
+int uvx__index_bind(struct uvx_index_s* index, struct uvx_index_node_s** bindings, void* conn, int64_t ikey, const char* skey);
+int uvx__index_unbind(struct uvx_index_s* index, struct uvx_index_node_s** bindings, int64_t ikey, const char* skey);
+void uvx__index_unbind_all(struct uvx_index_s* index, struct uvx_index_node_s** bindings);
+struct uvx_index_node_s* uvx__index_find(struct uvx_index_s* index, int64_t ikey, const char* skey);
+void* uvx__index_next(struct uvx_index_node_s** node);
+
+// defines in uvx_pubsub.c
+struct uvx_pubsub_conn_s;
+typedef int (*UVX_PUBSUB_ROUTE)(void* conn);
+typedef int (*UVX_PUBSUB_SEND)(void* conn, void* data, unsigned int size);
+struct uvx_pubsub_s* uvx__pubsub_new(uv_loop_t* loop, uvx_stats_t* stats, uvx_histogram_t* latency,
+                                     UVX_PUBSUB_ROUTE route, UVX_PUBSUB_SEND send);
+void uvx__pubsub_close(struct uvx_pubsub_s* ps, void* data, uv_close_cb on_close);
+int uvx__pubsub_subscribe(struct uvx_pubsub_s* ps, struct uvx_pubsub_conn_s** pc, void* conn, uv_stream_t* stream,
+                          const char* topic);
+int uvx__pubsub_unsubscribe(struct uvx_pubsub_s* ps, struct uvx_pubsub_conn_s* pc, const char* topic);
+void uvx__pubsub_drop(struct uvx_pubsub_conn_s* pc);
+void uvx__pubsub_conn_free(struct uvx_pubsub_s* ps, struct uvx_pubsub_conn_s** pc);
+void uvx__pubsub_flush(struct uvx_pubsub_conn_s* pc);
+unsigned int uvx__pubsub_publish(struct uvx_pubsub_s* ps, const char* topic, void* data, unsigned int size);
+
+// a token bucket of `rate` tokens per second, which bursts up to one second of rate, see config.*_per_second
+typedef struct uvx_bucket_s {
+    double tokens;  // negative if overdrawn
+    uint64_t time;  // uv_now() of last refill
+} uvx_bucket_t;
+
 //! Note: modify this struct along with uvx_server_t.privates!
 typedef struct uvx_server_private_s {
-    uv_timer_t heartbeat_timer; // sizeof(uv_timer_t) == 120
+    uv_timer_t heartbeat_timer;
     unsigned int heartbeat_index;
+    uint64_t heartbeat_due; // uv_now() when the heartbeat timer is expected to fire, to measure loop lag
     struct lh_table* conns; // connections of clients, hash-table of uvx_server_conn_t*
+    // read budgets, see config.read_budget_*
+    uv_check_t loop_check;  // runs at the end of each loop iteration, see _uv_on_loop_check()
+    unsigned int loop_iter; // index of current loop iteration, increased by loop_check
+    unsigned int loop_paused;
+    uint64_t loop_bytes;    // bytes read from all connections in current loop iteration
+    uvx_server_conn_t* paused_conns; // connections paused by read budgets, linked by paused_next
+    uvx_read_budget_stats_t read_budget_stats;
+    int read_budgets;       // 1 if any of config.read_budget_* is set
+    // accept limits, see config.accept_* and config.conn_max
+    uv_timer_t accept_timer;   // to accept a deferred connection later
+    unsigned int accept_iter;  // loop iteration index of accept_count
+    unsigned int accept_count; // connections accepted in current loop iteration
+    double accept_tokens;      // token bucket of config.accept_rate_per_second
+    uint64_t accept_refill_time; // uv_now() of last refilling accept_tokens
+    uvx_accept_stats_t accept_stats;
+    // latency histograms, see config.latency_*
+    uint64_t latency_dump_time; // uv_now() of last dumping latency histograms
+    uint64_t loop_check_time;   // uv_hrtime() of last loop_check, to measure loop_latency
+    uint64_t loop_idle_time;    // uv_metrics_idle_time() of last loop_check
+    int pipe;                   // 1 if listening on "unix:/path"
+    struct uvx_uring_s* uring;  // the io_uring engine, see config.io_uring, NULL if using libuv
+    struct uvx_bulk_s* bulks;   // bulks of connections waiting for zerocopy completions, see config.zerocopy_min
+    struct uvx_copy_s* copies;  // connections copying files into sends, see _uvx_conn_sendfile_copy()
+    struct uvx_handoff_s* handoff; // hot upgrade, see uvx_server_handoff_listen() and uvx_server_takeover()
+    uv_timer_t drain_timer;     // closes connections not drained in time, see uvx_server_drain()
+    int draining;               // 1: draining connections, 2: closing handles
+    int closing_handles;        // handles of xserver not closed yet, on_shutdown is called after all closed
+    UVX_S_ON_SHUTDOWN on_shutdown;
+    int rate_limits;            // 1 if any of config.*_per_second, see _uvx_check_rate_limit()
+    uvx_bucket_t bytes_bucket;  // of all connections
+    uvx_bucket_t msgs_bucket;
+    uvx_server_conn_t* limited_conns; // connections paused by rate limits, linked by limited_next
+    uv_timer_t limit_timer;     // resumes limited connections after their tokens refilled
+    uv_timer_t lag_timer;       // measures loop lag, see config.overload_lag_ms
+    uint64_t lag_due;           // uv_now() when the lag timer is expected to fire
+    int overloaded;             // 1 if loop lag exceeds config.overload_lag_ms, new connections are shed
+    uvx_send_class_stats_t send_classes[UVX_SEND_CLASSES]; // of all connections, see uvx_server_conn_send_prio()
+    struct uvx_index_s* index;  // connections by application keys, see uvx_server_conn_bind()
+    struct uvx_pubsub_s* pubsub; // the topic router, see uvx_server_publish()
 } uvx_server_private_t;
 
 #define _UVX_S_PRIVATE(x)  ((uvx_server_private_t*)(&(x)->privates))
 
+// an event written to config.log_out/log_err of the xserver if no drain target is set, see uvx_event.c
+#define _UVX_S_EVENT(x, level, ...)  uvx__event_log((x)->config.log_out, (x)->config.log_err, (level), "uvx-server", __VA_ARGS__)
+
+// the private data of connection, resides between uvx_server_conn_t and its extra data
+typedef struct uvx_server_conn_private_s {
+    unsigned int iter_index;       // loop iteration index of iter_reads and iter_bytes
+    unsigned int iter_reads;       // reads in current loop iteration
+    uint64_t iter_bytes;           // bytes read in current loop iteration
+    uint64_t paused_time;          // uv_hrtime() when paused by read budgets, 0 if not paused
+    uvx_server_conn_t* paused_next;
+    uint64_t request_time;         // uv_hrtime() of the first read of current request, see uvx_server_conn_mark_reply()
+    int shm_checked;               // 1 if the first read was checked for a hello of shared-memory transport
+    struct uvx_shm_s* shm;         // the shared-memory transport, see config.shm_enable
+    struct uvx_uring_conn_s* uring; // reads and writes through io_uring, see config.io_uring
+    struct uvx_bulk_s* bulk;       // sends of files and zerocopy buffers, see uvx_server_conn_sendfile()
+    struct uvx_copy_s* copy;       // files copied into sends by chunks, and sends after them, see _uvx_conn_sendfile_copy()
+    int handoff;                   // 1: draining before handed off to a new process, 2: handed off
+    uvx_bucket_t bytes_bucket;     // see config.conn_recv_*_per_second
+    uvx_bucket_t msgs_bucket;
+    int limited;                   // 1 if paused by rate limits
+    uvx_server_conn_t* limited_next;
+    struct uvx_outq_s* outq;       // prioritized sends, see uvx_server_conn_send_prio()
+    struct uvx_index_node_s* keys; // bindings of application keys, see uvx_server_conn_bind()
+    struct uvx_pubsub_conn_s* topics; // subscriptions and publishes not written, see uvx_server_conn_subscribe()
+} uvx_server_conn_private_t;
+
+#define _UVX_CONN_PRIVATE(conn)  ((uvx_server_conn_private_t*)((conn) + 1))
+
+// compile-time check: uvx_server_t.privates must be large enough to store uvx_server_private_t
+typedef char uvx__check_server_privates[sizeof(uvx_server_private_t) <= sizeof(((uvx_server_t*)0)->privates) ? 1 : -1];
+
 static void uvx__on_connection(uv_stream_t* uvserver, int status);
+static void _uvx_copy_poll_all(uvx_server_t* xserver);
+static void _uvx_copy_close(struct uvx_copy_s* c);
+static void _uvx_accept_conn(uvx_server_t* xserver);
+static void uvx__on_read(uv_stream_t* uvclient, ssize_t nread, const uv_buf_t* buf);
+static void _uvx_conn_on_uring_recv(void* owner, char* data, ssize_t nread);
+static void uvx__on_conn_alloc_buf(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
 static void _uv_disconnect_client(uv_stream_t* uvclient);
 static void _uv_after_close_connection(uv_handle_t* handle);
+static void _uvx_handoff_close(struct uvx_handoff_s* h);
+static int _uvx_handoff_defer_accept(struct uvx_handoff_s* h);
 
 uvx_server_config_t uvx_server_default_config(uvx_server_t* xserver) {
     uvx_server_config_t config = { 0 };
@@ -32,6 +218,10 @@ uvx_server_config_t uvx_server_default_config(uvx_server_t* xserver) {
     config.conn_extra_size = 0;
     config.conn_timeout_seconds = 180.0;
     config.heartbeat_interval_seconds = 60.0;
+    config.recv_buffer_min = 0;
+    config.recv_buffer_max = 0;
+    config.shm_spin_us = 50;
+    config.send_starve_bytes = 262144;
     config.log_out = stdout;
     config.log_err = stderr;
     return config;
@@ -43,61 +233,504 @@ static void _uv_on_heartbeat_timer(uv_timer_t* handle) {
     uvx_server_t* xserver = (uvx_server_t*) handle->data;
     assert(xserver);
     unsigned int index = _UVX_S_PRIVATE(xserver)->heartbeat_index++;
-    if(xserver->config.log_out)
-        fprintf(xserver->config.log_out, "[uvx-server] %s on heartbeat (index %u)\n", xserver->config.name, index);
-    if(xserver->config.on_heartbeat)
+    uint64_t now = uv_now(xserver->uvloop);
+    uvx__stats_lag(&xserver->stats, now > _UVX_S_PRIVATE(xserver)->heartbeat_due ? now - _UVX_S_PRIVATE(xserver)->heartbeat_due : 0);
+    _UVX_S_PRIVATE(xserver)->heartbeat_due = now + uv_timer_get_repeat(handle);
+    uvx__stats_tick(&xserver->stats, now);
+    if(_UVX_S_PRIVATE(xserver)->bulks)
+        uvx__bulk_poll_all(&_UVX_S_PRIVATE(xserver)->bulks, now); // also polled in loop_check, but the loop may be idle
+    _UVX_S_EVENT(xserver, UVX_LOG_DEBUG, "%s on heartbeat (index %u)", xserver->config.name, index);
+    if(xserver->config.on_heartbeat) {
+        uvx__watch_enter("on_heartbeat", xserver->config.name);
         xserver->config.on_heartbeat(xserver, index);
+        uvx__watch_exit();
+    }
+    if(xserver->config.latency_histograms && xserver->config.latency_dump_seconds > 0
+       && now - _UVX_S_PRIVATE(xserver)->latency_dump_time >= (uint64_t)(xserver->config.latency_dump_seconds * 1000)) {
+        _UVX_S_PRIVATE(xserver)->latency_dump_time = now;
+        uvx__histogram_dump("uvx-server", xserver->config.name, "send", &xserver->send_latency);
+        uvx__histogram_dump("uvx-server", xserver->config.name, "reply", &xserver->reply_latency);
+        uvx__histogram_dump("uvx-server", xserver->config.name, "loop", &xserver->loop_latency);
+    }
     // check and close timeout-ed connections
     if(xserver->config.conn_timeout_seconds > 0)
    	    _uvx_check_timeout_clients(xserver);
 }
 
-int uvx_server_start(uvx_server_t* xserver, uv_loop_t* loop, const char* ip, int port, uvx_server_config_t config) {
-    assert(xserver && loop && ip);
+// records the busy time of the last loop iteration, i.e. the time between two loop_checks
+// excluding the time waiting for I/O (measured by libuv, see UV_METRICS_IDLE_TIME).
+static void _uvx_record_loop_latency(uvx_server_t* xserver) {
+    uvx_server_private_t* priv = _UVX_S_PRIVATE(xserver);
+    uint64_t now = uv_hrtime();
+    uint64_t idle = uv_metrics_idle_time(xserver->uvloop);
+    if(priv->loop_check_time) {
+        uint64_t busy = (now - priv->loop_check_time) - (idle - priv->loop_idle_time);
+        uvx_histogram_record(&xserver->loop_latency, busy / 1000);
+    }
+    priv->loop_check_time = now;
+    priv->loop_idle_time = idle;
+}
+
+// at the end of each loop iteration: start next iteration of read budgets and accept limits,
+// and resume connections paused by read budgets, they will be read in next loop iteration.
+// returns 1 if loop_check is required by config, or else it's only started while copying files
+static int _uvx_loop_check_needed(uvx_server_t* xserver) {
+    return (_UVX_S_PRIVATE(xserver)->read_budgets || xserver->config.accept_batch_max
+            || xserver->config.latency_histograms || xserver->config.zerocopy_min);
+}
+
+static void _uv_on_loop_check(uv_check_t* handle) {
+    uvx_server_t* xserver = (uvx_server_t*) handle->data;
+    uvx_server_private_t* priv = _UVX_S_PRIVATE(xserver);
+    if(xserver->config.latency_histograms)
+        _uvx_record_loop_latency(xserver);
+    if(priv->bulks)
+        uvx__bulk_poll_all(&priv->bulks, uv_now(xserver->uvloop));
+    if(priv->copies)
+        _uvx_copy_poll_all(xserver);
+    uvx_read_budget_stats_t* stats = &priv->read_budget_stats;
+    if(priv->loop_bytes > stats->loop_bytes_max)
+        stats->loop_bytes_max = priv->loop_bytes;
+    if(priv->loop_paused > stats->loop_paused_max)
+        stats->loop_paused_max = priv->loop_paused;
+    priv->loop_iter++;
+    priv->loop_bytes = 0;
+    priv->loop_paused = 0;
+
+    uint64_t now = uv_hrtime();
+    uvx_server_conn_t* conn = priv->paused_conns;
+    priv->paused_conns = NULL;
+    while(conn) {
+        uvx_server_conn_private_t* cp = _UVX_CONN_PRIVATE(conn);
+        uvx_server_conn_t* next = cp->paused_next;
+        uint64_t delay = (now - cp->paused_time) / 1000; // in microseconds
+        stats->pause_time_total_us += delay;
+        if(delay > stats->pause_time_max_us)
+            stats->pause_time_max_us = delay;
+        stats->resumed_count++;
+        cp->paused_time = 0;
+        cp->paused_next = NULL;
+        if(!uv_is_closing((uv_handle_t*) &conn->uvclient) && cp->handoff == 0 && !cp->limited)
+            uv_read_start((uv_stream_t*) &conn->uvclient, uvx__on_conn_alloc_buf, uvx__on_read);
+        conn = next;
+    }
+}
+
+// removes conn from the paused list, if it was paused by read budgets
+static void _uvx_unpause_conn(uvx_server_t* xserver, uvx_server_conn_t* conn) {
+    if(_UVX_CONN_PRIVATE(conn)->paused_time == 0)
+        return;
+    uvx_server_conn_t** p = &_UVX_S_PRIVATE(xserver)->paused_conns;
+    while(*p && *p != conn)
+        p = &_UVX_CONN_PRIVATE(*p)->paused_next;
+    if(*p)
+        *p = _UVX_CONN_PRIVATE(conn)->paused_next;
+    _UVX_CONN_PRIVATE(conn)->paused_time = 0;
+    _UVX_CONN_PRIVATE(conn)->paused_next = NULL;
+}
+
+// counts a read of conn, and pauses it if exceeds read budgets
+static void _uvx_check_read_budget(uvx_server_t* xserver, uvx_server_conn_t* conn, ssize_t nread) {
+    uvx_server_private_t* priv = _UVX_S_PRIVATE(xserver);
+    uvx_server_conn_private_t* cp = _UVX_CONN_PRIVATE(conn);
+    if(cp->iter_index != priv->loop_iter) {
+        cp->iter_index = priv->loop_iter;
+        cp->iter_reads = 0;
+        cp->iter_bytes = 0;
+    }
+    cp->iter_reads++;
+    cp->iter_bytes += nread;
+    priv->loop_bytes += nread;
+
+    if(cp->paused_time || uv_is_closing((uv_handle_t*) &conn->uvclient))
+        return;
+    if((xserver->config.read_budget_count && cp->iter_reads >= xserver->config.read_budget_count)
+       || (xserver->config.read_budget_bytes && cp->iter_bytes >= xserver->config.read_budget_bytes)
+       || (xserver->config.loop_read_budget_bytes && priv->loop_bytes >= xserver->config.loop_read_budget_bytes)) {
+        uv_read_stop((uv_stream_t*) &conn->uvclient);
+        cp->paused_time = uv_hrtime();
+        cp->paused_next = priv->paused_conns;
+        priv->paused_conns = conn;
+        priv->loop_paused++;
+        priv->read_budget_stats.paused_count++;
+    }
+}
+
+// refills bucket, and takes n tokens from it. rate 0 means unlimited.
+static void _uvx_bucket_take(uvx_bucket_t* bucket, unsigned int rate, uint64_t now, double n) {
+    if(rate == 0)
+        return;
+    bucket->tokens += (double)rate * (now - bucket->time) / 1000.0;
+    if(bucket->tokens > rate)
+        bucket->tokens = rate;
+    bucket->time = now;
+    bucket->tokens -= n;
+}
+
+// returns the delay in milliseconds until bucket is not overdrawn, 0 if it's not
+static uint64_t _uvx_bucket_wait(uvx_bucket_t* bucket, unsigned int rate, uint64_t now) {
+    _uvx_bucket_take(bucket, rate, now, 0);
+    if(rate == 0 || bucket->tokens >= 0)
+        return 0;
+    return (uint64_t)(-bucket->tokens * 1000.0 / rate) + 1;
+}
+
+// returns the delay in milliseconds before conn is allowed to read, 0 if it's allowed now
+static uint64_t _uvx_rate_limit_wait(uvx_server_t* xserver, uvx_server_conn_t* conn, uint64_t now) {
+    uvx_server_private_t* priv = _UVX_S_PRIVATE(xserver);
+    uvx_server_conn_private_t* cp = _UVX_CONN_PRIVATE(conn);
+    uvx_server_config_t* config = &xserver->config;
+    uint64_t wait = 0, w;
+    if((w = _uvx_bucket_wait(&priv->bytes_bucket, config->recv_bytes_per_second, now)) > wait) wait = w;
+    if((w = _uvx_bucket_wait(&priv->msgs_bucket, config->recv_msgs_per_second, now)) > wait) wait = w;
+    if((w = _uvx_bucket_wait(&cp->bytes_bucket, config->conn_recv_bytes_per_second, now)) > wait) wait = w;
+    if((w = _uvx_bucket_wait(&cp->msgs_bucket, config->conn_recv_msgs_per_second, now)) > wait) wait = w;
+    return wait;
+}
+
+// resumes limited connections whose tokens refilled, and waits for the rest
+static void _uv_on_limit_timer(uv_timer_t* handle) {
+    uvx_server_t* xserver = (uvx_server_t*) handle->data;
+    uvx_server_private_t* priv = _UVX_S_PRIVATE(xserver);
+    uint64_t now = uv_now(xserver->uvloop);
+    uint64_t min_wait = 0;
+    uvx_server_conn_t** p = &priv->limited_conns;
+    while(*p) {
+        uvx_server_conn_t* conn = *p;
+        uvx_server_conn_private_t* cp = _UVX_CONN_PRIVATE(conn);
+        uint64_t wait = _uvx_rate_limit_wait(xserver, conn, now);
+        if(wait > 0) {
+            if(min_wait == 0 || wait < min_wait)
+                min_wait = wait;
+            p = &cp->limited_next;
+            continue;
+        }
+        *p = cp->limited_next;
+        cp->limited = 0;
+        cp->limited_next = NULL;
+        if(!uv_is_closing((uv_handle_t*) &conn->uvclient) && cp->handoff == 0 && cp->paused_time == 0)
+            uv_read_start((uv_stream_t*) &conn->uvclient, uvx__on_conn_alloc_buf, uvx__on_read);
+    }
+    if(min_wait > 0)
+        uv_timer_start(&priv->limit_timer, _uv_on_limit_timer, min_wait, 0);
+}
+
+// takes tokens of a read of conn, and pauses it until refilled if it exceeds rate limits
+static void _uvx_check_rate_limit(uvx_server_t* xserver, uvx_server_conn_t* conn, ssize_t nread) {
+    uvx_server_private_t* priv = _UVX_S_PRIVATE(xserver);
+    uvx_server_conn_private_t* cp = _UVX_CONN_PRIVATE(conn);
+    uvx_server_config_t* config = &xserver->config;
+    uint64_t now = uv_now(xserver->uvloop);
+    _uvx_bucket_take(&priv->bytes_bucket, config->recv_bytes_per_second, now, (double) nread);
+    _uvx_bucket_take(&priv->msgs_bucket, config->recv_msgs_per_second, now, 1);
+    _uvx_bucket_take(&cp->bytes_bucket, config->conn_recv_bytes_per_second, now, (double) nread);
+    _uvx_bucket_take(&cp->msgs_bucket, config->conn_recv_msgs_per_second, now, 1);
+    if(cp->limited || uv_is_closing((uv_handle_t*) &conn->uvclient))
+        return;
+    uint64_t wait = _uvx_rate_limit_wait(xserver, conn, now);
+    if(wait == 0)
+        return;
+    uv_read_stop((uv_stream_t*) &conn->uvclient);
+    cp->limited = 1;
+    cp->limited_next = priv->limited_conns;
+    priv->limited_conns = conn;
+    priv->read_budget_stats.limited_count++;
+    if(!uv_is_active((uv_handle_t*) &priv->limit_timer) || uv_timer_get_due_in(&priv->limit_timer) > wait)
+        uv_timer_start(&priv->limit_timer, _uv_on_limit_timer, wait, 0);
+}
+
+// removes conn from the limited list, if it was paused by rate limits
+static void _uvx_unlimit_conn(uvx_server_t* xserver, uvx_server_conn_t* conn) {
+    if(!_UVX_CONN_PRIVATE(conn)->limited)
+        return;
+    uvx_server_conn_t** p = &_UVX_S_PRIVATE(xserver)->limited_conns;
+    while(*p && *p != conn)
+        p = &_UVX_CONN_PRIVATE(*p)->limited_next;
+    if(*p)
+        *p = _UVX_CONN_PRIVATE(conn)->limited_next;
+    _UVX_CONN_PRIVATE(conn)->limited = 0;
+    _UVX_CONN_PRIVATE(conn)->limited_next = NULL;
+}
+
+// measures loop lag by the delay of lag timer, and sheds new connections while it exceeds config.overload_lag_ms
+static void _uv_on_lag_timer(uv_timer_t* handle) {
+    uvx_server_t* xserver = (uvx_server_t*) handle->data;
+    uvx_server_private_t* priv = _UVX_S_PRIVATE(xserver);
+    uint64_t now = uv_now(xserver->uvloop);
+    uint64_t lag = (now > priv->lag_due ? now - priv->lag_due : 0);
+    priv->lag_due = now + uv_timer_get_repeat(handle);
+    int overloaded = (lag > xserver->config.overload_lag_ms);
+    if(overloaded != priv->overloaded)
+        _UVX_S_EVENT(xserver, (overloaded ? UVX_LOG_WARN : UVX_LOG_INFO), "%s %s overload mode, loop lag %llu ms",
+                     xserver->config.name, (overloaded ? "enters" : "leaves"), (unsigned long long) lag);
+    priv->overloaded = overloaded;
+}
+
+void uvx_server_read_budget_stats(uvx_server_t* xserver, uvx_read_budget_stats_t* stats) {
+    memcpy(stats, &_UVX_S_PRIVATE(xserver)->read_budget_stats, sizeof(uvx_read_budget_stats_t));
+}
+
+// inits xserver, except its listening socket
+static void _uvx_server_init(uvx_server_t* xserver, uv_loop_t* loop, uvx_server_config_t config) {
 	xserver->uvloop = loop;
     memcpy(&xserver->config, &config, sizeof(uvx_server_config_t));
 
-	_UVX_S_PRIVATE(xserver)->conns = lh_kptr_table_new(config.conn_count, "clients connection table", NULL);
+	// linkhash resizes when it's 66% full, so make room for conn_count connections without resizing
+	_UVX_S_PRIVATE(xserver)->conns = lh_kptr_table_new(config.conn_count * 3 / 2 + 1, "clients connection table", NULL);
 
 	// init and start timer
 	int timeout = (int)(config.heartbeat_interval_seconds * 1000); // in milliseconds
 	uv_timer_init(loop, &_UVX_S_PRIVATE(xserver)->heartbeat_timer);
     _UVX_S_PRIVATE(xserver)->heartbeat_timer.data = xserver;
     _UVX_S_PRIVATE(xserver)->heartbeat_index = 0;
+    _UVX_S_PRIVATE(xserver)->heartbeat_due = uv_now(loop) + timeout;
+    memset(&xserver->stats, 0, sizeof(uvx_stats_t));
 	if(timeout > 0)
 		uv_timer_start(&_UVX_S_PRIVATE(xserver)->heartbeat_timer, _uv_on_heartbeat_timer, timeout, timeout);
 
-    // init tcp, bind and listen
-    uv_tcp_init(loop, &xserver->uvserver);
-    xserver->uvserver.data = xserver;
-    if(strchr(ip, ':')) {
-        struct sockaddr_in6 addr;
-        uv_ip6_addr(ip, port, &addr);
-        uv_tcp_bind(&xserver->uvserver, (const struct sockaddr*) &addr, 0);
+    // init read budgets, the check handle does not keep the loop alive
+    _UVX_S_PRIVATE(xserver)->loop_iter = 0;
+    _UVX_S_PRIVATE(xserver)->loop_bytes = 0;
+    _UVX_S_PRIVATE(xserver)->loop_paused = 0;
+    _UVX_S_PRIVATE(xserver)->paused_conns = NULL;
+    memset(&_UVX_S_PRIVATE(xserver)->read_budget_stats, 0, sizeof(uvx_read_budget_stats_t));
+    uv_check_init(loop, &_UVX_S_PRIVATE(xserver)->loop_check);
+    _UVX_S_PRIVATE(xserver)->loop_check.data = xserver;
+    _UVX_S_PRIVATE(xserver)->read_budgets =
+        (config.read_budget_count || config.read_budget_bytes || config.loop_read_budget_bytes);
+
+    // init accept limits
+    uv_timer_init(loop, &_UVX_S_PRIVATE(xserver)->accept_timer);
+    _UVX_S_PRIVATE(xserver)->accept_timer.data = xserver;
+    _UVX_S_PRIVATE(xserver)->accept_iter = 0;
+    _UVX_S_PRIVATE(xserver)->accept_count = 0;
+    _UVX_S_PRIVATE(xserver)->accept_tokens = (config.accept_rate_per_second > 1.0f ? config.accept_rate_per_second : 1.0);
+    _UVX_S_PRIVATE(xserver)->accept_refill_time = uv_now(loop);
+    memset(&_UVX_S_PRIVATE(xserver)->accept_stats, 0, sizeof(uvx_accept_stats_t));
+
+    // init latency histograms, loop_latency requires the loop to measure its idle time
+    uvx_histogram_reset(&xserver->send_latency);
+    uvx_histogram_reset(&xserver->reply_latency);
+    uvx_histogram_reset(&xserver->loop_latency);
+    _UVX_S_PRIVATE(xserver)->latency_dump_time = uv_now(loop);
+    _UVX_S_PRIVATE(xserver)->loop_check_time = 0;
+    _UVX_S_PRIVATE(xserver)->loop_idle_time = 0;
+    if(config.latency_histograms)
+        uv_loop_configure(loop, UV_METRICS_IDLE_TIME);
+
+    // init io_uring engine, falls back to libuv if it's not supported
+    _UVX_S_PRIVATE(xserver)->uring = NULL;
+    if(config.io_uring) {
+        _UVX_S_PRIVATE(xserver)->uring = uvx__uring_new(loop, config.recv_buffer_max, _uvx_conn_on_uring_recv);
+        if(_UVX_S_PRIVATE(xserver)->uring == NULL)
+            uvx__event_log(config.log_out, config.log_err, UVX_LOG_WARN, "uvx-server", "%s io_uring is not available, use libuv",
+                           config.name);
+    }
+
+    _UVX_S_PRIVATE(xserver)->bulks = NULL;
+    _UVX_S_PRIVATE(xserver)->copies = NULL;
+    if(_uvx_loop_check_needed(xserver)) {
+        uv_check_start(&_UVX_S_PRIVATE(xserver)->loop_check, _uv_on_loop_check);
+        uv_unref((uv_handle_t*) &_UVX_S_PRIVATE(xserver)->loop_check);
+    }
+    _UVX_S_PRIVATE(xserver)->handoff = NULL;
+
+    uv_timer_init(loop, &_UVX_S_PRIVATE(xserver)->drain_timer);
+    _UVX_S_PRIVATE(xserver)->drain_timer.data = xserver;
+    _UVX_S_PRIVATE(xserver)->draining = 0;
+    _UVX_S_PRIVATE(xserver)->closing_handles = 0;
+    _UVX_S_PRIVATE(xserver)->on_shutdown = NULL;
+
+    // init rate limits and overload protection
+    _UVX_S_PRIVATE(xserver)->rate_limits = (config.recv_bytes_per_second || config.recv_msgs_per_second
+                                            || config.conn_recv_bytes_per_second || config.conn_recv_msgs_per_second);
+    _UVX_S_PRIVATE(xserver)->bytes_bucket.tokens = config.recv_bytes_per_second;
+    _UVX_S_PRIVATE(xserver)->bytes_bucket.time = uv_now(loop);
+    _UVX_S_PRIVATE(xserver)->msgs_bucket.tokens = config.recv_msgs_per_second;
+    _UVX_S_PRIVATE(xserver)->msgs_bucket.time = uv_now(loop);
+    _UVX_S_PRIVATE(xserver)->limited_conns = NULL;
+    uv_timer_init(loop, &_UVX_S_PRIVATE(xserver)->limit_timer);
+    _UVX_S_PRIVATE(xserver)->limit_timer.data = xserver;
+    uv_timer_init(loop, &_UVX_S_PRIVATE(xserver)->lag_timer);
+    _UVX_S_PRIVATE(xserver)->lag_timer.data = xserver;
+    _UVX_S_PRIVATE(xserver)->overloaded = 0;
+    memset(_UVX_S_PRIVATE(xserver)->send_classes, 0, sizeof(_UVX_S_PRIVATE(xserver)->send_classes));
+    _UVX_S_PRIVATE(xserver)->index = NULL;
+    _UVX_S_PRIVATE(xserver)->pubsub = NULL;
+    if(config.overload_lag_ms > 0) {
+        // checks lag twice within the threshold, the timer does not keep the loop alive
+        uint64_t interval = (config.overload_lag_ms >= 2 ? config.overload_lag_ms / 2 : 1);
+        _UVX_S_PRIVATE(xserver)->lag_due = uv_now(loop) + interval;
+        uv_timer_start(&_UVX_S_PRIVATE(xserver)->lag_timer, _uv_on_lag_timer, interval, interval);
+        uv_unref((uv_handle_t*) &_UVX_S_PRIVATE(xserver)->lag_timer);
+    }
+}
+
+// returns 1 if the unix domain socket file at path is left by a dead process: nobody listens on it.
+// a live server (or any other failure) keeps the file, then bind fails with UV_EADDRINUSE.
+static int _uvx_pipe_stale(const char* path) {
+#ifdef _WIN32
+    return 0; // named pipes leave no file
+#else
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if(strlen(path) >= sizeof(addr.sun_path))
+        return 0;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+        return 0;
+    int stale = (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 && errno == ECONNREFUSED);
+    close(fd);
+    return stale;
+#endif
+}
+
+// inits tcp (or pipe), binds and listens on ip:port or "unix:/path"
+static int _uvx_server_listen(uvx_server_t* xserver, const char* ip, int port) {
+    uv_loop_t* loop = xserver->uvloop;
+    uvx_server_config_t* config = &xserver->config;
+    const char* pipe_name = uvx__pipe_name(ip);
+    int ret;
+    _UVX_S_PRIVATE(xserver)->pipe = (pipe_name != NULL);
+    if(pipe_name) {
+        uv_pipe_init(loop, &xserver->uvserver_pipe, 0);
+        ret = uv_pipe_bind(&xserver->uvserver_pipe, pipe_name);
+        if(ret == UV_EADDRINUSE && _uvx_pipe_stale(pipe_name)) {
+            // a stale socket file left by a crashed process
+            uv_fs_t req;
+            uv_fs_unlink(NULL, &req, pipe_name, NULL);
+            uv_fs_req_cleanup(&req);
+            ret = uv_pipe_bind(&xserver->uvserver_pipe, pipe_name);
+        }
     } else {
-        struct sockaddr_in addr;
-        uv_ip4_addr(ip, port, &addr);
-        uv_tcp_bind(&xserver->uvserver, (const struct sockaddr*) &addr, 0);
+        uv_tcp_init(loop, &xserver->uvserver);
+        if(strchr(ip, ':')) {
+            struct sockaddr_in6 addr;
+            uv_ip6_addr(ip, port, &addr);
+            ret = uv_tcp_bind(&xserver->uvserver, (const struct sockaddr*) &addr, 0);
+        } else {
+            struct sockaddr_in addr;
+            uv_ip4_addr(ip, port, &addr);
+            ret = uv_tcp_bind(&xserver->uvserver, (const struct sockaddr*) &addr, 0);
+        }
     }
+    xserver->uvserver.data = xserver;
 
-	int ret = uv_listen((uv_stream_t*)&xserver->uvserver, config.conn_backlog, uvx__on_connection);
-    if(ret >= 0 && config.log_out) {
+    if(ret >= 0)
+	    ret = uv_listen((uv_stream_t*)&xserver->uvserver, config->conn_backlog, uvx__on_connection);
+    if(ret >= 0 && config->log_out) {
         char timestr[32]; time_t t; time(&t);
         strftime(timestr, sizeof(timestr), "[%Y-%m-%d %X]", localtime(&t)); // C99 only: %F = %Y-%m-%d
-        fprintf(config.log_out, "[uvx-server] %s %s listening on %s:%d ...\n", timestr, xserver->config.name, ip, port);
+        if(pipe_name)
+            fprintf(config->log_out, "[uvx-server] %s %s listening on %s ...\n", timestr, xserver->config.name, ip);
+        else
+            fprintf(config->log_out, "[uvx-server] %s %s listening on %s:%d ...\n", timestr, xserver->config.name, ip, port);
+    }
+    if(ret < 0)
+        _UVX_S_PRIVATE(xserver)->accept_stats.failed++;
+    if(ret < 0 && config->log_err) {
+        if(pipe_name)
+            fprintf(config->log_err, "\n!!! [uvx-server] %s listen on %s failed: %s\n", xserver->config.name, ip, uv_strerror(ret));
+        else
+            fprintf(config->log_err, "\n!!! [uvx-server] %s listen on %s:%d failed: %s\n", xserver->config.name, ip, port, uv_strerror(ret));
     }
-    if(ret < 0 && config.log_err)
-        fprintf(config.log_err, "\n!!! [uvx-server] %s listen on %s:%d failed: %s\n", xserver->config.name, ip, port, uv_strerror(ret));
 
     return (ret >= 0);
 }
 
+int uvx_server_start(uvx_server_t* xserver, uv_loop_t* loop, const char* ip, int port, uvx_server_config_t config) {
+    assert(xserver && loop && ip);
+    _uvx_server_init(xserver, loop, config);
+    return _uvx_server_listen(xserver, ip, port);
+}
+
+static void _uv_after_close_server_handle(uv_handle_t* handle) {
+    uvx_server_t* xserver = (uvx_server_t*) handle->data;
+    uvx_server_private_t* priv = _UVX_S_PRIVATE(xserver);
+    if(--priv->closing_handles == 0 && priv->draining == 2 && priv->on_shutdown)
+        priv->on_shutdown(xserver); // xserver can be freed now
+}
+
+static void _uvx_close_server_handle(uvx_server_t* xserver, uv_handle_t* handle) {
+    _UVX_S_PRIVATE(xserver)->closing_handles++;
+    uv_close(handle, _uv_after_close_server_handle);
+}
+
+// closes the handles of xserver, after all connections closed
+static void _uvx_server_close(uvx_server_t* xserver) {
+    uvx_server_private_t* priv = _UVX_S_PRIVATE(xserver);
+    priv->draining = 2;
+    uv_timer_stop(&priv->heartbeat_timer);
+    uv_check_stop(&priv->loop_check);
+    uv_timer_stop(&priv->drain_timer);
+    priv->closing_handles++; // not call on_shutdown inside this function
+    _uvx_close_server_handle(xserver, (uv_handle_t*) &priv->heartbeat_timer);
+    _uvx_close_server_handle(xserver, (uv_handle_t*) &priv->loop_check);
+    _uvx_close_server_handle(xserver, (uv_handle_t*) &priv->accept_timer);
+    _uvx_close_server_handle(xserver, (uv_handle_t*) &priv->drain_timer);
+    _uvx_close_server_handle(xserver, (uv_handle_t*) &priv->limit_timer);
+    _uvx_close_server_handle(xserver, (uv_handle_t*) &priv->lag_timer);
+    // rings and bulks after their connections
+    uvx__uring_close(priv->uring);
+    priv->uring = NULL;
+    uvx__bulk_poll_all(&priv->bulks, UINT64_MAX); // resets the sockets still waiting for zerocopy completions
+    lh_table_free(priv->conns);
+    priv->conns = NULL;
+    uvx__index_free(priv->index);
+    priv->index = NULL;
+    if(priv->pubsub) {
+        priv->closing_handles++;
+        uvx__pubsub_close(priv->pubsub, xserver, _uv_after_close_server_handle);
+        priv->pubsub = NULL;
+    }
+    _UVX_S_EVENT(xserver, UVX_LOG_INFO, "%s shutdown", xserver->config.name);
+    _uv_after_close_server_handle((uv_handle_t*) &priv->drain_timer);
+}
+
+// closes connections not drained in time
+static void _uv_on_drain_timer(uv_timer_t* handle) {
+    uvx_server_t* xserver = (uvx_server_t*) handle->data;
+    struct lh_entry *e, *tmp;
+    lh_foreach_safe(_UVX_S_PRIVATE(xserver)->conns, e, tmp) {
+        uvx_server_conn_t* conn = (uvx_server_conn_t*) e->k;
+        if(!uv_is_closing((uv_handle_t*) &conn->uvclient))
+            _uv_disconnect_client((uv_stream_t*) &conn->uvclient);
+    }
+}
+
+int uvx_server_drain(uvx_server_t* xserver, unsigned int timeout_ms, UVX_S_ON_SHUTDOWN on_shutdown) {
+    uvx_server_private_t* priv = _UVX_S_PRIVATE(xserver);
+    if(priv->draining)
+        return 0;
+    priv->draining = 1;
+    priv->on_shutdown = on_shutdown;
+
+    // stop accepting
+    uv_timer_stop(&priv->accept_timer);
+    if(xserver->uvserver.type != UV_UNKNOWN_HANDLE && !uv_is_closing((uv_handle_t*) &xserver->uvserver))
+        _uvx_close_server_handle(xserver, (uv_handle_t*) &xserver->uvserver); // or else it's handed off
+    if(priv->handoff)
+        _uvx_handoff_close(priv->handoff);
+
+    // half-close connections after their writes sent, they're closed on EOF of peers, or by _uv_on_drain_timer()
+    if(timeout_ms > 0) {
+        struct lh_entry *e, *tmp;
+        lh_foreach_safe(priv->conns, e, tmp) {
+            uvx_server_conn_t* conn = (uvx_server_conn_t*) e->k;
+            if(!uv_is_closing((uv_handle_t*) &conn->uvclient) && _UVX_CONN_PRIVATE(conn)->handoff != 2)
+                uvx_server_conn_shutdown(conn);
+        }
+        uv_timer_start(&priv->drain_timer, _uv_on_drain_timer, timeout_ms, 0);
+    } else {
+        _uv_on_drain_timer(&priv->drain_timer);
+    }
+    if(priv->conns->count == 0)
+        _uvx_server_close(xserver);
+    return 1;
+}
+
 int uvx_server_shutdown(uvx_server_t* xserver) {
-	uv_timer_stop(&_UVX_S_PRIVATE(xserver)->heartbeat_timer);
-	uv_close((uv_handle_t*)&_UVX_S_PRIVATE(xserver)->heartbeat_timer, NULL);
-	lh_table_free(_UVX_S_PRIVATE(xserver)->conns);
-	uv_close((uv_handle_t*)&xserver->uvserver, NULL);
-    return 0;
+    return uvx_server_drain(xserver, 0, NULL);
 }
 
 void uvx_server_conn_ref(uvx_server_conn_t* conn, int ref) {
@@ -107,100 +740,679 @@ void uvx_server_conn_ref(uvx_server_conn_t* conn, int ref) {
     if(conn->refcount == 0) {
         uv_mutex_unlock(&conn->refmutex);
         uv_mutex_destroy(&conn->refmutex);
-        free(conn);
+        automem_uninit(&conn->inbuf);
+        uvx_free(conn);
         return;
     }
     uv_mutex_unlock(&conn->refmutex);
 }
 
+// returns the bulk of conn, creates it if conn writes by libuv, or NULL
+static struct uvx_bulk_s* _uvx_conn_bulk(uvx_server_conn_t* conn) {
+    uvx_server_conn_private_t* cp = _UVX_CONN_PRIVATE(conn);
+    if(cp->bulk == NULL && !uvx__shm_active(cp->shm) && cp->uring == NULL
+       && !uv_is_closing((uv_handle_t*) &conn->uvclient))
+        cp->bulk = uvx__bulk_new((uv_stream_t*) &conn->uvclient, &conn->xserver->stats,
+                                 &_UVX_S_PRIVATE(conn->xserver)->bulks);
+    return cp->bulk;
+}
+
+static int _uvx_conn_send_now(uvx_server_conn_t* conn, void* data, unsigned int size, int zerocopy);
+static int _uvx_copy_push(struct uvx_copy_s* c, uv_file fd, int64_t offset, void* data, uint64_t length);
+
 int uvx_server_conn_send(uvx_server_conn_t* conn, void* data, unsigned int size) {
-	return uvx_send_to_stream((uv_stream_t*)&conn->uvclient, data, size);
+    uvx_server_t* xserver = conn->xserver;
+    int zerocopy = (xserver->config.zerocopy_min && size >= xserver->config.zerocopy_min);
+    uvx__pubsub_flush(_UVX_CONN_PRIVATE(conn)->topics); // after the publishes queued
+    if(_UVX_CONN_PRIVATE(conn)->handoff == 2) { // owned by the new process
+        uvx_atomic_add1w_u64(&xserver->stats.send_failures, 1);
+        uvx_free(data);
+        return 0;
+    }
+    if(_UVX_CONN_PRIVATE(conn)->copy) // after the files being copied
+        return _uvx_copy_push(_UVX_CONN_PRIVATE(conn)->copy, -1, 0, data, size);
+    return _uvx_conn_send_now(conn, data, size, zerocopy);
 }
 
-static void uvx__on_read(uv_stream_t* uvclient, ssize_t nread, const uv_buf_t* buf) {
-    uvx_server_conn_t* conn = (uvx_server_conn_t*) uvclient->data;
-    assert(conn);
+// sends data by the transport of conn, not after the files being copied
+static int _uvx_conn_send_now(uvx_server_conn_t* conn, void* data, unsigned int size, int zerocopy) {
+    uvx_server_t* xserver = conn->xserver;
+    if(uvx__bulk_active(_UVX_CONN_PRIVATE(conn)->bulk)) // after the files or zerocopy buffers queued
+        return uvx__bulk_send(_UVX_CONN_PRIVATE(conn)->bulk, data, size, zerocopy);
+    if(uvx__shm_active(_UVX_CONN_PRIVATE(conn)->shm))
+        return uvx__shm_send(_UVX_CONN_PRIVATE(conn)->shm, data, size);
+    if(_UVX_CONN_PRIVATE(conn)->uring)
+        return uvx__uring_send(_UVX_CONN_PRIVATE(conn)->uring, data, size);
+    if(_UVX_CONN_PRIVATE(conn)->outq)
+        return uvx__outq_send(_UVX_CONN_PRIVATE(conn)->outq, data, size, UVX_SEND_NORMAL);
+    if(zerocopy && _uvx_conn_bulk(conn))
+        return uvx__bulk_send(_UVX_CONN_PRIVATE(conn)->bulk, data, size, 1);
+    return uvx__send_to_stream((uv_stream_t*)&conn->uvclient, data, size, &xserver->stats,
+                               (xserver->config.latency_histograms ? &xserver->send_latency : NULL));
+}
+
+int uvx_server_conn_send_prio(uvx_server_conn_t* conn, void* data, unsigned int size, int prio) {
+    uvx_server_t* xserver = conn->xserver;
+    uvx_server_conn_private_t* cp = _UVX_CONN_PRIVATE(conn);
+    uvx__pubsub_flush(cp->topics);
+    if(cp->copy)
+        return uvx_server_conn_send(conn, data, size); // after the files being copied
+    if(cp->outq == NULL && cp->handoff != 2 && !uvx__bulk_active(cp->bulk) && !uvx__shm_active(cp->shm)
+       && cp->uring == NULL && !uv_is_closing((uv_handle_t*) &conn->uvclient))
+        cp->outq = uvx__outq_new((uv_stream_t*) &conn->uvclient, &xserver->stats,
+                                 (xserver->config.latency_histograms ? &xserver->send_latency : NULL),
+                                 _UVX_S_PRIVATE(xserver)->send_classes, xserver->config.send_starve_bytes);
+    if(cp->outq && cp->handoff != 2 && !uvx__bulk_active(cp->bulk))
+        return uvx__outq_send(cp->outq, data, size, prio);
+    return uvx_server_conn_send(conn, data, size);
+}
+
+int uvx_server_conn_send_stats(uvx_server_conn_t* conn, uvx_send_class_stats_t* stats) {
+    if(_UVX_CONN_PRIVATE(conn)->outq == NULL)
+        return 0;
+    uvx__outq_stats(_UVX_CONN_PRIVATE(conn)->outq, stats);
+    return 1;
+}
+
+void uvx_server_send_stats(uvx_server_t* xserver, uvx_send_class_stats_t* stats) {
+    memcpy(stats, _UVX_S_PRIVATE(xserver)->send_classes, sizeof(_UVX_S_PRIVATE(xserver)->send_classes));
+}
+
+#define UVX_COPY_CHUNK  65536
+
+// a file (fd >= 0) or a buffer queued on the connection while files are copied
+typedef struct uvx_copy_job_s {
+    struct uvx_copy_job_s* next;
+    uv_file fd;
+    int64_t offset;
+    uint64_t length;  // of the file range or the buffer
+    char* data;       // the buffer, owned
+} uvx_copy_job_t;
+
+// copies files into sends by chunks, if sendfile() is not available for conn. the next chunk is read
+// asynchronously after the previous one is written (see _uvx_copy_ready()), so at most two are in flight.
+typedef struct uvx_copy_s {
+    uv_fs_t req;                 // the read in flight
+    uvx_server_conn_t* conn;     // NULL after the connection closed, then it's freed after the read completed
+    uvx_copy_job_t *head, *tail;
+    char* chunk;                 // being read
+    int reading;
+    int shutdown;                // 1: shutdown the connection after all sent
+    struct uvx_copy_s *prev, *next; // in xserver's copies
+} uvx_copy_t;
+
+static void _uvx_copy_pump(uvx_copy_t* c);
+
+static int _uvx_copy_push(uvx_copy_t* c, uv_file fd, int64_t offset, void* data, uint64_t length) {
+    uvx_copy_job_t* job = (uvx_copy_job_t*) uvx_calloc(1, sizeof(uvx_copy_job_t));
+    job->fd = fd;
+    job->offset = offset;
+    job->length = length;
+    job->data = (char*) data;
+    if(c->tail)
+        c->tail->next = job;
+    else
+        c->head = job;
+    c->tail = job;
+    return 1;
+}
+
+static void _uvx_copy_pop(uvx_copy_t* c) {
+    uvx_copy_job_t* job = c->head;
+    c->head = job->next;
+    if(c->head == NULL)
+        c->tail = NULL;
+    if(job->fd >= 0) {
+        uv_fs_t req;
+        uv_fs_close(NULL, &req, job->fd, NULL);
+        uv_fs_req_cleanup(&req);
+    }
+    uvx_free(job->data);
+    uvx_free(job);
+}
+
+static void _uvx_copy_unlink(uvx_copy_t* c, uvx_server_t* xserver) {
+    if(c->prev)
+        c->prev->next = c->next;
+    else
+        _UVX_S_PRIVATE(xserver)->copies = c->next;
+    if(c->next)
+        c->next->prev = c->prev;
+    c->prev = c->next = NULL;
+    if(_UVX_S_PRIVATE(xserver)->copies == NULL && !_uvx_loop_check_needed(xserver))
+        uv_check_stop(&_UVX_S_PRIVATE(xserver)->loop_check);
+}
+
+// returns 1 if at most one chunk is still waiting to be written, then the next one can be read
+static int _uvx_copy_ready(uvx_server_conn_t* conn) {
+    uvx_server_conn_private_t* cp = _UVX_CONN_PRIVATE(conn);
+    if(uv_stream_get_write_queue_size((uv_stream_t*) &conn->uvclient) > UVX_COPY_CHUNK)
+        return 0;
+    if(cp->outq) {
+        uvx_send_class_stats_t classes[UVX_SEND_CLASSES];
+        uint64_t queued = 0;
+        uvx__outq_stats(cp->outq, classes);
+        for(int i = 0; i < UVX_SEND_CLASSES; i++)
+            queued += classes[i].queued_count;
+        if(queued > 1)
+            return 0;
+    }
+    return (uvx__shm_queued(cp->shm) <= 1 && uvx__uring_queued(cp->uring) <= 1);
+}
+
+static void _uv_after_copy_read(uv_fs_t* req) {
+    uvx_copy_t* c = (uvx_copy_t*) req->data;
+    ssize_t n = req->result;
+    uv_fs_req_cleanup(req);
+    c->reading = 0;
+    char* chunk = c->chunk;
+    c->chunk = NULL;
+    if(c->conn == NULL) {
+        uvx_free(chunk);
+        uvx_free(c);
+        return;
+    }
+    uvx_copy_job_t* job = c->head;
+    if(n <= 0) {
+        _UVX_S_EVENT(c->conn->xserver, UVX_LOG_WARN, "%s sendfile read failed: %s", c->conn->xserver->config.name,
+                     (n == 0 ? "end of file" : uv_strerror((int) n)));
+        uvx_atomic_add1w_u64(&c->conn->xserver->stats.send_failures, 1);
+        uvx_free(chunk);
+        _uvx_copy_pop(c);
+    } else {
+        _uvx_conn_send_now(c->conn, chunk, (unsigned int) n, 0);
+        job->offset += n;
+        job->length -= (uint64_t) n;
+        if(job->length == 0)
+            _uvx_copy_pop(c);
+    }
+    _uvx_copy_pump(c);
+}
+
+// sends the buffers and reads the next chunk, or frees c after all sent
+static void _uvx_copy_pump(uvx_copy_t* c) {
+    uvx_server_conn_t* conn = c->conn;
+    while(c->head && !c->reading) {
+        uvx_copy_job_t* job = c->head;
+        if(job->fd < 0) {
+            _uvx_conn_send_now(conn, job->data, (unsigned int) job->length, 0);
+            job->data = NULL; // owned by the transport
+            _uvx_copy_pop(c);
+            continue;
+        }
+        if(!_uvx_copy_ready(conn))
+            return; // polled again at the end of loop iteration, see _uvx_copy_poll_all()
+        unsigned int size = (unsigned int)(job->length < UVX_COPY_CHUNK ? job->length : UVX_COPY_CHUNK);
+        c->chunk = (char*) uvx_malloc(size);
+        uv_buf_t buf = uv_buf_init(c->chunk, size);
+        c->req.data = c;
+        int r = uv_fs_read(conn->xserver->uvloop, &c->req, job->fd, &buf, 1, job->offset, _uv_after_copy_read);
+        if(r < 0) {
+            _UVX_S_EVENT(conn->xserver, UVX_LOG_WARN, "%s sendfile read failed: %s", conn->xserver->config.name,
+                         uv_strerror(r));
+            uvx_atomic_add1w_u64(&conn->xserver->stats.send_failures, 1);
+            uvx_free(c->chunk);
+            c->chunk = NULL;
+            _uvx_copy_pop(c);
+            continue;
+        }
+        c->reading = 1;
+    }
+    if(c->head == NULL && !c->reading) {
+        int shutdown = c->shutdown;
+        _uvx_copy_unlink(c, conn->xserver);
+        _UVX_CONN_PRIVATE(conn)->copy = NULL;
+        uvx_free(c);
+        if(shutdown)
+            uvx_server_conn_shutdown(conn);
+    }
+}
+
+static void _uvx_copy_poll_all(uvx_server_t* xserver) {
+    uvx_copy_t* c = _UVX_S_PRIVATE(xserver)->copies;
+    while(c) {
+        uvx_copy_t* next = c->next;
+        _uvx_copy_pump(c);
+        c = next;
+    }
+}
+
+// drops the jobs not sent, after the connection closed
+static void _uvx_copy_close(uvx_copy_t* c) {
+    _uvx_copy_unlink(c, c->conn->xserver);
+    while(c->head)
+        _uvx_copy_pop(c);
+    c->conn = NULL;
+    if(!c->reading)
+        uvx_free(c);
+}
+
+// sends the file by reading it into chunks, if sendfile() is not available for conn
+static int _uvx_conn_sendfile_copy(uvx_server_conn_t* conn, uv_file fd, int64_t offset, uint64_t length) {
+    uvx_server_conn_private_t* cp = _UVX_CONN_PRIVATE(conn);
+    if(cp->copy == NULL) {
+        uvx_copy_t* c = (uvx_copy_t*) uvx_calloc(1, sizeof(uvx_copy_t));
+        c->conn = conn;
+        c->next = _UVX_S_PRIVATE(conn->xserver)->copies;
+        if(c->next)
+            c->next->prev = c;
+        _UVX_S_PRIVATE(conn->xserver)->copies = c;
+        cp->copy = c;
+        uv_check_start(&_UVX_S_PRIVATE(conn->xserver)->loop_check, _uv_on_loop_check); // to poll copies
+        uv_unref((uv_handle_t*) &_UVX_S_PRIVATE(conn->xserver)->loop_check);
+    }
+    _uvx_copy_push(cp->copy, fd, offset, NULL, length);
+    _uvx_copy_pump(cp->copy);
+    return 1;
+}
+
+int uvx_server_conn_sendfile(uvx_server_conn_t* conn, uv_file fd, int64_t offset, uint64_t length) {
+    uvx__pubsub_flush(_UVX_CONN_PRIVATE(conn)->topics);
+    if(_UVX_CONN_PRIVATE(conn)->handoff == 2 || uv_is_closing((uv_handle_t*) &conn->uvclient)) {
+        uvx_atomic_add1w_u64(&conn->xserver->stats.send_failures, 1);
+        uv_fs_t req;
+        uv_fs_close(NULL, &req, fd, NULL);
+        uv_fs_req_cleanup(&req);
+        return 0;
+    }
+    if(_UVX_CONN_PRIVATE(conn)->copy == NULL && !uvx__outq_active(_UVX_CONN_PRIVATE(conn)->outq)
+       && _uvx_conn_bulk(conn)) // or else after the queued
+        return uvx__bulk_sendfile(_UVX_CONN_PRIVATE(conn)->bulk, fd, offset, length);
+    return _uvx_conn_sendfile_copy(conn, fd, offset, length);
+}
+
+static void _uv_after_shutdown_conn(uv_shutdown_t* req, int status) {
+    uvx_free(req); // the connection will be closed on EOF or timeout
+}
+
+int uvx_server_conn_shutdown(uvx_server_conn_t* conn) {
+    uvx__pubsub_flush(_UVX_CONN_PRIVATE(conn)->topics);
+    if(_UVX_CONN_PRIVATE(conn)->copy) {
+        _UVX_CONN_PRIVATE(conn)->copy->shutdown = 1; // after the files being copied
+        return 1;
+    }
+    if(_UVX_CONN_PRIVATE(conn)->uring)
+        return uvx__uring_shutdown(_UVX_CONN_PRIVATE(conn)->uring);
+    if(uvx__bulk_active(_UVX_CONN_PRIVATE(conn)->bulk))
+        return uvx__bulk_shutdown(_UVX_CONN_PRIVATE(conn)->bulk);
+    if(uvx__outq_active(_UVX_CONN_PRIVATE(conn)->outq))
+        return uvx__outq_shutdown(_UVX_CONN_PRIVATE(conn)->outq);
+    uv_shutdown_t* req = (uv_shutdown_t*) uvx_malloc(sizeof(uv_shutdown_t));
+    int r = uv_shutdown(req, (uv_stream_t*) &conn->uvclient, _uv_after_shutdown_conn);
+    if(r != 0)
+        uvx_free(req);
+    return (r == 0 ? 1 : 0);
+}
+
+void uvx_server_stats(uvx_server_t* xserver, uvx_stats_t* stats) {
+    uvx__stats_snapshot(&xserver->stats, stats);
+}
+
+unsigned int uvx_server_conn_consume(uvx_server_conn_t* conn, unsigned int size) {
+    return uvx__consume_mem(&conn->inbuf, size, &conn->recv_sizer);
+}
+
+void uvx_server_conn_mark_reply(uvx_server_conn_t* conn) {
+    uvx_server_conn_private_t* cp = _UVX_CONN_PRIVATE(conn);
+    if(cp->request_time) {
+        uvx_histogram_record(&conn->xserver->reply_latency, (uv_hrtime() - cp->request_time) / 1000);
+        cp->request_time = 0;
+    }
+}
+
+// moves conn to the tail of conns, see _uvx_check_timeout_clients()
+static void _uvx_touch_conn(uvx_server_t* xserver, uvx_server_conn_t* conn) {
+    // 更新最后通讯时间，先删除再插入的处理依赖lh_table内部实现，保证最近通讯的连接在表尾。
+    // 关联代码 _uvx_check_timeout_clients()
+    conn->last_comm_time = uv_now(xserver->uvloop);
+    int n = lh_table_delete(_UVX_S_PRIVATE(xserver)->conns, (const void*)conn);
+    assert(n == 0); //delete success
+    lh_table_insert(_UVX_S_PRIVATE(xserver)->conns, conn, (const void*)conn);
+}
+
+// delivers a message received through shared memory, as it's read from the connection.
+// returns 0 if the connection is closed in on_recv.
+static int _uvx_conn_on_shm_msg(void* owner, void* data, unsigned int size) {
+    uvx_server_conn_t* conn = (uvx_server_conn_t*) owner;
+    uvx_server_t* xserver = conn->xserver;
+    if(conn->last_comm_time != uv_now(xserver->uvloop))
+        _uvx_touch_conn(xserver, conn); // at most once per millisecond
+    if(xserver->config.latency_histograms && _UVX_CONN_PRIVATE(conn)->request_time == 0)
+        _UVX_CONN_PRIVATE(conn)->request_time = uv_hrtime(); // a new request starts
+    if(xserver->config.accumulate_recv) {
+        uv_buf_t tail;
+        uvx__alloc_mem_tail(&conn->inbuf, size, &tail);
+        memcpy(tail.base, data, size);
+        conn->inbuf.size += size;
+        data = conn->inbuf.pdata;
+        size = conn->inbuf.size;
+    }
+    if(xserver->config.on_recv) {
+        uvx__watch_enter("on_recv", xserver->config.name);
+        xserver->config.on_recv(xserver, conn, data, size);
+        uvx__watch_exit();
+    }
+    return !uv_is_closing((uv_handle_t*) &conn->uvclient);
+}
+
+// the peer corrupted the rings of shared-memory transport
+static void _uvx_conn_on_shm_fail(void* owner, int fatal) {
+    uvx_server_conn_t* conn = (uvx_server_conn_t*) owner;
+    uvx__shm_close(_UVX_CONN_PRIVATE(conn)->shm);
+    _UVX_CONN_PRIVATE(conn)->shm = NULL;
+    if(fatal && !uv_is_closing((uv_handle_t*) &conn->uvclient))
+        _uv_disconnect_client((uv_stream_t*) &conn->uvclient);
+}
+
+// handles the hello and doorbells of shared-memory transport, see config.shm_enable.
+// returns the size of the remaining normal data, which is moved to the start of `base`.
+static ssize_t _uvx_conn_shm_read(uvx_server_t* xserver, uvx_server_conn_t* conn, char* base, ssize_t nread) {
+    uvx_server_conn_private_t* cp = _UVX_CONN_PRIVATE(conn);
+    if(!cp->shm_checked) {
+        cp->shm_checked = 1;
+        if(uvx__shm_is_hello(base, (unsigned int) nread) && uvx__shm_is_local((uv_stream_t*) &conn->uvclient))
+            cp->shm = uvx__shm_new(xserver->uvloop, (uv_stream_t*) &conn->uvclient, xserver->config.shm_spin_us,
+                                   &xserver->stats, _uvx_conn_on_shm_msg, _uvx_conn_on_shm_fail, conn);
+    }
+    if(cp->shm == NULL)
+        return nread;
+    unsigned int used = 0;
+    if(!uvx__shm_on_read(cp->shm, base, (unsigned int) nread, &used)) {
+        uvx__shm_close(cp->shm); // refused, falls back to the connection
+        cp->shm = NULL;
+    }
+    memmove(base, base + used, nread - used);
+    return nread - used;
+}
+
+// handles data read from conn, by libuv or io_uring. in accumulate mode, `base` is the tail of conn->inbuf.
+static void _uvx_conn_on_read(uvx_server_conn_t* conn, char* base, ssize_t nread) {
     uvx_server_t* xserver = conn->xserver;
     assert(xserver);
+    uv_stream_t* uvclient = (uv_stream_t*) &conn->uvclient;
 	if(nread > 0) {
-        // 更新最后通讯时间，先删除再插入的处理依赖lh_table内部实现，保证最近通讯的连接在表尾。
-        // 关联代码 _uvx_check_timeout_clients()
-        conn->last_comm_time = uv_now(xserver->uvloop);
-        int n = lh_table_delete(_UVX_S_PRIVATE(xserver)->conns, (const void*)conn);
-        assert(n == 0); //delete success
-        lh_table_insert(_UVX_S_PRIVATE(xserver)->conns, conn, (const void*)conn);
-
-        if(xserver->config.on_recv)
-            xserver->config.on_recv(xserver, conn, buf->base, nread);
+        _uvx_touch_conn(xserver, conn);
+        uvx__recv_sizer_update(&conn->recv_sizer, nread);
+        if(xserver->config.shm_enable)
+            nread = _uvx_conn_shm_read(xserver, conn, base, nread);
+    }
+	if(nread > 0) {
+        uvx_atomic_add1w_u64(&xserver->stats.msgs_in, 1);
+        uvx_atomic_add1w_u64(&xserver->stats.bytes_in, nread);
+        if(xserver->config.latency_histograms && _UVX_CONN_PRIVATE(conn)->request_time == 0)
+            _UVX_CONN_PRIVATE(conn)->request_time = uv_hrtime(); // a new request starts
+
+        if(xserver->config.accumulate_recv) {
+            // data was read into conn->inbuf directly, see uvx__on_conn_alloc_buf()
+            assert(base == (char*)conn->inbuf.pdata + conn->inbuf.size);
+            conn->inbuf.size += (unsigned int) nread;
+            if(xserver->config.on_recv) {
+                uvx__watch_enter("on_recv", xserver->config.name);
+                xserver->config.on_recv(xserver, conn, conn->inbuf.pdata, conn->inbuf.size);
+                uvx__watch_exit();
+            }
+        } else {
+            if(xserver->config.on_recv) {
+                uvx__watch_enter("on_recv", xserver->config.name);
+                xserver->config.on_recv(xserver, conn, base, nread);
+                uvx__watch_exit();
+            }
+        }
+        if(_UVX_S_PRIVATE(xserver)->read_budgets && _UVX_CONN_PRIVATE(conn)->uring == NULL)
+            _uvx_check_read_budget(xserver, conn, nread); // io_uring connections are not paused
+        if(_UVX_S_PRIVATE(xserver)->rate_limits && _UVX_CONN_PRIVATE(conn)->uring == NULL)
+            _uvx_check_rate_limit(xserver, conn, nread);
 	} else if(nread < 0) {
-        if(xserver->config.log_err)
-            fprintf(xserver->config.log_err, "\n!!! [uvx-server] %s on recv error: %s\n", xserver->config.name, uv_strerror(nread));
-		_uv_disconnect_client(uvclient);
+        _UVX_S_EVENT(xserver, (nread == UV_EOF ? UVX_LOG_INFO : UVX_LOG_WARN),
+                     "%s on recv error: %s", xserver->config.name, uv_strerror(nread));
+        if(uvx__shm_active(_UVX_CONN_PRIVATE(conn)->shm))
+            uvx__shm_drain(_UVX_CONN_PRIVATE(conn)->shm); // messages sent before the peer closed
+        if(!uv_is_closing((uv_handle_t*) uvclient))
+            _uv_disconnect_client(uvclient);
 	}
-    free(buf->base);
+}
+
+static void uvx__on_read(uv_stream_t* uvclient, ssize_t nread, const uv_buf_t* buf) {
+    uvx_server_conn_t* conn = (uvx_server_conn_t*) uvclient->data;
+    assert(conn);
+    _uvx_conn_on_read(conn, buf->base, nread);
+    if(!conn->xserver->config.accumulate_recv)
+        uvx_free(buf->base);
+}
+
+// data read by io_uring, in a provided buffer which is recycled after return
+static void _uvx_conn_on_uring_recv(void* owner, char* data, ssize_t nread) {
+    uvx_server_conn_t* conn = (uvx_server_conn_t*) owner;
+    if(nread > 0 && conn->xserver->config.accumulate_recv) {
+        uv_buf_t tail;
+        uvx__alloc_mem_tail(&conn->inbuf, (size_t) nread, &tail);
+        memcpy(tail.base, data, nread);
+        data = tail.base;
+    }
+    _uvx_conn_on_read(conn, data, nread);
 }
 
 static void _uv_after_close_connection(uv_handle_t* handle) {
 	uvx_server_conn_t* conn = (uvx_server_conn_t*) handle->data;
     assert(conn && conn->xserver);
     uvx_server_t* xserver = conn->xserver;
-    if(xserver->config.on_conn_close)
+    _uvx_unpause_conn(xserver, conn);
+    _uvx_unlimit_conn(xserver, conn);
+    if(_UVX_CONN_PRIVATE(conn)->keys)
+        uvx__index_unbind_all(_UVX_S_PRIVATE(xserver)->index, &_UVX_CONN_PRIVATE(conn)->keys);
+    uvx__pubsub_conn_free(_UVX_S_PRIVATE(xserver)->pubsub, &_UVX_CONN_PRIVATE(conn)->topics);
+    uvx_atomic_add1w_u64(&xserver->stats.closes, 1);
+    if(xserver->config.on_conn_close) {
+        uvx__watch_enter("on_conn_close", xserver->config.name);
         xserver->config.on_conn_close(xserver, conn);
+        uvx__watch_exit();
+    }
 	int n = lh_table_delete(_UVX_S_PRIVATE(xserver)->conns, (const void*)conn);
 	assert(n == 0); //delete success
 	uvx_server_conn_ref(conn, -1); // call on_conn_close() inside here? in non-main-thread?
+    if(_UVX_S_PRIVATE(xserver)->draining == 1 && _UVX_S_PRIVATE(xserver)->conns->count == 0)
+        _uvx_server_close(xserver);
 }
 
-// defines in uvx.c
-void uvx__on_alloc_buf(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+static void uvx__on_conn_alloc_buf(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    uvx_server_conn_t* conn = (uvx_server_conn_t*) handle->data;
+    assert(conn && conn->xserver);
+    if(conn->xserver->config.accumulate_recv)
+        uvx__alloc_mem_tail(&conn->inbuf, uvx__recv_sizer_size(&conn->recv_sizer, suggested_size), buf);
+    else
+        uvx__on_alloc_buf(handle, uvx__recv_sizer_size(&conn->recv_sizer, suggested_size), buf);
+}
+
+// returns the delay in milliseconds before next accept is allowed, or 0 if it's allowed now.
+static uint64_t _uvx_accept_delay(uvx_server_t* xserver) {
+    uvx_server_private_t* priv = _UVX_S_PRIVATE(xserver);
+    if(xserver->config.accept_batch_max) {
+        if(priv->accept_iter != priv->loop_iter) {
+            priv->accept_iter = priv->loop_iter;
+            priv->accept_count = 0;
+        }
+        if(priv->accept_count >= xserver->config.accept_batch_max)
+            return 1; // not allowed in current loop iteration
+    }
+    if(xserver->config.accept_rate_per_second > 0) {
+        double rate = xserver->config.accept_rate_per_second;
+        double burst = (rate > 1.0 ? rate : 1.0);
+        uint64_t now = uv_now(xserver->uvloop);
+        priv->accept_tokens += (now - priv->accept_refill_time) * rate / 1000.0;
+        priv->accept_refill_time = now;
+        if(priv->accept_tokens > burst)
+            priv->accept_tokens = burst;
+        if(priv->accept_tokens < 1.0)
+            return (uint64_t)((1.0 - priv->accept_tokens) * 1000.0 / rate) + 1;
+    }
+    return 0;
+}
+
+static void _uv_on_accept_timer(uv_timer_t* handle) {
+    uvx_server_t* xserver = (uvx_server_t*) handle->data;
+    uint64_t delay = _uvx_accept_delay(xserver);
+    if(delay > 0) {
+        uv_timer_start(handle, _uv_on_accept_timer, delay, 0);
+        return;
+    }
+    _uvx_accept_conn(xserver); // libuv resumes listening after uv_accept()
+}
 
 static void uvx__on_connection(uv_stream_t* uvserver, int status) {
     uvx_server_t* xserver = (uvx_server_t*) uvserver->data;
     assert(xserver);
 	if(status == 0) {
-        if(xserver->config.log_out)
-		    fprintf(xserver->config.log_out, "[uvx-server] %s on connection\n", xserver->config.name);
+        _UVX_S_EVENT(xserver, UVX_LOG_INFO, "%s on connection", xserver->config.name);
 		assert(uvserver == (uv_stream_t*) &xserver->uvserver);
-        assert(xserver->config.conn_extra_size >= 0);
-
-        // Create new connection
-		uvx_server_conn_t* conn = (uvx_server_conn_t*) calloc(1, sizeof(uvx_server_conn_t) + xserver->config.conn_extra_size);
-        if(xserver->config.conn_extra_size > 0)
-            conn->extra = (void*)(conn + 1);
-        conn->xserver = xserver;
-		conn->uvclient.data = conn;
-        conn->last_comm_time = 0;
-        conn->refcount = 1;
-        uv_mutex_init(&conn->refmutex);
-
-		// Save to connection list
-		assert(lh_table_lookup_entry(_UVX_S_PRIVATE(xserver)->conns, conn) == NULL);
-		lh_table_insert(_UVX_S_PRIVATE(xserver)->conns, conn, (const void*)conn);
-
-		uv_tcp_init(xserver->uvloop, &conn->uvclient);
-		if(uv_accept(uvserver, (uv_stream_t*) &conn->uvclient) == 0) {
-			conn->last_comm_time = uv_now(xserver->uvloop);
-            if(xserver->config.on_conn_ok)
-                xserver->config.on_conn_ok(xserver, conn);
-			uv_read_start((uv_stream_t*) &conn->uvclient, uvx__on_alloc_buf, uvx__on_read);
-		} else {
-            if(xserver->config.on_conn_fail)
-                xserver->config.on_conn_fail(conn->xserver, conn);
-			uv_close((uv_handle_t*) &conn->uvclient, _uv_after_close_connection);
-		}
+        if(_UVX_S_PRIVATE(xserver)->handoff && _uvx_handoff_defer_accept(_UVX_S_PRIVATE(xserver)->handoff))
+            return; // accepted and handed off later, see _uv_on_handoff_timer()
+        uint64_t delay = _uvx_accept_delay(xserver);
+        if(delay > 0) {
+            // do not accept it now, libuv stops listening until the deferred uv_accept()
+            _UVX_S_PRIVATE(xserver)->accept_stats.deferred++;
+            uv_timer_start(&_UVX_S_PRIVATE(xserver)->accept_timer, _uv_on_accept_timer,
+                           (delay > 1 ? delay : 0), 0); // 0: next loop iteration
+            return;
+        }
+        _uvx_accept_conn(xserver);
 	} else {
-		if(xserver->config.log_err)
-            fprintf(xserver->config.log_err, "\n!!! [uvx-server] %s on connection error: %s\n", xserver->config.name, uv_strerror(status));
+        _UVX_S_PRIVATE(xserver)->accept_stats.failed++;
+        _UVX_S_EVENT(xserver, UVX_LOG_ERROR, "%s on connection error: %s", xserver->config.name, uv_strerror(status));
 	}
 }
 
+// the stream of a connection
+typedef union uvx_stream_u {
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+} uvx_stream_t;
+
+// inits the stream of an accepted connection, tcp or pipe as the xserver's
+static void _uvx_init_conn_stream(uvx_server_t* xserver, uv_stream_t* stream) {
+    if(_UVX_S_PRIVATE(xserver)->pipe)
+        uv_pipe_init(xserver->uvloop, (uv_pipe_t*) stream, 0);
+    else
+        uv_tcp_init(xserver->uvloop, (uv_tcp_t*) stream);
+}
+
+static void _uv_after_close_rejected(uv_handle_t* handle) {
+    uvx_free(handle);
+}
+
+// creates a connection and saves it to the connection list, its stream is not initialized
+static uvx_server_conn_t* _uvx_new_conn(uvx_server_t* xserver) {
+    assert(xserver->config.conn_extra_size >= 0);
+    uvx_server_conn_t* conn = (uvx_server_conn_t*) uvx_calloc(1, sizeof(uvx_server_conn_t)
+                              + sizeof(uvx_server_conn_private_t) + xserver->config.conn_extra_size);
+    if(xserver->config.conn_extra_size > 0)
+        conn->extra = (void*)(_UVX_CONN_PRIVATE(conn) + 1);
+    conn->xserver = xserver;
+    conn->uvclient.data = conn;
+    conn->last_comm_time = 0;
+    conn->refcount = 1;
+    uv_mutex_init(&conn->refmutex);
+    uvx__recv_sizer_init(&conn->recv_sizer, xserver->config.recv_buffer_min, xserver->config.recv_buffer_max);
+
+    assert(lh_table_lookup_entry(_UVX_S_PRIVATE(xserver)->conns, conn) == NULL);
+    lh_table_insert(_UVX_S_PRIVATE(xserver)->conns, conn, (const void*)conn);
+    return conn;
+}
+
+// starts a connected (accepted or adopted) connection: calls on_conn_ok and starts reading
+static void _uvx_open_conn(uvx_server_t* xserver, uvx_server_conn_t* conn) {
+    uvx_server_private_t* priv = _UVX_S_PRIVATE(xserver);
+    conn->last_comm_time = uv_now(xserver->uvloop);
+    _UVX_CONN_PRIVATE(conn)->bytes_bucket.tokens = xserver->config.conn_recv_bytes_per_second;
+    _UVX_CONN_PRIVATE(conn)->bytes_bucket.time = conn->last_comm_time;
+    _UVX_CONN_PRIVATE(conn)->msgs_bucket.tokens = xserver->config.conn_recv_msgs_per_second;
+    _UVX_CONN_PRIVATE(conn)->msgs_bucket.time = conn->last_comm_time;
+    // io_uring starts before on_conn_ok, which may send
+    struct uvx_uring_conn_s* uring = NULL;
+    if(priv->uring)
+        uring = _UVX_CONN_PRIVATE(conn)->uring = uvx__uring_conn_new(priv->uring, (uv_stream_t*) &conn->uvclient,
+                                                                     &xserver->stats, conn);
+    if(xserver->config.on_conn_ok) {
+        uvx__watch_enter("on_conn_ok", xserver->config.name);
+        xserver->config.on_conn_ok(xserver, conn);
+        uvx__watch_exit();
+    }
+    if(uring == NULL && !uv_is_closing((uv_handle_t*) &conn->uvclient))
+        uv_read_start((uv_stream_t*) &conn->uvclient, uvx__on_conn_alloc_buf, uvx__on_read);
+}
+
+// accept a pending connection, or reject it if there are too many connections.
+static void _uvx_accept_conn(uvx_server_t* xserver) {
+    uvx_server_private_t* priv = _UVX_S_PRIVATE(xserver);
+    uv_stream_t* uvserver = (uv_stream_t*) &xserver->uvserver;
+    priv->accept_count++;
+    if(xserver->config.accept_rate_per_second > 0)
+        priv->accept_tokens -= 1.0;
+
+    if((xserver->config.conn_max && priv->conns->count >= (int)xserver->config.conn_max) || priv->overloaded) {
+        // accept and close it immediately, without creating a connection
+        uvx_stream_t* uvclient = (uvx_stream_t*) uvx_malloc(sizeof(uvx_stream_t));
+        _uvx_init_conn_stream(xserver, (uv_stream_t*) uvclient);
+        if(uv_accept(uvserver, (uv_stream_t*) uvclient) != 0)
+            priv->accept_stats.failed++;
+        else if(priv->overloaded)
+            priv->accept_stats.shed++;
+        else
+            priv->accept_stats.rejected++;
+        uv_close((uv_handle_t*) uvclient, _uv_after_close_rejected);
+        return;
+    }
+    uvx_server_conn_t* conn = _uvx_new_conn(xserver);
+    _uvx_init_conn_stream(xserver, (uv_stream_t*) &conn->uvclient);
+    if(uv_accept(uvserver, (uv_stream_t*) &conn->uvclient) == 0) {
+        priv->accept_stats.accepted++;
+        uvx_atomic_add1w_u64(&xserver->stats.accepts, 1);
+        _uvx_open_conn(xserver, conn);
+    } else {
+        priv->accept_stats.failed++;
+        if(xserver->config.on_conn_fail) {
+            uvx__watch_enter("on_conn_fail", xserver->config.name);
+            xserver->config.on_conn_fail(conn->xserver, conn);
+            uvx__watch_exit();
+        }
+        uv_close((uv_handle_t*) &conn->uvclient, _uv_after_close_connection);
+    }
+}
+
+void uvx_server_accept_stats(uvx_server_t* xserver, uvx_accept_stats_t* stats) {
+    memcpy(stats, &_UVX_S_PRIVATE(xserver)->accept_stats, sizeof(uvx_accept_stats_t));
+}
+
 static void _uv_disconnect_client(uv_stream_t* uvclient) {
 	uvx_server_conn_t* conn = (uvx_server_conn_t*) uvclient->data;
 	assert(conn && ((uv_stream_t*)&conn->uvclient == uvclient));
 	uv_read_stop(uvclient);
     assert(conn->xserver);
-    if(conn->xserver->config.on_conn_closing)
+    if(conn->xserver->config.on_conn_closing) {
+        uvx__watch_enter("on_conn_closing", conn->xserver->config.name);
         conn->xserver->config.on_conn_closing(conn->xserver, conn);
+        uvx__watch_exit();
+    }
+    if(_UVX_CONN_PRIVATE(conn)->copy) {
+        _uvx_copy_close(_UVX_CONN_PRIVATE(conn)->copy);
+        _UVX_CONN_PRIVATE(conn)->copy = NULL;
+    }
+    if(_UVX_CONN_PRIVATE(conn)->shm) {
+        uvx__shm_close(_UVX_CONN_PRIVATE(conn)->shm);
+        _UVX_CONN_PRIVATE(conn)->shm = NULL;
+    }
+    if(_UVX_CONN_PRIVATE(conn)->uring) {
+        uvx__uring_conn_close(_UVX_CONN_PRIVATE(conn)->uring); // before the fd is closed
+        _UVX_CONN_PRIVATE(conn)->uring = NULL;
+    }
+    if(_UVX_CONN_PRIVATE(conn)->bulk) {
+        uvx__bulk_close(_UVX_CONN_PRIVATE(conn)->bulk, uv_now(conn->xserver->uvloop));
+        _UVX_CONN_PRIVATE(conn)->bulk = NULL;
+    }
+    if(_UVX_CONN_PRIVATE(conn)->outq) {
+        uvx__outq_close(_UVX_CONN_PRIVATE(conn)->outq);
+        _UVX_CONN_PRIVATE(conn)->outq = NULL;
+    }
+    uvx__pubsub_drop(_UVX_CONN_PRIVATE(conn)->topics);
 	uv_close((uv_handle_t*)uvclient, _uv_after_close_connection);
 }
 
@@ -213,9 +1425,9 @@ static void _uvx_check_timeout_clients(uvx_server_t* xserver) {
 	lh_foreach_safe(_UVX_S_PRIVATE(xserver)->conns, e, tmp) {
 		uvx_server_conn_t* conn = (uvx_server_conn_t*) e->k;
 		if(uv_now(xserver->uvloop) - conn->last_comm_time > conn_timeout) {
-            if(xserver->config.log_out)
-                fprintf(xserver->config.log_out, "[uvx-server] %s close connection %p for its long time silence\n",
-                        xserver->config.name, &conn->uvclient);
+            _UVX_S_EVENT(xserver, UVX_LOG_INFO, "%s close connection %p for its long time silence",
+                         xserver->config.name, &conn->uvclient);
+            uvx_atomic_add1w_u64(&xserver->stats.timeouts, 1);
 			_uv_disconnect_client((uv_stream_t*) &conn->uvclient); // will delete connection
 		} else {
 			break; //后面都是最近通讯过的
@@ -232,3 +1444,601 @@ int uvx_server_iter_conns(uvx_server_t* xserver, UVX_S_ON_ITER_CONN on_iter_conn
 	}
 	return _UVX_S_PRIVATE(xserver)->conns->count;
 }
+
+int uvx_server_conn_bind(uvx_server_conn_t* conn, int64_t ikey, const char* skey) {
+    uvx_server_t* xserver = conn->xserver;
+    if(uv_is_closing((uv_handle_t*) &conn->uvclient))
+        return 0;
+    if(_UVX_S_PRIVATE(xserver)->index == NULL)
+        _UVX_S_PRIVATE(xserver)->index = uvx__index_new(xserver->config.conn_count * 3 / 2 + 1);
+    return uvx__index_bind(_UVX_S_PRIVATE(xserver)->index, &_UVX_CONN_PRIVATE(conn)->keys, conn, ikey, skey);
+}
+
+int uvx_server_conn_unbind(uvx_server_conn_t* conn, int64_t ikey, const char* skey) {
+    return uvx__index_unbind(_UVX_S_PRIVATE(conn->xserver)->index, &_UVX_CONN_PRIVATE(conn)->keys, ikey, skey);
+}
+
+int uvx_server_iter_key(uvx_server_t* xserver, int64_t ikey, const char* skey,
+                        UVX_S_ON_ITER_CONN on_iter_conn, void* userdata) {
+    struct uvx_index_node_s* node = uvx__index_find(_UVX_S_PRIVATE(xserver)->index, ikey, skey);
+    int n = 0;
+    while(node) {
+        uvx_server_conn_t* conn = (uvx_server_conn_t*) uvx__index_next(&node);
+        if(uv_is_closing((uv_handle_t*) &conn->uvclient))
+            continue; // unbound after closed
+        n++;
+        if(on_iter_conn)
+            on_iter_conn(xserver, conn, userdata);
+    }
+    return n;
+}
+
+uvx_server_conn_t* uvx_server_find_key(uvx_server_t* xserver, int64_t ikey, const char* skey) {
+    struct uvx_index_node_s* node = uvx__index_find(_UVX_S_PRIVATE(xserver)->index, ikey, skey);
+    while(node) {
+        uvx_server_conn_t* conn = (uvx_server_conn_t*) uvx__index_next(&node);
+        if(!uv_is_closing((uv_handle_t*) &conn->uvclient))
+            return conn;
+    }
+    return NULL;
+}
+
+// publishes are written to the stream of conn directly (1), unless it sends by other transports or queues (0),
+// or it's closing or handed off (-1)
+static int _uvx_conn_pub_route(void* c) {
+    uvx_server_conn_t* conn = (uvx_server_conn_t*) c;
+    uvx_server_conn_private_t* cp = _UVX_CONN_PRIVATE(conn);
+    if(cp->handoff == 2 || uv_is_closing((uv_handle_t*) &conn->uvclient))
+        return -1;
+    if(cp->handoff || uvx__shm_active(cp->shm) || cp->uring || cp->outq || uvx__bulk_active(cp->bulk) || cp->copy)
+        return 0;
+    return 1;
+}
+
+static int _uvx_conn_pub_send(void* conn, void* data, unsigned int size) {
+    return uvx_server_conn_send((uvx_server_conn_t*) conn, data, size);
+}
+
+int uvx_server_conn_subscribe(uvx_server_conn_t* conn, const char* topic) {
+    uvx_server_t* xserver = conn->xserver;
+    if(uv_is_closing((uv_handle_t*) &conn->uvclient))
+        return 0;
+    if(_UVX_S_PRIVATE(xserver)->pubsub == NULL)
+        _UVX_S_PRIVATE(xserver)->pubsub = uvx__pubsub_new(xserver->uvloop, &xserver->stats,
+                                              (xserver->config.latency_histograms ? &xserver->send_latency : NULL),
+                                              _uvx_conn_pub_route, _uvx_conn_pub_send);
+    return uvx__pubsub_subscribe(_UVX_S_PRIVATE(xserver)->pubsub, &_UVX_CONN_PRIVATE(conn)->topics,
+                                 conn, (uv_stream_t*) &conn->uvclient, topic);
+}
+
+int uvx_server_conn_unsubscribe(uvx_server_conn_t* conn, const char* topic) {
+    return uvx__pubsub_unsubscribe(_UVX_S_PRIVATE(conn->xserver)->pubsub, _UVX_CONN_PRIVATE(conn)->topics, topic);
+}
+
+int uvx_server_publish(uvx_server_t* xserver, const char* topic, void* data, unsigned int size) {
+    return (int) uvx__pubsub_publish(_UVX_S_PRIVATE(xserver)->pubsub, topic, data, size);
+}
+
+//-----------------------------------------------------------------------------
+// hot upgrade: the old process hands off its listening socket and connections to the new process,
+// through an ipc pipe, see uvx_server_handoff_listen() and uvx_server_takeover().
+
+#define UVX_HANDOFF_LISTENER  1 // record carrying the listening socket
+#define UVX_HANDOFF_CONN      2 // record carrying a connection, and its uvx_handoff_conn_t
+#define UVX_HANDOFF_DONE      3 // no more records
+#define UVX_HANDOFF_ABORTED   4
+#define UVX_HANDOFF_INTERVAL  10 // in milliseconds, of checking connections drained
+
+// the header of a handoff record, followed by `size` bytes
+typedef struct uvx_handoff_hdr_s {
+    uint32_t type;
+    uint32_t size;
+} uvx_handoff_hdr_t;
+
+// the payload of UVX_HANDOFF_CONN, followed by conn->extra and the unconsumed conn->inbuf
+typedef struct uvx_handoff_conn_s {
+    uint32_t extra_size;
+    uint32_t inbuf_size;
+} uvx_handoff_conn_t;
+
+typedef struct uvx_handoff_s {
+    uv_pipe_t pipe;       // old process: listening for the new process, new process: connected to the old process
+    uv_pipe_t peer;       // old process: the new process connected
+    uv_timer_t timer;     // old process: checks connections drained
+    uv_connect_t connect; // new process
+    int handles;          // handles initialized, it's freed after all closed
+    int peer_inited, timer_inited, closing;
+    int done_sent;        // old process: DONE was sent, waits for the new process to close the pipe
+    int accept_deferred;  // old process: a connection is waiting in the listener, see _uvx_handoff_defer_accept()
+    int peer_closing;     // old process: closing a peer of another user
+    uvx_server_t* xserver;
+    UVX_S_ON_HANDOFF on_done;
+    int state;            // 0, or UVX_HANDOFF_* of the last record sent
+    int listener;         // 1 if the listening socket was handed off (or adopted)
+    unsigned int conns;   // connections handed off (or adopted)
+    unsigned int drain_ms;
+    uint64_t deadline;    // uv_now() to stop draining
+    automem_t inbuf;      // new process: records received, old process: discards
+    char ip[64];          // new process: listens on ip:port if there is no old process
+    int port;
+} uvx_handoff_t;
+
+typedef struct uvx_handoff_write_s {
+    uv_write_t w;
+    uvx_handoff_t* h;
+    uvx_server_conn_t* conn; // referenced until written
+    uint32_t type;
+    uv_buf_t buf;
+} uvx_handoff_write_t;
+
+static void _uv_after_close_handoff(uv_handle_t* handle) {
+    uvx_handoff_t* h = (uvx_handoff_t*) handle->data;
+    if(--h->handles == 0) {
+        automem_uninit(&h->inbuf);
+        uvx_free(h);
+    }
+}
+
+// closes the pipes and timer, h is freed later
+static void _uvx_handoff_close(uvx_handoff_t* h) {
+    if(h->closing)
+        return;
+    h->closing = 1;
+    if(_UVX_S_PRIVATE(h->xserver)->handoff == h)
+        _UVX_S_PRIVATE(h->xserver)->handoff = NULL;
+    uv_close((uv_handle_t*) &h->pipe, _uv_after_close_handoff);
+    if(h->peer_inited)
+        uv_close((uv_handle_t*) &h->peer, _uv_after_close_handoff);
+    if(h->timer_inited)
+        uv_close((uv_handle_t*) &h->timer, _uv_after_close_handoff);
+}
+
+static void _uv_after_handoff_write(uv_write_t* w, int status);
+
+// sends a record to the new process, with a handle if `handle` is not NULL
+static int _uvx_handoff_write(uvx_handoff_t* h, uint32_t type, uvx_server_conn_t* conn, uv_stream_t* handle) {
+    unsigned int extra_size = (conn ? (unsigned int) h->xserver->config.conn_extra_size : 0);
+    unsigned int inbuf_size = (conn ? conn->inbuf.size : 0);
+    unsigned int size = (conn ? sizeof(uvx_handoff_conn_t) + extra_size + inbuf_size : 0);
+    uvx_handoff_write_t* req = (uvx_handoff_write_t*) uvx_malloc(sizeof(uvx_handoff_write_t) + sizeof(uvx_handoff_hdr_t) + size);
+    char* p = (char*)(req + 1);
+    uvx_handoff_hdr_t hdr = { type, size };
+    memcpy(p, &hdr, sizeof(hdr));
+    if(conn) {
+        uvx_handoff_conn_t hc = { extra_size, inbuf_size };
+        memcpy(p + sizeof(hdr), &hc, sizeof(hc));
+        if(extra_size)
+            memcpy(p + sizeof(hdr) + sizeof(hc), conn->extra, extra_size);
+        if(inbuf_size)
+            memcpy(p + sizeof(hdr) + sizeof(hc) + extra_size, conn->inbuf.pdata, inbuf_size);
+        uvx_server_conn_ref(conn, 1);
+    }
+    req->h = h;
+    req->conn = conn;
+    req->type = type;
+    req->buf = uv_buf_init(p, sizeof(hdr) + size);
+    int r = uv_write2(&req->w, (uv_stream_t*) &h->peer, &req->buf, 1, handle, _uv_after_handoff_write);
+    if(r != 0) {
+        _UVX_S_EVENT(h->xserver, UVX_LOG_ERROR, "%s handoff write failed: %s", h->xserver->config.name, uv_strerror(r));
+        if(conn)
+            uvx_server_conn_ref(conn, -1);
+        uvx_free(req);
+        return 0;
+    }
+    return 1;
+}
+
+// the new process is gone, the old process keeps serving the connections not handed off yet
+static void _uvx_handoff_abort(uvx_handoff_t* h) {
+    uvx_server_t* xserver = h->xserver;
+    _UVX_S_EVENT(xserver, UVX_LOG_ERROR, "%s handoff aborted, %u connections were handed off", xserver->config.name, h->conns);
+    h->state = UVX_HANDOFF_ABORTED;
+    struct lh_entry *e, *tmp;
+    lh_foreach_safe(_UVX_S_PRIVATE(xserver)->conns, e, tmp) {
+        uvx_server_conn_t* conn = (uvx_server_conn_t*) e->k;
+        if(_UVX_CONN_PRIVATE(conn)->handoff == 1 && !uv_is_closing((uv_handle_t*) &conn->uvclient)) {
+            _UVX_CONN_PRIVATE(conn)->handoff = 0;
+            uv_read_start((uv_stream_t*) &conn->uvclient, uvx__on_conn_alloc_buf, uvx__on_read);
+        }
+    }
+    // the listener is still open, resumes accepting
+    if(h->accept_deferred && !uv_is_closing((uv_handle_t*) &xserver->uvserver))
+        uv_timer_start(&_UVX_S_PRIVATE(xserver)->accept_timer, _uv_on_accept_timer, 0, 0);
+    h->accept_deferred = 0;
+    if(h->on_done)
+        h->on_done(xserver, h->listener, h->conns);
+    _uvx_handoff_close(h);
+}
+
+static void _uv_after_handoff_write(uv_write_t* w, int status) {
+    uvx_handoff_write_t* req = (uvx_handoff_write_t*) w;
+    uvx_handoff_t* h = req->h;
+    uvx_server_t* xserver = h->xserver;
+    uvx_server_conn_t* conn = req->conn;
+    if(status == 0 && h->state != UVX_HANDOFF_ABORTED) {
+        if(req->type == UVX_HANDOFF_LISTENER) {
+            // the new process accepts from now on, this one only hands off connections accepted already.
+            // the listener is kept open until DONE is acknowledged, to resume accepting if the handoff aborts.
+            h->listener = 1;
+        } else if(req->type == UVX_HANDOFF_CONN) {
+            h->conns++;
+            if(!uv_is_closing((uv_handle_t*) &conn->uvclient))
+                _uv_disconnect_client((uv_stream_t*) &conn->uvclient); // the socket is kept open by the new process
+        } else if(req->type == UVX_HANDOFF_DONE) {
+            h->done_sent = 1; // not close the pipe until the new process read all, see _uv_on_handoff_peer_read()
+        }
+    } else if(h->state != UVX_HANDOFF_ABORTED) {
+        _UVX_S_EVENT(xserver, UVX_LOG_ERROR, "%s handoff write failed: %s", xserver->config.name, uv_strerror(status));
+        if(conn)
+            _UVX_CONN_PRIVATE(conn)->handoff = 1; // resumed by _uvx_handoff_abort()
+        _uvx_handoff_abort(h);
+    }
+    if(conn)
+        uvx_server_conn_ref(conn, -1);
+    uvx_free(req);
+}
+
+// returns 1 if the connection waiting in the listener should not be accepted now, since the listener was
+// handed off. libuv stops listening until it's accepted, by _uv_on_handoff_timer() or _uvx_handoff_abort().
+static int _uvx_handoff_defer_accept(uvx_handoff_t* h) {
+    if(!h->listener || h->state == UVX_HANDOFF_ABORTED)
+        return 0;
+    h->accept_deferred = 1;
+    return 1;
+}
+
+// hands off connections drained, closes those not drained in time, and sends DONE after all handed off
+static void _uv_on_handoff_timer(uv_timer_t* handle) {
+    uvx_handoff_t* h = (uvx_handoff_t*) handle->data;
+    uvx_server_t* xserver = h->xserver;
+    if(h->state != UVX_HANDOFF_LISTENER)
+        return;
+    if(h->accept_deferred) {
+        // accepted before the new process listened, hands it off as others
+        h->accept_deferred = 0;
+        uv_timer_stop(&_UVX_S_PRIVATE(xserver)->accept_timer);
+        _uvx_accept_conn(xserver);
+    }
+    int expired = (uv_now(xserver->uvloop) >= h->deadline);
+    unsigned int pending = 0;
+    struct lh_entry *e, *tmp;
+    lh_foreach_safe(_UVX_S_PRIVATE(xserver)->conns, e, tmp) {
+        uvx_server_conn_t* conn = (uvx_server_conn_t*) e->k;
+        uvx_server_conn_private_t* cp = _UVX_CONN_PRIVATE(conn);
+        if(cp->handoff == 2 || uv_is_closing((uv_handle_t*) &conn->uvclient))
+            continue;
+        if(cp->handoff == 0) {
+            cp->handoff = 1;
+            uv_read_stop((uv_stream_t*) &conn->uvclient); // the rest is read by the new process
+            _uvx_unpause_conn(xserver, conn);
+            if(uvx__shm_active(cp->shm) || cp->uring) {
+                _uv_disconnect_client((uv_stream_t*) &conn->uvclient); // their state can't be handed off
+                continue;
+            }
+        }
+        uvx__pubsub_flush(cp->topics);
+        if(uv_stream_get_write_queue_size((uv_stream_t*) &conn->uvclient) == 0 && !uvx__bulk_active(cp->bulk)
+           && !uvx__outq_active(cp->outq) && cp->copy == NULL) {
+            cp->handoff = 2;
+            if(!_uvx_handoff_write(h, UVX_HANDOFF_CONN, conn, (uv_stream_t*) &conn->uvclient)) {
+                _uvx_handoff_abort(h);
+                return;
+            }
+        } else if(expired) {
+            _UVX_S_EVENT(xserver, UVX_LOG_WARN, "%s close connection %p, its writes are not drained before handoff",
+                         xserver->config.name, &conn->uvclient);
+            _uv_disconnect_client((uv_stream_t*) &conn->uvclient);
+        } else {
+            pending++;
+        }
+    }
+    if(pending == 0) {
+        uv_timer_stop(&h->timer);
+        h->state = UVX_HANDOFF_DONE;
+        if(!_uvx_handoff_write(h, UVX_HANDOFF_DONE, NULL, NULL))
+            _uvx_handoff_abort(h);
+    }
+}
+
+static void _uv_on_handoff_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    uvx__alloc_mem_tail(&((uvx_handoff_t*) handle->data)->inbuf, 65536, buf);
+}
+
+// the new process closes the pipe after it read DONE. if the old process closes first, libuv of the new process
+// may report EOF before it read the records left, which are split at every handle.
+static void _uv_on_handoff_peer_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+    uvx_handoff_t* h = (uvx_handoff_t*) stream->data;
+    if(nread >= 0 || h->state == UVX_HANDOFF_ABORTED)
+        return;
+    if(!h->done_sent) {
+        _uvx_handoff_abort(h);
+        return;
+    }
+    _UVX_S_EVENT(h->xserver, UVX_LOG_INFO, "%s handed off the listener and %u connections",
+                 h->xserver->config.name, h->conns);
+    // stops accepting. a connection libuv took after DONE was sent is served here, the new process accepts the rest
+    if(h->listener && !uv_is_closing((uv_handle_t*) &h->xserver->uvserver)) {
+        uv_timer_stop(&_UVX_S_PRIVATE(h->xserver)->accept_timer);
+        if(h->accept_deferred)
+            _uvx_accept_conn(h->xserver);
+        h->accept_deferred = 0;
+        uv_close((uv_handle_t*) &h->xserver->uvserver, NULL);
+    }
+    if(h->on_done)
+        h->on_done(h->xserver, h->listener, h->conns);
+    _uvx_handoff_close(h);
+}
+
+static void _uv_after_close_rejected_pipe(uv_handle_t* handle) {
+    uvx_free(handle);
+}
+
+// returns 1 if the peer of the handoff pipe runs as the same user as this process
+static int _uvx_handoff_peer_trusted(uv_pipe_t* peer) {
+#ifdef _WIN32
+    return 1; // not checked
+#else
+    uv_os_fd_t fd;
+    if(uv_fileno((uv_handle_t*) peer, &fd) != 0)
+        return 0;
+  #ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == geteuid());
+  #else
+    uid_t uid;
+    gid_t gid;
+    return (getpeereid(fd, &uid, &gid) == 0 && uid == geteuid());
+  #endif
+#endif
+}
+
+static void _uv_after_close_untrusted_peer(uv_handle_t* handle) {
+    uvx_handoff_t* h = (uvx_handoff_t*) handle->data;
+    h->peer_closing = 0;
+    _uv_after_close_handoff(handle);
+}
+
+// accepts no other peer, frees the path for the new process to listen on for its own upgrade
+static void _uvx_handoff_unlink(uvx_handoff_t* h) {
+    char path[256];
+    size_t len = sizeof(path) - 1;
+    if(uv_pipe_getsockname(&h->pipe, path, &len) == 0) {
+        uv_fs_t req;
+        path[len] = '\0';
+        uv_fs_unlink(NULL, &req, path, NULL);
+        uv_fs_req_cleanup(&req);
+    }
+}
+
+static void _uv_on_handoff_connection(uv_stream_t* pipe, int status) {
+    uvx_handoff_t* h = (uvx_handoff_t*) pipe->data;
+    uvx_server_t* xserver = h->xserver;
+    if(status < 0)
+        return;
+    if(h->peer_inited || h->peer_closing) {
+        // only one new process
+        uv_pipe_t* rejected = (uv_pipe_t*) uvx_malloc(sizeof(uv_pipe_t));
+        uv_pipe_init(xserver->uvloop, rejected, 0);
+        uv_accept(pipe, (uv_stream_t*) rejected);
+        uv_close((uv_handle_t*) rejected, _uv_after_close_rejected_pipe);
+        return;
+    }
+    uv_pipe_init(xserver->uvloop, &h->peer, 1);
+    h->peer.data = h;
+    h->peer_inited = 1;
+    h->handles++;
+    if(uv_accept(pipe, (uv_stream_t*) &h->peer) != 0) {
+        _uvx_handoff_abort(h);
+        return;
+    }
+    if(!_uvx_handoff_peer_trusted(&h->peer)) {
+        // keeps waiting for the new process
+        _UVX_S_EVENT(xserver, UVX_LOG_WARN, "%s rejected a handoff peer of another user", xserver->config.name);
+        h->peer_inited = 0;
+        h->peer_closing = 1;
+        uv_close((uv_handle_t*) &h->peer, _uv_after_close_untrusted_peer);
+        return;
+    }
+    _UVX_S_EVENT(xserver, UVX_LOG_INFO, "%s hands off to a new process", xserver->config.name);
+    _uvx_handoff_unlink(h);
+    uv_read_start((uv_stream_t*) &h->peer, _uv_on_handoff_alloc, _uv_on_handoff_peer_read);
+    h->state = UVX_HANDOFF_LISTENER;
+    h->deadline = uv_now(xserver->uvloop) + h->drain_ms;
+    if(!_uvx_handoff_write(h, UVX_HANDOFF_LISTENER, NULL, (uv_stream_t*) &xserver->uvserver)) {
+        _uvx_handoff_abort(h);
+        return;
+    }
+    uv_timer_init(xserver->uvloop, &h->timer);
+    h->timer.data = h;
+    h->timer_inited = 1;
+    h->handles++;
+    uv_timer_start(&h->timer, _uv_on_handoff_timer, 0, UVX_HANDOFF_INTERVAL);
+}
+
+int uvx_server_handoff_listen(uvx_server_t* xserver, const char* path, unsigned int drain_ms, UVX_S_ON_HANDOFF on_done) {
+    assert(xserver && path);
+    if(_UVX_S_PRIVATE(xserver)->handoff)
+        return 0;
+    uvx_handoff_t* h = (uvx_handoff_t*) uvx_calloc(1, sizeof(uvx_handoff_t));
+    h->xserver = xserver;
+    h->on_done = on_done;
+    h->drain_ms = drain_ms;
+    uv_pipe_init(xserver->uvloop, &h->pipe, 0);
+    h->pipe.data = h;
+    h->handles = 1;
+    int ret = uv_pipe_bind(&h->pipe, path);
+    if(ret == UV_EADDRINUSE && _uvx_pipe_stale(path)) {
+        // left by a crashed process
+        uv_fs_t req;
+        uv_fs_unlink(NULL, &req, path, NULL);
+        uv_fs_req_cleanup(&req);
+        ret = uv_pipe_bind(&h->pipe, path);
+    }
+#ifndef _WIN32
+    if(ret >= 0) {
+        // only processes of the same user can connect, peers are also checked by _uvx_handoff_peer_trusted()
+        uv_fs_t req;
+        ret = uv_fs_chmod(NULL, &req, path, 0600, NULL);
+        uv_fs_req_cleanup(&req);
+    }
+#endif
+    if(ret >= 0)
+        ret = uv_listen((uv_stream_t*) &h->pipe, 1, _uv_on_handoff_connection);
+    if(ret < 0) {
+        _UVX_S_EVENT(xserver, UVX_LOG_ERROR, "%s handoff listen on %s failed: %s", xserver->config.name, path, uv_strerror(ret));
+        _UVX_S_PRIVATE(xserver)->handoff = h;
+        _uvx_handoff_close(h);
+        return 0;
+    }
+    uv_unref((uv_handle_t*) &h->pipe); // waiting for a new process doesn't keep the loop alive
+    _UVX_S_PRIVATE(xserver)->handoff = h;
+    return 1;
+}
+
+// new process: listens by itself if the listener was not adopted, and reports the result
+static void _uvx_takeover_finish(uvx_handoff_t* h) {
+    uvx_server_t* xserver = h->xserver;
+    if(xserver->uvserver.type == UV_UNKNOWN_HANDLE)
+        _uvx_server_listen(xserver, h->ip, h->port);
+    _UVX_S_EVENT(xserver, UVX_LOG_INFO, "%s took over %s and %u connections", xserver->config.name,
+                 (h->listener ? "the listener" : "nothing"), h->conns);
+    if(h->on_done)
+        h->on_done(xserver, h->listener, h->conns);
+    _uvx_handoff_close(h);
+}
+
+// accepts the handle of a record, a tcp or pipe
+static int _uvx_takeover_accept(uvx_handoff_t* h, uv_stream_t* stream, int* pipe) {
+    if(uv_pipe_pending_count(&h->pipe) == 0)
+        return UV_EINVAL;
+    uv_handle_type type = uv_pipe_pending_type(&h->pipe);
+    if(type == UV_TCP)
+        uv_tcp_init(h->xserver->uvloop, (uv_tcp_t*) stream);
+    else if(type == UV_NAMED_PIPE)
+        uv_pipe_init(h->xserver->uvloop, (uv_pipe_t*) stream, 0);
+    else
+        return UV_EINVAL;
+    *pipe = (type == UV_NAMED_PIPE);
+    return uv_accept((uv_stream_t*) &h->pipe, stream);
+}
+
+static void _uvx_takeover_listener(uvx_handoff_t* h) {
+    uvx_server_t* xserver = h->xserver;
+    int pipe = 0;
+    int r = _uvx_takeover_accept(h, (uv_stream_t*) &xserver->uvserver, &pipe);
+    if(r == 0) {
+        xserver->uvserver.data = xserver;
+        _UVX_S_PRIVATE(xserver)->pipe = pipe;
+        r = uv_listen((uv_stream_t*) &xserver->uvserver, xserver->config.conn_backlog, uvx__on_connection);
+    }
+    if(r != 0 && xserver->uvserver.type != UV_UNKNOWN_HANDLE)
+        uv_close((uv_handle_t*) &xserver->uvserver, NULL); // not listen on ip:port either, it's owned by the old process
+    if(r != 0)
+        _UVX_S_EVENT(xserver, UVX_LOG_ERROR, "%s adopt listener failed: %s", xserver->config.name, uv_strerror(r));
+    h->listener = (r == 0);
+}
+
+static void _uvx_takeover_conn(uvx_handoff_t* h, const char* data, unsigned int size) {
+    uvx_server_t* xserver = h->xserver;
+    uvx_handoff_conn_t hc;
+    if(size < sizeof(hc))
+        return;
+    memcpy(&hc, data, sizeof(hc));
+    if(sizeof(hc) + hc.extra_size + hc.inbuf_size > size)
+        return;
+    uvx_server_conn_t* conn = _uvx_new_conn(xserver);
+    int pipe = 0;
+    if(_uvx_takeover_accept(h, (uv_stream_t*) &conn->uvclient, &pipe) != 0) {
+        _UVX_S_EVENT(xserver, UVX_LOG_ERROR, "%s adopt connection failed", xserver->config.name);
+        if(xserver->config.on_conn_fail) {
+            uvx__watch_enter("on_conn_fail", xserver->config.name);
+            xserver->config.on_conn_fail(xserver, conn);
+            uvx__watch_exit();
+        }
+        if(conn->uvclient.type != UV_UNKNOWN_HANDLE) {
+            uv_close((uv_handle_t*) &conn->uvclient, _uv_after_close_connection);
+        } else {
+            lh_table_delete(_UVX_S_PRIVATE(xserver)->conns, (const void*) conn);
+            uvx_server_conn_ref(conn, -1);
+        }
+        return;
+    }
+    if(conn->extra)
+        memcpy(conn->extra, data + sizeof(hc),
+               (hc.extra_size < (uint32_t) xserver->config.conn_extra_size ? hc.extra_size : (uint32_t) xserver->config.conn_extra_size));
+    if(hc.inbuf_size > 0) {
+        uv_buf_t tail;
+        uvx__alloc_mem_tail(&conn->inbuf, hc.inbuf_size, &tail);
+        memcpy(tail.base, data + sizeof(hc) + hc.extra_size, hc.inbuf_size);
+        conn->inbuf.size += hc.inbuf_size;
+    }
+    h->conns++;
+    _uvx_open_conn(xserver, conn);
+    if(conn->inbuf.size > 0 && xserver->config.accumulate_recv && xserver->config.on_recv
+       && !uv_is_closing((uv_handle_t*) &conn->uvclient)) {
+        uvx__watch_enter("on_recv", xserver->config.name);
+        xserver->config.on_recv(xserver, conn, conn->inbuf.pdata, conn->inbuf.size);
+        uvx__watch_exit();
+    }
+}
+
+static void _uv_on_takeover_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    uvx__alloc_mem_tail(&((uvx_handoff_t*) handle->data)->inbuf, 65536, buf);
+}
+
+static void _uv_on_takeover_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+    uvx_handoff_t* h = (uvx_handoff_t*) stream->data;
+    if(nread < 0) {
+        if(nread != UV_EOF)
+            _UVX_S_EVENT(h->xserver, UVX_LOG_ERROR, "%s takeover read failed: %s", h->xserver->config.name, uv_strerror(nread));
+        _uvx_takeover_finish(h);
+        return;
+    }
+    h->inbuf.size += (unsigned int) nread;
+    while(h->inbuf.size >= sizeof(uvx_handoff_hdr_t)) {
+        uvx_handoff_hdr_t hdr;
+        memcpy(&hdr, h->inbuf.pdata, sizeof(hdr));
+        if(h->inbuf.size < sizeof(hdr) + hdr.size)
+            break;
+        const char* data = (const char*) h->inbuf.pdata + sizeof(hdr);
+        if(hdr.type == UVX_HANDOFF_LISTENER) {
+            _uvx_takeover_listener(h);
+        } else if(hdr.type == UVX_HANDOFF_CONN) {
+            _uvx_takeover_conn(h, data, hdr.size);
+        } else if(hdr.type == UVX_HANDOFF_DONE) {
+            _uvx_takeover_finish(h);
+            return;
+        }
+        automem_erase(&h->inbuf, sizeof(hdr) + hdr.size);
+    }
+}
+
+static void _uv_on_takeover_connect(uv_connect_t* req, int status) {
+    uvx_handoff_t* h = (uvx_handoff_t*) req->data;
+    if(status < 0) {
+        _UVX_S_EVENT(h->xserver, UVX_LOG_INFO, "%s no old process to take over: %s", h->xserver->config.name, uv_strerror(status));
+        _uvx_takeover_finish(h);
+        return;
+    }
+    uv_read_start((uv_stream_t*) &h->pipe, _uv_on_takeover_alloc, _uv_on_takeover_read);
+}
+
+int uvx_server_takeover(uvx_server_t* xserver, uv_loop_t* loop, const char* path, const char* ip, int port,
+                        uvx_server_config_t config, UVX_S_ON_HANDOFF on_done) {
+    assert(xserver && loop && path && ip);
+    _uvx_server_init(xserver, loop, config);
+    memset(&xserver->uvserver_pipe, 0, sizeof(xserver->uvserver_pipe)); // type is set by the listener adopted
+    uvx_handoff_t* h = (uvx_handoff_t*) uvx_calloc(1, sizeof(uvx_handoff_t));
+    h->xserver = xserver;
+    h->on_done = on_done;
+    snprintf(h->ip, sizeof(h->ip), "%s", ip);
+    h->port = port;
+    uv_pipe_init(loop, &h->pipe, 1);
+    h->pipe.data = h;
+    h->handles = 1;
+    h->connect.data = h;
+    uv_pipe_connect(&h->connect, &h->pipe, path, _uv_on_takeover_connect);
+    _UVX_S_PRIVATE(xserver)->handoff = h;
+    return 1;
+}
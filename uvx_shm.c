@@ -0,0 +1,623 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#ifndef _WIN32
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+#include "uvx.h"
+#include "utils/atomic.h"
+
+// uvx shared-memory ring transport between xclient and xserver on the same host, see config.shm_*.
+//
+// the xclient creates a segment of two SPSC rings (client->server and server->client), and sends a hello
+// with its name as the first bytes of the connection. the xserver maps it and replies. after that, all
+// messages go through the rings, and the connection is only used as the doorbell: a byte is written to it
+// when the peer is sleeping (not busy-polling) and there are new messages or freed space for it.
+
+// defines in uvx_event.c
+void uvx__event(int level, const char* tag, const char* fmt, ...);
+
+// defines in uvx.c
+int uvx__send_to_stream(uv_stream_t* stream, void* data, unsigned int size, uvx_stats_t* stats, uvx_histogram_t* latency);
+
+#ifndef _WIN32
+
+#define UVX_SHM_MAGIC       "UVXSHM1\n"
+#define UVX_SHM_MAGIC_SIZE  8
+#define UVX_SHM_NAME_MAX    64
+#define UVX_SHM_HELLO_SIZE  (UVX_SHM_MAGIC_SIZE + 8 + UVX_SHM_NAME_MAX) // magic, ring size, reserved, name
+#define UVX_SHM_REPLY_SIZE  (UVX_SHM_MAGIC_SIZE + 4) // magic, 1 if accepted or 0 if not
+#define UVX_SHM_RING_MIN    4096
+#define UVX_SHM_RING_MAX    (1u << 30)
+#define UVX_SHM_WRAP        0xFFFFFFFFu // the record header meaning "continue at the start of the ring"
+#define UVX_SHM_DRAIN_MAX   1024 // messages delivered per poll, the rest are left to the next loop iteration
+#define UVX_SHM_REPLY_TIMEOUT 5000 // ms, the xclient falls back to the connection if the server doesn't reply the hello
+
+#define UVX_SHM_ALIGN8(n)   (((n) + 7) & ~7u)
+
+// the control block of a ring, in shared memory. head and tail never wrap, the offset is `% ring_size`.
+// each record is a 8 bytes header (uint32 size and padding) followed by data, padded to 8 bytes.
+typedef struct uvx_shm_ctl_s {
+    uint64_t head;      // written by the producer only
+    char pad1[56];
+    uint64_t tail;      // written by the consumer only
+    char pad2[56];
+    uint32_t sleeping;  // 1 if the consumer is not polling, the producer rings the doorbell and clears it
+    uint32_t waiting;   // 1 if the producer is waiting for space, the consumer rings the doorbell and clears it
+    char pad3[56];
+} uvx_shm_ctl_t;
+
+enum { UVX_SHM_HELLO, UVX_SHM_ON, UVX_SHM_CLOSED };
+
+// returns 0 if the owner stops receiving (e.g. closed the connection in on_recv)
+typedef int (*UVX_SHM_ON_MSG)(void* owner, void* data, unsigned int size);
+// shm stopped, the owner should close it by uvx__shm_close(), and close the connection too if `fatal`
+// (the peer corrupted the ring), or else use the connection as usual (the hello is not replied in time)
+typedef void (*UVX_SHM_ON_FAIL)(void* owner, int fatal);
+
+typedef struct uvx_shm_s {
+    uv_idle_t idle;       // busy-polls the rings while active
+    uv_timer_t reply_timer; // see UVX_SHM_REPLY_TIMEOUT
+    uv_stream_t* stream;  // the connection, used for negotiation and doorbells
+    uvx_stats_t* stats;
+    UVX_SHM_ON_MSG on_msg;
+    UVX_SHM_ON_FAIL on_fail;
+    void* owner;
+    int state;
+    int creator;          // 1 on xclient side, which creates (and unlinks) the segment
+    char name[UVX_SHM_NAME_MAX];
+    char handshake[UVX_SHM_HELLO_SIZE]; // the hello (on xserver side) or reply (on xclient side) received so far
+    unsigned int handshake_size;
+    void* base;
+    size_t map_size;
+    unsigned int ring_size;
+    uvx_shm_ctl_t *in_ctl, *out_ctl;
+    char *in_data, *out_data;
+    // sends waiting for space of the ring, the data is owned
+    uv_buf_t* overflow;
+    unsigned int overflow_head, overflow_count, overflow_cap;
+    // adaptive busy-polling: after the last message, poll up to spin_us before sleeping. spin_us halves
+    // if polling finds nothing, and doubles if the doorbell rings within spin_max_us after sleeping.
+    unsigned int spin_max_us, spin_us;
+    uint64_t spin_start, sleep_time; // uv_hrtime() in microseconds
+    uv_write_t doorbell_req;         // used if the doorbell can't be written by uv_try_write()
+    int doorbell_busy, doorbell_again;
+    int handles_closed;              // shm is freed after both idle and reply_timer closed
+} uvx_shm_t;
+
+static void uvx__shm_poll(uvx_shm_t* shm);
+
+static uint64_t _uvx_shm_now_us(void) {
+    return uv_hrtime() / 1000;
+}
+
+static void _uvx_shm_free(uvx_shm_t* shm) {
+    if(shm->base)
+        munmap(shm->base, shm->map_size);
+    uvx_free(shm->overflow);
+    uvx_free(shm);
+}
+
+static void _uvx_shm_unlink(uvx_shm_t* shm) {
+    if(shm->creator && shm->name[0])
+        shm_unlink(shm->name);
+    shm->name[0] = '\0';
+}
+
+static void _uvx_shm_map(uvx_shm_t* shm, void* base, unsigned int ring_size) {
+    shm->base = base;
+    shm->ring_size = ring_size;
+    shm->map_size = 2 * sizeof(uvx_shm_ctl_t) + 2 * (size_t) ring_size;
+    uvx_shm_ctl_t* ctls = (uvx_shm_ctl_t*) base;
+    char* data = (char*)(ctls + 2);
+    // ring 0 is client->server, ring 1 is server->client
+    int in = (shm->creator ? 1 : 0);
+    shm->in_ctl = &ctls[in];
+    shm->out_ctl = &ctls[1 - in];
+    shm->in_data = data + (size_t) in * ring_size;
+    shm->out_data = data + (size_t)(1 - in) * ring_size;
+}
+
+static void _uvx_shm_after_doorbell(uv_write_t* req, int status);
+
+static void _uvx_shm_doorbell(uvx_shm_t* shm) {
+    static char bell = 0;
+    uv_buf_t buf = uv_buf_init(&bell, 1);
+    if(shm->doorbell_busy) {
+        shm->doorbell_again = 1;
+        return;
+    }
+    if(uv_try_write(shm->stream, &buf, 1) == 1)
+        return;
+    shm->doorbell_req.data = shm;
+    if(uv_write(&shm->doorbell_req, shm->stream, &buf, 1, _uvx_shm_after_doorbell) == 0)
+        shm->doorbell_busy = 1;
+}
+
+static void _uvx_shm_after_doorbell(uv_write_t* req, int status) {
+    uvx_shm_t* shm = (uvx_shm_t*) req->data;
+    shm->doorbell_busy = 0;
+    if(shm->state == UVX_SHM_CLOSED) {
+        if(shm->handles_closed == 2)
+            _uvx_shm_free(shm);
+        return;
+    }
+    if(status == 0 && shm->doorbell_again) {
+        shm->doorbell_again = 0;
+        _uvx_shm_doorbell(shm);
+    }
+}
+
+// wakes up the consumer of the outgoing ring if it's sleeping
+static void _uvx_shm_notify(uvx_shm_t* shm) {
+    if(shm->state != UVX_SHM_ON)
+        return; // the xserver drains the ring after accepting the hello
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // orders the store of head before the load of sleeping
+    if(__atomic_load_n(&shm->out_ctl->sleeping, __ATOMIC_RELAXED)
+       && __atomic_exchange_n(&shm->out_ctl->sleeping, 0, __ATOMIC_SEQ_CST))
+        _uvx_shm_doorbell(shm);
+}
+
+// writes a record to the outgoing ring, returns 0 if there is no space
+static int _uvx_shm_write(uvx_shm_t* shm, const void* data, unsigned int size) {
+    uvx_shm_ctl_t* ctl = shm->out_ctl;
+    uint64_t head = ctl->head;
+    uint64_t tail = __atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE);
+    uint64_t space = shm->ring_size - (head - tail);
+    unsigned int offset = (unsigned int)(head % shm->ring_size);
+    unsigned int contiguous = shm->ring_size - offset;
+    unsigned int need = 8 + UVX_SHM_ALIGN8(size);
+    if(need > contiguous) {
+        if(space < (uint64_t) contiguous + need)
+            return 0;
+        *(uint32_t*)(shm->out_data + offset) = UVX_SHM_WRAP;
+        head += contiguous;
+        offset = 0;
+    } else if(space < need) {
+        return 0;
+    }
+    *(uint32_t*)(shm->out_data + offset) = size;
+    memcpy(shm->out_data + offset + 8, data, size);
+    __atomic_store_n(&ctl->head, head + need, __ATOMIC_RELEASE);
+    uvx_atomic_add1w_u64(&shm->stats->msgs_out, 1);
+    uvx_atomic_add1w_u64(&shm->stats->bytes_out, size);
+    return 1;
+}
+
+// writes the overflow sends into the ring as many as possible, returns the count
+static unsigned int _uvx_shm_flush(uvx_shm_t* shm) {
+    unsigned int n = 0;
+    while(shm->overflow_count > 0) {
+        uv_buf_t* buf = &shm->overflow[shm->overflow_head];
+        if(!_uvx_shm_write(shm, buf->base, (unsigned int) buf->len)) {
+            if(__atomic_load_n(&shm->out_ctl->waiting, __ATOMIC_RELAXED))
+                break; // the consumer will ring the doorbell after freeing space
+            __atomic_store_n(&shm->out_ctl->waiting, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            continue; // try again, the consumer may have freed space before seeing `waiting`
+        }
+        uvx_atomic_add1w_u64(&shm->stats->write_queue_count, (uint64_t)-1);
+        uvx_atomic_add1w_u64(&shm->stats->write_queue_bytes, (uint64_t)0 - buf->len);
+        uvx_free(buf->base);
+        shm->overflow_head++;
+        shm->overflow_count--;
+        n++;
+    }
+    if(shm->overflow_count == 0)
+        shm->overflow_head = 0;
+    if(n > 0)
+        _uvx_shm_notify(shm);
+    return n;
+}
+
+static void _uvx_shm_overflow_push(uvx_shm_t* shm, void* data, unsigned int size) {
+    if(shm->overflow_head + shm->overflow_count == shm->overflow_cap) {
+        if(shm->overflow_head > 0) {
+            memmove(shm->overflow, shm->overflow + shm->overflow_head, shm->overflow_count * sizeof(uv_buf_t));
+            shm->overflow_head = 0;
+        } else {
+            shm->overflow_cap = (shm->overflow_cap ? shm->overflow_cap * 2 : 16);
+            shm->overflow = (uv_buf_t*) uvx_realloc(shm->overflow, shm->overflow_cap * sizeof(uv_buf_t));
+        }
+    }
+    shm->overflow[shm->overflow_head + shm->overflow_count++] = uv_buf_init((char*)data, size);
+    uvx_atomic_add1w_u64(&shm->stats->write_queue_count, 1);
+    uvx_atomic_add1w_u64(&shm->stats->write_queue_bytes, size);
+}
+
+// reads the size of the record at `tail` of a ring, which is UVX_SHM_WRAP or fits in the ring before `head`.
+// returns 0 if the ring is corrupted: it's shared memory, the peer can write anything into it.
+static int _uvx_shm_record(uvx_shm_t* shm, const char* ring, uint64_t tail, uint64_t head, uint32_t* size) {
+    uint64_t used = head - tail;
+    unsigned int offset = (unsigned int)(tail % shm->ring_size);
+    if(used > shm->ring_size || used < 8 || offset % 8 != 0)
+        return 0;
+    *size = *(const uint32_t*)(ring + offset);
+    if(*size == UVX_SHM_WRAP)
+        return (shm->ring_size - offset <= used);
+    return (*size <= shm->ring_size - offset - 8 && 8 + UVX_SHM_ALIGN8(*size) <= used);
+}
+
+// delivers up to `max` messages of the incoming ring, returns the count
+static unsigned int _uvx_shm_drain(uvx_shm_t* shm, unsigned int max) {
+    uvx_shm_ctl_t* ctl = shm->in_ctl;
+    uint64_t tail = ctl->tail;
+    uint64_t head = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE);
+    unsigned int n = 0;
+    while(tail != head && n < max && shm->state == UVX_SHM_ON) {
+        unsigned int offset = (unsigned int)(tail % shm->ring_size);
+        uint32_t size;
+        if(!_uvx_shm_record(shm, shm->in_data, tail, head, &size)) {
+            uvx__event(UVX_LOG_WARN, "uvx-shm", "the incoming ring is corrupted, close the connection");
+            shm->state = UVX_SHM_CLOSED; // stops reading and writing the rings
+            shm->on_fail(shm->owner, 1);
+            return n;
+        }
+        if(size == UVX_SHM_WRAP) {
+            tail += shm->ring_size - offset;
+            __atomic_store_n(&ctl->tail, tail, __ATOMIC_RELEASE);
+            continue;
+        }
+        n++;
+        uvx_atomic_add1w_u64(&shm->stats->msgs_in, 1);
+        uvx_atomic_add1w_u64(&shm->stats->bytes_in, size);
+        int go_on = shm->on_msg(shm->owner, shm->in_data + offset + 8, size);
+        tail += 8 + UVX_SHM_ALIGN8(size);
+        __atomic_store_n(&ctl->tail, tail, __ATOMIC_RELEASE);
+        if(!go_on)
+            break;
+        if(tail == head)
+            head = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE);
+    }
+    if(n > 0 && shm->state == UVX_SHM_ON) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST); // orders the store of tail before the load of waiting
+        if(__atomic_load_n(&ctl->waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&ctl->waiting, 0, __ATOMIC_SEQ_CST))
+            _uvx_shm_doorbell(shm);
+    }
+    return n;
+}
+
+static int _uvx_shm_in_empty(uvx_shm_t* shm) {
+    return __atomic_load_n(&shm->in_ctl->head, __ATOMIC_ACQUIRE) == shm->in_ctl->tail;
+}
+
+static void _uvx_shm_on_idle(uv_idle_t* handle) {
+    uvx__shm_poll((uvx_shm_t*) handle->data);
+}
+
+// drains the incoming ring and flushes the overflow, then keeps polling (by idle handle) or sleeps
+static void uvx__shm_poll(uvx_shm_t* shm) {
+    uint64_t now = _uvx_shm_now_us();
+    if(_uvx_shm_drain(shm, UVX_SHM_DRAIN_MAX) + _uvx_shm_flush(shm) > 0)
+        shm->spin_start = now;
+    if(shm->state != UVX_SHM_ON)
+        return;
+    if(!_uvx_shm_in_empty(shm) || now - shm->spin_start < shm->spin_us) {
+        uv_idle_start(&shm->idle, _uvx_shm_on_idle);
+        return;
+    }
+    // goes to sleep, and checks again in case the producer has missed `sleeping`
+    if(uv_is_active((uv_handle_t*) &shm->idle)) {
+        uv_idle_stop(&shm->idle);
+        shm->spin_us /= 2;
+    }
+    shm->sleep_time = now;
+    __atomic_store_n(&shm->in_ctl->sleeping, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(!_uvx_shm_in_empty(shm)) {
+        __atomic_store_n(&shm->in_ctl->sleeping, 0, __ATOMIC_SEQ_CST);
+        shm->spin_start = now;
+        uv_idle_start(&shm->idle, _uvx_shm_on_idle);
+    }
+}
+
+// a doorbell rang: there are new messages or freed space
+static void _uvx_shm_wake(uvx_shm_t* shm) {
+    if(!uv_is_active((uv_handle_t*) &shm->idle)) {
+        uint64_t now = _uvx_shm_now_us();
+        if(now - shm->sleep_time <= shm->spin_max_us)
+            shm->spin_us = (shm->spin_us * 2 + 1 < shm->spin_max_us ? shm->spin_us * 2 + 1 : shm->spin_max_us);
+        shm->spin_start = now;
+    }
+    uvx__shm_poll(shm);
+}
+
+uvx_shm_t* uvx__shm_new(uv_loop_t* loop, uv_stream_t* stream, unsigned int spin_us, uvx_stats_t* stats,
+                        UVX_SHM_ON_MSG on_msg, UVX_SHM_ON_FAIL on_fail, void* owner) {
+    uvx_shm_t* shm = (uvx_shm_t*) uvx_calloc(1, sizeof(uvx_shm_t));
+    uv_idle_init(loop, &shm->idle);
+    shm->idle.data = shm;
+    uv_timer_init(loop, &shm->reply_timer);
+    shm->reply_timer.data = shm;
+    shm->stream = stream;
+    shm->stats = stats;
+    shm->on_msg = on_msg;
+    shm->on_fail = on_fail;
+    shm->owner = owner;
+    shm->state = UVX_SHM_HELLO;
+    // busy-polling only helps if the peer runs on another CPU at the same time
+    shm->spin_max_us = shm->spin_us = (uv_available_parallelism() > 1 ? spin_us : 0);
+    if(stream->type == UV_TCP)
+        uv_tcp_nodelay((uv_tcp_t*) stream, 1); // or else doorbells are delayed by Nagle's algorithm
+    return shm;
+}
+
+// returns 1 if the peer of `stream` is on the same host: a unix domain socket, or a loopback address
+int uvx__shm_is_local(uv_stream_t* stream) {
+    if(stream->type == UV_NAMED_PIPE)
+        return 1;
+    struct sockaddr_storage addr;
+    int len = sizeof(addr);
+    if(uv_tcp_getpeername((uv_tcp_t*) stream, (struct sockaddr*) &addr, &len) != 0)
+        return 0;
+    if(addr.ss_family == AF_INET)
+        return (((unsigned char*) &((struct sockaddr_in*) &addr)->sin_addr)[0] == 127);
+    if(addr.ss_family == AF_INET6) {
+        static const unsigned char loopback[16] = { [15] = 1 };
+        static const unsigned char v4mapped[12] = { [10] = 0xff, [11] = 0xff };
+        const unsigned char* a = (const unsigned char*) &((struct sockaddr_in6*) &addr)->sin6_addr;
+        return (memcmp(a, loopback, 16) == 0 || (memcmp(a, v4mapped, 12) == 0 && a[12] == 127));
+    }
+    return 0;
+}
+
+// returns 1 if the first read of a connection starts with a hello of xclient
+int uvx__shm_is_hello(const void* data, unsigned int size) {
+    return (size >= UVX_SHM_MAGIC_SIZE && memcmp(data, UVX_SHM_MAGIC, UVX_SHM_MAGIC_SIZE) == 0);
+}
+
+static void _uvx_shm_fallback(uvx_shm_t* shm);
+
+static void _uvx_shm_on_reply_timeout(uv_timer_t* handle) {
+    uvx_shm_t* shm = (uvx_shm_t*) handle->data;
+    if(shm->state != UVX_SHM_HELLO)
+        return;
+    uvx__event(UVX_LOG_WARN, "uvx-shm", "the server doesn't reply the shared-memory hello, use the connection");
+    _uvx_shm_unlink(shm);
+    _uvx_shm_fallback(shm);
+    shm->state = UVX_SHM_CLOSED;
+    shm->on_fail(shm->owner, 0);
+}
+
+// creates the segment and sends the hello, on xclient side. returns 1 on success, or 0 if fails.
+int uvx__shm_connect(uvx_shm_t* shm, unsigned int ring_size) {
+    static unsigned int seq = 0;
+    if(ring_size < UVX_SHM_RING_MIN)
+        ring_size = UVX_SHM_RING_MIN;
+    if(ring_size > UVX_SHM_RING_MAX)
+        ring_size = UVX_SHM_RING_MAX;
+    ring_size = (ring_size + UVX_SHM_RING_MIN - 1) & ~(UVX_SHM_RING_MIN - 1);
+    shm->creator = 1;
+    snprintf(shm->name, sizeof(shm->name), "/uvx-%d-%u-%08x", (int) getpid(), ++seq, (unsigned int)(uv_hrtime() & 0xffffffff));
+    int fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0) {
+        uvx__event(UVX_LOG_WARN, "uvx-shm", "shm_open(%s) failed: %s", shm->name, strerror(errno));
+        shm->name[0] = '\0';
+        return 0;
+    }
+    size_t map_size = 2 * sizeof(uvx_shm_ctl_t) + 2 * (size_t) ring_size;
+    void* base = MAP_FAILED;
+    if(ftruncate(fd, (off_t) map_size) == 0)
+        base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        uvx__event(UVX_LOG_WARN, "uvx-shm", "mapping %s failed: %s", shm->name, strerror(errno));
+        _uvx_shm_unlink(shm);
+        return 0;
+    }
+    _uvx_shm_map(shm, base, ring_size); // zero-filled by ftruncate
+    shm->in_ctl->sleeping = shm->out_ctl->sleeping = 1;
+
+    char* hello = (char*) uvx_calloc(1, UVX_SHM_HELLO_SIZE);
+    memcpy(hello, UVX_SHM_MAGIC, UVX_SHM_MAGIC_SIZE);
+    memcpy(hello + UVX_SHM_MAGIC_SIZE, &ring_size, 4);
+    memcpy(hello + UVX_SHM_MAGIC_SIZE + 8, shm->name, strlen(shm->name));
+    if(!uvx__send_to_stream(shm->stream, hello, UVX_SHM_HELLO_SIZE, NULL, NULL)) {
+        _uvx_shm_unlink(shm);
+        return 0;
+    }
+    // e.g. the server is not an xserver, or its shm_enable is off
+    uv_timer_start(&shm->reply_timer, _uvx_shm_on_reply_timeout, UVX_SHM_REPLY_TIMEOUT, 0);
+    return 1;
+}
+
+// maps the segment of a complete hello, on xserver side. returns 1 on success, or 0 if fails.
+static int _uvx_shm_accept(uvx_shm_t* shm) {
+    const char* hello = shm->handshake;
+    uint32_t ring_size;
+    memcpy(&ring_size, hello + UVX_SHM_MAGIC_SIZE, 4);
+    const char* name = hello + UVX_SHM_MAGIC_SIZE + 8;
+    // only segments created by xclients (named "/uvx-*") can be mapped
+    if(ring_size < UVX_SHM_RING_MIN || ring_size > UVX_SHM_RING_MAX || ring_size % 8 != 0
+       || memchr(name, '\0', UVX_SHM_NAME_MAX) == NULL || strncmp(name, "/uvx-", 5) != 0 || strchr(name + 1, '/'))
+        return 0;
+    int fd = shm_open(name, O_RDWR, 0);
+    if(fd < 0) {
+        uvx__event(UVX_LOG_WARN, "uvx-shm", "shm_open(%s) failed: %s", name, strerror(errno));
+        return 0;
+    }
+    size_t map_size = 2 * sizeof(uvx_shm_ctl_t) + 2 * (size_t) ring_size;
+    struct stat st;
+    void* base = MAP_FAILED;
+    // created by an xclient of the same user, with mode 0600, so others can't access it
+    if(fstat(fd, &st) == 0 && st.st_uid == geteuid() && S_ISREG(st.st_mode) && (st.st_mode & 077) == 0
+       && (size_t) st.st_size == map_size)
+        base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        uvx__event(UVX_LOG_WARN, "uvx-shm", "refused to map %s: not owned by this user, or bad mode or size", name);
+        return 0;
+    }
+    _uvx_shm_map(shm, base, ring_size);
+    return 1;
+}
+
+// sends the messages written into the ring before the xserver refused it, through the connection
+static void _uvx_shm_fallback(uvx_shm_t* shm) {
+    uvx_shm_ctl_t* ctl = shm->out_ctl;
+    uint64_t tail = ctl->tail, head = ctl->head;
+    while(tail != head) {
+        unsigned int offset = (unsigned int)(tail % shm->ring_size);
+        uint32_t size;
+        if(!_uvx_shm_record(shm, shm->out_data, tail, head, &size))
+            break; // the peer wrote into it
+        if(size == UVX_SHM_WRAP) {
+            tail += shm->ring_size - offset;
+            continue;
+        }
+        void* data = uvx_malloc(size);
+        memcpy(data, shm->out_data + offset + 8, size);
+        uvx__send_to_stream(shm->stream, data, size, NULL, NULL); // already counted in stats
+        tail += 8 + UVX_SHM_ALIGN8(size);
+    }
+    ctl->tail = head;
+    for(; shm->overflow_count > 0; shm->overflow_head++, shm->overflow_count--) {
+        uv_buf_t* buf = &shm->overflow[shm->overflow_head];
+        uvx_atomic_add1w_u64(&shm->stats->write_queue_count, (uint64_t)-1);
+        uvx_atomic_add1w_u64(&shm->stats->write_queue_bytes, (uint64_t)0 - buf->len);
+        uvx__send_to_stream(shm->stream, buf->base, (unsigned int) buf->len, shm->stats, NULL);
+    }
+}
+
+// handles bytes read from the connection: the hello or reply, and doorbells.
+// returns 1 if all bytes were consumed, or 0 if the negotiation failed, then the owner should close shm,
+// and the remaining bytes (from `data + *used`) are normal data.
+int uvx__shm_on_read(uvx_shm_t* shm, const void* data, unsigned int size, unsigned int* used) {
+    *used = 0;
+    if(shm->state == UVX_SHM_HELLO) {
+        unsigned int expected = (shm->creator ? UVX_SHM_REPLY_SIZE : UVX_SHM_HELLO_SIZE);
+        unsigned int n = expected - shm->handshake_size;
+        if(n > size)
+            n = size;
+        if(shm->creator && shm->handshake_size < UVX_SHM_MAGIC_SIZE) {
+            unsigned int m = UVX_SHM_MAGIC_SIZE - shm->handshake_size;
+            if(memcmp(data, UVX_SHM_MAGIC + shm->handshake_size, (m < n ? m : n)) != 0) {
+                // not a reply, the server doesn't know the hello: these bytes are normal data
+                uvx__event(UVX_LOG_WARN, "uvx-shm", "the server doesn't support shared-memory transport");
+                uv_timer_stop(&shm->reply_timer);
+                _uvx_shm_unlink(shm);
+                _uvx_shm_fallback(shm);
+                return 0;
+            }
+        }
+        memcpy(shm->handshake + shm->handshake_size, data, n);
+        shm->handshake_size += n;
+        *used = n;
+        if(shm->handshake_size < expected)
+            return 1;
+        if(shm->creator) {
+            uint32_t accepted = 0;
+            memcpy(&accepted, shm->handshake + UVX_SHM_MAGIC_SIZE, 4);
+            uv_timer_stop(&shm->reply_timer);
+            _uvx_shm_unlink(shm); // both sides have mapped it (or never will)
+            if(accepted != 1) {
+                uvx__event(UVX_LOG_WARN, "uvx-shm", "shared-memory transport is refused by the server");
+                _uvx_shm_fallback(shm);
+                return 0;
+            }
+        } else {
+            int accepted = _uvx_shm_accept(shm);
+            char* reply = (char*) uvx_malloc(UVX_SHM_REPLY_SIZE);
+            memcpy(reply, UVX_SHM_MAGIC, UVX_SHM_MAGIC_SIZE);
+            memcpy(reply + UVX_SHM_MAGIC_SIZE, &accepted, 4);
+            uvx__send_to_stream(shm->stream, reply, UVX_SHM_REPLY_SIZE, NULL, NULL);
+            if(!accepted) {
+                uvx__event(UVX_LOG_WARN, "uvx-shm", "refused a shared-memory transport");
+                return 0;
+            }
+        }
+        shm->state = UVX_SHM_ON;
+        shm->sleep_time = _uvx_shm_now_us();
+        _uvx_shm_notify(shm); // for the messages written before the reply
+    }
+    *used = size; // the rest are doorbells
+    _uvx_shm_wake(shm);
+    return 1;
+}
+
+// takes `data`, writes it into the ring, or queues it if the ring is full.
+// returns 1 on success (or queued), or 0 if fails.
+int uvx__shm_send(uvx_shm_t* shm, void* data, unsigned int size) {
+    if(size > shm->ring_size / 2 - 8 || shm->state == UVX_SHM_CLOSED) {
+        uvx__event(UVX_LOG_WARN, "uvx-shm", "failed to send %u bytes through shared memory (ring size %u)", size, shm->ring_size);
+        uvx_atomic_add1w_u64(&shm->stats->send_failures, 1);
+        uvx_free(data);
+        return 0;
+    }
+    if(shm->overflow_count == 0 && _uvx_shm_write(shm, data, size)) {
+        uvx_free(data);
+        _uvx_shm_notify(shm);
+        return 1;
+    }
+    _uvx_shm_overflow_push(shm, data, size);
+    if(shm->state == UVX_SHM_ON)
+        _uvx_shm_flush(shm);
+    return 1;
+}
+
+// delivers all remaining messages of the incoming ring, e.g. before closing the connection on EOF
+void uvx__shm_drain(uvx_shm_t* shm) {
+    while(shm->state == UVX_SHM_ON && _uvx_shm_drain(shm, UVX_SHM_DRAIN_MAX) > 0);
+}
+
+static void _uvx_shm_after_close_handle(uv_handle_t* handle) {
+    uvx_shm_t* shm = (uvx_shm_t*) handle->data;
+    if(++shm->handles_closed == 2 && !shm->doorbell_busy)
+        _uvx_shm_free(shm); // or else freed in _uvx_shm_after_doorbell()
+}
+
+// drops the sends in overflow, and frees shm later. the connection should be closed (or fall back to it).
+void uvx__shm_close(uvx_shm_t* shm) {
+    shm->state = UVX_SHM_CLOSED;
+    _uvx_shm_unlink(shm);
+    for(; shm->overflow_count > 0; shm->overflow_head++, shm->overflow_count--) {
+        uv_buf_t* buf = &shm->overflow[shm->overflow_head];
+        uvx_atomic_add1w_u64(&shm->stats->write_queue_count, (uint64_t)-1);
+        uvx_atomic_add1w_u64(&shm->stats->write_queue_bytes, (uint64_t)0 - buf->len);
+        uvx_atomic_add1w_u64(&shm->stats->send_failures, 1);
+        uvx_free(buf->base);
+    }
+    uv_idle_stop(&shm->idle);
+    uv_close((uv_handle_t*) &shm->idle, _uvx_shm_after_close_handle);
+    uv_close((uv_handle_t*) &shm->reply_timer, _uvx_shm_after_close_handle);
+}
+
+// returns 1 if messages are transferred through shared memory
+int uvx__shm_active(uvx_shm_t* shm) {
+    return (shm && shm->state == UVX_SHM_ON);
+}
+
+// returns the count of sends queued while the ring is full
+unsigned int uvx__shm_queued(uvx_shm_t* shm) {
+    return (shm ? shm->overflow_count : 0);
+}
+
+#else // _WIN32: not supported, xclients use the connection as usual
+
+typedef int (*UVX_SHM_ON_MSG)(void* owner, void* data, unsigned int size);
+typedef void (*UVX_SHM_ON_FAIL)(void* owner, int fatal);
+struct uvx_shm_s;
+
+struct uvx_shm_s* uvx__shm_new(uv_loop_t* loop, uv_stream_t* stream, unsigned int spin_us, uvx_stats_t* stats,
+                               UVX_SHM_ON_MSG on_msg, UVX_SHM_ON_FAIL on_fail, void* owner) {
+    uvx__event(UVX_LOG_WARN, "uvx-shm", "shared-memory transport is not supported on Windows");
+    return NULL;
+}
+int uvx__shm_is_local(uv_stream_t* stream) { return 0; }
+int uvx__shm_is_hello(const void* data, unsigned int size) { return 0; }
+int uvx__shm_connect(struct uvx_shm_s* shm, unsigned int ring_size) { return 0; }
+int uvx__shm_on_read(struct uvx_shm_s* shm, const void* data, unsigned int size, unsigned int* used) { *used = 0; return 0; }
+int uvx__shm_send(struct uvx_shm_s* shm, void* data, unsigned int size) { uvx_free(data); return 0; }
+void uvx__shm_drain(struct uvx_shm_s* shm) { }
+void uvx__shm_close(struct uvx_shm_s* shm) { }
+int uvx__shm_active(struct uvx_shm_s* shm) { return 0; }
+unsigned int uvx__shm_queued(struct uvx_shm_s* shm) { return 0; }
+
+#endif // _WIN32
@@ -6,18 +6,31 @@
 #include <assert.h>
 
 #include "uvx.h"
+#include "utils/atomic.h"
 
 // Author: Liigo <liigo@qq.com>.
 
+// defines in uvx_watchdog.c
+void uvx__watch_enter(const char* callback, const char* name);
+void uvx__watch_exit(void);
+
 // defines in uvx.c
 void uvx__on_alloc_buf(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+void uvx__stats_snapshot(uvx_stats_t* src, uvx_stats_t* dst);
 
 static void uvx__on_udp_recv(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf, const struct sockaddr* addr, unsigned int flags) {
     uvx_udp_t* xudp = (uvx_udp_t*) handle->data;
     // printf("on udp recv: size=%d \n", nread);
-    if(nread > 0 && xudp->config.on_recv)
-        xudp->config.on_recv(xudp, buf->base, nread, addr, flags);
-    free(buf->base);
+    if(nread > 0) {
+        uvx_atomic_add1w_u64(&xudp->stats.msgs_in, 1);
+        uvx_atomic_add1w_u64(&xudp->stats.bytes_in, nread);
+        if(xudp->config.on_recv) {
+            uvx__watch_enter("on_recv", xudp->config.name);
+            xudp->config.on_recv(xudp, buf->base, nread, addr, flags);
+            uvx__watch_exit();
+        }
+    }
+    uvx_free(buf->base);
 }
 
 uvx_udp_config_t uvx_udp_default_config(uvx_udp_t* xudp) {
@@ -32,6 +45,7 @@ int uvx_udp_start(uvx_udp_t* xudp, uv_loop_t* loop, const char* ip, int port, uv
     assert(xudp && loop);
 	xudp->uvloop = loop;
     memcpy(&xudp->config, &config, sizeof(uvx_udp_config_t));
+    memset(&xudp->stats, 0, sizeof(uvx_stats_t));
 
 	// init udp
     uv_udp_init(loop, &xudp->uvudp);
@@ -70,16 +84,41 @@ int uvx_udp_start(uvx_udp_t* xudp, uv_loop_t* loop, const char* ip, int port, uv
     return 1;
 }
 
+// the send request of uvx_udp_send_to_addr(), data resides after it
+typedef struct uvx_udp_send_req_s {
+    uv_udp_send_t req;
+    unsigned int size;
+} uvx_udp_send_req_t;
+
 static void uv_after_udp_send(uv_udp_send_t* req, int status) {
-    free(req); // see uvx_udp_send_to_addr()
+    uvx_udp_t* xudp = (uvx_udp_t*) req->data;
+    uvx_stats_t* stats = &xudp->stats;
+    unsigned int size = ((uvx_udp_send_req_t*)req)->size;
+    uvx_atomic_add1w_u64(&stats->write_queue_count, (uint64_t)-1);
+    uvx_atomic_add1w_u64(&stats->write_queue_bytes, (uint64_t)0 - size);
+    if(status == 0) {
+        uvx_atomic_add1w_u64(&stats->msgs_out, 1);
+        uvx_atomic_add1w_u64(&stats->bytes_out, size);
+    } else {
+        uvx_atomic_add1w_u64(&stats->send_failures, 1);
+    }
+    uvx_free(req); // see uvx_udp_send_to_addr()
 }
 
 int uvx_udp_send_to_addr(uvx_udp_t* xudp, const struct sockaddr* addr, const void* data, unsigned int datalen) {
-    uv_udp_send_t* req = (uv_udp_send_t*) malloc(sizeof(uv_udp_send_t) + datalen);
-    uv_buf_t buf = uv_buf_init((char*)req + sizeof(uv_udp_send_t), datalen);
+    uvx_udp_send_req_t* req = (uvx_udp_send_req_t*) uvx_malloc(sizeof(uvx_udp_send_req_t) + datalen);
+    uv_buf_t buf = uv_buf_init((char*)req + sizeof(uvx_udp_send_req_t), datalen);
     memcpy(buf.base, data, datalen); // copy data to the end of req
-    req->data = xudp;
-    return (uv_udp_send(req, &xudp->uvudp, &buf, 1, addr, uv_after_udp_send) == 0 ? 1 : 0); 
+    req->req.data = xudp;
+    req->size = datalen;
+    if(uv_udp_send(&req->req, &xudp->uvudp, &buf, 1, addr, uv_after_udp_send) != 0) {
+        uvx_atomic_add1w_u64(&xudp->stats.send_failures, 1);
+        uvx_free(req);
+        return 0;
+    }
+    uvx_atomic_add1w_u64(&xudp->stats.write_queue_count, 1);
+    uvx_atomic_add1w_u64(&xudp->stats.write_queue_bytes, datalen);
+    return 1;
 }
 
 int uvx_udp_send_to_ip(uvx_udp_t* xudp, const char* ip, int port, const void* data, unsigned int datalen) {
@@ -95,6 +134,10 @@ int uvx_udp_send_to_ip(uvx_udp_t* xudp, const char* ip, int port, const void* da
     }
 }
 
+void uvx_udp_stats(uvx_udp_t* xudp, uvx_stats_t* stats) {
+    uvx__stats_snapshot(&xudp->stats, stats);
+}
+
 int uvx_udp_set_broadcast(uvx_udp_t* xudp, int on) {
     return (uv_udp_set_broadcast(&xudp->uvudp, on) == 0 ? 1 : 0);
 }
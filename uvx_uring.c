@@ -0,0 +1,546 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#ifdef __linux__
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/syscall.h>
+    #include <sys/utsname.h>
+    #include <linux/io_uring.h>
+#endif
+
+#include "uvx.h"
+#include "utils/atomic.h"
+
+// uvx io_uring engine for the connections of xserver (Linux only), see config.io_uring.
+//
+// each xserver owns a ring. a connection reads by a multishot recv, which picks buffers from a provided
+// buffer ring shared by all connections, and writes by one sendmsg at a time, which carries all queued sends.
+// new requests are only prepared in the submission queue, and submitted by one io_uring_enter() per loop
+// iteration (in a prepare handle, or after handling completions). the ring's fd is polled by libuv.
+
+// defines in uvx_event.c
+void uvx__event(int level, const char* tag, const char* fmt, ...);
+
+// passes the data read by a connection to its owner, nread < 0 is UV_EOF or an error
+typedef void (*UVX_URING_ON_RECV)(void* owner, char* data, ssize_t nread);
+
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT)
+
+#define UVX_URING_ENTRIES   256   // size of submission queue
+#define UVX_URING_CQ_SIZE   4096  // size of completion queue, multishot recvs complete many times
+#define UVX_URING_BUFS      256   // provided buffers for recvs, power of 2
+#define UVX_URING_BGID      0     // the group id of provided buffers
+#define UVX_URING_IOV_MAX   64    // max sends carried by one sendmsg
+
+// the op of a request, stored in the low bits of user_data, the rest is uvx_uring_conn_t*
+enum { UVX_URING_OP_RECV = 1, UVX_URING_OP_SEND = 2, UVX_URING_OP_CANCEL = 3, UVX_URING_OP_MASK = 3 };
+
+typedef struct uvx_uring_conn_s uvx_uring_conn_t;
+
+typedef struct uvx_uring_s {
+    uv_poll_t poll;       // the ring's fd is readable if there are completions
+    uv_prepare_t prepare; // submits prepared requests before waiting for I/O
+    int fd;
+    int closed_handles;
+    UVX_URING_ON_RECV on_recv;
+    uvx_uring_conn_t* conns; // live connections, and closed ones with requests in flight
+    // submission queue
+    void* sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+    unsigned sq_entries;
+    unsigned to_submit;   // prepared but not submitted
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    // completion queue, shares sq_ring (IORING_FEAT_SINGLE_MMAP)
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe* cqes;
+    // provided buffers
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_size;
+    char* bufs;
+    unsigned int buf_size;
+    unsigned short buf_tail;
+} uvx_uring_t;
+
+struct uvx_uring_conn_s {
+    uvx_uring_t* ring;
+    uvx_uring_conn_t *prev, *next; // in ring->conns
+    void* owner;          // NULL after closed, it's freed when all requests completed
+    uvx_stats_t* stats;
+    int fd;
+    int ops;              // requests in flight
+    int recv_armed;
+    int shutdown;         // 1: shutdown writing after sends completed
+    int failed;           // 1 if a send failed, the connection is broken
+    // queued sends, the data is owned. the first `sending` ones are carried by the sendmsg in flight.
+    uv_buf_t* queue;
+    unsigned int queue_head, queue_count, queue_cap;
+    unsigned int sending;
+    size_t offset;        // bytes of queue[queue_head] already sent
+    struct msghdr msg;
+    struct iovec iov[UVX_URING_IOV_MAX];
+};
+
+static void _uvx_uring_on_poll(uv_poll_t* handle, int status, int events);
+static void _uvx_uring_submit(uvx_uring_t* ring);
+
+// ---------------------------------------------------------------------------------------------------------------------
+// the ring
+
+static int _uvx_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int _uvx_uring_enter(int fd, unsigned to_submit, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, NULL, 0);
+}
+
+static int _uvx_uring_register(int fd, unsigned opcode, void* arg, unsigned nargs) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+// returns the next free sqe (zeroed), submits prepared ones first if the queue is full
+static struct io_uring_sqe* _uvx_uring_sqe(uvx_uring_t* ring) {
+    unsigned tail = *ring->sq_tail;
+    if(tail - uvx_atomic_load_u32(ring->sq_head) >= ring->sq_entries) {
+        _uvx_uring_submit(ring);
+        if(tail - uvx_atomic_load_u32(ring->sq_head) >= ring->sq_entries)
+            return NULL;
+    }
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    uvx_atomic_store_u32(ring->sq_tail, tail + 1); // the kernel reads the sqe after it sees the new tail
+    ring->to_submit++;
+    return sqe;
+}
+
+static void _uvx_uring_submit(uvx_uring_t* ring) {
+    while(ring->to_submit > 0) {
+        int n = _uvx_uring_enter(ring->fd, ring->to_submit, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            // EAGAIN or EBUSY: the kernel is short of resources or completions, retry after handling completions
+            if(n < 0 && errno != EAGAIN && errno != EBUSY)
+                uvx__event(UVX_LOG_ERROR, "uvx-uring", "io_uring_enter() failed: %s", strerror(errno));
+            return;
+        }
+        ring->to_submit -= (unsigned) n;
+    }
+}
+
+static void _uv_uring_on_prepare(uv_prepare_t* handle) {
+    _uvx_uring_submit((uvx_uring_t*) handle->data);
+}
+
+// gives back a provided buffer to the kernel
+static void _uvx_uring_recycle(uvx_uring_t* ring, unsigned short bid) {
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (UVX_URING_BUFS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * ring->buf_size);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// requires io_uring with single mmap, provided buffer rings (5.19) and multishot recv (6.0)
+static int _uvx_uring_kernel_ok(void) {
+    struct utsname u;
+    int major = 0, minor = 0;
+    if(uname(&u) != 0 || sscanf(u.release, "%d.%d", &major, &minor) != 2)
+        return 0;
+    return (major >= 6);
+}
+
+static void _uvx_uring_free(uvx_uring_t* ring) {
+    if(ring->sq_ring && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if(ring->sqes && (void*) ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if(ring->buf_ring && (void*) ring->buf_ring != MAP_FAILED)
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    if(ring->fd >= 0)
+        close(ring->fd);
+    uvx_free(ring->bufs);
+    uvx_free(ring);
+}
+
+// creates a ring, buf_size is the size of each provided buffer for recvs.
+// returns NULL if io_uring is not supported, the caller should fall back to libuv.
+uvx_uring_t* uvx__uring_new(uv_loop_t* loop, unsigned int buf_size, UVX_URING_ON_RECV on_recv) {
+    if(!_uvx_uring_kernel_ok()) {
+        uvx__event(UVX_LOG_WARN, "uvx-uring", "io_uring requires Linux 6.0 or later");
+        return NULL;
+    }
+    uvx_uring_t* ring = (uvx_uring_t*) uvx_calloc(1, sizeof(uvx_uring_t));
+    ring->fd = -1;
+    ring->on_recv = on_recv;
+    ring->buf_size = (buf_size == 0 || buf_size > 65536 ? 65536 : (buf_size < 4096 ? 4096 : buf_size));
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = UVX_URING_CQ_SIZE;
+    ring->fd = _uvx_uring_setup(UVX_URING_ENTRIES, &p);
+    if(ring->fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        uvx__event(UVX_LOG_WARN, "uvx-uring", "io_uring_setup() failed or lacks features: %s",
+                   (ring->fd < 0 ? strerror(errno) : "single mmap, nodrop"));
+        goto fail;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sq_ring_size = (sq_size > cq_size ? sq_size : cq_size);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                             ring->fd, IORING_OFF_SQES);
+    if(ring->sq_ring == MAP_FAILED || (void*) ring->sqes == MAP_FAILED) {
+        uvx__event(UVX_LOG_WARN, "uvx-uring", "mmap() of io_uring failed: %s", strerror(errno));
+        goto fail;
+    }
+    char* base = (char*) ring->sq_ring;
+    ring->sq_head    = (unsigned*)(base + p.sq_off.head);
+    ring->sq_tail    = (unsigned*)(base + p.sq_off.tail);
+    ring->sq_mask    = (unsigned*)(base + p.sq_off.ring_mask);
+    ring->sq_flags   = (unsigned*)(base + p.sq_off.flags);
+    ring->sq_array   = (unsigned*)(base + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head    = (unsigned*)(base + p.cq_off.head);
+    ring->cq_tail    = (unsigned*)(base + p.cq_off.tail);
+    ring->cq_mask    = (unsigned*)(base + p.cq_off.ring_mask);
+    ring->cqes       = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+
+    // the provided buffer ring must be page aligned
+    ring->buf_ring_size = UVX_URING_BUFS * sizeof(struct io_uring_buf);
+    ring->buf_ring = (struct io_uring_buf_ring*) mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if((void*) ring->buf_ring == MAP_FAILED) {
+        uvx__event(UVX_LOG_WARN, "uvx-uring", "mmap() of buffer ring failed: %s", strerror(errno));
+        goto fail;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t) ring->buf_ring;
+    reg.ring_entries = UVX_URING_BUFS;
+    reg.bgid = UVX_URING_BGID;
+    if(_uvx_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uvx__event(UVX_LOG_WARN, "uvx-uring", "register provided buffer ring failed: %s", strerror(errno));
+        goto fail;
+    }
+    ring->bufs = (char*) uvx_malloc((size_t) UVX_URING_BUFS * ring->buf_size);
+    ring->buf_tail = 0;
+    for(unsigned short i = 0; i < UVX_URING_BUFS; i++)
+        _uvx_uring_recycle(ring, i);
+
+    // neither handle keeps the loop alive
+    uv_poll_init(loop, &ring->poll, ring->fd);
+    ring->poll.data = ring;
+    uv_poll_start(&ring->poll, UV_READABLE, _uvx_uring_on_poll);
+    uv_unref((uv_handle_t*) &ring->poll);
+    uv_prepare_init(loop, &ring->prepare);
+    ring->prepare.data = ring;
+    uv_prepare_start(&ring->prepare, _uv_uring_on_prepare);
+    uv_unref((uv_handle_t*) &ring->prepare);
+    uvx__event(UVX_LOG_INFO, "uvx-uring", "io_uring is on, %u entries, %u buffers of %u bytes",
+               p.sq_entries, UVX_URING_BUFS, ring->buf_size);
+    return ring;
+
+fail:
+    _uvx_uring_free(ring);
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// connections
+
+static void _uvx_uring_conn_free(uvx_uring_conn_t* uc) {
+    uvx_uring_t* ring = uc->ring;
+    if(uc->prev)
+        uc->prev->next = uc->next;
+    else
+        ring->conns = uc->next;
+    if(uc->next)
+        uc->next->prev = uc->prev;
+    for(; uc->queue_count > 0; uc->queue_head++, uc->queue_count--) {
+        uv_buf_t* buf = &uc->queue[uc->queue_head];
+        uvx_atomic_add1w_u64(&uc->stats->write_queue_count, (uint64_t)-1);
+        uvx_atomic_add1w_u64(&uc->stats->write_queue_bytes, (uint64_t)0 - buf->len);
+        uvx_atomic_add1w_u64(&uc->stats->send_failures, 1);
+        uvx_free(buf->base);
+    }
+    uvx_free(uc->queue);
+    uvx_free(uc);
+}
+
+static void _uvx_uring_recv(uvx_uring_conn_t* uc) {
+    struct io_uring_sqe* sqe = _uvx_uring_sqe(uc->ring);
+    if(sqe == NULL) {
+        uvx__event(UVX_LOG_ERROR, "uvx-uring", "submission queue is full, recv is not armed");
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uc->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UVX_URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = (uint64_t)(uintptr_t) uc | UVX_URING_OP_RECV;
+    uc->ops++;
+    uc->recv_armed = 1;
+}
+
+// sends the queued data by one sendmsg, if there is no one in flight
+static void _uvx_uring_send_next(uvx_uring_conn_t* uc) {
+    if(uc->sending || uc->queue_count == 0 || uc->failed)
+        return;
+    struct io_uring_sqe* sqe = _uvx_uring_sqe(uc->ring);
+    if(sqe == NULL)
+        return; // retried on next completion of this connection
+    unsigned int n = (uc->queue_count < UVX_URING_IOV_MAX ? uc->queue_count : UVX_URING_IOV_MAX);
+    for(unsigned int i = 0; i < n; i++) {
+        uv_buf_t* buf = &uc->queue[uc->queue_head + i];
+        uc->iov[i].iov_base = buf->base + (i == 0 ? uc->offset : 0);
+        uc->iov[i].iov_len  = buf->len  - (i == 0 ? uc->offset : 0);
+    }
+    memset(&uc->msg, 0, sizeof(uc->msg));
+    uc->msg.msg_iov = uc->iov;
+    uc->msg.msg_iovlen = n;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = uc->fd;
+    sqe->addr = (uint64_t)(uintptr_t) &uc->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t) uc | UVX_URING_OP_SEND;
+    uc->ops++;
+    uc->sending = n;
+}
+
+// starts io_uring for a connected stream (tcp or pipe), instead of uv_read_start() and uv_write().
+// data is read into provided buffers and passed to `owner` by ring's on_recv.
+uvx_uring_conn_t* uvx__uring_conn_new(uvx_uring_t* ring, uv_stream_t* stream, uvx_stats_t* stats, void* owner) {
+    uv_os_fd_t fd;
+    if(ring == NULL || uv_fileno((uv_handle_t*) stream, &fd) != 0)
+        return NULL;
+    uvx_uring_conn_t* uc = (uvx_uring_conn_t*) uvx_calloc(1, sizeof(uvx_uring_conn_t));
+    uc->ring = ring;
+    uc->owner = owner;
+    uc->stats = stats;
+    uc->fd = fd;
+    uc->next = ring->conns;
+    if(ring->conns)
+        ring->conns->prev = uc;
+    ring->conns = uc;
+    _uvx_uring_recv(uc);
+    return uc;
+}
+
+// queues a send, which takes the ownership of data. returns 0 on failure, and data is freed.
+int uvx__uring_send(uvx_uring_conn_t* uc, void* data, unsigned int size) {
+    if(uc->owner == NULL || uc->failed || uc->shutdown) {
+        uvx_atomic_add1w_u64(&uc->stats->send_failures, 1);
+        uvx_free(data);
+        return 0;
+    }
+    if(uc->queue_head + uc->queue_count == uc->queue_cap) {
+        if(uc->queue_head > 0 && uc->queue_head >= uc->queue_count) {
+            memmove(uc->queue, uc->queue + uc->queue_head, uc->queue_count * sizeof(uv_buf_t));
+            uc->queue_head = 0;
+        } else {
+            uc->queue_cap = (uc->queue_cap ? uc->queue_cap * 2 : 16);
+            uc->queue = (uv_buf_t*) uvx_realloc(uc->queue, uc->queue_cap * sizeof(uv_buf_t));
+        }
+    }
+    uc->queue[uc->queue_head + uc->queue_count++] = uv_buf_init((char*) data, size);
+    uvx_atomic_add1w_u64(&uc->stats->write_queue_count, 1);
+    uvx_atomic_add1w_u64(&uc->stats->write_queue_bytes, size);
+    _uvx_uring_send_next(uc);
+    return 1;
+}
+
+// shuts down writing after the queued sends completed. returns 0 on failure.
+int uvx__uring_shutdown(uvx_uring_conn_t* uc) {
+    if(uc->owner == NULL || uc->shutdown)
+        return 0;
+    uc->shutdown = 1;
+    if(uc->queue_count == 0)
+        shutdown(uc->fd, SHUT_WR);
+    return 1;
+}
+
+// returns the count of sends not completed, including the ones in flight
+unsigned int uvx__uring_queued(uvx_uring_conn_t* uc) {
+    return (uc ? uc->queue_count : 0);
+}
+
+// stops reading and cancels sends in flight, before the stream is closed.
+// the requests are submitted right now, because the fd will be closed and may be reused by the next accept.
+void uvx__uring_conn_close(uvx_uring_conn_t* uc) {
+    uvx_uring_t* ring = uc->ring;
+    uc->owner = NULL;
+    if(uc->ops > 0) {
+        struct io_uring_sqe* sqe = _uvx_uring_sqe(ring);
+        if(sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = uc->fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = (uint64_t)(uintptr_t) uc | UVX_URING_OP_CANCEL;
+            uc->ops++;
+        }
+    }
+    _uvx_uring_submit(ring);
+    if(uc->ops == 0)
+        _uvx_uring_conn_free(uc);
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// completions
+
+static void _uvx_uring_on_recv(uvx_uring_conn_t* uc, int res, unsigned flags) {
+    uvx_uring_t* ring = uc->ring;
+    char* data = NULL;
+    unsigned short bid = 0;
+    if(flags & IORING_CQE_F_BUFFER) {
+        bid = (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT);
+        data = ring->bufs + (size_t)bid * ring->buf_size;
+    }
+    if(uc->owner) {
+        if(res > 0)
+            ring->on_recv(uc->owner, data, res);
+        else if(res == 0)
+            ring->on_recv(uc->owner, NULL, UV_EOF);
+        else if(res != -ENOBUFS && res != -ECANCELED)
+            ring->on_recv(uc->owner, NULL, res); // UV_E* == -errno on unix
+    }
+    if(data)
+        _uvx_uring_recycle(ring, bid);
+    if(!(flags & IORING_CQE_F_MORE)) {
+        uc->ops--; // after on_recv, which may close the connection, so uc is not freed there
+        uc->recv_armed = 0;
+    }
+    // a multishot recv stops on errors, or runs out of buffers (they are recycled above)
+    if(uc->owner && !uc->recv_armed && (res > 0 || res == -ENOBUFS))
+        _uvx_uring_recv(uc);
+}
+
+static void _uvx_uring_on_send(uvx_uring_conn_t* uc, int res) {
+    uc->ops--;
+    uc->sending = 0;
+    if(res < 0) {
+        if(uc->owner && res != -ECANCELED)
+            uvx__event(UVX_LOG_WARN, "uvx-uring", "sendmsg failed: %s", strerror(-res));
+        uc->failed = 1; // drops all queued sends, reading will see the error and close the connection
+        for(; uc->queue_count > 0; uc->queue_head++, uc->queue_count--) {
+            uv_buf_t* buf = &uc->queue[uc->queue_head];
+            uvx_atomic_add1w_u64(&uc->stats->write_queue_count, (uint64_t)-1);
+            uvx_atomic_add1w_u64(&uc->stats->write_queue_bytes, (uint64_t)0 - buf->len);
+            uvx_atomic_add1w_u64(&uc->stats->send_failures, 1);
+            uvx_free(buf->base);
+        }
+        return;
+    }
+    size_t sent = (size_t) res;
+    while(sent > 0 && uc->queue_count > 0) {
+        uv_buf_t* buf = &uc->queue[uc->queue_head];
+        size_t remain = buf->len - uc->offset;
+        if(sent < remain) {
+            uc->offset += sent; // partially sent
+            break;
+        }
+        sent -= remain;
+        uvx_atomic_add1w_u64(&uc->stats->write_queue_count, (uint64_t)-1);
+        uvx_atomic_add1w_u64(&uc->stats->write_queue_bytes, (uint64_t)0 - buf->len);
+        uvx_atomic_add1w_u64(&uc->stats->msgs_out, 1);
+        uvx_atomic_add1w_u64(&uc->stats->bytes_out, buf->len);
+        uvx_free(buf->base);
+        uc->offset = 0;
+        uc->queue_head++;
+        uc->queue_count--;
+    }
+    if(uc->queue_count == 0)
+        uc->queue_head = 0;
+    if(uc->owner) {
+        _uvx_uring_send_next(uc);
+        if(uc->shutdown && uc->queue_count == 0)
+            shutdown(uc->fd, SHUT_WR);
+    }
+}
+
+static void _uvx_uring_on_poll(uv_poll_t* handle, int status, int events) {
+    uvx_uring_t* ring = (uvx_uring_t*) handle->data;
+    unsigned int reaped = 0;
+    for(;;) {
+        unsigned head = *ring->cq_head;
+        if(head == uvx_atomic_load_u32(ring->cq_tail)) {
+            // completions overflowed the queue are kept by the kernel, flush them (IORING_FEAT_NODROP)
+            if((uvx_atomic_load_u32(ring->sq_flags) & IORING_SQ_CQ_OVERFLOW) && reaped > 0) {
+                _uvx_uring_enter(ring->fd, 0, IORING_ENTER_GETEVENTS);
+                reaped = 0;
+                continue;
+            }
+            break;
+        }
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        uvx_atomic_store_u32(ring->cq_head, head + 1);
+        reaped++;
+
+        uvx_uring_conn_t* uc = (uvx_uring_conn_t*)(uintptr_t)(user_data & ~(uint64_t)UVX_URING_OP_MASK);
+        switch(user_data & UVX_URING_OP_MASK) {
+        case UVX_URING_OP_RECV:   _uvx_uring_on_recv(uc, res, flags); break;
+        case UVX_URING_OP_SEND:   _uvx_uring_on_send(uc, res); break;
+        case UVX_URING_OP_CANCEL: uc->ops--; break;
+        default: continue;
+        }
+        if(uc->owner == NULL && uc->ops == 0)
+            _uvx_uring_conn_free(uc);
+    }
+    _uvx_uring_submit(ring); // sends and re-armed recvs, in one syscall
+}
+
+static void _uvx_uring_after_close_handle(uv_handle_t* handle) {
+    uvx_uring_t* ring = (uvx_uring_t*) handle->data;
+    if(++ring->closed_handles == 2)
+        _uvx_uring_free(ring); // closing the fd cancels all requests in flight
+}
+
+// closes the ring, connections should have been closed.
+void uvx__uring_close(uvx_uring_t* ring) {
+    if(ring == NULL)
+        return;
+    while(ring->conns)
+        _uvx_uring_conn_free(ring->conns);
+    uv_poll_stop(&ring->poll);
+    uv_close((uv_handle_t*) &ring->poll, _uvx_uring_after_close_handle);
+    uv_prepare_stop(&ring->prepare);
+    uv_close((uv_handle_t*) &ring->prepare, _uvx_uring_after_close_handle);
+}
+
+#else // not Linux, or kernel headers without multishot recv: xservers fall back to libuv
+
+struct uvx_uring_s;
+struct uvx_uring_conn_s;
+
+struct uvx_uring_s* uvx__uring_new(uv_loop_t* loop, unsigned int buf_size, UVX_URING_ON_RECV on_recv) {
+    uvx__event(UVX_LOG_WARN, "uvx-uring", "io_uring is not supported on this platform");
+    return NULL;
+}
+void uvx__uring_close(struct uvx_uring_s* ring) { }
+struct uvx_uring_conn_s* uvx__uring_conn_new(struct uvx_uring_s* ring, uv_stream_t* stream, uvx_stats_t* stats,
+                                             void* owner) { return NULL; }
+int uvx__uring_send(struct uvx_uring_conn_s* uc, void* data, unsigned int size) { uvx_free(data); return 0; }
+int uvx__uring_shutdown(struct uvx_uring_conn_s* uc) { return 0; }
+void uvx__uring_conn_close(struct uvx_uring_conn_s* uc) { }
+unsigned int uvx__uring_queued(struct uvx_uring_conn_s* uc) { return 0; }
+
+#endif // __linux__
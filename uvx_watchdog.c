@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "uvx.h"
+#include "utils/atomic.h"
+
+// uvx watchdog, see `uvx_watchdog_t`.
+
+#if defined(_MSC_VER) && !defined(__clang__)
+	#define UVX_THREAD_LOCAL __declspec(thread)
+#else
+	#define UVX_THREAD_LOCAL __thread
+#endif
+
+// defines in uvx_event.c
+void uvx__event(int level, const char* tag, const char* fmt, ...);
+
+//! Note: modify this struct along with uvx_watchdog_t.privates!
+typedef struct uvx_watchdog_private_s {
+    uv_prepare_t prepare;   // before polling for I/O, the end of an iteration
+    uv_check_t check;       // after I/O callbacks
+    uint64_t prepare_time;  // uv_hrtime() of last prepare
+    uint64_t prepare_idle;  // uv_metrics_idle_time() of last prepare
+    uint64_t check_time;    // uv_hrtime() of last check
+    uint64_t io_busy;       // busy time of I/O callbacks in current iteration, in nanoseconds
+    // the uvx callback running, see uvx__watch_enter()
+    int depth;              // > 1 if callbacks are nested
+    const char* callback;
+    const char* name;
+    uint64_t enter_time;    // uv_hrtime() of entering the callback, read by monitor thread too
+    uint64_t reported_time; // enter_time of the callback reported by monitor thread
+    // the longest callback in current iteration
+    uint64_t worst_ns;
+    const char* worst_callback;
+    const char* worst_name;
+    // monitor thread
+    uv_thread_t thread;
+    uv_mutex_t mutex;       // protects stop and offenders
+    uv_cond_t cond;
+    int stop;
+    int offender_count;
+    uvx_stall_t offenders[UVX_WATCHDOG_OFFENDERS];
+} uvx_watchdog_private_t;
+
+#define _UVX_W_PRIVATE(x)  ((uvx_watchdog_private_t*)(&(x)->privates))
+
+// compile-time check: uvx_watchdog_t.privates must be large enough to store uvx_watchdog_private_t
+typedef char uvx__check_watchdog_privates[sizeof(uvx_watchdog_private_t) <= sizeof(((uvx_watchdog_t*)0)->privates) ? 1 : -1];
+
+// the watchdog of current thread's loop
+static UVX_THREAD_LOCAL uvx_watchdog_t* _uvx_watchdog = NULL;
+
+// marks entering an uvx callback, called by xserver/xclient/xudp around each callback.
+void uvx__watch_enter(const char* callback, const char* name) {
+    uvx_watchdog_t* watchdog = _uvx_watchdog;
+    if(watchdog == NULL)
+        return;
+    uvx_watchdog_private_t* priv = _UVX_W_PRIVATE(watchdog);
+    if(priv->depth++ > 0)
+        return; // nested, attributes to the outermost callback
+    priv->callback = callback;
+    priv->name = name;
+    uvx_atomic_store_u64(&priv->enter_time, uv_hrtime());
+}
+
+// marks leaving an uvx callback.
+void uvx__watch_exit(void) {
+    uvx_watchdog_t* watchdog = _uvx_watchdog;
+    if(watchdog == NULL)
+        return;
+    uvx_watchdog_private_t* priv = _UVX_W_PRIVATE(watchdog);
+    if(priv->depth == 0 || --priv->depth > 0)
+        return;
+    uint64_t elapsed = uv_hrtime() - priv->enter_time;
+    uvx_atomic_store_u64(&priv->enter_time, 0);
+    if(elapsed > priv->worst_ns) {
+        priv->worst_ns = elapsed;
+        priv->worst_callback = priv->callback;
+        priv->worst_name = priv->name;
+    }
+}
+
+// keeps the worst UVX_WATCHDOG_OFFENDERS stalls, replaces the least one if full.
+static void _uvx_watchdog_add_offender(uvx_watchdog_private_t* priv, uvx_stall_t* stall) {
+    uv_mutex_lock(&priv->mutex);
+    if(priv->offender_count < UVX_WATCHDOG_OFFENDERS) {
+        priv->offenders[priv->offender_count++] = *stall;
+    } else {
+        int least = 0;
+        for(int i = 1; i < priv->offender_count; i++) {
+            if(priv->offenders[i].busy_us < priv->offenders[least].busy_us)
+                least = i;
+        }
+        if(stall->busy_us > priv->offenders[least].busy_us)
+            priv->offenders[least] = *stall;
+    }
+    uv_mutex_unlock(&priv->mutex);
+}
+
+static void _uvx_watchdog_on_stall(uvx_watchdog_t* watchdog, uint64_t busy_us) {
+    uvx_watchdog_private_t* priv = _UVX_W_PRIVATE(watchdog);
+    uvx_stall_t stall;
+    memset(&stall, 0, sizeof(stall));
+    stall.time = uv_now(watchdog->uvloop);
+    stall.busy_us = busy_us;
+    stall.callback_us = priv->worst_ns / 1000;
+    stall.callback = (priv->worst_callback ? priv->worst_callback : "unknown");
+    if(priv->worst_name)
+        snprintf(stall.name, sizeof(stall.name), "%s", priv->worst_name);
+    uvx_atomic_add1w_u64(&watchdog->stalls, 1);
+    _uvx_watchdog_add_offender(priv, &stall);
+
+    char msg[160];
+    snprintf(msg, sizeof(msg), "loop stalled %llu us, longest callback: %s of %s (%llu us)",
+             (unsigned long long) stall.busy_us, stall.callback, stall.name, (unsigned long long) stall.callback_us);
+    uvx__event(UVX_LOG_WARN, "uvx-watchdog", "%s", msg);
+    if(watchdog->xlog)
+        uvx_log_send(watchdog->xlog, UVX_LOG_WARN, "uvx,watchdog", msg, __FILE__, __LINE__);
+}
+
+// after I/O callbacks: measures the busy time since last prepare, excluding the time waiting for I/O
+static void _uvx_watchdog_on_check(uv_check_t* handle) {
+    uvx_watchdog_private_t* priv = _UVX_W_PRIVATE((uvx_watchdog_t*) handle->data);
+    uint64_t now = uv_hrtime();
+    if(priv->prepare_time) {
+        uint64_t idle = uv_metrics_idle_time(handle->loop) - priv->prepare_idle;
+        uint64_t elapsed = now - priv->prepare_time;
+        priv->io_busy = (elapsed > idle ? elapsed - idle : 0);
+    }
+    priv->check_time = now;
+}
+
+// before polling for I/O: the end of an iteration, which is busy since last check (closing handles,
+// timers, idles) plus the busy time of I/O callbacks
+static void _uvx_watchdog_on_prepare(uv_prepare_t* handle) {
+    uvx_watchdog_t* watchdog = (uvx_watchdog_t*) handle->data;
+    uvx_watchdog_private_t* priv = _UVX_W_PRIVATE(watchdog);
+    uint64_t now = uv_hrtime();
+    if(priv->check_time) {
+        uint64_t busy_us = (priv->io_busy + (now - priv->check_time)) / 1000;
+        uvx_atomic_add1w_u64(&watchdog->iterations, 1);
+        if(busy_us > watchdog->max_us)
+            uvx_atomic_store_u64(&watchdog->max_us, busy_us);
+        if(busy_us >= (uint64_t)(watchdog->stall_ms * 1000))
+            _uvx_watchdog_on_stall(watchdog, busy_us);
+    }
+    priv->io_busy = 0;
+    priv->worst_ns = 0;
+    priv->worst_callback = NULL;
+    priv->worst_name = NULL;
+    priv->prepare_time = uv_hrtime();
+    priv->prepare_idle = uv_metrics_idle_time(handle->loop);
+}
+
+// monitor thread: warns if an uvx callback is blocking the loop, before it returns
+static void _uvx_watchdog_thread(void* arg) {
+    uvx_watchdog_t* watchdog = (uvx_watchdog_t*) arg;
+    uvx_watchdog_private_t* priv = _UVX_W_PRIVATE(watchdog);
+    uint64_t stall_ns = (uint64_t)(watchdog->stall_ms * 1000000);
+    uint64_t interval = stall_ns / 2;
+    if(interval < 1000000)
+        interval = 1000000; // 1ms
+    uv_mutex_lock(&priv->mutex);
+    while(!priv->stop) {
+        uv_cond_timedwait(&priv->cond, &priv->mutex, interval);
+        uint64_t enter_time = uvx_atomic_load_u64(&priv->enter_time);
+        if(enter_time && enter_time != priv->reported_time && uv_hrtime() - enter_time >= stall_ns) {
+            priv->reported_time = enter_time; // once per callback
+            // callback and name may be changed at the same time, but they always point to valid strings
+            const char* callback = priv->callback;
+            const char* name = priv->name;
+            uvx__event(UVX_LOG_WARN, "uvx-watchdog", "loop blocked %llu us (still running) in %s of %s",
+                       (unsigned long long)((uv_hrtime() - enter_time) / 1000), callback, name);
+        }
+    }
+    uv_mutex_unlock(&priv->mutex);
+}
+
+int uvx_watchdog_start(uvx_watchdog_t* watchdog, uv_loop_t* loop, float stall_ms, uvx_log_t* xlog) {
+    assert(watchdog && loop);
+    if(_uvx_watchdog)
+        return 0; // only one watchdog per thread
+    uvx_watchdog_private_t* priv = _UVX_W_PRIVATE(watchdog);
+    memset(priv, 0, sizeof(uvx_watchdog_private_t));
+    watchdog->uvloop = loop;
+    watchdog->stall_ms = stall_ms;
+    watchdog->xlog = xlog;
+    watchdog->iterations = 0;
+    watchdog->stalls = 0;
+    watchdog->max_us = 0;
+
+    uv_mutex_init(&priv->mutex);
+    uv_cond_init(&priv->cond);
+    if(uv_thread_create(&priv->thread, _uvx_watchdog_thread, watchdog) != 0) {
+        uv_cond_destroy(&priv->cond);
+        uv_mutex_destroy(&priv->mutex);
+        return 0;
+    }
+    // the busy time of iterations excludes the time waiting for I/O, measured by the loop
+    uv_loop_configure(loop, UV_METRICS_IDLE_TIME);
+    uv_prepare_init(loop, &priv->prepare);
+    priv->prepare.data = watchdog;
+    uv_prepare_start(&priv->prepare, _uvx_watchdog_on_prepare);
+    uv_unref((uv_handle_t*) &priv->prepare);
+    uv_check_init(loop, &priv->check);
+    priv->check.data = watchdog;
+    uv_check_start(&priv->check, _uvx_watchdog_on_check);
+    uv_unref((uv_handle_t*) &priv->check);
+    _uvx_watchdog = watchdog;
+    return 1;
+}
+
+static int _uvx_stall_cmp(const void* a, const void* b) {
+    uint64_t x = ((const uvx_stall_t*)a)->busy_us, y = ((const uvx_stall_t*)b)->busy_us;
+    return (x < y ? 1 : (x > y ? -1 : 0));
+}
+
+int uvx_watchdog_offenders(uvx_watchdog_t* watchdog, uvx_stall_t* stalls, int max) {
+    uvx_watchdog_private_t* priv = _UVX_W_PRIVATE(watchdog);
+    uvx_stall_t sorted[UVX_WATCHDOG_OFFENDERS];
+    uv_mutex_lock(&priv->mutex);
+    int n = priv->offender_count;
+    memcpy(sorted, priv->offenders, n * sizeof(uvx_stall_t));
+    uv_mutex_unlock(&priv->mutex);
+    qsort(sorted, n, sizeof(uvx_stall_t), _uvx_stall_cmp);
+    if(n > max)
+        n = max;
+    memcpy(stalls, sorted, n * sizeof(uvx_stall_t));
+    return n;
+}
+
+int uvx_watchdog_stop(uvx_watchdog_t* watchdog) {
+    uvx_watchdog_private_t* priv = _UVX_W_PRIVATE(watchdog);
+    if(_uvx_watchdog == watchdog)
+        _uvx_watchdog = NULL;
+    uv_mutex_lock(&priv->mutex);
+    priv->stop = 1;
+    uv_cond_signal(&priv->cond);
+    uv_mutex_unlock(&priv->mutex);
+    uv_thread_join(&priv->thread);
+    uv_cond_destroy(&priv->cond);
+    uv_mutex_destroy(&priv->mutex);
+    uv_prepare_stop(&priv->prepare);
+    uv_close((uv_handle_t*) &priv->prepare, NULL);
+    uv_check_stop(&priv->check);
+    uv_close((uv_handle_t*) &priv->check, NULL);
+    return 1;
+}